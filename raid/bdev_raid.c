@@ -50,6 +50,8 @@ static void	raid_bdev_examine(struct spdk_bdev *bdev);
 static int	raid_bdev_init(void);
 static void	raid_bdev_deconfigure(struct raid_bdev *raid_bdev,
 				      raid_bdev_destruct_cb cb_fn, void *cb_arg);
+static void	raid_bdev_stop_background(struct raid_bdev *raid_bdev,
+		raid_bdev_stop_background_cb cb_fn, void *cb_ctx);
 
 /*
  * brief:
@@ -229,6 +231,12 @@ raid_bdev_free_base_bdev_resource(struct raid_base_bdev_info *base_info)
 	spdk_bdev_close(base_info->desc);
 	base_info->desc = NULL;
 
+	if (base_info->rebuilding) {
+		/* Not counted as discovered until rebuilt */
+		base_info->rebuilding = false;
+		return;
+	}
+
 	assert(raid_bdev->num_base_bdevs_discovered);
 	raid_bdev->num_base_bdevs_discovered--;
 }
@@ -258,27 +266,28 @@ raid_bdev_module_stop_done(struct raid_bdev *raid_bdev)
 }
 
 static void
-_raid_bdev_destruct(void *ctxt)
+raid_bdev_destruct_continue(void *ctx, int status)
 {
-	struct raid_bdev *raid_bdev = ctxt;
+	struct raid_bdev *raid_bdev = ctx;
 	struct raid_base_bdev_info *base_info;
 
-	SPDK_DEBUGLOG(bdev_raid, "raid_bdev_destruct\n");
+	if (status != 0) {
+		SPDK_ERRLOG("Failed to stop background operations of raid bdev %s on shutdown: "
+			    "%s\n", raid_bdev->bdev.name, spdk_strerror(-status));
+	}
 
 	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
 		/*
 		 * Close all base bdev descriptors for which call has come from below
 		 * layers.  Also close the descriptors if we have started shutdown.
+		 * A base bdev which wasn't rebuilt holds no usable data, close it too.
 		 */
-		if (g_shutdown_started || base_info->remove_scheduled == true) {
+		if (g_shutdown_started || base_info->remove_scheduled == true ||
+		    base_info->rebuilding) {
 			raid_bdev_free_base_bdev_resource(base_info);
 		}
 	}
 
-	if (g_shutdown_started) {
-		raid_bdev->state = RAID_BDEV_STATE_OFFLINE;
-	}
-
 	if (raid_bdev->module->stop != NULL) {
 		if (raid_bdev->module->stop(raid_bdev) == false) {
 			return;
@@ -288,6 +297,30 @@ _raid_bdev_destruct(void *ctxt)
 	raid_bdev_module_stop_done(raid_bdev);
 }
 
+static void
+_raid_bdev_destruct(void *ctxt)
+{
+	struct raid_bdev *raid_bdev = ctxt;
+
+	SPDK_DEBUGLOG(bdev_raid, "raid_bdev_destruct\n");
+
+	if (g_shutdown_started && raid_bdev->state == RAID_BDEV_STATE_ONLINE) {
+		/*
+		 * The raid bdev is not deconfigured on shutdown, stop the background operations
+		 * while the base bdevs are still open, so that the module can write out its data.
+		 */
+		raid_bdev->state = RAID_BDEV_STATE_OFFLINE;
+		raid_bdev_stop_background(raid_bdev, raid_bdev_destruct_continue, raid_bdev);
+		return;
+	}
+
+	if (g_shutdown_started) {
+		raid_bdev->state = RAID_BDEV_STATE_OFFLINE;
+	}
+
+	raid_bdev_destruct_continue(raid_bdev, 0);
+}
+
 static int
 raid_bdev_destruct(void *ctx)
 {
@@ -299,11 +332,60 @@ raid_bdev_destruct(void *ctx)
 void
 raid_bdev_io_complete(struct raid_bdev_io *raid_io, enum spdk_bdev_io_status status)
 {
-	struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(raid_io);
+	struct spdk_bdev_io *bdev_io;
+
+	if (raid_io->completion_cb != NULL) {
+		raid_io->completion_cb(raid_io, status);
+		return;
+	}
 
+	bdev_io = spdk_bdev_io_from_ctx(raid_io);
 	spdk_bdev_io_complete(bdev_io, status);
 }
 
+/*
+ * brief:
+ * raid_bdev_io_init initializes the raid_io with the I/O parameters. It is used
+ * for I/Os coming from the bdev layer as well as for I/Os internal to the raid
+ * module, which are not backed by a bdev_io and must set completion_cb.
+ * params:
+ * raid_io - pointer to raid_bdev_io
+ * raid_ch - pointer to raid bdev io channel the I/O is submitted on
+ * type - I/O type
+ * offset_blocks - offset in blocks on the raid bdev
+ * num_blocks - number of blocks
+ * iovs - data buffers
+ * iovcnt - number of data buffers
+ * md_buf - separate metadata buffer, may be NULL
+ * memory_domain - memory domain of the data buffers, may be NULL
+ * memory_domain_ctx - context of the memory domain
+ * returns:
+ * none
+ */
+void
+raid_bdev_io_init(struct raid_bdev_io *raid_io, struct raid_bdev_io_channel *raid_ch,
+		  enum spdk_bdev_io_type type, uint64_t offset_blocks,
+		  uint64_t num_blocks, struct iovec *iovs, int iovcnt, void *md_buf,
+		  struct spdk_memory_domain *memory_domain, void *memory_domain_ctx)
+{
+	struct spdk_io_channel *ch = spdk_io_channel_from_ctx(raid_ch);
+
+	raid_io->raid_bdev = spdk_io_channel_get_io_device(ch);
+	raid_io->raid_ch = raid_ch;
+	raid_io->type = type;
+	raid_io->offset_blocks = offset_blocks;
+	raid_io->num_blocks = num_blocks;
+	raid_io->iovs = iovs;
+	raid_io->iovcnt = iovcnt;
+	raid_io->md_buf = md_buf;
+	raid_io->memory_domain = memory_domain;
+	raid_io->memory_domain_ctx = memory_domain_ctx;
+	raid_io->base_bdev_io_remaining = 0;
+	raid_io->base_bdev_io_submitted = 0;
+	raid_io->base_bdev_io_status = SPDK_BDEV_IO_STATUS_SUCCESS;
+	raid_io->completion_cb = NULL;
+}
+
 /*
  * brief:
  * raid_bdev_io_complete_part - signal the completion of a part of the expected
@@ -455,6 +537,10 @@ raid_bdev_get_buf_cb(struct spdk_io_channel *ch, struct spdk_bdev_io *bdev_io,
 		return;
 	}
 
+	raid_io->iovs = bdev_io->u.bdev.iovs;
+	raid_io->iovcnt = bdev_io->u.bdev.iovcnt;
+	raid_io->md_buf = bdev_io->u.bdev.md_buf;
+
 	raid_io->raid_bdev->module->submit_rw_request(raid_io);
 }
 
@@ -474,11 +560,10 @@ raid_bdev_submit_request(struct spdk_io_channel *ch, struct spdk_bdev_io *bdev_i
 {
 	struct raid_bdev_io *raid_io = (struct raid_bdev_io *)bdev_io->driver_ctx;
 
-	raid_io->raid_bdev = bdev_io->bdev->ctxt;
-	raid_io->raid_ch = spdk_io_channel_get_ctx(ch);
-	raid_io->base_bdev_io_remaining = 0;
-	raid_io->base_bdev_io_submitted = 0;
-	raid_io->base_bdev_io_status = SPDK_BDEV_IO_STATUS_SUCCESS;
+	raid_bdev_io_init(raid_io, spdk_io_channel_get_ctx(ch), bdev_io->type,
+			  bdev_io->u.bdev.offset_blocks, bdev_io->u.bdev.num_blocks,
+			  bdev_io->u.bdev.iovs, bdev_io->u.bdev.iovcnt, bdev_io->u.bdev.md_buf,
+			  bdev_io->u.bdev.memory_domain, bdev_io->u.bdev.memory_domain_ctx);
 
 	switch (bdev_io->type) {
 	case SPDK_BDEV_IO_TYPE_READ:
@@ -495,6 +580,7 @@ raid_bdev_submit_request(struct spdk_io_channel *ch, struct spdk_bdev_io *bdev_i
 
 	case SPDK_BDEV_IO_TYPE_FLUSH:
 	case SPDK_BDEV_IO_TYPE_UNMAP:
+	case SPDK_BDEV_IO_TYPE_WRITE_ZEROES:
 		raid_io->raid_bdev->module->submit_null_payload_request(raid_io);
 		break;
 
@@ -524,10 +610,20 @@ _raid_bdev_io_type_supported(struct raid_bdev *raid_bdev, enum spdk_bdev_io_type
 	struct raid_base_bdev_info *base_info;
 
 	if (io_type == SPDK_BDEV_IO_TYPE_FLUSH ||
-	    io_type == SPDK_BDEV_IO_TYPE_UNMAP) {
+	    io_type == SPDK_BDEV_IO_TYPE_UNMAP ||
+	    io_type == SPDK_BDEV_IO_TYPE_WRITE_ZEROES) {
 		if (raid_bdev->module->submit_null_payload_request == NULL) {
 			return false;
 		}
+
+		if (raid_bdev->module->io_type_supported == NULL) {
+			/* Write zeroes has to be supported explicitly */
+			if (io_type == SPDK_BDEV_IO_TYPE_WRITE_ZEROES) {
+				return false;
+			}
+		} else if (raid_bdev->module->io_type_supported(raid_bdev, io_type) == false) {
+			return false;
+		}
 	}
 
 	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
@@ -566,6 +662,7 @@ raid_bdev_io_type_supported(void *ctx, enum spdk_bdev_io_type io_type)
 	case SPDK_BDEV_IO_TYPE_FLUSH:
 	case SPDK_BDEV_IO_TYPE_RESET:
 	case SPDK_BDEV_IO_TYPE_UNMAP:
+	case SPDK_BDEV_IO_TYPE_WRITE_ZEROES:
 		return _raid_bdev_io_type_supported(ctx, io_type);
 
 	default:
@@ -592,6 +689,70 @@ raid_bdev_get_io_channel(void *ctxt)
 	return spdk_get_io_channel(raid_bdev);
 }
 
+/*
+ * brief:
+ * raid_bdev_write_opts_json writes the optional parameters of the raid bdev which
+ * are not set to their defaults, using the names of the bdev_raid_create RPC
+ * params:
+ * raid_bdev - pointer to raid_bdev
+ * w - pointer to json context
+ * returns:
+ * none
+ */
+static void
+raid_bdev_write_opts_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w)
+{
+	const struct raid_bdev_opts *opts = &raid_bdev->opts;
+
+	if (opts->stripe_cache_size != 0) {
+		spdk_json_write_named_uint32(w, "stripe_cache_size", opts->stripe_cache_size);
+	}
+	if (opts->stripe_cache_flush_timeout_ms != 0) {
+		spdk_json_write_named_uint32(w, "stripe_cache_flush_timeout_ms",
+					     opts->stripe_cache_flush_timeout_ms);
+	}
+	if (opts->stripe_pool_size != 0) {
+		spdk_json_write_named_uint32(w, "stripe_pool_size", opts->stripe_pool_size);
+	}
+	if (opts->stripe_pool_max != 0) {
+		spdk_json_write_named_uint32(w, "stripe_pool_max", opts->stripe_pool_max);
+	}
+	if (opts->read_hedge_permille != 0) {
+		spdk_json_write_named_uint32(w, "read_hedge_permille", opts->read_hedge_permille);
+	}
+	if (opts->parity_layout != RAID_PARITY_LAYOUT_LEFT_ASYMMETRIC) {
+		spdk_json_write_named_string(w, "parity_layout",
+					     raid_bdev_parity_layout_to_str(opts->parity_layout));
+	}
+	if (opts->dif_type != SPDK_DIF_DISABLE) {
+		spdk_json_write_named_int32(w, "dif_type", opts->dif_type);
+		spdk_json_write_named_int32(w, "dif_pi_format", opts->dif_pi_format);
+	}
+	if (opts->read_verify != RAID_READ_VERIFY_AUTO) {
+		spdk_json_write_named_string(w, "read_verify",
+					     raid_bdev_read_verify_to_str(opts->read_verify));
+	}
+	if (opts->chunk_checksums) {
+		spdk_json_write_named_bool(w, "chunk_checksums", true);
+	}
+	if (opts->stripe_owner_threads != 0) {
+		spdk_json_write_named_uint32(w, "stripe_owner_threads", opts->stripe_owner_threads);
+	}
+	if (opts->read_policy != RAID_READ_POLICY_LEAST_OUTSTANDING) {
+		spdk_json_write_named_string(w, "read_policy",
+					     raid_bdev_read_policy_to_str(opts->read_policy));
+	}
+	if (opts->read_preferred_slot != 0) {
+		spdk_json_write_named_uint32(w, "read_preferred_slot", opts->read_preferred_slot);
+	}
+	if (opts->read_spillover_qd != 0) {
+		spdk_json_write_named_uint32(w, "read_spillover_qd", opts->read_spillover_qd);
+	}
+	if (opts->read_stream_affinity) {
+		spdk_json_write_named_bool(w, "read_stream_affinity", true);
+	}
+}
+
 void
 raid_bdev_write_info_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w)
 {
@@ -607,6 +768,7 @@ raid_bdev_write_info_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ct
 	spdk_json_write_named_string(w, "state", raid_bdev_state_to_str(raid_bdev->state));
 	spdk_json_write_named_string(w, "raid_level", raid_bdev_level_to_str(raid_bdev->level));
 	spdk_json_write_named_bool(w, "superblock", raid_bdev->superblock_enabled);
+	raid_bdev_write_opts_json(raid_bdev, w);
 	spdk_json_write_named_uint32(w, "num_base_bdevs", raid_bdev->num_base_bdevs);
 	spdk_json_write_named_uint32(w, "num_base_bdevs_discovered", raid_bdev->num_base_bdevs_discovered);
 	spdk_json_write_name(w, "base_bdevs_list");
@@ -680,6 +842,7 @@ raid_bdev_write_config_json(struct spdk_bdev *bdev, struct spdk_json_write_ctx *
 	spdk_json_write_named_uint32(w, "strip_size_kb", raid_bdev->strip_size_kb);
 	spdk_json_write_named_string(w, "raid_level", raid_bdev_level_to_str(raid_bdev->level));
 	spdk_json_write_named_bool(w, "superblock", raid_bdev->superblock_enabled);
+	raid_bdev_write_opts_json(raid_bdev, w);
 
 	spdk_json_write_named_array_begin(w, "base_bdevs");
 	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
@@ -691,6 +854,10 @@ raid_bdev_write_config_json(struct spdk_bdev *bdev, struct spdk_json_write_ctx *
 	spdk_json_write_object_end(w);
 
 	spdk_json_write_object_end(w);
+
+	if (raid_bdev->module->write_config_json != NULL) {
+		raid_bdev->module->write_config_json(raid_bdev, w);
+	}
 }
 
 static int
@@ -778,6 +945,8 @@ static struct {
 	{ "1", RAID1 },
 	{ "raid5f", RAID5F },
 	{ "5f", RAID5F },
+	{ "raid6", RAID6 },
+	{ "6", RAID6 },
 	{ "concat", CONCAT },
 	{ }
 };
@@ -792,9 +961,44 @@ static struct {
 	{ }
 };
 
+static struct {
+	const char *name;
+	enum raid_parity_layout value;
+} g_raid_parity_layout_names[] = {
+	{ "left-asymmetric", RAID_PARITY_LAYOUT_LEFT_ASYMMETRIC },
+	{ "right-asymmetric", RAID_PARITY_LAYOUT_RIGHT_ASYMMETRIC },
+	{ "left-symmetric", RAID_PARITY_LAYOUT_LEFT_SYMMETRIC },
+	{ "right-symmetric", RAID_PARITY_LAYOUT_RIGHT_SYMMETRIC },
+	{ }
+};
+
+static struct {
+	const char *name;
+	enum raid_read_verify value;
+} g_raid_read_verify_names[] = {
+	{ "auto", RAID_READ_VERIFY_AUTO },
+	{ "parity", RAID_READ_VERIFY_PARITY },
+	{ "full", RAID_READ_VERIFY_FULL },
+	{ }
+};
+
+static struct {
+	const char *name;
+	enum raid_read_policy value;
+} g_raid_read_policy_names[] = {
+	{ "least-outstanding", RAID_READ_POLICY_LEAST_OUTSTANDING },
+	{ "latency", RAID_READ_POLICY_LATENCY },
+	{ "round-robin", RAID_READ_POLICY_ROUND_ROBIN },
+	{ "preferred", RAID_READ_POLICY_PREFERRED },
+	{ }
+};
+
 /* We have to use the typedef in the function declaration to appease astyle. */
 typedef enum raid_level raid_level_t;
 typedef enum raid_bdev_state raid_bdev_state_t;
+typedef enum raid_parity_layout raid_parity_layout_t;
+typedef enum raid_read_verify raid_read_verify_t;
+typedef enum raid_read_policy raid_read_policy_t;
 
 raid_level_t
 raid_bdev_str_to_level(const char *str)
@@ -857,6 +1061,118 @@ raid_bdev_state_to_str(enum raid_bdev_state state)
 	return "";
 }
 
+raid_parity_layout_t
+raid_bdev_str_to_parity_layout(const char *str)
+{
+	unsigned int i;
+
+	assert(str != NULL);
+
+	for (i = 0; g_raid_parity_layout_names[i].name != NULL; i++) {
+		if (strcasecmp(g_raid_parity_layout_names[i].name, str) == 0) {
+			return g_raid_parity_layout_names[i].value;
+		}
+	}
+
+	return INVALID_RAID_PARITY_LAYOUT;
+}
+
+const char *
+raid_bdev_parity_layout_to_str(enum raid_parity_layout layout)
+{
+	unsigned int i;
+
+	for (i = 0; g_raid_parity_layout_names[i].name != NULL; i++) {
+		if (g_raid_parity_layout_names[i].value == layout) {
+			return g_raid_parity_layout_names[i].name;
+		}
+	}
+
+	return "";
+}
+
+raid_read_verify_t
+raid_bdev_str_to_read_verify(const char *str)
+{
+	unsigned int i;
+
+	assert(str != NULL);
+
+	for (i = 0; g_raid_read_verify_names[i].name != NULL; i++) {
+		if (strcasecmp(g_raid_read_verify_names[i].name, str) == 0) {
+			return g_raid_read_verify_names[i].value;
+		}
+	}
+
+	return INVALID_RAID_READ_VERIFY;
+}
+
+const char *
+raid_bdev_read_verify_to_str(enum raid_read_verify verify)
+{
+	unsigned int i;
+
+	for (i = 0; g_raid_read_verify_names[i].name != NULL; i++) {
+		if (g_raid_read_verify_names[i].value == verify) {
+			return g_raid_read_verify_names[i].name;
+		}
+	}
+
+	return "";
+}
+
+raid_read_policy_t
+raid_bdev_str_to_read_policy(const char *str)
+{
+	unsigned int i;
+
+	assert(str != NULL);
+
+	for (i = 0; g_raid_read_policy_names[i].name != NULL; i++) {
+		if (strcasecmp(g_raid_read_policy_names[i].name, str) == 0) {
+			return g_raid_read_policy_names[i].value;
+		}
+	}
+
+	return INVALID_RAID_READ_POLICY;
+}
+
+const char *
+raid_bdev_read_policy_to_str(enum raid_read_policy policy)
+{
+	unsigned int i;
+
+	for (i = 0; g_raid_read_policy_names[i].name != NULL; i++) {
+		if (g_raid_read_policy_names[i].value == policy) {
+			return g_raid_read_policy_names[i].name;
+		}
+	}
+
+	return "";
+}
+
+/*
+ * brief:
+ * raid_bdev_stop_background stops the background operations of the raid module,
+ * if it has any, and calls cb_fn when they are stopped
+ * params:
+ * raid_bdev - pointer to raid bdev
+ * cb_fn - callback function, can be NULL
+ * cb_ctx - argument to callback function
+ * returns:
+ * none
+ */
+static void
+raid_bdev_stop_background(struct raid_bdev *raid_bdev, raid_bdev_stop_background_cb cb_fn,
+			  void *cb_ctx)
+{
+	if (raid_bdev->module->stop_background != NULL) {
+		raid_bdev->module->stop_background(raid_bdev, cb_fn, cb_ctx);
+	} else if (cb_fn != NULL) {
+		cb_fn(cb_ctx, 0);
+	}
+}
+
 /*
  * brief:
  * raid_bdev_fini_start is called when bdev layer is starting the
@@ -869,8 +1185,16 @@ raid_bdev_state_to_str(enum raid_bdev_state state)
 static void
 raid_bdev_fini_start(void)
 {
+	struct raid_bdev *raid_bdev;
+
 	SPDK_DEBUGLOG(bdev_raid, "raid_bdev_fini_start\n");
 	g_shutdown_started = true;
+
+	TAILQ_FOREACH(raid_bdev, &g_raid_bdev_list, global_link) {
+		if (raid_bdev->state == RAID_BDEV_STATE_ONLINE) {
+			raid_bdev_stop_background(raid_bdev, NULL, NULL);
+		}
+	}
 }
 
 /*
@@ -946,6 +1270,7 @@ raid_bdev_init(void)
  * level - raid level
  * superblock_enabled - true if raid should have superblock
  * uuid - uuid to set for the bdev
+ * opts - optional parameters, NULL for defaults
  * raid_bdev_out - the created raid bdev
  * returns:
  * 0 - success
@@ -954,7 +1279,7 @@ raid_bdev_init(void)
 int
 raid_bdev_create(const char *name, uint32_t strip_size, uint8_t num_base_bdevs,
 		 enum raid_level level, bool superblock_enabled, const struct spdk_uuid *uuid,
-		 struct raid_bdev **raid_bdev_out)
+		 const struct raid_bdev_opts *opts, struct raid_bdev **raid_bdev_out)
 {
 	struct raid_bdev *raid_bdev;
 	struct spdk_bdev *raid_bdev_gen;
@@ -1049,6 +1374,9 @@ raid_bdev_create(const char *name, uint32_t strip_size, uint8_t num_base_bdevs,
 	raid_bdev->level = level;
 	raid_bdev->min_base_bdevs_operational = min_operational;
 	raid_bdev->superblock_enabled = superblock_enabled;
+	if (opts != NULL) {
+		raid_bdev->opts = *opts;
+	}
 
 	raid_bdev_gen = &raid_bdev->bdev;
 
@@ -1205,6 +1533,35 @@ raid_bdev_configure(struct raid_bdev *raid_bdev)
 	return 0;
 }
 
+static void
+raid_bdev_deconfigure_unregister(void *ctx, int status)
+{
+	struct raid_bdev *raid_bdev = ctx;
+	struct raid_base_bdev_info *base_info;
+
+	if (status != 0) {
+		SPDK_ERRLOG("Failed to stop background operations of raid bdev %s: %s\n",
+			    raid_bdev->bdev.name, spdk_strerror(-status));
+
+		/* A removed base bdev can't be kept, but a delete can be retried later */
+		if (raid_bdev->destroy_started) {
+			raid_bdev->destroy_started = false;
+			RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
+				base_info->remove_scheduled = false;
+			}
+			raid_bdev->state = RAID_BDEV_STATE_ONLINE;
+			SPDK_DEBUGLOG(bdev_raid, "raid bdev state changing back to online\n");
+			if (raid_bdev->deconfigure_cb_fn) {
+				raid_bdev->deconfigure_cb_fn(raid_bdev->deconfigure_cb_arg, status);
+			}
+			return;
+		}
+	}
+
+	spdk_bdev_unregister(&raid_bdev->bdev, raid_bdev->deconfigure_cb_fn,
+			     raid_bdev->deconfigure_cb_arg);
+}
+
 /*
  * brief:
  * If raid bdev is online and registered, change the bdev state to
@@ -1232,7 +1589,10 @@ raid_bdev_deconfigure(struct raid_bdev *raid_bdev, raid_bdev_destruct_cb cb_fn,
 	assert(raid_bdev->num_base_bdevs_discovered);
 	SPDK_DEBUGLOG(bdev_raid, "raid bdev state changing from online to offline\n");
 
-	spdk_bdev_unregister(&raid_bdev->bdev, cb_fn, cb_arg);
+	raid_bdev->deconfigure_cb_fn = cb_fn;
+	raid_bdev->deconfigure_cb_arg = cb_arg;
+
+	raid_bdev_stop_background(raid_bdev, raid_bdev_deconfigure_unregister, raid_bdev);
 }
 
 /*
@@ -1261,6 +1621,50 @@ raid_bdev_find_base_info_by_bdev(struct spdk_bdev *base_bdev)
 	return NULL;
 }
 
+/*
+ * brief:
+ * raid_bdev_quiesce_range quiesces a range of the raid bdev on behalf of the raid
+ * module, e.g. to keep I/O away from stripes being rebuilt
+ * params:
+ * raid_bdev - pointer to raid bdev
+ * offset_blocks - offset of the range in raid bdev blocks
+ * num_blocks - length of the range in raid bdev blocks
+ * cb_fn - callback called once the range is quiesced
+ * cb_arg - argument to callback function
+ * returns:
+ * 0 - success
+ * non zero - failure
+ */
+int
+raid_bdev_quiesce_range(struct raid_bdev *raid_bdev, uint64_t offset_blocks,
+			uint64_t num_blocks, spdk_bdev_quiesce_cb cb_fn, void *cb_arg)
+{
+	return spdk_bdev_quiesce_range(&raid_bdev->bdev, &g_raid_if, offset_blocks, num_blocks,
+				       cb_fn, cb_arg);
+}
+
+/*
+ * brief:
+ * raid_bdev_unquiesce_range resumes I/O to a range quiesced with
+ * raid_bdev_quiesce_range
+ * params:
+ * raid_bdev - pointer to raid bdev
+ * offset_blocks - offset of the range in raid bdev blocks
+ * num_blocks - length of the range in raid bdev blocks
+ * cb_fn - callback called once the range is unquiesced
+ * cb_arg - argument to callback function
+ * returns:
+ * 0 - success
+ * non zero - failure
+ */
+int
+raid_bdev_unquiesce_range(struct raid_bdev *raid_bdev, uint64_t offset_blocks,
+			  uint64_t num_blocks, spdk_bdev_quiesce_cb cb_fn, void *cb_arg)
+{
+	return spdk_bdev_unquiesce_range(&raid_bdev->bdev, &g_raid_if, offset_blocks, num_blocks,
+					 cb_fn, cb_arg);
+}
+
 static void
 raid_bdev_remove_base_bdev_on_unquiesced(void *ctx, int status)
 {
@@ -1332,6 +1736,23 @@ raid_bdev_remove_base_bdev_on_quiesced(void *ctx, int status)
 			      raid_bdev_channels_remove_base_bdev_done);
 }
 
+static void
+raid_bdev_remove_base_bdev_quiesce(void *ctx, int status)
+{
+	struct raid_base_bdev_info *base_info = ctx;
+	struct raid_bdev *raid_bdev = base_info->raid_bdev;
+	int ret;
+
+	ret = spdk_bdev_quiesce(&raid_bdev->bdev, &g_raid_if,
+				raid_bdev_remove_base_bdev_on_quiesced, base_info);
+	if (ret != 0) {
+		base_info->remove_scheduled = false;
+		if (base_info->remove_cb != NULL) {
+			base_info->remove_cb(base_info->remove_cb_ctx, ret);
+		}
+	}
+}
+
 /*
  * brief:
  * raid_bdev_remove_base_bdev function is called by below layers when base_bdev
@@ -1383,20 +1804,15 @@ raid_bdev_remove_base_bdev(struct spdk_bdev *base_bdev, raid_bdev_remove_base_bd
 			/* There is no base bdev for this raid, so free the raid device. */
 			raid_bdev_cleanup_and_free(raid_bdev);
 		}
-	} else if (raid_bdev->num_base_bdevs_discovered == raid_bdev->min_base_bdevs_operational) {
+	} else if (!base_info->rebuilding &&
+		   raid_bdev->num_base_bdevs_discovered == raid_bdev->min_base_bdevs_operational) {
 		/*
 		 * After this base bdev is removed there will not be enough base bdevs
 		 * to keep the raid bdev operational.
 		 */
 		raid_bdev_deconfigure(raid_bdev, cb_fn, cb_ctx);
 	} else {
-		int ret;
-
-		ret = spdk_bdev_quiesce(&raid_bdev->bdev, &g_raid_if,
-					raid_bdev_remove_base_bdev_on_quiesced, base_info);
-		if (ret != 0) {
-			base_info->remove_scheduled = false;
-		}
+		raid_bdev_stop_background(raid_bdev, raid_bdev_remove_base_bdev_quiesce, base_info);
 	}
 
 	return 0;
@@ -1522,6 +1938,46 @@ raid_bdev_delete(struct raid_bdev *raid_bdev, raid_bdev_destruct_cb cb_fn, void
 	}
 }
 
+/*
+ * brief:
+ * raid_bdev_base_bdev_set_data_region sets the offset and the size of the data
+ * region of a base bdev, leaving room for the superblock if the raid bdev has one
+ * params:
+ * base_info - raid base bdev info
+ * bdev - the base bdev
+ * returns:
+ * 0 - success
+ * non zero - failure
+ */
+static int
+raid_bdev_base_bdev_set_data_region(struct raid_base_bdev_info *base_info, struct spdk_bdev *bdev)
+{
+	struct raid_bdev *raid_bdev = base_info->raid_bdev;
+
+	base_info->data_offset = 0;
+	base_info->data_size = bdev->blockcnt;
+
+	if (raid_bdev->superblock_enabled) {
+		assert((RAID_BDEV_MIN_DATA_OFFSET_SIZE % bdev->blocklen) == 0);
+		base_info->data_offset = RAID_BDEV_MIN_DATA_OFFSET_SIZE / bdev->blocklen;
+
+		if (bdev->optimal_io_boundary) {
+			base_info->data_offset = spdk_divide_round_up(base_info->data_offset,
+						 bdev->optimal_io_boundary) * bdev->optimal_io_boundary;
+		}
+
+		if (base_info->data_offset >= bdev->blockcnt) {
+			SPDK_ERRLOG("Data offset %lu exceeds base bdev capacity %lu on bdev '%s'\n",
+				    base_info->data_offset, bdev->blockcnt, base_info->name);
+			return -EINVAL;
+		}
+
+		base_info->data_size = bdev->blockcnt - base_info->data_offset;
+	}
+
+	return 0;
+}
+
 static int
 raid_bdev_configure_base_bdev(struct raid_base_bdev_info *base_info)
 {
@@ -1557,27 +2013,12 @@ raid_bdev_configure_base_bdev(struct raid_base_bdev_info *base_info)
 
 	base_info->desc = desc;
 	base_info->blockcnt = bdev->blockcnt;
-	base_info->data_offset = 0;
-	base_info->data_size = bdev->blockcnt;
 	raid_bdev->num_base_bdevs_discovered++;
 	assert(raid_bdev->num_base_bdevs_discovered <= raid_bdev->num_base_bdevs);
 
-	if (raid_bdev->superblock_enabled) {
-		assert((RAID_BDEV_MIN_DATA_OFFSET_SIZE % bdev->blocklen) == 0);
-		base_info->data_offset = RAID_BDEV_MIN_DATA_OFFSET_SIZE / bdev->blocklen;
-
-		if (bdev->optimal_io_boundary) {
-			base_info->data_offset = spdk_divide_round_up(base_info->data_offset,
-						 bdev->optimal_io_boundary) * bdev->optimal_io_boundary;
-		}
-
-		if (base_info->data_offset >= bdev->blockcnt) {
-			SPDK_ERRLOG("Data offset %lu exceeds base bdev capacity %lu on bdev '%s'\n",
-				    base_info->data_offset, bdev->blockcnt, base_info->name);
-			return -EINVAL;
-		}
-
-		base_info->data_size = bdev->blockcnt - base_info->data_offset;
+	rc = raid_bdev_base_bdev_set_data_region(base_info, bdev);
+	if (rc != 0) {
+		return rc;
 	}
 
 	if (raid_bdev->num_base_bdevs_discovered == raid_bdev->num_base_bdevs) {
@@ -1638,6 +2079,276 @@ raid_bdev_add_base_device(struct raid_bdev *raid_bdev, const char *name, uint8_t
 	return 0;
 }
 
+struct raid_bdev_attach_base_bdev_ctx {
+	struct raid_base_bdev_info	*base_info;
+	raid_bdev_attach_base_bdev_cb	cb_fn;
+	void				*cb_ctx;
+	int				status;
+};
+
+static void
+raid_bdev_attach_base_bdev_done(struct raid_bdev_attach_base_bdev_ctx *ctx, int status)
+{
+	struct raid_base_bdev_info *base_info = ctx->base_info;
+	struct raid_bdev *raid_bdev = base_info->raid_bdev;
+
+	if (status != 0) {
+		spdk_spin_lock(&raid_bdev->base_bdev_lock);
+		raid_bdev_free_base_bdev_resource(base_info);
+		spdk_spin_unlock(&raid_bdev->base_bdev_lock);
+	}
+
+	ctx->cb_fn(ctx->cb_ctx, status);
+	free(ctx);
+}
+
+static void
+raid_bdev_attach_base_bdev_on_unquiesced(void *_ctx, int status)
+{
+	struct raid_bdev_attach_base_bdev_ctx *ctx = _ctx;
+	struct raid_bdev *raid_bdev = ctx->base_info->raid_bdev;
+
+	if (status != 0) {
+		SPDK_ERRLOG("Failed to unquiesce raid bdev %s: %s\n",
+			    raid_bdev->bdev.name, spdk_strerror(-status));
+	}
+
+	raid_bdev_attach_base_bdev_done(ctx, ctx->status);
+}
+
+static void
+raid_bdev_attach_base_bdev_unquiesce(struct spdk_io_channel_iter *i, int status)
+{
+	struct raid_bdev_attach_base_bdev_ctx *ctx = spdk_io_channel_iter_get_ctx(i);
+	struct raid_bdev *raid_bdev = ctx->base_info->raid_bdev;
+
+	spdk_bdev_unquiesce(&raid_bdev->bdev, &g_raid_if, raid_bdev_attach_base_bdev_on_unquiesced,
+			    ctx);
+}
+
+static void
+raid_bdev_channel_attach_base_bdev(struct spdk_io_channel_iter *i)
+{
+	struct raid_bdev_attach_base_bdev_ctx *ctx = spdk_io_channel_iter_get_ctx(i);
+	struct raid_base_bdev_info *base_info = ctx->base_info;
+	struct spdk_io_channel *ch = spdk_io_channel_iter_get_channel(i);
+	struct raid_bdev_io_channel *raid_ch = spdk_io_channel_get_ctx(ch);
+	uint8_t idx = base_info - base_info->raid_bdev->base_bdev_info;
+	int status = 0;
+
+	if (raid_ch->base_channel[idx] == NULL) {
+		raid_ch->base_channel[idx] = spdk_bdev_get_io_channel(base_info->desc);
+		if (raid_ch->base_channel[idx] == NULL) {
+			SPDK_ERRLOG("Unable to create io channel for base bdev\n");
+			status = -ENOMEM;
+		}
+	}
+
+	spdk_for_each_channel_continue(i, status);
+}
+
+static void
+raid_bdev_channel_detach_base_bdev(struct spdk_io_channel_iter *i)
+{
+	struct raid_bdev_attach_base_bdev_ctx *ctx = spdk_io_channel_iter_get_ctx(i);
+	struct spdk_io_channel *ch = spdk_io_channel_iter_get_channel(i);
+	struct raid_bdev_io_channel *raid_ch = spdk_io_channel_get_ctx(ch);
+	uint8_t idx = ctx->base_info - ctx->base_info->raid_bdev->base_bdev_info;
+
+	if (raid_ch->base_channel[idx] != NULL) {
+		spdk_put_io_channel(raid_ch->base_channel[idx]);
+		raid_ch->base_channel[idx] = NULL;
+	}
+
+	spdk_for_each_channel_continue(i, 0);
+}
+
+static void
+raid_bdev_channels_attach_base_bdev_done(struct spdk_io_channel_iter *i, int status)
+{
+	struct raid_bdev_attach_base_bdev_ctx *ctx = spdk_io_channel_iter_get_ctx(i);
+	struct raid_bdev *raid_bdev = ctx->base_info->raid_bdev;
+
+	if (status != 0) {
+		/* Put the channels which were already created */
+		ctx->status = status;
+		spdk_for_each_channel(raid_bdev, raid_bdev_channel_detach_base_bdev, ctx,
+				      raid_bdev_attach_base_bdev_unquiesce);
+		return;
+	}
+
+	raid_bdev_attach_base_bdev_unquiesce(i, 0);
+}
+
+static void
+raid_bdev_attach_base_bdev_on_quiesced(void *_ctx, int status)
+{
+	struct raid_bdev_attach_base_bdev_ctx *ctx = _ctx;
+	struct raid_bdev *raid_bdev = ctx->base_info->raid_bdev;
+
+	if (status != 0) {
+		SPDK_ERRLOG("Failed to quiesce raid bdev %s: %s\n",
+			    raid_bdev->bdev.name, spdk_strerror(-status));
+		raid_bdev_attach_base_bdev_done(ctx, status);
+		return;
+	}
+
+	spdk_for_each_channel(raid_bdev, raid_bdev_channel_attach_base_bdev, ctx,
+			      raid_bdev_channels_attach_base_bdev_done);
+}
+
+/*
+ * brief:
+ * raid_bdev_attach_base_bdev opens and claims a replacement base bdev and adds it
+ * into an empty slot of an online raid bdev. The base bdev is marked as rebuilding,
+ * the raid module is responsible for rebuilding its data and then calling
+ * raid_bdev_base_bdev_rebuilt. cb_fn is called once all raid bdev channels have an
+ * I/O channel of the base bdev.
+ * params:
+ * raid_bdev - pointer to raid bdev
+ * name - name of the base bdev
+ * slot - empty slot to attach the base bdev to
+ * cb_fn - callback function
+ * cb_ctx - argument to callback function
+ * returns:
+ * 0 - success
+ * non zero - failure
+ */
+int
+raid_bdev_attach_base_bdev(struct raid_bdev *raid_bdev, const char *name, uint8_t slot,
+			   raid_bdev_attach_base_bdev_cb cb_fn, void *cb_ctx)
+{
+	struct raid_bdev_attach_base_bdev_ctx *ctx;
+	struct raid_base_bdev_info *base_info, *iter;
+	struct spdk_bdev_desc *desc;
+	struct spdk_bdev *bdev;
+	uint64_t data_size = 0;
+	int rc;
+
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
+	assert(cb_fn != NULL);
+
+	if (raid_bdev->state != RAID_BDEV_STATE_ONLINE || slot >= raid_bdev->num_base_bdevs) {
+		return -EINVAL;
+	}
+
+	base_info = &raid_bdev->base_bdev_info[slot];
+	if (base_info->name != NULL || base_info->desc != NULL) {
+		SPDK_ERRLOG("Slot %u on raid bdev '%s' is not empty\n", slot, raid_bdev->bdev.name);
+		return -EBUSY;
+	}
+
+	RAID_FOR_EACH_BASE_BDEV(raid_bdev, iter) {
+		if (iter->desc != NULL) {
+			data_size = iter->data_size;
+			break;
+		}
+	}
+
+	rc = spdk_bdev_open_ext(name, true, raid_bdev_event_base_bdev, NULL, &desc);
+	if (rc != 0) {
+		SPDK_ERRLOG("Unable to create desc on bdev '%s'\n", name);
+		return rc;
+	}
+
+	bdev = spdk_bdev_desc_get_bdev(desc);
+
+	if (bdev->blocklen != raid_bdev->bdev.blocklen ||
+	    spdk_bdev_get_md_size(bdev) != raid_bdev->bdev.md_len ||
+	    spdk_bdev_is_md_interleaved(bdev) != raid_bdev->bdev.md_interleave) {
+		SPDK_ERRLOG("Bdev '%s' block format doesn't match raid bdev '%s'\n",
+			    name, raid_bdev->bdev.name);
+		spdk_bdev_close(desc);
+		return -EINVAL;
+	}
+
+	rc = spdk_bdev_module_claim_bdev(bdev, NULL, &g_raid_if);
+	if (rc != 0) {
+		SPDK_ERRLOG("Unable to claim this bdev as it is already claimed\n");
+		spdk_bdev_close(desc);
+		return rc;
+	}
+
+	base_info->name = strdup(name);
+	if (base_info->name == NULL) {
+		spdk_bdev_module_release_bdev(bdev);
+		spdk_bdev_close(desc);
+		return -ENOMEM;
+	}
+
+	rc = raid_bdev_base_bdev_set_data_region(base_info, bdev);
+	if (rc == 0 && base_info->data_size < data_size) {
+		SPDK_ERRLOG("Bdev '%s' is too small to replace a base bdev of raid bdev '%s'\n",
+			    name, raid_bdev->bdev.name);
+		rc = -EINVAL;
+	}
+	if (rc != 0) {
+		free(base_info->name);
+		base_info->name = NULL;
+		spdk_bdev_module_release_bdev(bdev);
+		spdk_bdev_close(desc);
+		return rc;
+	}
+
+	SPDK_DEBUGLOG(bdev_raid, "bdev %s is claimed\n", bdev->name);
+
+	base_info->data_size = data_size;
+	base_info->blockcnt = bdev->blockcnt;
+	base_info->rebuilding = true;
+
+	spdk_spin_lock(&raid_bdev->base_bdev_lock);
+	base_info->desc = desc;
+	spdk_spin_unlock(&raid_bdev->base_bdev_lock);
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		rc = -ENOMEM;
+		goto err;
+	}
+	ctx->base_info = base_info;
+	ctx->cb_fn = cb_fn;
+	ctx->cb_ctx = cb_ctx;
+
+	rc = spdk_bdev_quiesce(&raid_bdev->bdev, &g_raid_if, raid_bdev_attach_base_bdev_on_quiesced,
+			       ctx);
+	if (rc != 0) {
+		free(ctx);
+		goto err;
+	}
+
+	return 0;
+err:
+	spdk_spin_lock(&raid_bdev->base_bdev_lock);
+	raid_bdev_free_base_bdev_resource(base_info);
+	spdk_spin_unlock(&raid_bdev->base_bdev_lock);
+	return rc;
+}
+
+/*
+ * brief:
+ * raid_bdev_base_bdev_rebuilt is called by the raid module when the data of a
+ * base bdev attached with raid_bdev_attach_base_bdev has been rebuilt
+ * params:
+ * base_info - raid base bdev info
+ * returns:
+ * none
+ */
+void
+raid_bdev_base_bdev_rebuilt(struct raid_base_bdev_info *base_info)
+{
+	struct raid_bdev *raid_bdev = base_info->raid_bdev;
+
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
+	assert(base_info->rebuilding);
+
+	base_info->rebuilding = false;
+	raid_bdev->num_base_bdevs_discovered++;
+	assert(raid_bdev->num_base_bdevs_discovered <= raid_bdev->num_base_bdevs);
+
+	SPDK_NOTICELOG("Base bdev '%s' of raid bdev '%s' rebuilt\n", base_info->name,
+		       raid_bdev->bdev.name);
+}
+
 /*
  * brief:
  * raid_bdev_examine function is the examine function call by the below layers
@@ -15,10 +15,53 @@ enum raid_level {
 	INVALID_RAID_LEVEL	= -1,
 	RAID0			= 0,
 	RAID1			= 1,
+	RAID6			= 6,
 	RAID5F			= 95, /* 0x5f */
 	CONCAT			= 99,
 };
 
+/*
+ * Placement of the parity and data chunks of a stripe, with the numbering of the md
+ * driver. Left layouts rotate the parity from the last member down to the first, right
+ * ones from the first up to the last. Asymmetric layouts place the data chunks in member
+ * order around the parity, symmetric ones start them on the member after the parity so
+ * that consecutive data chunks are on consecutive members.
+ */
+enum raid_parity_layout {
+	INVALID_RAID_PARITY_LAYOUT		= -1,
+	RAID_PARITY_LAYOUT_LEFT_ASYMMETRIC	= 0,
+	RAID_PARITY_LAYOUT_RIGHT_ASYMMETRIC	= 1,
+	RAID_PARITY_LAYOUT_LEFT_SYMMETRIC	= 2,
+	RAID_PARITY_LAYOUT_RIGHT_SYMMETRIC	= 3,
+};
+
+/*
+ * How raid5f verifies the data of reads. With auto, the protection information guard
+ * tags are checked if the raid bdev has protection information, and the chunk is only
+ * compared with its reconstruction from the other members if they don't match. Without
+ * protection information, or with parity, every read is compared. Full does both.
+ */
+enum raid_read_verify {
+	INVALID_RAID_READ_VERIFY	= -1,
+	RAID_READ_VERIFY_AUTO		= 0,
+	RAID_READ_VERIFY_PARITY		= 1,
+	RAID_READ_VERIFY_FULL		= 2,
+};
+
+/*
+ * How raid1 picks the mirror a read is sent to. Least-outstanding takes the mirror with
+ * the fewest blocks being read, latency the one with the lowest expected completion time
+ * from its average read latency and queue, and round-robin each mirror in turn. Preferred
+ * reads from one mirror and spills over to the others while its queue is full.
+ */
+enum raid_read_policy {
+	INVALID_RAID_READ_POLICY		= -1,
+	RAID_READ_POLICY_LEAST_OUTSTANDING	= 0,
+	RAID_READ_POLICY_LATENCY		= 1,
+	RAID_READ_POLICY_ROUND_ROBIN		= 2,
+	RAID_READ_POLICY_PREFERRED		= 3,
+};
+
 /*
  * Raid state describes the state of the raid. This raid bdev can be either in
  * configured list or configuring list
@@ -44,6 +87,7 @@ enum raid_bdev_state {
 };
 
 typedef void (*raid_bdev_remove_base_bdev_cb)(void *ctx, int status);
+typedef void (*raid_bdev_attach_base_bdev_cb)(void *ctx, int status);
 
 /*
  * raid_base_bdev_info contains information for the base bdevs which are part of some
@@ -81,8 +125,18 @@ struct raid_base_bdev_info {
 
 	/* Hold the number of blocks to know how large the base bdev is resized. */
 	uint64_t		blockcnt;
+
+	/*
+	 * Set while the base bdev is attached to an online raid bdev as a replacement and its
+	 * data is rebuilt. It is not counted in num_base_bdevs_discovered until then.
+	 */
+	bool			rebuilding;
 };
 
+struct raid_bdev_io;
+typedef void (*raid_bdev_io_completion_cb)(struct raid_bdev_io *raid_io,
+		enum spdk_bdev_io_status status);
+
 /*
  * raid_bdev_io is the context part of bdev_io. It contains the information
  * related to bdev_io for a raid bdev
@@ -102,8 +156,97 @@ struct raid_bdev_io {
 	uint8_t				base_bdev_io_submitted;
 	uint8_t				base_bdev_io_status;
 
+	/* Time the I/O was submitted to a base bdev, for modules tracking their latency */
+	uint64_t			base_bdev_io_submit_tsc;
+
 	/* Private data for the raid module */
 	void				*module_private;
+
+	/* I/O parameters, set from the bdev_io or by the raid module for internal I/O */
+	enum spdk_bdev_io_type		type;
+	uint64_t			offset_blocks;
+	uint64_t			num_blocks;
+	struct iovec			*iovs;
+	int				iovcnt;
+	void				*md_buf;
+	struct spdk_memory_domain	*memory_domain;
+	void				*memory_domain_ctx;
+
+	/* Custom completion callback. Overrides bdev_io completion if set. */
+	raid_bdev_io_completion_cb	completion_cb;
+};
+
+typedef void (*raid_bdev_destruct_cb)(void *cb_ctx, int rc);
+typedef void (*raid_bdev_stop_background_cb)(void *cb_ctx, int status);
+
+/*
+ * Optional raid bdev parameters. A value of 0 selects the default of the raid
+ * module. Parameters which don't apply to the raid level are ignored.
+ */
+struct raid_bdev_opts {
+	/* Number of stripes in the raid5f write-back stripe cache, 0 disables the cache */
+	uint32_t			stripe_cache_size;
+
+	/* Time in milliseconds after which partially written cached stripes are flushed */
+	uint32_t			stripe_cache_flush_timeout_ms;
+
+	/* Number of raid5f stripe requests of each type preallocated per io channel */
+	uint32_t			stripe_pool_size;
+
+	/* Number of raid5f stripe requests of each type an io channel may grow to under load */
+	uint32_t			stripe_pool_max;
+
+	/*
+	 * Latency percentile of a base bdev in per mille, e.g. 990 for p99, after which raid5f
+	 * reconstructs a read from the other base bdevs in parallel. 0 disables hedged reads.
+	 */
+	uint32_t			read_hedge_permille;
+
+	/* Parity layout of raid5f, left-asymmetric by default */
+	enum raid_parity_layout		parity_layout;
+
+	/*
+	 * Type and format of the protection information raid5f exposes in the metadata of the
+	 * raid bdev. It is stored with the rest of the metadata on base bdevs without DIF and
+	 * its guard tags are checked by reads.
+	 */
+	enum spdk_dif_type		dif_type;
+	enum spdk_dif_pi_format		dif_pi_format;
+
+	/* Read verification of raid5f */
+	enum raid_read_verify		read_verify;
+
+	/*
+	 * Keep a checksum of every raid5f chunk in a table at the end of each base bdev, so
+	 * that verified reads of a chunk only read that chunk
+	 */
+	bool				chunk_checksums;
+
+	/*
+	 * Number of threads owning the raid5f stripes, runs of consecutive stripes being owned by
+	 * the threads in turn. Reads and writes are forwarded to the owners of their stripes, so
+	 * that the requests of a stripe run on a single thread. 0 handles I/Os where they are
+	 * received.
+	 */
+	uint32_t			stripe_owner_threads;
+
+	/* Mirror selection of raid1 reads */
+	enum raid_read_policy		read_policy;
+
+	/* Slot of the mirror reads go to with the preferred raid1 read policy */
+	uint32_t			read_preferred_slot;
+
+	/*
+	 * Number of reads in progress on the preferred mirror above which raid1 sends reads
+	 * to the other mirrors
+	 */
+	uint32_t			read_spillover_qd;
+
+	/*
+	 * Send reads continuing a recent sequential read of a raid1 io channel to the same
+	 * mirror, so that its readahead keeps working
+	 */
+	bool				read_stream_affinity;
 };
 
 /*
@@ -157,6 +300,13 @@ struct raid_bdev {
 	/* Set to true if superblock metadata is enabled on this raid bdev */
 	bool				superblock_enabled;
 
+	/* Optional parameters of this raid bdev */
+	struct raid_bdev_opts		opts;
+
+	/* Callback and its argument for deconfiguring this raid bdev */
+	raid_bdev_destruct_cb		deconfigure_cb_fn;
+	void				*deconfigure_cb_arg;
+
 	/* Module for RAID-level specific operations */
 	struct raid_bdev_module		*module;
 
@@ -187,11 +337,9 @@ TAILQ_HEAD(raid_all_tailq, raid_bdev);
 
 extern struct raid_all_tailq		g_raid_bdev_list;
 
-typedef void (*raid_bdev_destruct_cb)(void *cb_ctx, int rc);
-
 int raid_bdev_create(const char *name, uint32_t strip_size, uint8_t num_base_bdevs,
 		     enum raid_level level, bool superblock, const struct spdk_uuid *uuid,
-		     struct raid_bdev **raid_bdev_out);
+		     const struct raid_bdev_opts *opts, struct raid_bdev **raid_bdev_out);
 void raid_bdev_delete(struct raid_bdev *raid_bdev, raid_bdev_destruct_cb cb_fn, void *cb_ctx);
 int raid_bdev_add_base_device(struct raid_bdev *raid_bdev, const char *name, uint8_t slot);
 struct raid_bdev *raid_bdev_find_by_name(const char *name);
@@ -199,9 +347,18 @@ enum raid_level raid_bdev_str_to_level(const char *str);
 const char *raid_bdev_level_to_str(enum raid_level level);
 enum raid_bdev_state raid_bdev_str_to_state(const char *str);
 const char *raid_bdev_state_to_str(enum raid_bdev_state state);
+enum raid_parity_layout raid_bdev_str_to_parity_layout(const char *str);
+const char *raid_bdev_parity_layout_to_str(enum raid_parity_layout layout);
+enum raid_read_verify raid_bdev_str_to_read_verify(const char *str);
+const char *raid_bdev_read_verify_to_str(enum raid_read_verify verify);
+enum raid_read_policy raid_bdev_str_to_read_policy(const char *str);
+const char *raid_bdev_read_policy_to_str(enum raid_read_policy policy);
 void raid_bdev_write_info_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w);
 int raid_bdev_remove_base_bdev(struct spdk_bdev *base_bdev, raid_bdev_remove_base_bdev_cb cb_fn,
 			       void *cb_ctx);
+int raid_bdev_attach_base_bdev(struct raid_bdev *raid_bdev, const char *name, uint8_t slot,
+			       raid_bdev_attach_base_bdev_cb cb_fn, void *cb_ctx);
+void raid_bdev_base_bdev_rebuilt(struct raid_base_bdev_info *base_info);
 
 /*
  * RAID module descriptor
@@ -251,9 +408,15 @@ struct raid_bdev_module {
 	/* Handler for R/W requests */
 	void (*submit_rw_request)(struct raid_bdev_io *raid_io);
 
-	/* Handler for requests without payload (flush, unmap). Optional. */
+	/* Handler for requests without payload (flush, unmap, write zeroes). Optional. */
 	void (*submit_null_payload_request)(struct raid_bdev_io *raid_io);
 
+	/*
+	 * Called to check if a type of request without payload is supported. Optional.
+	 * If not set, flush and unmap are supported when submit_null_payload_request is set.
+	 */
+	bool (*io_type_supported)(struct raid_bdev *raid_bdev, enum spdk_bdev_io_type io_type);
+
 	/*
 	 * Called when the bdev's IO channel is created to get the module's private IO channel.
 	 * Optional.
@@ -266,6 +429,22 @@ struct raid_bdev_module {
 	 */
 	void (*resize)(struct raid_bdev *raid_bdev);
 
+	/*
+	 * Called before the raid bdev is unregistered or a base bdev is removed from it,
+	 * to stop background operations of the module. cb_fn, if not NULL, must be called
+	 * once no more I/O of these operations is outstanding. A non-zero status tells that
+	 * the module failed to write data it holds to the base bdevs, the unregistration of
+	 * the raid bdev is then aborted if possible. Optional.
+	 */
+	void (*stop_background)(struct raid_bdev *raid_bdev, raid_bdev_stop_background_cb cb_fn,
+				void *cb_ctx);
+
+	/*
+	 * Called when writing the raid bdev configuration, after the bdev_raid_create object,
+	 * to add RPC objects restoring the module's runtime state. Optional.
+	 */
+	void (*write_config_json)(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w);
+
 	TAILQ_ENTRY(raid_bdev_module) link;
 };
 
@@ -281,12 +460,20 @@ __RAID_MODULE_REGISTER(__LINE__)(void)					\
     raid_bdev_module_list_add(_module);					\
 }
 
+void raid_bdev_io_init(struct raid_bdev_io *raid_io, struct raid_bdev_io_channel *raid_ch,
+		       enum spdk_bdev_io_type type, uint64_t offset_blocks,
+		       uint64_t num_blocks, struct iovec *iovs, int iovcnt, void *md_buf,
+		       struct spdk_memory_domain *memory_domain, void *memory_domain_ctx);
 bool raid_bdev_io_complete_part(struct raid_bdev_io *raid_io, uint64_t completed,
 				enum spdk_bdev_io_status status);
 void raid_bdev_queue_io_wait(struct raid_bdev_io *raid_io, struct spdk_bdev *bdev,
 			     struct spdk_io_channel *ch, spdk_bdev_io_wait_cb cb_fn);
 void raid_bdev_io_complete(struct raid_bdev_io *raid_io, enum spdk_bdev_io_status status);
 void raid_bdev_module_stop_done(struct raid_bdev *raid_bdev);
+int raid_bdev_quiesce_range(struct raid_bdev *raid_bdev, uint64_t offset_blocks,
+			    uint64_t num_blocks, spdk_bdev_quiesce_cb cb_fn, void *cb_arg);
+int raid_bdev_unquiesce_range(struct raid_bdev *raid_bdev, uint64_t offset_blocks,
+			      uint64_t num_blocks, spdk_bdev_quiesce_cb cb_fn, void *cb_arg);
 
 /**
  * Raid bdev I/O read/write wrapper for spdk_bdev_readv_blocks_ext function.
@@ -326,6 +513,18 @@ raid_bdev_unmap_blocks(struct raid_base_bdev_info *base_info, struct spdk_io_cha
 				      num_blocks, cb, cb_arg);
 }
 
+/**
+ * Raid bdev I/O read/write wrapper for spdk_bdev_write_zeroes_blocks function.
+ */
+static inline int
+raid_bdev_write_zeroes_blocks(struct raid_base_bdev_info *base_info, struct spdk_io_channel *ch,
+			      uint64_t offset_blocks, uint64_t num_blocks,
+			      spdk_bdev_io_completion_cb cb, void *cb_arg)
+{
+	return spdk_bdev_write_zeroes_blocks(base_info->desc, ch, base_info->data_offset + offset_blocks,
+					     num_blocks, cb, cb_arg);
+}
+
 /**
  * Raid bdev I/O read/write wrapper for spdk_bdev_flush_blocks function.
  */
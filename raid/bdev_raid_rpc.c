@@ -133,6 +133,9 @@ struct rpc_bdev_raid_create {
 
 	/* If set, information about raid bdev will be stored in superblock on each base bdev */
 	bool                                 superblock_enabled;
+
+	/* Optional raid bdev parameters */
+	struct raid_bdev_opts                opts;
 };
 
 /*
@@ -178,6 +181,78 @@ decode_raid_level(const struct spdk_json_val *val, void *out)
 	return ret;
 }
 
+/*
+ * Decoder function for RPC bdev_raid_create to decode parity layout
+ */
+static int
+decode_parity_layout(const struct spdk_json_val *val, void *out)
+{
+	int ret;
+	char *str = NULL;
+	enum raid_parity_layout layout;
+
+	ret = spdk_json_decode_string(val, &str);
+	if (ret == 0 && str != NULL) {
+		layout = raid_bdev_str_to_parity_layout(str);
+		if (layout == INVALID_RAID_PARITY_LAYOUT) {
+			ret = -EINVAL;
+		} else {
+			*(enum raid_parity_layout *)out = layout;
+		}
+	}
+
+	free(str);
+	return ret;
+}
+
+/*
+ * Decoder function for RPC bdev_raid_create to decode read verification
+ */
+static int
+decode_read_verify(const struct spdk_json_val *val, void *out)
+{
+	int ret;
+	char *str = NULL;
+	enum raid_read_verify verify;
+
+	ret = spdk_json_decode_string(val, &str);
+	if (ret == 0 && str != NULL) {
+		verify = raid_bdev_str_to_read_verify(str);
+		if (verify == INVALID_RAID_READ_VERIFY) {
+			ret = -EINVAL;
+		} else {
+			*(enum raid_read_verify *)out = verify;
+		}
+	}
+
+	free(str);
+	return ret;
+}
+
+/*
+ * Decoder function for RPC bdev_raid_create to decode raid1 read policy
+ */
+static int
+decode_read_policy(const struct spdk_json_val *val, void *out)
+{
+	int ret;
+	char *str = NULL;
+	enum raid_read_policy policy;
+
+	ret = spdk_json_decode_string(val, &str);
+	if (ret == 0 && str != NULL) {
+		policy = raid_bdev_str_to_read_policy(str);
+		if (policy == INVALID_RAID_READ_POLICY) {
+			ret = -EINVAL;
+		} else {
+			*(enum raid_read_policy *)out = policy;
+		}
+	}
+
+	free(str);
+	return ret;
+}
+
 /*
  * Decoder function for RPC bdev_raid_create to decode base bdevs list
  */
@@ -199,6 +274,21 @@ static const struct spdk_json_object_decoder rpc_bdev_raid_create_decoders[] = {
 	{"base_bdevs", offsetof(struct rpc_bdev_raid_create, base_bdevs), decode_base_bdevs},
 	{"uuid", offsetof(struct rpc_bdev_raid_create, uuid), spdk_json_decode_uuid, true},
 	{"superblock", offsetof(struct rpc_bdev_raid_create, superblock_enabled), spdk_json_decode_bool, true},
+	{"stripe_cache_size", offsetof(struct rpc_bdev_raid_create, opts.stripe_cache_size), spdk_json_decode_uint32, true},
+	{"stripe_cache_flush_timeout_ms", offsetof(struct rpc_bdev_raid_create, opts.stripe_cache_flush_timeout_ms), spdk_json_decode_uint32, true},
+	{"stripe_pool_size", offsetof(struct rpc_bdev_raid_create, opts.stripe_pool_size), spdk_json_decode_uint32, true},
+	{"stripe_pool_max", offsetof(struct rpc_bdev_raid_create, opts.stripe_pool_max), spdk_json_decode_uint32, true},
+	{"read_hedge_permille", offsetof(struct rpc_bdev_raid_create, opts.read_hedge_permille), spdk_json_decode_uint32, true},
+	{"parity_layout", offsetof(struct rpc_bdev_raid_create, opts.parity_layout), decode_parity_layout, true},
+	{"dif_type", offsetof(struct rpc_bdev_raid_create, opts.dif_type), spdk_json_decode_int32, true},
+	{"dif_pi_format", offsetof(struct rpc_bdev_raid_create, opts.dif_pi_format), spdk_json_decode_int32, true},
+	{"read_verify", offsetof(struct rpc_bdev_raid_create, opts.read_verify), decode_read_verify, true},
+	{"chunk_checksums", offsetof(struct rpc_bdev_raid_create, opts.chunk_checksums), spdk_json_decode_bool, true},
+	{"stripe_owner_threads", offsetof(struct rpc_bdev_raid_create, opts.stripe_owner_threads), spdk_json_decode_uint32, true},
+	{"read_policy", offsetof(struct rpc_bdev_raid_create, opts.read_policy), decode_read_policy, true},
+	{"read_preferred_slot", offsetof(struct rpc_bdev_raid_create, opts.read_preferred_slot), spdk_json_decode_uint32, true},
+	{"read_spillover_qd", offsetof(struct rpc_bdev_raid_create, opts.read_spillover_qd), spdk_json_decode_uint32, true},
+	{"read_stream_affinity", offsetof(struct rpc_bdev_raid_create, opts.read_stream_affinity), spdk_json_decode_bool, true},
 };
 
 /*
@@ -229,7 +319,7 @@ rpc_bdev_raid_create(struct spdk_jsonrpc_request *request,
 	}
 
 	rc = raid_bdev_create(req.name, req.strip_size_kb, req.base_bdevs.num_base_bdevs,
-			      req.level, req.superblock_enabled, &req.uuid, &raid_bdev);
+			      req.level, req.superblock_enabled, &req.uuid, &req.opts, &raid_bdev);
 	if (rc != 0) {
 		spdk_jsonrpc_send_error_response_fmt(request, rc,
 						     "Failed to create RAID bdev %s: %s",
@@ -0,0 +1,58 @@
+#!/bin/bash
+# Compare the raid5f parity layouts with sequential and random reads and writes.
+# The array is built on 5 malloc bdevs, or null bdevs with -t null. Null bdevs don't
+# keep data, so reads from them fail parity verification and trigger repairs; use
+# them for write throughput only.
+
+SPDK_DIR=${SPDK_DIR:-/opt/mellanox/spdk}
+BDEV_TYPE=malloc
+RUNTIME=10
+IODEPTH=8
+
+while getopts "t:r:q:" opt; do
+	case $opt in
+		t) BDEV_TYPE=$OPTARG ;;
+		r) RUNTIME=$OPTARG ;;
+		q) IODEPTH=$OPTARG ;;
+		*) echo "usage: $0 [-t malloc|null] [-r runtime_s] [-q iodepth]"; exit 1 ;;
+	esac
+done
+
+conf=$(mktemp --suffix=.json)
+trap 'rm -f $conf' EXIT
+
+write_conf() {
+	local layout=$1
+	local i
+
+	{
+		echo '{ "subsystems": [ { "subsystem": "bdev", "config": ['
+		for i in 0 1 2 3 4; do
+			if [ "$BDEV_TYPE" = null ]; then
+				echo "{ \"method\": \"bdev_null_create\", \"params\": { \"name\": \"Base$i\","
+				echo "  \"block_size\": 512, \"num_blocks\": 2097152 } },"
+			else
+				echo "{ \"method\": \"bdev_malloc_create\", \"params\": { \"name\": \"Base$i\","
+				echo "  \"block_size\": 512, \"num_blocks\": 262144 } },"
+			fi
+		done
+		echo '{ "method": "bdev_raid_create", "params": { "name": "Raid5", "strip_size_kb": 64,'
+		echo "  \"raid_level\": \"raid5f\", \"parity_layout\": \"$layout\","
+		echo '  "base_bdevs": [ "Base0", "Base1", "Base2", "Base3", "Base4" ] } }'
+		echo '] } ] }'
+	} > "$conf"
+}
+
+printf "%-17s %-10s %6s %10s %10s\n" "layout" "rw" "bs" "IOPS" "MiB/s"
+for layout in left-asymmetric right-asymmetric left-symmetric right-symmetric; do
+	write_conf $layout
+	for rw in read write randread randwrite; do
+		for bs in 4k 64k 256k; do
+			out=$(SPDK_DIR=$SPDK_DIR SPDK_JSON_CONF=$conf RW=$rw BS=$bs RUNTIME=$RUNTIME \
+				IODEPTH=$IODEPTH fio --output-format=json "$(dirname "$0")/layout.fio")
+			iops=$(echo "$out" | jq '[.jobs[0].read.iops, .jobs[0].write.iops] | add')
+			bw=$(echo "$out" | jq '([.jobs[0].read.bw, .jobs[0].write.bw] | add) / 1024')
+			printf "%-17s %-10s %6s %10.0f %10.1f\n" $layout $rw $bs "$iops" "$bw"
+		done
+	done
+done
@@ -0,0 +1,88 @@
+#!/bin/bash
+# Compare the scaling of raid5f over 1 to 16 cores with I/Os handled on the core they are
+# submitted on and with stripes owned by one thread per core (stripe_owner_threads).
+# bdevperf runs a job per core on the raid bdev, built on 5 malloc bdevs, or null bdevs
+# with -t null. Null bdevs don't keep data, so reads from them fail parity verification
+# and trigger repairs; use them for write throughput only. A stripe is 256 KiB and owners
+# take runs of 64 stripes (RAID5F_STRIPE_OWNER_RUN), 16 MiB: 1 MiB writes cover several
+# stripes of one owner, 32 MiB writes are split between owners. The table is also written to
+# results.txt next to this script, or to the file given with -o, with the machine it ran on.
+
+SPDK_DIR=${SPDK_DIR:-/opt/mellanox/spdk}
+BDEV_TYPE=malloc
+RUNTIME=10
+IODEPTH=32
+CORES="1 2 4 8 16"
+RESULTS=$(dirname "$0")/results.txt
+
+while getopts "t:r:q:c:o:" opt; do
+	case $opt in
+		t) BDEV_TYPE=$OPTARG ;;
+		r) RUNTIME=$OPTARG ;;
+		q) IODEPTH=$OPTARG ;;
+		c) CORES=$OPTARG ;;
+		o) RESULTS=$OPTARG ;;
+		*) echo "usage: $0 [-t malloc|null] [-r runtime_s] [-q iodepth] [-c \"cores ...\"] [-o results]"
+		   exit 1 ;;
+	esac
+done
+
+conf=$(mktemp --suffix=.json)
+trap 'rm -f $conf' EXIT
+
+write_conf() {
+	local owners=$1
+	local i
+
+	{
+		echo '{ "subsystems": [ { "subsystem": "bdev", "config": ['
+		for i in 0 1 2 3 4; do
+			if [ "$BDEV_TYPE" = null ]; then
+				echo "{ \"method\": \"bdev_null_create\", \"params\": { \"name\": \"Base$i\","
+				echo "  \"block_size\": 512, \"num_blocks\": 2097152 } },"
+			else
+				echo "{ \"method\": \"bdev_malloc_create\", \"params\": { \"name\": \"Base$i\","
+				echo "  \"block_size\": 512, \"num_blocks\": 262144 } },"
+			fi
+		done
+		echo '{ "method": "bdev_raid_create", "params": { "name": "Raid5", "strip_size_kb": 64,'
+		echo "  \"raid_level\": \"raid5f\", \"stripe_owner_threads\": $owners,"
+		echo '  "base_bdevs": [ "Base0", "Base1", "Base2", "Base3", "Base4" ] } }'
+		echo '] } ] }'
+	} > "$conf"
+}
+
+if [ ! -x "$SPDK_DIR/build/examples/bdevperf" ]; then
+	echo "bdevperf not found in $SPDK_DIR, set SPDK_DIR to the SPDK build with this module"
+	exit 1
+fi
+
+{
+echo "# $(date -u +%F) $(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null)" \
+	"$(grep -m1 'model name' /proc/cpuinfo | cut -d: -f2) x $(nproc), $BDEV_TYPE bdevs," \
+	"qd $IODEPTH, ${RUNTIME}s"
+printf "%-8s %5s %-10s %6s %10s %10s\n" "mode" "cores" "rw" "bs" "IOPS" "MiB/s"
+for cores in $CORES; do
+	if [ "$cores" -gt "$(nproc)" ]; then
+		echo "# skipping $cores cores, only $(nproc) available"
+		continue
+	fi
+	mask=$(printf "0x%x" $(((1 << cores) - 1)))
+	for mode in default owners; do
+		if [ $mode = owners ]; then
+			write_conf "$cores"
+		else
+			write_conf 0
+		fi
+		for wl in randread:4096 randwrite:4096 write:262144 write:1048576 write:33554432; do
+			rw=${wl%:*}
+			bs=${wl#*:}
+			# The summary line reads "Total : <IOPS> <MiB/s> ..."
+			read -r iops bw < <("$SPDK_DIR/build/examples/bdevperf" -m "$mask" -C \
+				--json "$conf" -q "$IODEPTH" -o "$bs" -w "$rw" -t "$RUNTIME" 2>/dev/null |
+				awk -F: '/Total/ { split($2, a, " "); print a[1], a[2] }')
+			printf "%-8s %5s %-10s %6s %10.0f %10.1f\n" $mode "$cores" "$rw" "$bs" "${iops:-0}" "${bw:-0}"
+		done
+	done
+done
+} | tee "$RESULTS"
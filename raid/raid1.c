@@ -5,17 +5,67 @@
 
 #include "bdev_raid.h"
 
+#include "spdk/env.h"
 #include "spdk/likely.h"
 #include "spdk/log.h"
 
+/* Default number of reads in progress on the preferred mirror before reads spill over */
+#define RAID1_DEFAULT_READ_SPILLOVER_QD 32
+
+/* Weight of a new sample in the read latency average, as a power of 2 divisor */
+#define RAID1_READ_LATENCY_EWMA_SHIFT 3
+
+/*
+ * With the latency policy, a mirror not read for this many reads of the channel gets the
+ * next one, so that its latency is known again after it was slow for a while
+ */
+#define RAID1_READ_LATENCY_PROBE_INTERVAL 256
+
+/* Number of sequential read streams tracked per io channel */
+#define RAID1_READ_STREAMS 8
+
 struct raid1_info {
 	/* The parent raid bdev */
 	struct raid_bdev *raid_bdev;
+
+	enum raid_read_policy read_policy;
+	uint8_t read_preferred_slot;
+	uint32_t read_spillover_qd;
+	bool read_stream_affinity;
+};
+
+/* Recent sequential read, continued by a read starting where it ended */
+struct raid1_read_stream {
+	uint64_t end_lba;
+	uint8_t idx;
+
+	/* Value of the channel read counter when the stream was last read, 0 if unused */
+	uint64_t last_read;
+};
+
+/* Reads of a base bdev on an io channel */
+struct raid1_member_stats {
+	uint64_t read_blocks_outstanding;
+	uint32_t reads_outstanding;
+
+	/* Moving average of the read latency in ticks, 0 until a read completed */
+	uint64_t read_latency_ewma;
+
+	/* Value of the channel read counter when the base bdev was last read */
+	uint64_t last_read;
 };
 
 struct raid1_io_channel {
-	/* Array of per-base_bdev counters of outstanding read blocks on this channel */
-	uint64_t read_blocks_outstanding[0];
+	/* Number of reads submitted on this channel */
+	uint64_t reads;
+
+	/* Next base bdev of the round-robin policy */
+	uint8_t next_read_idx;
+
+	struct raid1_read_stream streams[RAID1_READ_STREAMS];
+
+	/* Array of per-base_bdev read statistics of this channel */
+	struct raid1_member_stats members[0];
 };
 
 static void
@@ -23,9 +73,12 @@ raid1_channel_inc_read_counters(struct raid_bdev_io_channel *raid_ch, uint8_t id
 				uint64_t num_blocks)
 {
 	struct raid1_io_channel *raid1_ch = spdk_io_channel_get_ctx(raid_ch->module_channel);
+	struct raid1_member_stats *member = &raid1_ch->members[idx];
 
-	assert(raid1_ch->read_blocks_outstanding[idx] <= UINT64_MAX - num_blocks);
-	raid1_ch->read_blocks_outstanding[idx] += num_blocks;
+	assert(member->read_blocks_outstanding <= UINT64_MAX - num_blocks);
+	member->read_blocks_outstanding += num_blocks;
+	member->reads_outstanding++;
+	member->last_read = raid1_ch->reads++;
 }
 
 static void
@@ -33,9 +86,29 @@ raid1_channel_dec_read_counters(struct raid_bdev_io_channel *raid_ch, uint8_t id
 				uint64_t num_blocks)
 {
 	struct raid1_io_channel *raid1_ch = spdk_io_channel_get_ctx(raid_ch->module_channel);
+	struct raid1_member_stats *member = &raid1_ch->members[idx];
+
+	assert(member->read_blocks_outstanding >= num_blocks);
+	member->read_blocks_outstanding -= num_blocks;
+	assert(member->reads_outstanding > 0);
+	member->reads_outstanding--;
+}
+
+static void
+raid1_channel_update_read_latency(struct raid_bdev_io_channel *raid_ch, uint8_t idx,
+				  uint64_t ticks)
+{
+	struct raid1_io_channel *raid1_ch = spdk_io_channel_get_ctx(raid_ch->module_channel);
+	struct raid1_member_stats *member = &raid1_ch->members[idx];
 
-	assert(raid1_ch->read_blocks_outstanding[idx] >= num_blocks);
-	raid1_ch->read_blocks_outstanding[idx] -= num_blocks;
+	if (member->read_latency_ewma == 0) {
+		member->read_latency_ewma = spdk_max(ticks, 1);
+		return;
+	}
+
+	member->read_latency_ewma = spdk_max(member->read_latency_ewma -
+					     (member->read_latency_ewma >> RAID1_READ_LATENCY_EWMA_SHIFT) +
+					     (ticks >> RAID1_READ_LATENCY_EWMA_SHIFT), 1);
 }
 
 static inline void
@@ -63,6 +136,10 @@ raid1_read_bdev_io_completion(struct spdk_bdev_io *bdev_io, bool success, void *
 
 	raid1_channel_dec_read_counters(raid_io->raid_ch, raid_io->base_bdev_io_submitted,
 					spdk_bdev_io_from_ctx(raid_io)->u.bdev.num_blocks);
+	if (success) {
+		raid1_channel_update_read_latency(raid_io->raid_ch, raid_io->base_bdev_io_submitted,
+						  spdk_get_ticks() - raid_io->base_bdev_io_submit_tsc);
+	}
 
 	raid1_bdev_io_completion(bdev_io, success, raid_io);
 }
@@ -88,7 +165,7 @@ raid1_init_ext_io_opts(struct spdk_bdev_io *bdev_io, struct spdk_bdev_ext_io_opt
 }
 
 static uint8_t
-raid1_channel_next_read_base_bdev(struct raid_bdev_io_channel *raid_ch)
+raid1_channel_least_outstanding(struct raid_bdev_io_channel *raid_ch, uint8_t skip_idx)
 {
 	struct raid1_io_channel *raid1_ch = spdk_io_channel_get_ctx(raid_ch->module_channel);
 	uint64_t read_blocks_min = UINT64_MAX;
@@ -96,9 +173,42 @@ raid1_channel_next_read_base_bdev(struct raid_bdev_io_channel *raid_ch)
 	uint8_t i;
 
 	for (i = 0; i < raid_ch->num_channels; i++) {
-		if (raid_ch->base_channel[i] != NULL &&
-		    raid1_ch->read_blocks_outstanding[i] < read_blocks_min) {
-			read_blocks_min = raid1_ch->read_blocks_outstanding[i];
+		if (raid_ch->base_channel[i] != NULL && i != skip_idx &&
+		    raid1_ch->members[i].read_blocks_outstanding < read_blocks_min) {
+			read_blocks_min = raid1_ch->members[i].read_blocks_outstanding;
+			idx = i;
+		}
+	}
+
+	return idx;
+}
+
+/*
+ * Pick the base bdev expected to complete the read first, from its average latency and
+ * the reads it already has. Base bdevs not read for a while are probed.
+ */
+static uint8_t
+raid1_channel_lowest_latency(struct raid_bdev_io_channel *raid_ch)
+{
+	struct raid1_io_channel *raid1_ch = spdk_io_channel_get_ctx(raid_ch->module_channel);
+	struct raid1_member_stats *member;
+	uint64_t cost, cost_min = UINT64_MAX;
+	uint8_t idx = UINT8_MAX;
+	uint8_t i;
+
+	for (i = 0; i < raid_ch->num_channels; i++) {
+		if (raid_ch->base_channel[i] == NULL) {
+			continue;
+		}
+
+		member = &raid1_ch->members[i];
+		if (raid1_ch->reads - member->last_read >= RAID1_READ_LATENCY_PROBE_INTERVAL) {
+			return i;
+		}
+
+		cost = member->read_latency_ewma * (member->reads_outstanding + 1);
+		if (cost < cost_min) {
+			cost_min = cost;
 			idx = i;
 		}
 	}
@@ -106,6 +216,82 @@ raid1_channel_next_read_base_bdev(struct raid_bdev_io_channel *raid_ch)
 	return idx;
 }
 
+static uint8_t
+raid1_channel_round_robin(struct raid_bdev_io_channel *raid_ch)
+{
+	struct raid1_io_channel *raid1_ch = spdk_io_channel_get_ctx(raid_ch->module_channel);
+	uint8_t idx;
+	uint8_t i;
+
+	for (i = 0; i < raid_ch->num_channels; i++) {
+		idx = (raid1_ch->next_read_idx + i) % raid_ch->num_channels;
+		if (raid_ch->base_channel[idx] != NULL) {
+			raid1_ch->next_read_idx = (idx + 1) % raid_ch->num_channels;
+			return idx;
+		}
+	}
+
+	return UINT8_MAX;
+}
+
+/* Read from the preferred base bdev unless its queue is full and another one can take it */
+static uint8_t
+raid1_channel_preferred(struct raid_bdev_io_channel *raid_ch, struct raid1_info *r1info)
+{
+	struct raid1_io_channel *raid1_ch = spdk_io_channel_get_ctx(raid_ch->module_channel);
+	uint8_t idx = r1info->read_preferred_slot;
+	uint8_t other_idx;
+
+	if (raid_ch->base_channel[idx] == NULL) {
+		return raid1_channel_least_outstanding(raid_ch, UINT8_MAX);
+	}
+
+	if (raid1_ch->members[idx].reads_outstanding >= r1info->read_spillover_qd) {
+		other_idx = raid1_channel_least_outstanding(raid_ch, idx);
+		if (other_idx != UINT8_MAX &&
+		    raid1_ch->members[other_idx].reads_outstanding < r1info->read_spillover_qd) {
+			return other_idx;
+		}
+	}
+
+	return idx;
+}
+
+/* Return the stream the read continues, or the least recently read one to replace */
+static struct raid1_read_stream *
+raid1_channel_find_stream(struct raid1_io_channel *raid1_ch, uint64_t lba, bool *found)
+{
+	struct raid1_read_stream *stream, *lru = &raid1_ch->streams[0];
+
+	for (stream = raid1_ch->streams; stream < raid1_ch->streams + RAID1_READ_STREAMS; stream++) {
+		if (stream->last_read != 0 && stream->end_lba == lba) {
+			*found = true;
+			return stream;
+		}
+		if (stream->last_read < lru->last_read) {
+			lru = stream;
+		}
+	}
+
+	*found = false;
+	return lru;
+}
+
+static uint8_t
+raid1_channel_next_read_base_bdev(struct raid_bdev_io_channel *raid_ch, struct raid1_info *r1info)
+{
+	switch (r1info->read_policy) {
+	case RAID_READ_POLICY_LATENCY:
+		return raid1_channel_lowest_latency(raid_ch);
+	case RAID_READ_POLICY_ROUND_ROBIN:
+		return raid1_channel_round_robin(raid_ch);
+	case RAID_READ_POLICY_PREFERRED:
+		return raid1_channel_preferred(raid_ch, r1info);
+	default:
+		return raid1_channel_least_outstanding(raid_ch, UINT8_MAX);
+	}
+}
+
 static int
 raid1_submit_read_request(struct raid_bdev_io *raid_io)
 {
@@ -117,12 +303,24 @@ raid1_submit_read_request(struct raid_bdev_io *raid_io)
 	struct spdk_io_channel *base_ch;
 	uint64_t pd_lba, pd_blocks;
 	uint8_t idx;
+	struct raid1_info *r1info = raid_bdev->module_private;
+	struct raid1_io_channel *raid1_ch = spdk_io_channel_get_ctx(raid_ch->module_channel);
+	struct raid1_read_stream *stream = NULL;
+	bool stream_found = false;
 	int ret;
 
 	pd_lba = bdev_io->u.bdev.offset_blocks;
 	pd_blocks = bdev_io->u.bdev.num_blocks;
 
-	idx = raid1_channel_next_read_base_bdev(raid_ch);
+	/* Continuations of a stream stay on its mirror, new streams are placed by the policy */
+	if (r1info->read_stream_affinity) {
+		stream = raid1_channel_find_stream(raid1_ch, pd_lba, &stream_found);
+	}
+	if (stream_found && raid_ch->base_channel[stream->idx] != NULL) {
+		idx = stream->idx;
+	} else {
+		idx = raid1_channel_next_read_base_bdev(raid_ch, r1info);
+	}
 	if (spdk_unlikely(idx == UINT8_MAX)) {
 		raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_FAILED);
 		return 0;
@@ -134,6 +332,7 @@ raid1_submit_read_request(struct raid_bdev_io *raid_io)
 	raid_io->base_bdev_io_remaining = 1;
 
 	raid1_init_ext_io_opts(bdev_io, &io_opts);
+	raid_io->base_bdev_io_submit_tsc = spdk_get_ticks();
 	ret = raid_bdev_readv_blocks_ext(base_info, base_ch,
 					 bdev_io->u.bdev.iovs, bdev_io->u.bdev.iovcnt,
 					 pd_lba, pd_blocks, raid1_read_bdev_io_completion,
@@ -142,6 +341,11 @@ raid1_submit_read_request(struct raid_bdev_io *raid_io)
 	if (spdk_likely(ret == 0)) {
 		raid1_channel_inc_read_counters(raid_ch, idx, pd_blocks);
 		raid_io->base_bdev_io_submitted = idx;
+		if (stream != NULL) {
+			stream->end_lba = pd_lba + pd_blocks;
+			stream->idx = idx;
+			stream->last_read = raid1_ch->reads;
+		}
 	} else if (spdk_unlikely(ret == -ENOMEM)) {
 		raid_bdev_queue_io_wait(raid_io, spdk_bdev_desc_get_bdev(base_info->desc),
 					base_ch, _raid1_submit_rw_request);
@@ -270,6 +474,21 @@ raid1_start(struct raid_bdev *raid_bdev)
 	}
 	r1info->raid_bdev = raid_bdev;
 
+	r1info->read_policy = raid_bdev->opts.read_policy;
+	/* The preferred slot is ignored by the other policies */
+	if (r1info->read_policy == RAID_READ_POLICY_PREFERRED &&
+	    raid_bdev->opts.read_preferred_slot >= raid_bdev->num_base_bdevs) {
+		SPDK_ERRLOG("Preferred read slot %u is out of range\n", raid_bdev->opts.read_preferred_slot);
+		free(r1info);
+		return -EINVAL;
+	}
+	r1info->read_preferred_slot = raid_bdev->opts.read_preferred_slot;
+	r1info->read_spillover_qd = raid_bdev->opts.read_spillover_qd;
+	if (r1info->read_spillover_qd == 0) {
+		r1info->read_spillover_qd = RAID1_DEFAULT_READ_SPILLOVER_QD;
+	}
+	r1info->read_stream_affinity = raid_bdev->opts.read_stream_affinity;
+
 	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
 		min_blockcnt = spdk_min(min_blockcnt, base_info->data_size);
 	}
@@ -283,7 +502,8 @@ raid1_start(struct raid_bdev *raid_bdev)
 
 	snprintf(name, sizeof(name), "raid1_%s", raid_bdev->bdev.name);
 	spdk_io_device_register(r1info, raid1_ioch_create, raid1_ioch_destroy,
-				sizeof(struct raid1_io_channel) + raid_bdev->num_base_bdevs * sizeof(uint64_t),
+				sizeof(struct raid1_io_channel) +
+				raid_bdev->num_base_bdevs * sizeof(struct raid1_member_stats),
 				name);
 
 	return 0;
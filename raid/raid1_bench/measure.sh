@@ -0,0 +1,88 @@
+#!/bin/bash
+# Compare sequential reads of raid1 spread over the mirrors by the least-outstanding policy
+# with reads continuing a stream kept on the same mirror (read_stream_affinity). Each fio job
+# reads its own region sequentially. The mirrors are 2 malloc bdevs, or AIO bdevs on the
+# devices given with -d, as readahead and prefetch only exist on real devices. The table is
+# also written to results.txt next to this script, or to the file given with -o, with the
+# machine and devices it ran on.
+
+SPDK_DIR=${SPDK_DIR:-/opt/mellanox/spdk}
+DEVICES=
+RUNTIME=10
+IODEPTH=8
+RESULTS=$(dirname "$0")/results.txt
+
+while getopts "d:r:q:o:" opt; do
+	case $opt in
+		d) DEVICES=$OPTARG ;;
+		r) RUNTIME=$OPTARG ;;
+		q) IODEPTH=$OPTARG ;;
+		o) RESULTS=$OPTARG ;;
+		*) echo "usage: $0 [-d \"dev0 dev1\"] [-r runtime_s] [-q iodepth] [-o results]"; exit 1 ;;
+	esac
+done
+
+if [ ! -e "$SPDK_DIR/build/fio/spdk_bdev" ] || ! command -v fio > /dev/null; then
+	echo "fio or the SPDK fio plugin not found in $SPDK_DIR, set SPDK_DIR to the SPDK build"
+	exit 1
+fi
+
+conf=$(mktemp --suffix=.json)
+trap 'rm -f $conf' EXIT
+
+write_conf() {
+	local affinity=$1
+	local i=0
+	local dev
+
+	{
+		echo '{ "subsystems": [ { "subsystem": "bdev", "config": ['
+		if [ -n "$DEVICES" ]; then
+			for dev in $DEVICES; do
+				echo "{ \"method\": \"bdev_aio_create\", \"params\": { \"name\": \"Base$i\","
+				echo "  \"filename\": \"$dev\" } },"
+				i=$((i + 1))
+			done
+		else
+			for i in 0 1; do
+				echo "{ \"method\": \"bdev_malloc_create\", \"params\": { \"name\": \"Base$i\","
+				echo "  \"block_size\": 512, \"num_blocks\": 1048576 } },"
+			done
+			i=2
+		fi
+		echo '{ "method": "bdev_raid_create", "params": { "name": "Raid1", "strip_size_kb": 0,'
+		echo "  \"raid_level\": \"raid1\", \"read_stream_affinity\": $affinity,"
+		echo -n '  "base_bdevs": ['
+		for ((dev = 0; dev < i; dev++)); do
+			[ $dev -gt 0 ] && echo -n ', '
+			echo -n "\"Base$dev\""
+		done
+		echo '] } }'
+		echo '] } ] }'
+	} > "$conf"
+}
+
+{
+echo "# $(date -u +%F) $(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null)" \
+	"$(grep -m1 'model name' /proc/cpuinfo | cut -d: -f2), mirrors: ${DEVICES:-malloc}," \
+	"qd $IODEPTH, ${RUNTIME}s"
+printf "%-18s %7s %6s %10s %10s\n" "mode" "numjobs" "bs" "IOPS" "MiB/s"
+for affinity in false true; do
+	write_conf $affinity
+	if [ $affinity = true ]; then
+		mode=stream-affinity
+	else
+		mode=least-outstanding
+	fi
+	for numjobs in 1 2 4 8; do
+		for bs in 4k 128k; do
+			out=$(SPDK_DIR=$SPDK_DIR SPDK_JSON_CONF=$conf BS=$bs RUNTIME=$RUNTIME \
+				NUMJOBS=$numjobs SIZE=$((64 / numjobs))m IODEPTH=$IODEPTH \
+				fio --output-format=json "$(dirname "$0")/seqread.fio")
+			iops=$(echo "$out" | jq '.jobs[0].read.iops')
+			bw=$(echo "$out" | jq '.jobs[0].read.bw / 1024')
+			printf "%-18s %7s %6s %10.0f %10.1f\n" $mode $numjobs $bs "$iops" "$bw"
+		done
+	done
+done
+} | tee "$RESULTS"
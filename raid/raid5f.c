@@ -3,7 +3,8 @@
  *   All rights reserved.
  */
 
-#include "bdev_raid.h"
+#include "raid5f.h"
+#include "raid5f_xor.h"
 
 #include "spdk/env.h"
 #include "spdk/thread.h"
@@ -12,15 +13,415 @@
 #include "spdk/likely.h"
 #include "spdk/log.h"
 #include "spdk/accel.h"
+#include "spdk/notify.h"
+#include "spdk/dif.h"
+#include "spdk/crc32.h"
 
-/* Maximum concurrent full stripe writes per io channel */
-#define RAID5F_MAX_STRIPES 32
+/* Default number of stripe requests of each type preallocated per io channel */
+#define RAID5F_DEFAULT_STRIPE_POOL_SIZE 32
 
+/* Default number of stripe requests of each type a pool may grow to under load */
+#define RAID5F_DEFAULT_STRIPE_POOL_MAX 256
 
-struct read_cb_arg {
-  struct raid_bdev_io* raid_io;
-  uint64_t stripe_index;
-  uint64_t stripe_offset;
+/* Period of the poller freeing stripe requests a pool grew by and no longer needs */
+#define RAID5F_STRIPE_POOL_SHRINK_PERIOD_US (1000 * 1000)
+
+/*
+ * Strips up to this size are xor-ed on the submitting core instead of with accel, where
+ * the round trip costs more than the calculation. xor_bench/ measures the crossover.
+ */
+#define RAID5F_XOR_INLINE_MAX_LEN (32 * 1024)
+
+/* Number of buckets of the stripe lock waiters, stripes are mapped to them by their index modulo */
+#define RAID5F_STRIPE_LOCK_BUCKETS 1024
+
+/* Maximum number of whole stripes an unmap or write zeroes locks and zeroes at a time */
+#define RAID5F_ZERO_REQUEST_MAX_STRIPES 128
+
+/* Maximum number of stripe owner threads of the sharded mode */
+#define RAID5F_MAX_STRIPE_OWNERS 256
+
+/*
+ * Consecutive stripes owned by the same thread in the sharded mode, so that an I/O spanning
+ * several stripes is rarely split and keeps the multi-stripe read and write batching paths
+ */
+#define RAID5F_STRIPE_OWNER_RUN 64
+
+/* Default time after which partially written stripes are flushed from the stripe cache */
+#define RAID5F_STRIPE_CACHE_FLUSH_TIMEOUT_MS 100
+
+/* Period of the scrubber poller */
+#define RAID5F_SCRUB_POLL_PERIOD_US 10000
+
+/* Maximum number of stripes verified concurrently by the scrubber */
+#define RAID5F_SCRUB_MAX_STRIPES 4
+
+/* Default number of outstanding foreground I/Os above which the scrubber pauses */
+#define RAID5F_SCRUB_DEFAULT_MAX_FG_QD 16
+
+/* Parity mismatches logged by the scrubber per second, all of them are in the event history */
+#define RAID5F_SCRUB_LOG_PER_SEC 10
+
+/* Period of the rebuild poller */
+#define RAID5F_REBUILD_POLL_PERIOD_US 10000
+
+/* Default number of stripes quiesced and rebuilt at a time */
+#define RAID5F_REBUILD_DEFAULT_WINDOW_STRIPES 256
+
+/* Default number of stripes rebuilt concurrently on each io channel */
+#define RAID5F_REBUILD_DEFAULT_QUEUE_DEPTH 8
+
+/* Default number of outstanding foreground I/Os above which the rebuild pauses */
+#define RAID5F_REBUILD_DEFAULT_MAX_FG_QD 64
+
+/* Mismatch events buffered on each io channel and kept in the history of the raid bdev */
+#define RAID5F_MISMATCH_RING_SIZE 64
+#define RAID5F_MISMATCH_HISTORY_SIZE 1024
+
+/* Period of moving the mismatch events of an io channel to the history */
+#define RAID5F_MISMATCH_DRAIN_PERIOD_US (100 * 1000)
+
+/* Notification sent with the raid bdev name when new mismatch events are available */
+#define RAID5F_MISMATCH_NOTIFY_TYPE "raid5f_mismatch"
+
+/* Member index of events which don't tell the member */
+#define RAID5F_MISMATCH_NO_MEMBER UINT8_MAX
+
+/* Maximum number of repairs in progress per io channel, each one holds a partial write request */
+#define RAID5F_MAX_REPAIRS 2
+
+/* Maximum number of repairs waiting on an io channel, further ones are dropped */
+#define RAID5F_REPAIR_QUEUE_MAX 64
+
+/*
+ * Buffers for reconstruct reads are borrowed from a pool on each io channel. Size classes
+ * are powers of 2 from RAID5F_BUF_POOL_MIN_LEN, so that a read gets a buffer close to its
+ * length instead of a whole strip.
+ */
+#define RAID5F_BUF_POOL_MIN_LEN 4096
+#define RAID5F_BUF_POOL_CLASSES 20
+
+/* Bytes of idle buffers kept in the pool of an io channel, returned ones above that are freed */
+#define RAID5F_BUF_POOL_CACHE_SIZE (8 * 1024 * 1024)
+
+/* Period of the poller starting hedged reads, and the one only updating latency statistics */
+#define RAID5F_READ_HEDGE_POLL_PERIOD_US 50
+#define RAID5F_READ_HEDGE_UPDATE_PERIOD_US (100 * 1000)
+
+/* Reads are never hedged before this time */
+#define RAID5F_READ_HEDGE_MIN_DELAY_US 100
+
+/*
+ * Latency samples of a base bdev needed before its percentile is used as the hedge threshold.
+ * Until then, reads are hedged after RAID5F_READ_HEDGE_EWMA_FACTOR times the average latency.
+ */
+#define RAID5F_READ_HEDGE_MIN_SAMPLES 64
+#define RAID5F_READ_HEDGE_EWMA_FACTOR 4
+
+/* Maximum number of hedge reconstructions in progress per io channel */
+#define RAID5F_READ_HEDGE_MAX_ACTIVE 8
+
+/* Number of log2 buckets of the read latency histograms, in ticks */
+#define RAID5F_LATENCY_HIST_BUCKETS 64
+
+/* Memory per io channel for caching chunks reconstructed by degraded reads */
+#define RAID5F_DEGRADED_CACHE_SIZE (16 * 1024 * 1024)
+
+/* Maximum number of entries of the degraded read cache, it is searched linearly */
+#define RAID5F_DEGRADED_CACHE_MAX_ENTRIES 128
+
+/* Number of stripe write generation counters. Must be a power of 2. */
+#define RAID5F_STRIPE_GEN_BUCKETS 4096
+
+/* Maximum number of stripes read at once by a read of whole stripes */
+#define RAID5F_STRIPES_READ_MAX 16
+
+/* Maximum number of stripes of a write spanning several stripes written at a time */
+#define RAID5F_SPLIT_WRITE_DEPTH 16
+
+/* Maximum number of whole stripes written with a single base bdev write per member */
+#define RAID5F_WRITE_BATCH_MAX 8
+
+/*
+ * Write-intent bitmap, kept in the space reserved before the data of the base bdevs of raid
+ * bdevs with a superblock. It starts at this byte offset and has at most this many regions.
+ */
+#define RAID5F_WIB_OFFSET (64 * 1024)
+#define RAID5F_WIB_MAX_REGIONS (64 * 1024)
+
+/* Minimum amount of data covered by a region of the write-intent bitmap */
+#define RAID5F_WIB_MIN_REGION_SIZE (64 * 1024 * 1024)
+
+#define RAID5F_WIB_MAGIC 0x4249573546444152ULL
+#define RAID5F_WIB_VERSION 1
+
+/* Regions without writes for a whole period are cleared from the write-intent bitmap */
+#define RAID5F_WIB_POLL_PERIOD_US (100 * 1000)
+#define RAID5F_WIB_CLEAR_PERIOD_US (5 * 1000 * 1000)
+
+/* Number of stripes of dirty regions resynced at a time after a restart */
+#define RAID5F_WIB_RESYNC_DEPTH 8
+
+/*
+ * Chunk checksum table, kept at the end of the data area of each base bdev. It is read and
+ * written in pages of this size, rounded up to whole blocks, and cached in this much memory.
+ */
+#define RAID5F_CSUM_PAGE_SIZE 4096
+#define RAID5F_CSUM_CACHE_SIZE (16 * 1024 * 1024)
+
+/* Period of writing back the dirty pages of the chunk checksum table and pages written at a time */
+#define RAID5F_CSUM_POLL_PERIOD_US (1000 * 1000)
+#define RAID5F_CSUM_WRITE_DEPTH 8
+
+struct raid5f_info;
+struct raid5f_range_lock;
+
+typedef void (*raid5f_range_lock_cb)(void *cb_arg);
+
+/*
+ * Requests waiting for the stripes with the same index modulo the number of buckets. The lock
+ * state of each stripe is changed with atomics by the holders while the stripe is not
+ * contended. Once a request has to wait, it is queued in the bucket of the stripe, under the
+ * bucket lock, and the last holder releasing the stripe grants it to the waiters in order with
+ * messages to their threads. The bucket lock is only taken on contention and held for a queue
+ * update, which is cheaper than passing every lock request to an owner thread of the stripe.
+ */
+struct raid5f_stripe_lock_bucket {
+	struct spdk_spinlock lock;
+
+	/* Waiting requests, in the order they found their stripe held */
+	TAILQ_HEAD(, raid5f_range_lock) waiters;
+} __attribute__((aligned(SPDK_CACHE_LINE_SIZE)));
+
+#define RAID5F_STRIPE_LOCK_EXCLUSIVE (1U << 31)
+#define RAID5F_STRIPE_LOCK_WAITERS (1U << 30)
+#define RAID5F_STRIPE_LOCK_SHARED_MASK (RAID5F_STRIPE_LOCK_WAITERS - 1)
+
+/*
+ * Lock of a range of stripes, shared or exclusive. Its stripes are taken in ascending order,
+ * so requests holding several of them can't deadlock.
+ */
+struct raid5f_range_lock {
+	struct raid5f_info *r5f_info;
+	uint64_t first_stripe;
+	uint64_t num_stripes;
+	bool exclusive;
+
+	/* Number of stripes of the range held */
+	uint64_t acquired;
+
+	/* Thread of the request, cb is called there if the range couldn't be taken at once */
+	struct spdk_thread *thread;
+	raid5f_range_lock_cb cb;
+	void *cb_arg;
+
+	TAILQ_ENTRY(raid5f_range_lock) link;
+};
+
+struct raid5f_stripes_read;
+
+/* Context of a read request, which may span several chunks and stripes */
+struct raid5f_read_ctx {
+	struct raid_bdev_io *raid_io;
+
+	/* Blocks of the read completed so far */
+	uint64_t blocks_done;
+
+	/* Stripes of the current part, held shared while it is read and verified */
+	struct raid5f_range_lock lock;
+	bool locked;
+
+	/*
+	 * Blocks of the read up to which whole stripes are read chunk by chunk, set when a read
+	 * of whole stripes found a mismatch so that the chunks are verified and repaired.
+	 */
+	uint64_t verify_chunks_end;
+
+	/* Read of whole stripes currently being processed */
+	struct raid5f_stripes_read *stripes_read;
+
+	/* Part of the read currently being processed, contained in a single chunk */
+	uint64_t stripe_index;
+	uint8_t chunk_idx;
+	uint64_t chunk_offset;
+	uint64_t num_blocks;
+	struct iovec *iovs;
+	int iovcnt;
+	void *md_buf;
+
+	/* Iovecs used when the current part is only a slice of the read */
+	struct iovec *slice_iovs;
+	int slice_iovcnt_max;
+
+	/* Time the read of the current part was submitted to its base bdev */
+	uint64_t submit_tsc;
+
+	/*
+	 * Checksum the chunk of the current part is verified with and, if the part is only a
+	 * slice of the chunk, the bounce buffers the whole chunk is read into
+	 */
+	uint32_t csum;
+	struct iovec csum_iov;
+	void *csum_md_buf;
+
+	/* Set if the protection information or the checksum of the current part didn't match */
+	bool chunk_bad;
+};
+
+/*
+ * Read of a part into a bounce buffer, which is reconstructed from the other base bdevs in
+ * parallel if the base bdev is slow. Whichever finishes first completes the part. If the
+ * reconstruction wins, the read is left to finish on its own and frees this afterwards.
+ */
+struct raid5f_read_hedge {
+	/* The read the part belongs to, NULL once the part is completed */
+	struct raid5f_read_ctx *read_ctx;
+
+	/* NULL if the io channel was destroyed while the base bdev read was outstanding */
+	struct raid5f_io_channel *r5ch;
+
+	uint8_t chunk_idx;
+	uint64_t submit_tsc;
+
+	/* Bounce buffers for the base bdev read, borrowed from the io channel's pool */
+	struct iovec iov;
+	void *md_buf;
+	size_t md_len;
+
+	bool read_pending;
+	bool read_success;
+
+	/* Set once a reconstruction was started, and while it is in progress */
+	bool hedged;
+	bool hedge_pending;
+
+	TAILQ_ENTRY(raid5f_read_hedge) link;
+};
+
+/* Read of a member of a read of whole stripes, spanning its chunks of all the stripes */
+struct raid5f_stripes_read_member {
+	struct raid5f_stripes_read *stripes_read;
+	uint8_t idx;
+	uint64_t submit_tsc;
+	struct iovec *iovs;
+	int iovcnt;
+	int iovcnt_max;
+};
+
+/*
+ * Read of whole stripes with a single base bdev read per member. The data chunks are read
+ * directly into the read's buffers and the parity chunks into bounce buffers, then every
+ * stripe is verified at once by checking that its chunks xor to zero.
+ */
+struct raid5f_stripes_read {
+	struct raid5f_read_ctx *read_ctx;
+	uint64_t stripe_index;
+	uint64_t num_stripes;
+
+	/* Parity chunk of each stripe, borrowed from the io channel's pool */
+	void *parity_bufs[RAID5F_STRIPES_READ_MAX];
+
+	uint8_t submitted;
+	uint8_t remaining;
+	bool failed;
+
+	struct raid5f_stripes_read_member members[];
+};
+
+/* Write of a member of a write batch, spanning its chunks of all the stripes */
+struct raid5f_write_batch_member {
+	struct raid5f_write_batch *batch;
+	uint8_t idx;
+	struct iovec *iovs;
+	int iovcnt;
+	int iovcnt_max;
+};
+
+/*
+ * Write of consecutive whole stripes of a split write. Each stripe has its own write stripe
+ * request, which locks the stripe and calculates its parity, but the chunks of all the
+ * stripes are written with a single base bdev write per member once every parity is ready.
+ */
+struct raid5f_write_batch {
+	struct stripe_request *stripe_reqs[RAID5F_WRITE_BATCH_MAX];
+	uint32_t num_stripes;
+	uint8_t num_members;
+
+	/* Stripes whose parity is not calculated yet */
+	uint32_t xor_remaining;
+	bool xor_failed;
+
+	/* Members whose write was submitted, and references held by pending member writes */
+	uint8_t submitted;
+	uint8_t remaining;
+
+	/* Exclusive lock of the stripes, taken at once so that they are in ascending order */
+	struct raid5f_range_lock lock;
+
+	struct raid5f_write_batch_member members[];
+};
+
+/*
+ * Write spanning several stripes. It is split into a write of each stripe, up to
+ * RAID5F_SPLIT_WRITE_DEPTH of which are in progress at a time.
+ */
+struct raid5f_split_write {
+	struct raid_bdev_io *raid_io;
+
+	/* Blocks of the write submitted so far */
+	uint64_t blocks_submitted;
+
+	uint32_t active;
+	bool submitting;
+	enum spdk_bdev_io_status status;
+
+	/* Stripe writes which couldn't get a resource, they are retried first */
+	TAILQ_HEAD(, raid5f_split_write_stripe) retry_queue;
+};
+
+/* Unmap or write zeroes: whole stripes are zeroed on the base bdevs, the rest through writes */
+struct raid5f_zero_request {
+	struct raid_bdev_io *raid_io;
+
+	/* Whole stripes of the range left to zero and the next base bdev to send them to */
+	uint64_t first_stripe;
+	uint64_t num_stripes;
+	uint8_t next_member;
+
+	/*
+	 * The whole stripes are zeroed up to RAID5F_ZERO_REQUEST_MAX_STRIPES at a time, held
+	 * exclusive until all base bdevs are done with them
+	 */
+	struct raid5f_range_lock lock;
+	bool locked;
+	uint32_t base_active;
+
+	/* Head and tail of the range not covering a whole stripe */
+	struct raid5f_zero_partial {
+		struct raid_bdev_io raid_io;
+		struct raid5f_zero_request *zero_req;
+		struct iovec *iovs;
+		void *md_buf;
+		bool submitted;
+	} partials[2];
+	uint8_t num_partials;
+
+	uint32_t active;
+	bool submitting;
+	enum spdk_bdev_io_status status;
+};
+
+struct raid5f_split_write_stripe {
+	struct raid_bdev_io raid_io;
+	struct raid5f_split_write *split;
+
+	/* Batch the stripe is written with, if any */
+	struct raid5f_write_batch *batch;
+
+	struct iovec *iovs;
+	int iovcnt;
+	int iovcnt_max;
+	TAILQ_ENTRY(raid5f_split_write_stripe) link;
 };
 
 struct chunk {
@@ -39,23 +440,35 @@ struct chunk {
 	/* Pointer to buffer with I/O metadata */
 	void *md_buf;
 
+	/* Range of the chunk accessed by the request, in blocks from the chunk start */
+	uint64_t req_offset;
+	uint64_t req_blocks;
+
+	/* Old and new contents of the chunk, used as parity sources by partial stripe writes */
+	struct iovec old_iovs[3];
+	int old_iovcnt;
+	struct iovec *new_iovs;
+	int new_iovcnt;
+	int new_iovcnt_max;
+
 	/* Shallow copy of IO request parameters */
 	struct spdk_bdev_ext_io_opts ext_opts;
 };
 
 struct stripe_request;
 typedef void (*stripe_req_xor_cb)(struct stripe_request *stripe_req, int status);
+typedef void (*stripe_req_start_fn)(struct stripe_request *stripe_req);
 
 struct stripe_request {
 	enum stripe_request_type {
 		STRIPE_REQ_WRITE,
 		STRIPE_REQ_RECONSTRUCT,
+		STRIPE_REQ_PARTIAL_WRITE,
+		RAID5F_STRIPE_REQ_TYPES,
 	} type;
 
         // shawgerj added fields
         int poisoned;
-	struct iovec *saved_iovs;
-        size_t saved_iovs_num;
 
 
 	struct raid5f_io_channel *r5ch;
@@ -76,21 +489,93 @@ struct stripe_request {
 
 			/* Buffer for stripe io metadata parity */
 			void *parity_md_buf;
+
+			/* Parity chunk is written after the xor, data chunks don't wait for it */
+			bool parity_deferred;
+
+			/* shawgerj data chunk picked to get a flipped bit, NULL if none */
+			struct chunk *poison_chunk;
+
+			/* For retrying the deferred parity chunk write */
+			struct spdk_bdev_io_wait_entry parity_waitq;
 		} write;
 
 		struct {
-			/* Array of buffers for reading chunk data */
+			/*
+			 * Arrays of buffers for reading chunk data and metadata, borrowed from
+			 * the buffer pool of the io channel while the request is in use
+			 */
 			void **chunk_buffers;
-
-			/* Array of buffers for reading chunk metadata */
 			void **chunk_md_buffers;
 
+			/* Length of the borrowed data and metadata buffers */
+			size_t buf_len;
+			size_t md_buf_len;
+
 			/* Chunk to reconstruct from parity */
 			struct chunk *chunk;
 
 			/* Offset from chunk start */
 			uint64_t chunk_offset;
+
+			/* Number of blocks to reconstruct */
+			uint64_t num_blocks;
+
+			/* The read this reconstruction is part of */
+			struct raid5f_read_ctx *read_ctx;
+
+			/*
+			 * The chunk was read and is reconstructed only to verify it. The
+			 * reconstructed data goes to the verify buffers and is compared.
+			 */
+			bool verify;
+			void *verify_buf;
+			void *verify_md_buf;
+
+			/* Degraded read cache entry the whole chunk is reconstructed into */
+			struct raid5f_degraded_cache_entry *cache_entry;
+
+			/* Hedged read racing this reconstruction into the verify buffers */
+			struct raid5f_read_hedge *hedge;
 		} reconstruct;
+
+		struct {
+			/* Buffer for stripe parity */
+			void *parity_buf;
+
+			/* Buffer for stripe io metadata parity */
+			void *parity_md_buf;
+
+			/* Array of buffers for reading old chunk data, indexed by base bdev */
+			void **chunk_buffers;
+
+			/* Array of buffers for reading old chunk metadata, indexed by base bdev */
+			void **chunk_md_buffers;
+
+			/* Array of buffers for assembling new chunk metadata, indexed by base bdev */
+			void **chunk_new_md_buffers;
+
+			/* Rows of the stripe touched by the write, in blocks from the chunk start */
+			uint64_t row_offset;
+			uint64_t row_blocks;
+
+			/* How the new parity is calculated */
+			enum partial_write_mode {
+				/* Read old data of written chunks and old parity */
+				PARTIAL_WRITE_RMW,
+				/* Read the rest of the data chunks and calculate parity from scratch */
+				PARTIAL_WRITE_RCW,
+			} mode;
+
+			/* Parity base bdev is missing, only data is written */
+			bool skip_parity;
+
+			/* Missing written chunk whose old data must be reconstructed first */
+			struct chunk *reconstruct_chunk;
+
+			/* Set once pre-reads are done and writes are being submitted */
+			bool writing;
+		} partial;
 	};
 
 	/* Array of iovec iterators for each chunk */
@@ -106,17 +591,72 @@ struct stripe_request {
 		size_t len;
 		size_t remaining;
 		size_t remaining_md;
+		uint32_t n_src;
+		void *dest_md_buf;
 		int status;
 		stripe_req_xor_cb cb;
 	} xor;
 
 	TAILQ_ENTRY(stripe_request) link;
 
+	/* Exclusive lock of the stripe, held from when the request starts until it is released */
+	struct raid5f_range_lock lock;
+	bool locked;
+
+	/* Function to start the request once the stripe is acquired */
+	stripe_req_start_fn lock_start_fn;
+
 	/* Array of chunks corresponding to base_bdevs */
         // shawgerj don't put anything after this or chunks will break
 	struct chunk chunks[0];
 };
 
+/* What found a mismatch, or completed the action taken for it */
+enum raid5f_mismatch_source {
+	RAID5F_MISMATCH_SRC_READ,
+	RAID5F_MISMATCH_SRC_SCRUB,
+	RAID5F_MISMATCH_SRC_RESYNC,
+	RAID5F_MISMATCH_SRC_REPAIR,
+};
+
+enum raid5f_mismatch_action {
+	/* Reported only */
+	RAID5F_MISMATCH_LOGGED,
+	RAID5F_MISMATCH_REPAIR_QUEUED,
+	/* Not repaired because the repair queue was full */
+	RAID5F_MISMATCH_REPAIR_DROPPED,
+	RAID5F_MISMATCH_REPAIRED,
+	/* The stripe was consistent when read again for the repair */
+	RAID5F_MISMATCH_TRANSIENT,
+	RAID5F_MISMATCH_REPAIR_FAILED,
+	/* Parity recomputed from the data */
+	RAID5F_MISMATCH_PARITY_REWRITTEN,
+};
+
+struct raid5f_mismatch_event {
+	/* Position in the history of the raid bdev, assigned when the event is moved there */
+	uint64_t seq;
+
+	uint64_t stripe_index;
+
+	/* Time in ticks while on the io channel, then microseconds since the epoch */
+	uint64_t time;
+
+	uint8_t member;
+	uint8_t source;
+	uint8_t action;
+};
+
+/* Thread owning a share of the stripes, runs of RAID5F_STRIPE_OWNER_RUN stripes round robin */
+struct raid5f_owner {
+	struct spdk_thread *thread;
+
+	/* raid bdev io channel of the thread, taken by the first I/O forwarded to it */
+	struct spdk_io_channel *ch;
+
+	struct raid5f_info *r5f_info;
+};
+
 struct raid5f_info {
 	/* The parent raid bdev */
 	struct raid_bdev *raid_bdev;
@@ -129,1058 +669,11203 @@ struct raid5f_info {
 
 	/* Alignment for buffer allocation */
 	size_t buf_alignment;
-};
 
-struct raid5f_io_channel {
-	/* All available stripe requests on this channel */
-	struct {
-		TAILQ_HEAD(, stripe_request) write;
-		TAILQ_HEAD(, stripe_request) reconstruct;
-	} free_stripe_requests;
+	/* Zero-filled buffer of a strip size, used to pad parity sources of partial writes */
+	void *zero_buf;
 
-	/* accel_fw channel */
-	struct spdk_io_channel *accel_ch;
+	/*
+	 * Bitmap of the stripes zeroed as a whole and not written since. They are read as
+	 * zeroes without reading the base bdevs. Not persistent.
+	 */
+	uint64_t *zero_stripes;
 
-	/* For retrying xor if accel_ch runs out of resources */
-	TAILQ_HEAD(, stripe_request) xor_retry_queue;
+	/* Write-back stripe cache, NULL if disabled */
+	struct raid5f_cache *cache;
 
-	/* For iterating over chunk iovecs during xor calculation */
-	void **chunk_xor_buffers;
-	struct iovec **chunk_xor_iovs;
-	size_t *chunk_xor_iovcnt;
-};
+	/* Background scrubber, NULL if not running. Accessed on the app thread. */
+	struct raid5f_scrub *scrub;
 
-#define __CHUNK_IN_RANGE(req, c) \
-	c < req->chunks + raid5f_ch_to_r5f_info(req->r5ch)->raid_bdev->num_base_bdevs
+	/* Set while the scrubber runs, foreground I/Os are only counted then */
+	bool scrub_active;
 
-#define FOR_EACH_CHUNK_FROM(req, c, from) \
-	for (c = from; __CHUNK_IN_RANGE(req, c); c++)
+	/* Rebuild onto a replacement base bdev, NULL if not running. Accessed on the app thread. */
+	struct raid5f_rebuild *rebuild;
 
-#define FOR_EACH_CHUNK(req, c) \
-	FOR_EACH_CHUNK_FROM(req, c, req->chunks)
+	/* Set while the rebuild runs, foreground I/Os are counted then too */
+	bool rebuild_active;
 
-#define __NEXT_DATA_CHUNK(req, c) \
-	c == req->parity_chunk ? c+1 : c
+	/*
+	 * Slot of the base bdev being rebuilt, UINT8_MAX if none, and the stripe up to which
+	 * it is rebuilt. The base bdev is treated as missing from the checkpoint on.
+	 */
+	uint8_t rebuild_slot;
+	uint64_t rebuild_checkpoint;
 
-#define FOR_EACH_DATA_CHUNK(req, c) \
-	for (c = __NEXT_DATA_CHUNK(req, req->chunks); __CHUNK_IN_RANGE(req, c); \
-	     c = __NEXT_DATA_CHUNK(req, c+1))
+	/* End of the stripes quiesced for the rebuild, from rebuild_checkpoint */
+	uint64_t rebuild_window_end;
 
-static inline struct raid5f_info *
-raid5f_ch_to_r5f_info(struct raid5f_io_channel *r5ch)
-{
-	return spdk_io_channel_get_io_device(spdk_io_channel_from_ctx(r5ch));
-}
+	/* Parameters of the last rebuild, for saving the config of an unfinished one */
+	struct raid5f_rebuild_opts rebuild_opts;
 
-static inline struct stripe_request *
-raid5f_chunk_stripe_req(struct chunk *chunk)
-{
-	return SPDK_CONTAINEROF((chunk - chunk->index), struct stripe_request, chunks);
-}
+	/* Write-intent bitmap, NULL if the base bdevs have no space reserved for it */
+	struct raid5f_wib *wib;
 
-static inline uint8_t
-raid5f_stripe_data_chunks_num(const struct raid_bdev *raid_bdev)
-{
-	return raid_bdev->min_base_bdevs_operational;
-}
+	/* Chunk checksum table, NULL if disabled */
+	struct raid5f_csum *csum;
 
-static inline uint8_t
-raid5f_stripe_parity_chunk_index(const struct raid_bdev *raid_bdev, uint64_t stripe_index)
-{
-	return raid5f_stripe_data_chunks_num(raid_bdev) - stripe_index % raid_bdev->num_base_bdevs;
-}
+	/* Stripe cache flushes submitted to the array and not yet completed */
+	uint64_t cache_flushes_active;
 
-static inline void
-raid5f_stripe_request_release(struct stripe_request *stripe_req)
-{
-	if (spdk_likely(stripe_req->type == STRIPE_REQ_WRITE)) {
-		TAILQ_INSERT_HEAD(&stripe_req->r5ch->free_stripe_requests.write, stripe_req, link);
-	} else if (stripe_req->type == STRIPE_REQ_RECONSTRUCT) {
-		TAILQ_INSERT_HEAD(&stripe_req->r5ch->free_stripe_requests.reconstruct, stripe_req, link);
-	} else {
-		assert(false);
-	}
-}
+	/* Foreground I/Os submitted to the array and not yet completed */
+	uint64_t fg_outstanding;
 
-static void raid5f_xor_stripe_retry(struct stripe_request *stripe_req);
+	/* Stripe where the last stopped scrub would continue */
+	uint64_t scrub_checkpoint;
 
-static void
-raid5f_xor_stripe_done(struct stripe_request *stripe_req)
-{
-	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
+	/* Parity mismatches found by the scrubber, recorded in the mismatch history */
+	uint64_t num_mismatches;
 
-	if (stripe_req->xor.status != 0) {
-		SPDK_ERRLOG("stripe xor failed: %s\n", spdk_strerror(-stripe_req->xor.status));
-	}
-	// shawgerj compared xor-ed chunk to the one we saved
-	
-	/* if (stripe_req->type == STRIPE_REQ_RECONSTRUCT) { */
-	/*   //	  SPDK_ERRLOG("read op in xor_stripe_done.\n"); */
-	/*   for (int i = 0; i < stripe_req->reconstruct.chunk->iovcnt; i++) { */
-	/*     if (memcmp(stripe_req->saved_iovs[i].iov_base, stripe_req->reconstruct.chunk->iovs[i].iov_base, */
-	/* 	       stripe_req->saved_iovs[i].iov_len)) { */
-	/*       stripe_req->xor.cb(stripe_req, stripe_req->xor.status); */
-	/*     } */
-	/*   } */
-	/* } */
-	
-	stripe_req->xor.cb(stripe_req, stripe_req->xor.status);
+	/* Mismatch events of all sources, the newest RAID5F_MISMATCH_HISTORY_SIZE are kept */
+	struct {
+		struct spdk_spinlock lock;
+		struct raid5f_mismatch_event events[RAID5F_MISMATCH_HISTORY_SIZE];
+		/* Sequence number of the next event */
+		uint64_t next_seq;
+		/* Events lost because an io channel's ring was full */
+		uint64_t dropped;
+	} mismatch_history;
+
+	/* Repair statistics, updated from all io channels */
+	struct {
+		/* Reads whose data didn't match the reconstruction from the other chunks */
+		uint64_t read_mismatches;
+		/* Chunks rewritten */
+		uint64_t repaired;
+		/* Stripes found consistent when re-read for the repair */
+		uint64_t consistent;
+		uint64_t failed;
+		/* Repairs not queued because the queue was full */
+		uint64_t dropped;
+		/* Reads whose protection information didn't match the data */
+		uint64_t pi_errors;
+	} repair_stats;
+
+	/* Number of stripe requests of each type preallocated and allowed per io channel */
+	uint32_t stripe_pool_size;
+	uint32_t stripe_pool_max;
+
+	/* Latency percentile in per mille after which reads are hedged, 0 if disabled */
+	uint32_t read_hedge_permille;
+
+	/*
+	 * Set if reads check the protection information of the data and if they compare it
+	 * with the reconstruction from the other chunks
+	 */
+	bool pi_verify;
+	bool parity_verify;
+
+	/* Read latency of each base bdev, published periodically by the io channels */
+	struct raid5f_member_stats {
+		/* Average latency and hedge threshold of the last io channel to publish */
+		uint64_t ewma_ticks;
+		uint64_t threshold_ticks;
+		/* Reads outstanding on all io channels */
+		int64_t outstanding;
+	} *member_stats;
+
+	/* Hedged read statistics, updated from all io channels */
+	struct {
+		/* Reads a reconstruction was started for */
+		uint64_t hedged;
+		/* Reads completed by the reconstruction before the base bdev */
+		uint64_t wins;
+	} hedge_stats;
 
-	if (!TAILQ_EMPTY(&r5ch->xor_retry_queue)) {
-		stripe_req = TAILQ_FIRST(&r5ch->xor_retry_queue);
-		TAILQ_REMOVE(&r5ch->xor_retry_queue, stripe_req, link);
-		raid5f_xor_stripe_retry(stripe_req);
-	}
-}
+	/* Stripe request pool statistics, updated from all io channels */
+	struct {
+		/* Stripe requests currently allocated on all io channels */
+		uint64_t allocated;
+		/* Stripe requests allocated above the preallocated ones and freed by the shrinker */
+		uint64_t grown;
+		uint64_t shrunk;
+		/* Requests which found their pool at its maximum size */
+		uint64_t exhausted;
+		/* I/Os completed with NOMEM status for the bdev layer to retry */
+		uint64_t nomem;
+		/* Base bdev I/Os queued to be retried when the base bdev had no spdk_bdev_io */
+		uint64_t base_io_retries;
+	} pool_stats;
+
+	/*
+	 * Counters bumped when a write to a stripe starts and when it completes, hashed
+	 * by stripe index. Cached reconstructions are valid while the counter is unchanged.
+	 */
+	uint32_t stripe_gen[RAID5F_STRIPE_GEN_BUCKETS];
+
+	/* Lock state of each stripe of the array and the waiters for them */
+	uint32_t *stripe_locks;
+	struct raid5f_stripe_lock_bucket *stripe_lock_buckets;
+
+	/* Threads owning the stripes in the sharded mode, NULL if I/Os aren't forwarded */
+	struct raid5f_owner *owners;
+	uint32_t num_owners;
+	uint32_t owners_active;
+};
 
-static void raid5f_xor_stripe_continue(struct stripe_request *stripe_req);
+/* Flush of all dirty stripes of the cache when the raid bdev is stopped */
+struct raid5f_cache_stop {
+	struct raid_bdev *raid_bdev;
+	raid_bdev_stop_background_cb cb_fn;
+	void *cb_ctx;
 
-static void
-_raid5f_xor_stripe_cb(struct stripe_request *stripe_req, int status)
-{
-	if (status != 0) {
-		stripe_req->xor.status = status;
-	}
+	/* Stripes being flushed */
+	uint32_t remaining;
 
-	if (stripe_req->xor.remaining + stripe_req->xor.remaining_md == 0) {
-		raid5f_xor_stripe_done(stripe_req);
-	}
-}
+	/* Set if the flush of a stripe failed */
+	bool failed;
+};
 
-static void
-raid5f_xor_stripe_cb(void *_stripe_req, int status)
+/* Request waiting for a cached stripe to be flushed */
+struct raid5f_cache_waiter {
+	struct raid_bdev_io *raid_io;
+
+	/* Set instead of raid_io if the stop of the cache waits for the flush */
+	struct raid5f_cache_stop *stop;
+
+	/* Thread the request is resumed on */
+	struct spdk_thread *thread;
+
+	/* Set if the flush failed */
+	bool failed;
+
+	TAILQ_ENTRY(raid5f_cache_waiter) link;
+};
+
+struct raid5f_cache_entry {
+	/* Index of the cached stripe */
+	uint64_t stripe_index;
+
+	enum raid5f_cache_entry_state {
+		RAID5F_CACHE_ENTRY_FREE,
+		RAID5F_CACHE_ENTRY_DIRTY,
+		RAID5F_CACHE_ENTRY_FLUSHING,
+	} state;
+
+	/* Stripe data and metadata buffers */
+	void *buf;
+	void *md_buf;
+
+	/* Bitmap of the blocks of the stripe written to the cache */
+	uint64_t *dirty;
+	uint64_t dirty_blocks;
+
+	/* Time when the entry became dirty, in ticks */
+	uint64_t dirty_tsc;
+
+	/* Requests waiting for the flush of the entry to complete */
+	TAILQ_HEAD(, raid5f_cache_waiter) waiters;
+
+	/* Link in the free, dirty or flushing list */
+	TAILQ_ENTRY(raid5f_cache_entry) link;
+
+	/* Link in the hash bucket of the stripe */
+	TAILQ_ENTRY(raid5f_cache_entry) hash_link;
+};
+
+TAILQ_HEAD(raid5f_cache_bucket, raid5f_cache_entry);
+
+/*
+ * Write-back cache of partially written stripes, shared by all io channels of
+ * the array. Writes smaller than a stripe are copied to the cache and completed.
+ * A stripe is written to the array when it has been fully written, when it has
+ * been dirty longer than the flush timeout or on a flush request.
+ */
+struct raid5f_cache {
+	struct spdk_spinlock lock;
+
+	struct raid5f_cache_entry *entries;
+	uint32_t num_entries;
+
+	TAILQ_HEAD(, raid5f_cache_entry) free_entries;
+
+	/* Dirty entries, ordered by the time they became dirty */
+	TAILQ_HEAD(, raid5f_cache_entry) dirty_entries;
+
+	TAILQ_HEAD(, raid5f_cache_entry) flushing_entries;
+
+	/* Hash of dirty and flushing entries by stripe index */
+	struct raid5f_cache_bucket *buckets;
+	uint32_t buckets_mask;
+
+	uint64_t flush_timeout_ticks;
+
+	/* Set while the raid bdev is stopped, writes aren't cached anymore */
+	bool stopping;
+};
+
+/* Internal write of the dirty blocks of a cached stripe to the array */
+struct raid5f_cache_flush {
+	struct raid_bdev_io raid_io;
+
+	struct raid5f_cache_entry *entry;
+
+	/* Reference to the raid bdev io channel the flush is submitted on */
+	struct spdk_io_channel *ch;
+
+	struct iovec iov;
+
+	/* Next block of the stripe to check for dirty data */
+	uint64_t offset;
+
+	TAILQ_ENTRY(raid5f_cache_flush) link;
+};
+
+/* Idle buffer of the reconstruct buffer pool, the link is kept in the buffer itself */
+struct raid5f_buf {
+	SLIST_ENTRY(raid5f_buf) link;
+};
+
+struct raid5f_io_channel {
+	/* Stripe requests on this channel, one pool per stripe request type */
+	struct raid5f_stripe_pool {
+		/* Available stripe requests, most recently used first */
+		TAILQ_HEAD(raid5f_stripe_request_head, stripe_request) free;
+		uint32_t num_allocated;
+		uint32_t num_free;
+		/* Most stripe requests in use at once since the last shrink */
+		uint32_t peak_in_use;
+	} stripe_pools[RAID5F_STRIPE_REQ_TYPES];
+
+	/* Poller freeing stripe requests the pools grew by, NULL if the pools can't grow */
+	struct spdk_poller *stripe_pool_poller;
+
+	/* Idle reconstruct buffers by size class and their total length */
+	SLIST_HEAD(, raid5f_buf) buf_pool[RAID5F_BUF_POOL_CLASSES];
+	size_t buf_pool_cached;
+
+	/* Read latency of each base bdev on this channel, indexed by slot */
+	struct raid5f_member_latency {
+		uint64_t ewma_ticks;
+		uint32_t outstanding;
+		/* Outstanding count last added to the array-wide statistics */
+		uint32_t published_outstanding;
+		/* Reads outstanding longer than this are hedged */
+		uint64_t threshold_ticks;
+		/* Latency histogram, halved on each threshold update */
+		uint32_t hist[RAID5F_LATENCY_HIST_BUCKETS];
+	} *member_lat;
+
+	/* Reads which may be hedged, oldest first, and the reconstructions in progress */
+	TAILQ_HEAD(, raid5f_read_hedge) hedge_reads;
+	uint32_t hedges_active;
+
+	/* Poller starting hedged reads and updating the thresholds */
+	struct spdk_poller *hedge_poller;
+	uint64_t hedge_update_tsc;
+
+	/* accel_fw channel */
+	struct spdk_io_channel *accel_ch;
+
+	/* For iterating over chunk iovecs during xor calculation */
+	void **chunk_xor_buffers;
+	struct iovec **chunk_xor_iovs;
+	size_t *chunk_xor_iovcnt;
+
+	/* Stripe cache flushes waiting for a free stripe request */
+	TAILQ_HEAD(, raid5f_cache_flush) cache_flush_retry_queue;
+
+	/* Poller flushing expired stripes from the stripe cache */
+	struct spdk_poller *cache_poller;
+
+	/* Repairs waiting for a partial write request and the number in progress */
+	TAILQ_HEAD(, raid5f_repair) repair_queue;
+	uint32_t repairs_queued;
+	uint32_t repairs_active;
+
+	/* Idle contexts of writes gated by the write-intent bitmap */
+	TAILQ_HEAD(, raid5f_wib_write) wib_writes;
+
+	/* Mismatch events not yet moved to the history, from mismatch_tail to mismatch_head */
+	struct raid5f_mismatch_event mismatch_ring[RAID5F_MISMATCH_RING_SIZE];
+	uint32_t mismatch_head;
+	uint32_t mismatch_tail;
+	uint32_t mismatch_dropped;
+
+	/* Poller moving the mismatch events to the history */
+	struct spdk_poller *mismatch_poller;
+
+	/* Chunks of the missing base bdev reconstructed by reads, most recently used first */
+	TAILQ_HEAD(raid5f_degraded_cache_head, raid5f_degraded_cache_entry) degraded_cache;
+	uint32_t degraded_cache_entries;
+	uint32_t degraded_cache_max_entries;
+};
+
+struct raid5f_degraded_cache_entry {
+	/* Stripe and index of the reconstructed chunk, stripe_index is UINT64_MAX if unused */
+	uint64_t stripe_index;
+	uint8_t chunk_idx;
+
+	/* Stripe write generation when the reconstruction started */
+	uint32_t gen;
+
+	/* Set while the reconstruction is in progress */
+	bool filling;
+
+	/* Set if md_buf holds the reconstructed metadata */
+	bool md_valid;
+
+	void *buf;
+	void *md_buf;
+
+	TAILQ_ENTRY(raid5f_degraded_cache_entry) link;
+};
+
+/* Rewrite of a range of a chunk which doesn't match the rest of the stripe */
+struct raid5f_repair {
+	/* Internal request the stripe request is attached to */
+	struct raid_bdev_io raid_io;
+
+	/* Reference to the raid bdev io channel the repair runs on */
+	struct spdk_io_channel *ch;
+
+	uint64_t stripe_index;
+
+	/* Index of the chunk to rewrite, a data chunk identified as bad or the parity chunk */
+	uint8_t chunk_idx;
+
+	/* Range to repair, in blocks from the chunk start */
+	uint64_t offset;
+	uint64_t num_blocks;
+
+	struct stripe_request *stripe_req;
+
+	/* Index of the next chunk to read and number of chunk I/Os in progress */
+	uint8_t next_read;
+	uint8_t remaining;
+	bool failed;
+
+	TAILQ_ENTRY(raid5f_repair) link;
+};
+
+#define __CHUNK_IN_RANGE(req, c) \
+	c < req->chunks + raid5f_ch_to_r5f_info(req->r5ch)->raid_bdev->num_base_bdevs
+
+#define FOR_EACH_CHUNK_FROM(req, c, from) \
+	for (c = from; __CHUNK_IN_RANGE(req, c); c++)
+
+#define FOR_EACH_CHUNK(req, c) \
+	FOR_EACH_CHUNK_FROM(req, c, req->chunks)
+
+/* Data chunks are visited in the order of their data in the stripe, set by the layout */
+#define FOR_EACH_DATA_CHUNK(req, c) \
+	for (c = raid5f_data_chunk_at(req, 0); __CHUNK_IN_RANGE(req, c); \
+	     c = raid5f_data_chunk_at(req, raid5f_chunk_data_index(req, c) + 1))
+
+static inline struct raid5f_info *
+raid5f_ch_to_r5f_info(struct raid5f_io_channel *r5ch)
+{
+	return spdk_io_channel_get_io_device(spdk_io_channel_from_ctx(r5ch));
+}
+
+/*
+ * Record a mismatch event on the io channel. Only the channel's thread touches the ring,
+ * so this is a single store of the event. The poller moves the events to the history
+ * of the raid bdev, where they get their sequence number and wall clock time.
+ */
+static void
+raid5f_mismatch_record(struct raid5f_io_channel *r5ch, uint64_t stripe_index, uint8_t member,
+		       enum raid5f_mismatch_source source, enum raid5f_mismatch_action action)
+{
+	struct raid5f_mismatch_event *event;
+
+	if (spdk_unlikely(r5ch->mismatch_head - r5ch->mismatch_tail == RAID5F_MISMATCH_RING_SIZE)) {
+		r5ch->mismatch_dropped++;
+		return;
+	}
+
+	event = &r5ch->mismatch_ring[r5ch->mismatch_head % RAID5F_MISMATCH_RING_SIZE];
+	event->stripe_index = stripe_index;
+	event->time = spdk_get_ticks();
+	event->member = member;
+	event->source = source;
+	event->action = action;
+	r5ch->mismatch_head++;
+}
+
+static inline struct raid5f_io_channel *
+raid5f_raid_ch_to_r5ch(struct raid_bdev_io_channel *raid_ch)
+{
+	return spdk_io_channel_get_ctx(raid_ch->module_channel);
+}
+
+/* Move the mismatch events of the io channel to the history, returns the number moved */
+static uint32_t
+raid5f_mismatch_drain(struct raid5f_io_channel *r5ch)
+{
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(r5ch);
+	struct raid5f_mismatch_event *event;
+	uint64_t now_tsc, now_us, ticks_hz = spdk_get_ticks_hz();
+	uint32_t count = 0;
+	struct timespec ts;
+
+	if (r5ch->mismatch_head == r5ch->mismatch_tail && r5ch->mismatch_dropped == 0) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now_us = ts.tv_sec * SPDK_SEC_TO_USEC + ts.tv_nsec / 1000;
+	now_tsc = spdk_get_ticks();
+
+	spdk_spin_lock(&r5f_info->mismatch_history.lock);
+	while (r5ch->mismatch_tail != r5ch->mismatch_head) {
+		event = &r5f_info->mismatch_history.events[r5f_info->mismatch_history.next_seq %
+				RAID5F_MISMATCH_HISTORY_SIZE];
+		*event = r5ch->mismatch_ring[r5ch->mismatch_tail % RAID5F_MISMATCH_RING_SIZE];
+		event->seq = r5f_info->mismatch_history.next_seq++;
+		event->time = now_us - (now_tsc - event->time) * SPDK_SEC_TO_USEC / ticks_hz;
+		r5ch->mismatch_tail++;
+		count++;
+	}
+	r5f_info->mismatch_history.dropped += r5ch->mismatch_dropped;
+	spdk_spin_unlock(&r5f_info->mismatch_history.lock);
+	r5ch->mismatch_dropped = 0;
+
+	if (count > 0) {
+		spdk_notify_send(RAID5F_MISMATCH_NOTIFY_TYPE, r5f_info->raid_bdev->bdev.name);
+	}
+
+	return count;
+}
+
+static int
+raid5f_mismatch_poll(void *ctx)
+{
+	return raid5f_mismatch_drain(ctx) > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+static inline struct stripe_request *
+raid5f_chunk_stripe_req(struct chunk *chunk)
+{
+	return SPDK_CONTAINEROF((chunk - chunk->index), struct stripe_request, chunks);
+}
+
+static inline uint8_t
+raid5f_stripe_data_chunks_num(const struct raid_bdev *raid_bdev)
+{
+	return raid_bdev->min_base_bdevs_operational;
+}
+
+static inline bool
+raid5f_layout_symmetric(const struct raid_bdev *raid_bdev)
+{
+	return raid_bdev->opts.parity_layout == RAID_PARITY_LAYOUT_LEFT_SYMMETRIC ||
+	       raid_bdev->opts.parity_layout == RAID_PARITY_LAYOUT_RIGHT_SYMMETRIC;
+}
+
+static inline uint8_t
+raid5f_stripe_parity_chunk_index(const struct raid_bdev *raid_bdev, uint64_t stripe_index)
+{
+	uint8_t rotation = stripe_index % raid_bdev->num_base_bdevs;
+
+	switch (raid_bdev->opts.parity_layout) {
+	case RAID_PARITY_LAYOUT_RIGHT_ASYMMETRIC:
+	case RAID_PARITY_LAYOUT_RIGHT_SYMMETRIC:
+		return rotation;
+	default:
+		return raid5f_stripe_data_chunks_num(raid_bdev) - rotation;
+	}
+}
+
+/* Get the member holding the data_idx-th data chunk of the stripe */
+static inline uint8_t
+raid5f_stripe_data_chunk_index(const struct raid_bdev *raid_bdev, uint64_t stripe_index,
+			       uint8_t data_idx)
+{
+	uint8_t p_idx = raid5f_stripe_parity_chunk_index(raid_bdev, stripe_index);
+
+	if (raid5f_layout_symmetric(raid_bdev)) {
+		return (p_idx + 1 + data_idx) % raid_bdev->num_base_bdevs;
+	}
+
+	return data_idx < p_idx ? data_idx : data_idx + 1;
+}
+
+/* Get the position of the data of a member in the stripe, the inverse of the above */
+static inline uint8_t
+raid5f_stripe_chunk_data_index(const struct raid_bdev *raid_bdev, uint64_t stripe_index,
+			       uint8_t chunk_idx)
+{
+	uint8_t p_idx = raid5f_stripe_parity_chunk_index(raid_bdev, stripe_index);
+
+	assert(chunk_idx != p_idx);
+
+	if (raid5f_layout_symmetric(raid_bdev)) {
+		return (chunk_idx + raid_bdev->num_base_bdevs - p_idx - 1) % raid_bdev->num_base_bdevs;
+	}
+
+	return chunk_idx < p_idx ? chunk_idx : chunk_idx - 1;
+}
+
+/* Get the data_idx-th data chunk of the request, or the end of its chunks past the last one */
+static inline struct chunk *
+raid5f_data_chunk_at(struct stripe_request *req, uint8_t data_idx)
+{
+	const struct raid_bdev *raid_bdev = raid5f_ch_to_r5f_info(req->r5ch)->raid_bdev;
+
+	if (data_idx >= raid5f_stripe_data_chunks_num(raid_bdev)) {
+		return req->chunks + raid_bdev->num_base_bdevs;
+	}
+
+	return &req->chunks[raid5f_stripe_data_chunk_index(raid_bdev, req->stripe_index, data_idx)];
+}
+
+static inline uint8_t
+raid5f_chunk_data_index(struct stripe_request *req, struct chunk *chunk)
+{
+	return raid5f_stripe_chunk_data_index(raid5f_ch_to_r5f_info(req->r5ch)->raid_bdev,
+					      req->stripe_index, chunk->index);
+}
+
+/* Maximum number of xor sources and destination: old parity plus old and new data chunks */
+static inline uint32_t
+raid5f_xor_buffers_max(const struct raid_bdev *raid_bdev)
+{
+	return 2 * raid_bdev->num_base_bdevs;
+}
+
+static inline uint32_t
+raid5f_stripe_gen(struct raid5f_info *r5f_info, uint64_t stripe_index)
+{
+	return __atomic_load_n(&r5f_info->stripe_gen[stripe_index & (RAID5F_STRIPE_GEN_BUCKETS - 1)],
+			       __ATOMIC_ACQUIRE);
+}
+
+static inline void
+raid5f_stripe_gen_bump(struct raid5f_info *r5f_info, uint64_t stripe_index)
+{
+	__atomic_fetch_add(&r5f_info->stripe_gen[stripe_index & (RAID5F_STRIPE_GEN_BUCKETS - 1)], 1,
+			   __ATOMIC_RELEASE);
+}
+
+static inline bool
+raid5f_stripe_zero(struct raid5f_info *r5f_info, uint64_t stripe_index)
+{
+	return __atomic_load_n(&r5f_info->zero_stripes[stripe_index / 64], __ATOMIC_ACQUIRE) &
+	       (1ULL << (stripe_index % 64));
+}
+
+static inline void
+raid5f_stripe_clear_zero(struct raid5f_info *r5f_info, uint64_t stripe_index)
+{
+	uint64_t bit = 1ULL << (stripe_index % 64);
+
+	if (raid5f_stripe_zero(r5f_info, stripe_index)) {
+		__atomic_fetch_and(&r5f_info->zero_stripes[stripe_index / 64], ~bit, __ATOMIC_RELEASE);
+	}
+}
+
+static void
+raid5f_stripes_set_zero(struct raid5f_info *r5f_info, uint64_t stripe_index, uint64_t num_stripes)
+{
+	uint64_t i;
+
+	for (i = stripe_index; i < stripe_index + num_stripes; i++) {
+		__atomic_fetch_or(&r5f_info->zero_stripes[i / 64], 1ULL << (i % 64), __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Get the channel of a base bdev for I/O to a stripe. A base bdev being rebuilt is
+ * treated as missing in the stripes which are not rebuilt yet.
+ */
+static inline struct spdk_io_channel *
+raid5f_base_channel(struct raid_bdev_io *raid_io, uint8_t idx, uint64_t stripe_index)
+{
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+	struct spdk_io_channel *base_ch = raid_io->raid_ch->base_channel[idx];
+
+	if (spdk_unlikely(idx == r5f_info->rebuild_slot) && base_ch != NULL &&
+	    stripe_index >= __atomic_load_n(&r5f_info->rebuild_checkpoint, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	return base_ch;
+}
+
+static inline bool
+raid5f_stripe_degraded(struct raid_bdev_io *raid_io, uint64_t stripe_index)
+{
+	uint8_t i;
+
+	for (i = 0; i < raid_io->raid_ch->num_channels; i++) {
+		if (raid5f_base_channel(raid_io, i, stripe_index) == NULL) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static int
+raid5f_iovs_append(struct iovec **iovs, int *iovcnt, int *iovcnt_max, void *base, size_t len)
+{
+	if (len == 0) {
+		return 0;
+	}
+
+	if (*iovcnt == *iovcnt_max) {
+		int new_max = *iovcnt_max ? *iovcnt_max * 2 : 4;
+		struct iovec *new_iovs;
+
+		new_iovs = realloc(*iovs, new_max * sizeof(**iovs));
+		if (!new_iovs) {
+			return -ENOMEM;
+		}
+		*iovs = new_iovs;
+		*iovcnt_max = new_max;
+	}
+
+	(*iovs)[*iovcnt].iov_base = base;
+	(*iovs)[*iovcnt].iov_len = len;
+	(*iovcnt)++;
+
+	return 0;
+}
+
+/* Append the part of src starting at byte offset and spanning len bytes */
+static int
+raid5f_iovs_append_slice(struct iovec **iovs, int *iovcnt, int *iovcnt_max,
+			 const struct iovec *src, int src_iovcnt, size_t offset, size_t len)
+{
+	int i;
+	int ret;
+
+	for (i = 0; i < src_iovcnt && len > 0; i++) {
+		size_t n;
+
+		if (offset >= src[i].iov_len) {
+			offset -= src[i].iov_len;
+			continue;
+		}
+
+		n = spdk_min(len, src[i].iov_len - offset);
+		ret = raid5f_iovs_append(iovs, iovcnt, iovcnt_max, src[i].iov_base + offset, n);
+		if (ret) {
+			return ret;
+		}
+		len -= n;
+		offset = 0;
+	}
+
+	return len == 0 ? 0 : -EINVAL;
+}
+
+static inline uint32_t
+raid5f_buf_pool_class(size_t len)
+{
+	uint32_t class = 0;
+
+	while (((size_t)RAID5F_BUF_POOL_MIN_LEN << class) < len) {
+		class++;
+	}
+
+	return class;
+}
+
+/* Borrow a buffer of at least len bytes from the io channel's pool */
+static void *
+raid5f_buf_get(struct raid5f_io_channel *r5ch, size_t len)
+{
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(r5ch);
+	uint32_t class = raid5f_buf_pool_class(len);
+	size_t class_len = (size_t)RAID5F_BUF_POOL_MIN_LEN << class;
+	struct raid5f_buf *buf;
+
+	assert(class < RAID5F_BUF_POOL_CLASSES);
+
+	buf = SLIST_FIRST(&r5ch->buf_pool[class]);
+	if (buf != NULL) {
+		SLIST_REMOVE_HEAD(&r5ch->buf_pool[class], link);
+		r5ch->buf_pool_cached -= class_len;
+		return buf;
+	}
+
+	return spdk_dma_malloc(class_len, r5f_info->buf_alignment, NULL);
+}
+
+/* Return a buffer borrowed with the same len to the io channel's pool */
+static void
+raid5f_buf_put(struct raid5f_io_channel *r5ch, void *_buf, size_t len)
+{
+	uint32_t class = raid5f_buf_pool_class(len);
+	size_t class_len = (size_t)RAID5F_BUF_POOL_MIN_LEN << class;
+	struct raid5f_buf *buf = _buf;
+
+	if (r5ch->buf_pool_cached + class_len > RAID5F_BUF_POOL_CACHE_SIZE) {
+		spdk_dma_free(buf);
+		return;
+	}
+
+	SLIST_INSERT_HEAD(&r5ch->buf_pool[class], buf, link);
+	r5ch->buf_pool_cached += class_len;
+}
+
+/*
+ * Chunk checksum table. Each base bdev keeps the CRC32C of each of its chunks, data and
+ * separate metadata, in a table following its data, one 32-bit entry per stripe. Full stripe
+ * writes set the entries of the data chunks they write and other writes clear them, 0 meaning
+ * unknown. A read of a chunk whose checksum is known verifies it by reading only that chunk
+ * and falls back to the verification against the other chunks on a mismatch.
+ *
+ * Pages of the table are cached in memory shared by all io channels and written back lazily
+ * by a poller on the app thread. A page updated before it is read from its base bdev keeps
+ * which entries are up to date and takes only the others when it is read.
+ */
+struct raid5f_csum_page {
+	struct raid5f_csum *csum;
+
+	/* Base bdev and page of its table, member is UINT8_MAX if the page is unused */
+	uint8_t member;
+	uint64_t page_idx;
+
+	/* Entries of the page and, until it is read from the base bdev, the ones up to date */
+	uint32_t *entries;
+	uint64_t *known;
+
+	bool loaded;
+	bool loading;
+	bool writing;
+	bool dirty;
+
+	/* Link in the list of unused or the list of used pages, least recently used first */
+	TAILQ_ENTRY(raid5f_csum_page) lru_link;
+
+	/* Link in the hash bucket of the page */
+	TAILQ_ENTRY(raid5f_csum_page) hash_link;
+};
+
+TAILQ_HEAD(raid5f_csum_bucket, raid5f_csum_page);
+
+struct raid5f_csum {
+	struct raid5f_info *r5f_info;
+
+	struct spdk_spinlock lock;
+
+	/* Location of the table on each base bdev in blocks from the start of its data */
+	uint64_t offset_blocks;
+
+	/* Size of a page of the table, its entries and number of pages on each base bdev */
+	uint32_t page_blocks;
+	uint32_t entries_per_page;
+	uint64_t num_pages;
+
+	/* Cached pages and their entries, allocated at once */
+	struct raid5f_csum_page *pages;
+	uint32_t num_cached;
+	void *entries_buf;
+	uint64_t *known_buf;
+
+	TAILQ_HEAD(, raid5f_csum_page) free_pages;
+	TAILQ_HEAD(, raid5f_csum_page) lru;
+
+	/* Hash of used pages by base bdev and page index */
+	struct raid5f_csum_bucket *buckets;
+	uint32_t buckets_mask;
+
+	/* raid bdev io channel of the app thread, providing the base bdev channels */
+	struct spdk_io_channel *ch;
+
+	struct spdk_poller *poller;
+
+	/* Writes of pages in progress, on the app thread */
+	uint32_t writes_active;
+
+	bool stopping;
+	bool stopped;
+	TAILQ_HEAD(, raid5f_stop_waiter) stop_waiters;
+
+	/* Statistics, updated from all io channels */
+	struct {
+		/* Reads verified by the checksum and reads whose data didn't match it */
+		uint64_t verified;
+		uint64_t mismatches;
+		/* Reads of chunks with an unknown checksum */
+		uint64_t misses;
+		/* Updates lost because no page could be evicted from the cache */
+		uint64_t updates_dropped;
+		uint64_t page_reads;
+		uint64_t page_writes;
+		uint64_t errors;
+	} stats;
+};
+
+/* Read of a page of the table on the thread needing it */
+struct raid5f_csum_load {
+	struct raid5f_csum *csum;
+	struct raid5f_csum_page *page;
+
+	/* Reference to the raid bdev io channel the page is read on */
+	struct spdk_io_channel *ch;
+
+	void *buf;
+	size_t len;
+};
+
+/* Checksum of a chunk, never 0 which marks unknown entries */
+static uint32_t
+raid5f_csum_calc(struct iovec *iovs, int iovcnt, void *md_buf, size_t md_len)
+{
+	uint32_t crc;
+
+	crc = spdk_crc32c_iov_update(iovs, iovcnt, ~0);
+	if (md_len != 0) {
+		crc = spdk_crc32c_update(md_buf, md_len, crc);
+	}
+	crc = ~crc;
+
+	return crc != 0 ? crc : 1;
+}
+
+static inline uint64_t
+raid5f_csum_page_offset(struct raid5f_csum *csum, struct raid_base_bdev_info *base_info,
+			uint64_t page_idx)
+{
+	return base_info->data_offset + csum->offset_blocks + page_idx * csum->page_blocks;
+}
+
+static inline struct raid5f_csum_bucket *
+raid5f_csum_bucket(struct raid5f_csum *csum, uint8_t member, uint64_t page_idx)
+{
+	uint8_t num_base_bdevs = csum->r5f_info->raid_bdev->num_base_bdevs;
+
+	return &csum->buckets[(page_idx * num_base_bdevs + member) & csum->buckets_mask];
+}
+
+static struct raid5f_csum_page *
+raid5f_csum_page_find(struct raid5f_csum *csum, uint8_t member, uint64_t page_idx)
+{
+	struct raid5f_csum_page *page;
+
+	TAILQ_FOREACH(page, raid5f_csum_bucket(csum, member, page_idx), hash_link) {
+		if (page->member == member && page->page_idx == page_idx) {
+			return page;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Get the cached page of the table, taking an unused page or evicting the least recently used
+ * clean one if it isn't cached. Returns NULL if all pages are dirty or being read or written.
+ * Called with the lock held.
+ */
+static struct raid5f_csum_page *
+raid5f_csum_page_get(struct raid5f_csum *csum, uint8_t member, uint64_t page_idx)
+{
+	struct raid5f_csum_page *page;
+
+	page = raid5f_csum_page_find(csum, member, page_idx);
+	if (page != NULL) {
+		TAILQ_REMOVE(&csum->lru, page, lru_link);
+		TAILQ_INSERT_TAIL(&csum->lru, page, lru_link);
+		return page;
+	}
+
+	page = TAILQ_FIRST(&csum->free_pages);
+	if (page != NULL) {
+		TAILQ_REMOVE(&csum->free_pages, page, lru_link);
+	} else {
+		TAILQ_FOREACH(page, &csum->lru, lru_link) {
+			if (!page->dirty && !page->loading && !page->writing) {
+				break;
+			}
+		}
+		if (page == NULL) {
+			return NULL;
+		}
+		TAILQ_REMOVE(&csum->lru, page, lru_link);
+		TAILQ_REMOVE(raid5f_csum_bucket(csum, page->member, page->page_idx), page,
+			     hash_link);
+	}
+
+	page->member = member;
+	page->page_idx = page_idx;
+	page->loaded = false;
+	memset(page->known, 0, SPDK_CEIL_DIV(csum->entries_per_page, 64) * sizeof(uint64_t));
+	TAILQ_INSERT_TAIL(&csum->lru, page, lru_link);
+	TAILQ_INSERT_TAIL(raid5f_csum_bucket(csum, member, page_idx), page, hash_link);
+
+	return page;
+}
+
+static void
+raid5f_csum_load_free(struct raid5f_csum_load *load)
+{
+	if (load->buf != NULL) {
+		raid5f_buf_put(raid5f_raid_ch_to_r5ch(spdk_io_channel_get_ctx(load->ch)), load->buf,
+			       load->len);
+	}
+	if (load->ch != NULL) {
+		spdk_put_io_channel(load->ch);
+	}
+	free(load);
+}
+
+static void
+raid5f_csum_page_load_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_csum_load *load = cb_arg;
+	struct raid5f_csum *csum = load->csum;
+	struct raid5f_csum_page *page = load->page;
+	uint32_t *entries = load->buf;
+	uint32_t i;
+
+	spdk_bdev_free_io(bdev_io);
+
+	spdk_spin_lock(&csum->lock);
+	if (success) {
+		for (i = 0; i < csum->entries_per_page; i++) {
+			if (!(page->known[i / 64] & (1ULL << (i % 64)))) {
+				page->entries[i] = entries[i];
+			}
+		}
+		page->loaded = true;
+	}
+	page->loading = false;
+	spdk_spin_unlock(&csum->lock);
+
+	__atomic_fetch_add(success ? &csum->stats.page_reads : &csum->stats.errors, 1,
+			   __ATOMIC_RELAXED);
+
+	raid5f_csum_load_free(load);
+}
+
+/*
+ * Read a page of the table marked as loading on the current thread. Nothing is retried on
+ * failure, the next access to the page starts another read.
+ */
+static void
+raid5f_csum_page_load(struct raid5f_csum *csum, struct raid5f_csum_page *page)
+{
+	struct raid_bdev *raid_bdev = csum->r5f_info->raid_bdev;
+	struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[page->member];
+	struct raid_bdev_io_channel *raid_ch;
+	struct spdk_io_channel *base_ch;
+	struct raid5f_csum_load *load;
+	int ret = -ENOMEM;
+
+	load = calloc(1, sizeof(*load));
+	if (load != NULL) {
+		load->csum = csum;
+		load->page = page;
+		load->len = (size_t)csum->page_blocks * raid_bdev->bdev.blocklen;
+		load->ch = spdk_get_io_channel(raid_bdev);
+	}
+
+	if (load != NULL && load->ch != NULL) {
+		raid_ch = spdk_io_channel_get_ctx(load->ch);
+		base_ch = raid_ch->base_channel[page->member];
+		load->buf = raid5f_buf_get(raid5f_raid_ch_to_r5ch(raid_ch), load->len);
+		if (base_ch == NULL) {
+			ret = -ENODEV;
+		} else if (load->buf != NULL) {
+			ret = spdk_bdev_read_blocks(base_info->desc, base_ch, load->buf,
+						    raid5f_csum_page_offset(csum, base_info,
+								    page->page_idx),
+						    csum->page_blocks, raid5f_csum_page_load_complete,
+						    load);
+		}
+	}
+
+	if (ret == 0) {
+		return;
+	}
+
+	if (load != NULL) {
+		raid5f_csum_load_free(load);
+	}
+
+	spdk_spin_lock(&csum->lock);
+	page->loading = false;
+	spdk_spin_unlock(&csum->lock);
+}
+
+/*
+ * Get the checksum of a chunk. Returns false if it isn't known, and starts reading its page
+ * of the table if it isn't cached.
+ */
+static bool
+raid5f_csum_lookup(struct raid5f_csum *csum, uint8_t member, uint64_t stripe_index,
+		   uint32_t *value)
+{
+	uint64_t page_idx = stripe_index / csum->entries_per_page;
+	uint32_t i = stripe_index % csum->entries_per_page;
+	struct raid5f_csum_page *page;
+	bool load = false;
+
+	*value = 0;
+
+	spdk_spin_lock(&csum->lock);
+	page = raid5f_csum_page_get(csum, member, page_idx);
+	if (page != NULL) {
+		if (page->loaded || (page->known[i / 64] & (1ULL << (i % 64)))) {
+			*value = page->entries[i];
+		}
+		if (!page->loaded && !page->loading) {
+			page->loading = true;
+			load = true;
+		}
+	}
+	spdk_spin_unlock(&csum->lock);
+
+	if (load) {
+		raid5f_csum_page_load(csum, page);
+	}
+
+	if (*value == 0) {
+		__atomic_fetch_add(&csum->stats.misses, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	return true;
+}
+
+/* Set the checksum of a chunk, 0 if its contents are not known */
+static void
+raid5f_csum_update(struct raid5f_csum *csum, uint8_t member, uint64_t stripe_index,
+		   uint32_t value)
+{
+	uint64_t page_idx = stripe_index / csum->entries_per_page;
+	uint32_t i = stripe_index % csum->entries_per_page;
+	struct raid5f_csum_page *page;
+
+	spdk_spin_lock(&csum->lock);
+	page = raid5f_csum_page_get(csum, member, page_idx);
+	if (page != NULL) {
+		page->entries[i] = value;
+		page->known[i / 64] |= 1ULL << (i % 64);
+		page->dirty = true;
+	}
+	spdk_spin_unlock(&csum->lock);
+
+	if (page == NULL) {
+		__atomic_fetch_add(&csum->stats.updates_dropped, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Set the checksums of the data chunks written by a full stripe write */
+static void
+raid5f_csum_stripe_write(struct stripe_request *stripe_req)
+{
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(stripe_req->r5ch);
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct chunk *chunk;
+	size_t md_len = 0;
+	uint32_t value = 0;
+
+	if (r5f_info->csum == NULL) {
+		return;
+	}
+
+	if (spdk_bdev_is_md_separate(&raid_bdev->bdev)) {
+		md_len = raid_bdev->strip_size * spdk_bdev_get_md_size(&raid_bdev->bdev);
+	}
+
+	FOR_EACH_DATA_CHUNK(stripe_req, chunk) {
+		/* Buffers of a memory domain can't be accessed, the checksums become unknown */
+		if (raid_io->memory_domain == NULL && (md_len == 0 || chunk->md_buf != NULL)) {
+			value = raid5f_csum_calc(chunk->iovs, chunk->iovcnt, chunk->md_buf, md_len);
+		}
+		raid5f_csum_update(r5f_info->csum, chunk->index, stripe_req->stripe_index, value);
+	}
+}
+
+/* Return the buffers of a reconstruct request to the io channel's pool */
+static void
+raid5f_reconstruct_put_buffers(struct stripe_request *stripe_req)
+{
+	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
+	uint8_t n = raid5f_stripe_data_chunks_num(raid5f_ch_to_r5f_info(r5ch)->raid_bdev);
+	size_t len = stripe_req->reconstruct.buf_len;
+	size_t md_len = stripe_req->reconstruct.md_buf_len;
+	uint8_t i;
+
+	for (i = 0; i < n; i++) {
+		if (stripe_req->reconstruct.chunk_buffers[i] != NULL) {
+			raid5f_buf_put(r5ch, stripe_req->reconstruct.chunk_buffers[i], len);
+			stripe_req->reconstruct.chunk_buffers[i] = NULL;
+		}
+		if (stripe_req->reconstruct.chunk_md_buffers[i] != NULL) {
+			raid5f_buf_put(r5ch, stripe_req->reconstruct.chunk_md_buffers[i], md_len);
+			stripe_req->reconstruct.chunk_md_buffers[i] = NULL;
+		}
+	}
+
+	if (stripe_req->reconstruct.verify_buf != NULL) {
+		raid5f_buf_put(r5ch, stripe_req->reconstruct.verify_buf, len);
+		stripe_req->reconstruct.verify_buf = NULL;
+	}
+	if (stripe_req->reconstruct.verify_md_buf != NULL) {
+		raid5f_buf_put(r5ch, stripe_req->reconstruct.verify_md_buf, md_len);
+		stripe_req->reconstruct.verify_md_buf = NULL;
+	}
+}
+
+/*
+ * Borrow the buffers a reconstruct request needs for num_blocks: one for each chunk read
+ * from the array and, with verify_buf, one for the reconstructed chunk. Metadata buffers
+ * are borrowed with md.
+ */
+static int
+raid5f_reconstruct_get_buffers(struct stripe_request *stripe_req, uint64_t num_blocks,
+			       bool verify_buf, bool md)
+{
+	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
+	struct raid_bdev *raid_bdev = raid5f_ch_to_r5f_info(r5ch)->raid_bdev;
+	uint8_t n = raid5f_stripe_data_chunks_num(raid_bdev);
+	size_t len = num_blocks << raid_bdev->blocklen_shift;
+	size_t md_len = md ? num_blocks * spdk_bdev_get_md_size(&raid_bdev->bdev) : 0;
+	uint8_t i;
+
+	stripe_req->reconstruct.buf_len = len;
+	stripe_req->reconstruct.md_buf_len = md_len;
+
+	for (i = 0; i < n; i++) {
+		stripe_req->reconstruct.chunk_buffers[i] = raid5f_buf_get(r5ch, len);
+		if (stripe_req->reconstruct.chunk_buffers[i] == NULL) {
+			goto err;
+		}
+		if (md) {
+			stripe_req->reconstruct.chunk_md_buffers[i] = raid5f_buf_get(r5ch, md_len);
+			if (stripe_req->reconstruct.chunk_md_buffers[i] == NULL) {
+				goto err;
+			}
+		}
+	}
+
+	if (verify_buf) {
+		stripe_req->reconstruct.verify_buf = raid5f_buf_get(r5ch, len);
+		if (stripe_req->reconstruct.verify_buf == NULL) {
+			goto err;
+		}
+		if (md) {
+			stripe_req->reconstruct.verify_md_buf = raid5f_buf_get(r5ch, md_len);
+			if (stripe_req->reconstruct.verify_md_buf == NULL) {
+				goto err;
+			}
+		}
+	}
+
+	return 0;
+err:
+	raid5f_reconstruct_put_buffers(stripe_req);
+	return -ENOMEM;
+}
+
+static void raid5f_stripe_unlock(struct stripe_request *stripe_req);
+static void raid5f_cache_flush_submit(struct raid5f_cache_flush *flush);
+static void raid5f_repair_kick(struct raid5f_io_channel *r5ch);
+
+static inline void
+raid5f_stripe_request_release(struct stripe_request *stripe_req)
+{
+	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
+	struct raid5f_stripe_pool *pool;
+	struct raid5f_cache_flush *flush;
+
+	if (stripe_req->type != STRIPE_REQ_RECONSTRUCT) {
+		raid5f_stripe_gen_bump(raid5f_ch_to_r5f_info(r5ch), stripe_req->stripe_index);
+	} else {
+		raid5f_reconstruct_put_buffers(stripe_req);
+	}
+
+	assert(stripe_req->type < RAID5F_STRIPE_REQ_TYPES);
+	pool = &r5ch->stripe_pools[stripe_req->type];
+	TAILQ_INSERT_HEAD(&pool->free, stripe_req, link);
+	pool->num_free++;
+
+	raid5f_stripe_unlock(stripe_req);
+
+	flush = TAILQ_FIRST(&r5ch->cache_flush_retry_queue);
+	if (flush != NULL) {
+		TAILQ_REMOVE(&r5ch->cache_flush_retry_queue, flush, link);
+		raid5f_cache_flush_submit(flush);
+	}
+
+	raid5f_repair_kick(r5ch);
+}
+
+static struct stripe_request *raid5f_stripe_request_alloc(struct raid5f_io_channel *r5ch,
+		enum stripe_request_type type);
+
+/*
+ * Get an available stripe request of the type without taking it from the pool. The pool grows
+ * by one if it is empty and below its maximum size. Returns NULL if none is available.
+ */
+static struct stripe_request *
+raid5f_stripe_request_peek(struct raid5f_io_channel *r5ch, enum stripe_request_type type)
+{
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(r5ch);
+	struct raid5f_stripe_pool *pool = &r5ch->stripe_pools[type];
+	struct stripe_request *stripe_req;
+
+	stripe_req = TAILQ_FIRST(&pool->free);
+	if (spdk_likely(stripe_req != NULL)) {
+		return stripe_req;
+	}
+
+	if (pool->num_allocated < r5f_info->stripe_pool_max) {
+		stripe_req = raid5f_stripe_request_alloc(r5ch, type);
+	}
+	if (stripe_req == NULL) {
+		__atomic_fetch_add(&r5f_info->pool_stats.exhausted, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	TAILQ_INSERT_HEAD(&pool->free, stripe_req, link);
+	pool->num_allocated++;
+	pool->num_free++;
+	__atomic_fetch_add(&r5f_info->pool_stats.grown, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&r5f_info->pool_stats.allocated, 1, __ATOMIC_RELAXED);
+
+	return stripe_req;
+}
+
+/* Take a stripe request returned by raid5f_stripe_request_peek() from its pool */
+static inline void
+raid5f_stripe_request_take(struct stripe_request *stripe_req)
+{
+	struct raid5f_stripe_pool *pool = &stripe_req->r5ch->stripe_pools[stripe_req->type];
+
+	TAILQ_REMOVE(&pool->free, stripe_req, link);
+	pool->num_free--;
+	pool->peak_in_use = spdk_max(pool->peak_in_use, pool->num_allocated - pool->num_free);
+}
+
+/* Queue a base bdev I/O to be retried when the base bdev has an spdk_bdev_io available */
+static void
+raid5f_queue_io_wait(struct raid_bdev_io *raid_io, struct raid_base_bdev_info *base_info,
+		     struct spdk_io_channel *base_ch, spdk_bdev_io_wait_cb cb_fn)
+{
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+
+	__atomic_fetch_add(&r5f_info->pool_stats.base_io_retries, 1, __ATOMIC_RELAXED);
+	raid_bdev_queue_io_wait(raid_io, spdk_bdev_desc_get_bdev(base_info->desc), base_ch, cb_fn);
+}
+
+/* Complete an I/O which couldn't get a resource, the bdev layer retries it later */
+static void
+raid5f_io_complete_nomem(struct raid_bdev_io *raid_io)
+{
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+
+	__atomic_fetch_add(&r5f_info->pool_stats.nomem, 1, __ATOMIC_RELAXED);
+	raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_NOMEM);
+}
+
+static inline struct raid5f_stripe_lock_bucket *
+raid5f_stripe_lock_bucket(struct raid5f_info *r5f_info, uint64_t stripe_index)
+{
+	return &r5f_info->stripe_lock_buckets[stripe_index & (RAID5F_STRIPE_LOCK_BUCKETS - 1)];
+}
+
+static inline bool
+raid5f_stripe_lock_try(uint32_t *stripe_lock, bool exclusive)
+{
+	uint32_t state = __atomic_load_n(stripe_lock, __ATOMIC_RELAXED);
+
+	do {
+		if (exclusive ? state != 0 :
+		    (state & (RAID5F_STRIPE_LOCK_EXCLUSIVE | RAID5F_STRIPE_LOCK_WAITERS)) != 0) {
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(stripe_lock, &state,
+					      exclusive ? RAID5F_STRIPE_LOCK_EXCLUSIVE : state + 1,
+					      true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	return true;
+}
+
+static bool raid5f_range_lock_continue(struct raid5f_range_lock *lock);
+
+static void
+raid5f_range_lock_granted(void *ctx)
+{
+	struct raid5f_range_lock *lock = ctx;
+
+	if (raid5f_range_lock_continue(lock)) {
+		lock->cb(lock->cb_arg);
+	}
+}
+
+/* Grant the stripe to the waiters at the head of its queue. Called with the bucket locked. */
+static void
+raid5f_stripe_lock_grant(struct raid5f_info *r5f_info, struct raid5f_stripe_lock_bucket *bucket,
+			 uint64_t stripe_index)
+{
+	uint32_t *stripe_lock = &r5f_info->stripe_locks[stripe_index];
+	struct raid5f_range_lock *lock, *tmp;
+	bool waiting = false;
+	uint32_t state;
+
+	assert(spdk_spin_held(&bucket->lock));
+
+	/* Holders only release the stripe while it has waiters, nobody else takes it */
+	TAILQ_FOREACH_SAFE(lock, &bucket->waiters, link, tmp) {
+		if (lock->first_stripe + lock->acquired != stripe_index) {
+			continue;
+		}
+
+		state = __atomic_load_n(stripe_lock, __ATOMIC_ACQUIRE);
+		if (lock->exclusive) {
+			if ((state & (RAID5F_STRIPE_LOCK_EXCLUSIVE | RAID5F_STRIPE_LOCK_SHARED_MASK)) != 0) {
+				waiting = true;
+				break;
+			}
+			__atomic_fetch_or(stripe_lock, RAID5F_STRIPE_LOCK_EXCLUSIVE,
+					  __ATOMIC_ACQUIRE);
+		} else {
+			if ((state & RAID5F_STRIPE_LOCK_EXCLUSIVE) != 0) {
+				waiting = true;
+				break;
+			}
+			__atomic_fetch_add(stripe_lock, 1, __ATOMIC_ACQUIRE);
+		}
+
+		TAILQ_REMOVE(&bucket->waiters, lock, link);
+		lock->acquired++;
+		spdk_thread_send_msg(lock->thread, raid5f_range_lock_granted, lock);
+	}
+
+	if (!waiting) {
+		__atomic_fetch_and(stripe_lock, ~RAID5F_STRIPE_LOCK_WAITERS, __ATOMIC_RELEASE);
+	}
+}
+
+/* Take the rest of the stripes of the range, return false if it has to wait for one */
+static bool
+raid5f_range_lock_continue(struct raid5f_range_lock *lock)
+{
+	struct raid5f_info *r5f_info = lock->r5f_info;
+	struct raid5f_stripe_lock_bucket *bucket;
+	uint64_t stripe_index;
+	uint32_t *stripe_lock;
+
+	while (lock->acquired < lock->num_stripes) {
+		stripe_index = lock->first_stripe + lock->acquired;
+		stripe_lock = &r5f_info->stripe_locks[stripe_index];
+		if (!raid5f_stripe_lock_try(stripe_lock, lock->exclusive)) {
+			bucket = raid5f_stripe_lock_bucket(r5f_info, stripe_index);
+
+			spdk_spin_lock(&bucket->lock);
+			__atomic_fetch_or(stripe_lock, RAID5F_STRIPE_LOCK_WAITERS,
+					  __ATOMIC_ACQ_REL);
+			TAILQ_INSERT_TAIL(&bucket->waiters, lock, link);
+			/* The holders may have released the stripe before seeing the waiter */
+			raid5f_stripe_lock_grant(r5f_info, bucket, stripe_index);
+			spdk_spin_unlock(&bucket->lock);
+
+			return false;
+		}
+		lock->acquired++;
+	}
+
+	return true;
+}
+
+/*
+ * Lock a range of stripes for the array. Returns true if the range was acquired. Otherwise
+ * cb is called on the current thread when it is.
+ */
+static bool
+raid5f_range_lock(struct raid5f_range_lock *lock, struct raid5f_info *r5f_info,
+		  uint64_t first_stripe, uint64_t num_stripes, bool exclusive,
+		  raid5f_range_lock_cb cb, void *cb_arg)
+{
+	assert(num_stripes > 0);
+	assert(first_stripe + num_stripes <= r5f_info->total_stripes);
+
+	lock->r5f_info = r5f_info;
+	lock->first_stripe = first_stripe;
+	lock->num_stripes = num_stripes;
+	lock->exclusive = exclusive;
+	lock->acquired = 0;
+	lock->thread = spdk_get_thread();
+	lock->cb = cb;
+	lock->cb_arg = cb_arg;
+
+	return raid5f_range_lock_continue(lock);
+}
+
+static void
+raid5f_range_unlock(struct raid5f_range_lock *lock)
+{
+	struct raid5f_info *r5f_info = lock->r5f_info;
+	struct raid5f_stripe_lock_bucket *bucket;
+	uint64_t stripe_index;
+	uint32_t state;
+	uint64_t i;
+
+	for (i = 0; i < lock->acquired; i++) {
+		stripe_index = lock->first_stripe + i;
+		if (lock->exclusive) {
+			state = __atomic_fetch_and(&r5f_info->stripe_locks[stripe_index],
+						   ~RAID5F_STRIPE_LOCK_EXCLUSIVE, __ATOMIC_RELEASE);
+		} else {
+			state = __atomic_fetch_sub(&r5f_info->stripe_locks[stripe_index], 1,
+						   __ATOMIC_RELEASE);
+			if ((state & RAID5F_STRIPE_LOCK_SHARED_MASK) != 1) {
+				continue;
+			}
+		}
+
+		/* The last holder grants the stripe to the next waiters */
+		if (state & RAID5F_STRIPE_LOCK_WAITERS) {
+			bucket = raid5f_stripe_lock_bucket(r5f_info, stripe_index);
+			spdk_spin_lock(&bucket->lock);
+			raid5f_stripe_lock_grant(r5f_info, bucket, stripe_index);
+			spdk_spin_unlock(&bucket->lock);
+		}
+	}
+	lock->acquired = 0;
+}
+
+static void
+raid5f_stripe_locks_free(struct raid5f_info *r5f_info)
+{
+	uint32_t i;
+
+	if (r5f_info->stripe_lock_buckets) {
+		for (i = 0; i < RAID5F_STRIPE_LOCK_BUCKETS; i++) {
+			spdk_spin_destroy(&r5f_info->stripe_lock_buckets[i].lock);
+		}
+		free(r5f_info->stripe_lock_buckets);
+	}
+	free(r5f_info->stripe_locks);
+}
+
+/* A lock state per stripe keeps unrelated stripes from contending for the same lock */
+static int
+raid5f_stripe_locks_alloc(struct raid5f_info *r5f_info)
+{
+	struct raid5f_stripe_lock_bucket *buckets;
+	uint32_t i;
+
+	r5f_info->stripe_locks = calloc(r5f_info->total_stripes, sizeof(*r5f_info->stripe_locks));
+	if (!r5f_info->stripe_locks) {
+		return -ENOMEM;
+	}
+
+	if (posix_memalign((void **)&buckets, SPDK_CACHE_LINE_SIZE,
+			   RAID5F_STRIPE_LOCK_BUCKETS * sizeof(*buckets)) != 0) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < RAID5F_STRIPE_LOCK_BUCKETS; i++) {
+		spdk_spin_init(&buckets[i].lock);
+		TAILQ_INIT(&buckets[i].waiters);
+	}
+	r5f_info->stripe_lock_buckets = buckets;
+
+	return 0;
+}
+
+static void
+raid5f_stripe_locked(void *cb_arg)
+{
+	struct stripe_request *stripe_req = cb_arg;
+
+	stripe_req->locked = true;
+	stripe_req->lock_start_fn(stripe_req);
+}
+
+/*
+ * Serialize requests changing the same stripe across the array. Returns true if the stripe
+ * was acquired. Otherwise the request waits for the current holders and start_fn is called
+ * when it is its turn.
+ */
+static bool
+raid5f_stripe_lock(struct stripe_request *stripe_req, stripe_req_start_fn start_fn)
+{
+	assert(!stripe_req->locked);
+
+	stripe_req->lock_start_fn = start_fn;
+	if (!raid5f_range_lock(&stripe_req->lock, raid5f_ch_to_r5f_info(stripe_req->r5ch),
+			       stripe_req->stripe_index, 1, true, raid5f_stripe_locked, stripe_req)) {
+		return false;
+	}
+	stripe_req->locked = true;
+
+	return true;
+}
+
+static void
+raid5f_stripe_unlock(struct stripe_request *stripe_req)
+{
+	if (!stripe_req->locked) {
+		return;
+	}
+
+	raid5f_range_unlock(&stripe_req->lock);
+	stripe_req->locked = false;
+}
+
+static void
+raid5f_xor_stripe_done(struct stripe_request *stripe_req)
+{
+	if (stripe_req->xor.status != 0) {
+		SPDK_ERRLOG("stripe xor failed: %s\n", spdk_strerror(-stripe_req->xor.status));
+	}
+	stripe_req->xor.cb(stripe_req, stripe_req->xor.status);
+}
+
+static void raid5f_xor_stripe_continue(struct stripe_request *stripe_req);
+
+static void
+_raid5f_xor_stripe_cb(struct stripe_request *stripe_req, int status)
+{
+	if (status != 0) {
+		stripe_req->xor.status = status;
+	}
+
+	if (stripe_req->xor.remaining + stripe_req->xor.remaining_md == 0) {
+		raid5f_xor_stripe_done(stripe_req);
+	}
+}
+
+static void
+raid5f_xor_stripe_cb(void *_stripe_req, int status)
+{
+	struct stripe_request *stripe_req = _stripe_req;
+
+	stripe_req->xor.remaining -= stripe_req->xor.len;
+	
+	if (stripe_req->xor.remaining > 0) {
+		if (status != 0) {
+			stripe_req->xor.status = status;
+		}
+		stripe_req->xor.len = spdk_ioviter_nextv(stripe_req->chunk_iov_iters,
+				      stripe_req->r5ch->chunk_xor_buffers);
+		raid5f_xor_stripe_continue(stripe_req);
+	} else {
+		_raid5f_xor_stripe_cb(stripe_req, status);
+	}
+}
+
+static void
+raid5f_xor_stripe_md_cb(void *_stripe_req, int status)
+{
+	struct stripe_request *stripe_req = _stripe_req;
+
+	stripe_req->xor.remaining_md = 0;
+
+	_raid5f_xor_stripe_cb(stripe_req, status);
+}
+
+/* Xor the rest of the data on this core, walking the iovecs from the current segment */
+static void
+raid5f_xor_stripe_inline(struct stripe_request *stripe_req)
+{
+	void **buffers = stripe_req->r5ch->chunk_xor_buffers;
+	uint32_t n_src = stripe_req->xor.n_src;
+
+	while (true) {
+		raid5f_xor_gen(buffers[n_src], buffers, n_src, stripe_req->xor.len);
+		stripe_req->xor.remaining -= stripe_req->xor.len;
+		if (stripe_req->xor.remaining == 0) {
+			break;
+		}
+		stripe_req->xor.len = spdk_ioviter_nextv(stripe_req->chunk_iov_iters, buffers);
+	}
+
+	_raid5f_xor_stripe_cb(stripe_req, 0);
+}
+
+static void
+raid5f_xor_stripe_continue(struct stripe_request *stripe_req)
+{
+	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
+	uint32_t n_src = stripe_req->xor.n_src;
+	uint32_t i;
+	int ret;
+
+	assert(stripe_req->xor.len > 0);
+
+	for (i = 0; i < n_src; i++) {
+		stripe_req->chunk_xor_buffers[i] = r5ch->chunk_xor_buffers[i];
+	}
+
+	ret = spdk_accel_submit_xor(r5ch->accel_ch, r5ch->chunk_xor_buffers[n_src],
+				    stripe_req->chunk_xor_buffers, n_src, stripe_req->xor.len,
+				    raid5f_xor_stripe_cb, stripe_req);
+	if (spdk_unlikely(ret)) {
+		if (ret == -ENOMEM) {
+			/* accel is busy, don't wait for it */
+			raid5f_xor_stripe_inline(stripe_req);
+		} else {
+			stripe_req->xor.remaining = 0;
+			_raid5f_xor_stripe_cb(stripe_req, ret);
+		}
+	}
+}
+
+static int
+raid5f_xor_stripe_submit_md(struct stripe_request *stripe_req)
+{
+	int ret;
+
+	ret = spdk_accel_submit_xor(stripe_req->r5ch->accel_ch, stripe_req->xor.dest_md_buf,
+				    stripe_req->chunk_xor_md_buffers, stripe_req->xor.n_src,
+				    stripe_req->xor.remaining_md, raid5f_xor_stripe_md_cb, stripe_req);
+	if (spdk_unlikely(ret)) {
+		if (ret == -ENOMEM) {
+			raid5f_xor_gen(stripe_req->xor.dest_md_buf, stripe_req->chunk_xor_md_buffers,
+				       stripe_req->xor.n_src, stripe_req->xor.remaining_md);
+			stripe_req->xor.remaining_md = 0;
+		} else {
+			stripe_req->xor.status = ret;
+			raid5f_xor_stripe_done(stripe_req);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Calculate xor of n_src source iovec arrays spanning num_blocks into the destination.
+ * The caller places the sources in r5ch->chunk_xor_iovs/chunk_xor_iovcnt at indexes
+ * 0..n_src-1 and the destination at index n_src. The iovec arrays must stay valid
+ * until cb is called. If dest_md_buf is not NULL, metadata is calculated from the
+ * sources in stripe_req->chunk_xor_md_buffers. Small strips are calculated inline
+ * and cb may be called before this function returns.
+ */
+static void
+raid5f_xor_stripe_iovs(struct stripe_request *stripe_req, uint32_t n_src, uint64_t num_blocks,
+		       void *dest_md_buf, stripe_req_xor_cb cb)
+{
+	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
+	struct raid_bdev *raid_bdev = stripe_req->raid_io->raid_bdev;
+
+	assert(cb != NULL);
+	assert(n_src < raid5f_xor_buffers_max(raid_bdev));
+
+	stripe_req->xor.n_src = n_src;
+	stripe_req->xor.len = spdk_ioviter_firstv(stripe_req->chunk_iov_iters, n_src + 1,
+			      r5ch->chunk_xor_iovs,
+			      r5ch->chunk_xor_iovcnt,
+			      r5ch->chunk_xor_buffers);
+	stripe_req->xor.remaining = num_blocks << raid_bdev->blocklen_shift;
+	stripe_req->xor.status = 0;
+	stripe_req->xor.cb = cb;
+	stripe_req->xor.dest_md_buf = dest_md_buf;
+	stripe_req->xor.remaining_md = 0;
+
+	if (stripe_req->xor.remaining <= RAID5F_XOR_INLINE_MAX_LEN) {
+		if (dest_md_buf != NULL) {
+			raid5f_xor_gen(dest_md_buf, stripe_req->chunk_xor_md_buffers, n_src,
+				       num_blocks * spdk_bdev_get_md_size(&raid_bdev->bdev));
+		}
+		raid5f_xor_stripe_inline(stripe_req);
+		return;
+	}
+
+	if (dest_md_buf != NULL) {
+		stripe_req->xor.remaining_md = num_blocks * spdk_bdev_get_md_size(&raid_bdev->bdev);
+
+		if (raid5f_xor_stripe_submit_md(stripe_req) != 0) {
+			return;
+		}
+	}
+
+	raid5f_xor_stripe_continue(stripe_req);
+}
+
+static void
+raid5f_xor_stripe(struct stripe_request *stripe_req, stripe_req_xor_cb cb)
+{
+	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct chunk *chunk;
+	struct chunk *dest_chunk;
+	uint64_t num_blocks;
+	void *dest_md_buf = NULL;
+	uint8_t c;
+
+	assert(cb != NULL);
+
+	if (spdk_likely(stripe_req->type == STRIPE_REQ_WRITE)) {
+		num_blocks = raid_bdev->strip_size;
+		dest_chunk = stripe_req->parity_chunk;
+	} else if (stripe_req->type == STRIPE_REQ_RECONSTRUCT) {
+		num_blocks = stripe_req->reconstruct.num_blocks;
+		dest_chunk = stripe_req->reconstruct.chunk;
+	} else {
+		assert(false);
+		return;
+	}
+
+	c = 0;
+	FOR_EACH_CHUNK(stripe_req, chunk) {
+		if (chunk == dest_chunk) {
+			continue;
+		}
+		r5ch->chunk_xor_iovs[c] = chunk->iovs;
+		r5ch->chunk_xor_iovcnt[c] = chunk->iovcnt;
+		stripe_req->chunk_xor_md_buffers[c] = chunk->md_buf;
+		c++;
+	}
+	r5ch->chunk_xor_iovs[c] = dest_chunk->iovs;
+	r5ch->chunk_xor_iovcnt[c] = dest_chunk->iovcnt;
+
+	if (raid_io->md_buf) {
+		dest_md_buf = dest_chunk->md_buf;
+	}
+
+	raid5f_xor_stripe_iovs(stripe_req, c, num_blocks, dest_md_buf, cb);
+}
+
+static void raid5f_read_ctx_part_done(struct raid5f_read_ctx *read_ctx,
+				      enum spdk_bdev_io_status status);
+static void raid5f_partial_write_reads_done(struct stripe_request *stripe_req);
+static void raid5f_partial_write_fail(struct stripe_request *stripe_req);
+
+static void raid5f_degraded_cache_copy(struct raid5f_read_ctx *read_ctx,
+				       struct raid5f_degraded_cache_entry *entry);
+static void raid5f_rebuild_stripe_reconstructed(struct stripe_request *stripe_req,
+		enum spdk_bdev_io_status status);
+static void raid5f_read_hedge_reconstructed(struct stripe_request *stripe_req,
+		enum spdk_bdev_io_status status);
+
+static void
+raid5f_stripe_request_reconstruct_done(struct stripe_request *stripe_req,
+				       enum spdk_bdev_io_status status)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid5f_read_ctx *read_ctx = stripe_req->reconstruct.read_ctx;
+	struct raid5f_degraded_cache_entry *entry = stripe_req->reconstruct.cache_entry;
+
+	if (stripe_req->reconstruct.hedge != NULL) {
+		raid5f_read_hedge_reconstructed(stripe_req, status);
+		return;
+	}
+
+	if (read_ctx == NULL) {
+		/* Stripe of a rebuild, the request is kept until the chunk is written */
+		raid5f_rebuild_stripe_reconstructed(stripe_req, status);
+		return;
+	}
+
+	if (entry) {
+		struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(stripe_req->r5ch);
+
+		entry->filling = false;
+		if (status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+			raid5f_degraded_cache_copy(read_ctx, entry);
+		}
+
+		/* Don't keep a reconstruction which may have raced with a write */
+		if (status != SPDK_BDEV_IO_STATUS_SUCCESS ||
+		    entry->gen != raid5f_stripe_gen(r5f_info, stripe_req->stripe_index)) {
+			entry->stripe_index = UINT64_MAX;
+		}
+	}
+
+	raid5f_stripe_request_release(stripe_req);
+
+	raid_io->module_private = read_ctx;
+	raid5f_read_ctx_part_done(read_ctx, status);
+}
+
+static int raid5f_repair_queue(struct raid_bdev_io_channel *raid_ch, uint64_t stripe_index,
+			       uint8_t chunk_idx, uint64_t offset, uint64_t num_blocks);
+
+static bool
+raid5f_iovs_equal_buf(const struct iovec *iovs, int iovcnt, const void *buf, size_t len)
+{
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		size_t n = spdk_min(len, iovs[i].iov_len);
+
+		if (memcmp(iovs[i].iov_base, buf, n) != 0) {
+			return false;
+		}
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* Set the checksum of the chunk if the part, which was verified, is all of it */
+static void
+raid5f_csum_learn(struct raid5f_read_ctx *read_ctx)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	size_t md_len = 0;
+
+	if (r5f_info->csum == NULL || read_ctx->num_blocks != raid_bdev->strip_size) {
+		return;
+	}
+
+	if (spdk_bdev_is_md_separate(&raid_bdev->bdev)) {
+		if (read_ctx->md_buf == NULL) {
+			return;
+		}
+		md_len = read_ctx->num_blocks * spdk_bdev_get_md_size(&raid_bdev->bdev);
+	}
+
+	raid5f_csum_update(r5f_info->csum, read_ctx->chunk_idx, read_ctx->stripe_index,
+			   raid5f_csum_calc(read_ctx->iovs, read_ctx->iovcnt, read_ctx->md_buf,
+					    md_len));
+}
+
+/*
+ * Compare the chunk data read for a request with its reconstruction from the other
+ * chunks. On a mismatch of a chunk whose protection information or checksum didn't
+ * match either, the reconstruction is returned instead and the chunk is queued for
+ * repair. Otherwise the parity doesn't tell which member is wrong, so the data is
+ * returned as read and the parity is queued to be rewritten, like the scrubber does.
+ */
+static void
+raid5f_reconstruct_verify(struct stripe_request *stripe_req)
+{
+	struct raid5f_read_ctx *read_ctx = stripe_req->reconstruct.read_ctx;
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	size_t len = read_ctx->num_blocks << raid_bdev->blocklen_shift;
+	size_t md_len = 0;
+	uint8_t repair_idx = stripe_req->parity_chunk->index;
+	int ret;
+
+	if (read_ctx->md_buf) {
+		md_len = read_ctx->num_blocks * spdk_bdev_get_md_size(&raid_bdev->bdev);
+	}
+
+	if (raid5f_iovs_equal_buf(read_ctx->iovs, read_ctx->iovcnt, stripe_req->reconstruct.verify_buf,
+				  len) &&
+	    (md_len == 0 ||
+	     memcmp(read_ctx->md_buf, stripe_req->reconstruct.verify_md_buf, md_len) == 0)) {
+		raid5f_csum_learn(read_ctx);
+		return;
+	}
+
+	if (read_ctx->chunk_bad) {
+		spdk_copy_buf_to_iovs(read_ctx->iovs, read_ctx->iovcnt,
+				      stripe_req->reconstruct.verify_buf, len);
+		if (md_len != 0) {
+			memcpy(read_ctx->md_buf, stripe_req->reconstruct.verify_md_buf, md_len);
+		}
+		repair_idx = read_ctx->chunk_idx;
+	}
+
+	__atomic_fetch_add(&r5f_info->repair_stats.read_mismatches, 1, __ATOMIC_RELAXED);
+
+	ret = raid5f_repair_queue(raid_io->raid_ch, stripe_req->stripe_index, repair_idx,
+				  read_ctx->chunk_offset, read_ctx->num_blocks);
+	raid5f_mismatch_record(stripe_req->r5ch, stripe_req->stripe_index, read_ctx->chunk_idx,
+			       RAID5F_MISMATCH_SRC_READ, ret == 0 ? RAID5F_MISMATCH_REPAIR_QUEUED :
+			       RAID5F_MISMATCH_REPAIR_DROPPED);
+
+	/* The read returns what the repair leaves in the chunk */
+	raid5f_csum_learn(read_ctx);
+}
+
+static void
+raid5f_stripe_request_reconstruct_xor_done(struct stripe_request *stripe_req, int status)
+{
+	if (status == 0 && stripe_req->reconstruct.verify) {
+		raid5f_reconstruct_verify(stripe_req);
+	}
+
+	raid5f_stripe_request_reconstruct_done(stripe_req, status == 0 ? SPDK_BDEV_IO_STATUS_SUCCESS :
+					       SPDK_BDEV_IO_STATUS_FAILED);
+}
+
+/*
+ * Account completion of count chunk I/Os of the stripe request and advance its state
+ * when all of them are done.
+ */
+static void
+raid5f_stripe_request_chunks_complete(struct stripe_request *stripe_req, uint64_t count,
+				      enum spdk_bdev_io_status status)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+
+	if (spdk_likely(stripe_req->type == STRIPE_REQ_WRITE) ||
+	    (stripe_req->type == STRIPE_REQ_PARTIAL_WRITE && stripe_req->partial.writing)) {
+		if (raid_bdev_io_complete_part(raid_io, count, status)) {
+			raid5f_stripe_request_release(stripe_req);
+		}
+		return;
+	}
+
+	if (status != SPDK_BDEV_IO_STATUS_SUCCESS) {
+		raid_io->base_bdev_io_status = status;
+	}
+
+	assert(raid_io->base_bdev_io_remaining >= count);
+	raid_io->base_bdev_io_remaining -= count;
+	if (raid_io->base_bdev_io_remaining > 0) {
+		return;
+	}
+
+	if (stripe_req->type == STRIPE_REQ_RECONSTRUCT) {
+		if (raid_io->base_bdev_io_status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+			raid5f_xor_stripe(stripe_req, raid5f_stripe_request_reconstruct_xor_done);
+		} else {
+			raid5f_stripe_request_reconstruct_done(stripe_req, raid_io->base_bdev_io_status);
+		}
+	} else if (stripe_req->type == STRIPE_REQ_PARTIAL_WRITE) {
+		if (raid_io->base_bdev_io_status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+			raid5f_partial_write_reads_done(stripe_req);
+		} else {
+			raid5f_partial_write_fail(stripe_req);
+		}
+	} else {
+		assert(false);
+	}
+}
+
+static void
+raid5f_chunk_complete_bdev_io(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct chunk *chunk = cb_arg;
+	struct stripe_request *stripe_req = raid5f_chunk_stripe_req(chunk);
+	enum spdk_bdev_io_status status = success ? SPDK_BDEV_IO_STATUS_SUCCESS :
+					  SPDK_BDEV_IO_STATUS_FAILED;
+
+	spdk_bdev_free_io(bdev_io);
+
+	raid5f_stripe_request_chunks_complete(stripe_req, 1, status);
+}
+
+static void raid5f_stripe_request_submit_chunks(struct stripe_request *stripe_req);
+
+static void
+raid5f_chunk_submit_retry(void *_raid_io)
+{
+	struct raid_bdev_io *raid_io = _raid_io;
+	struct stripe_request *stripe_req = raid_io->module_private;
+
+	raid5f_stripe_request_submit_chunks(stripe_req);
+}
+
+static inline void
+raid5f_init_ext_io_opts(struct raid_bdev_io *raid_io, struct spdk_bdev_ext_io_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->size = sizeof(*opts);
+	opts->memory_domain = raid_io->memory_domain;
+	opts->memory_domain_ctx = raid_io->memory_domain_ctx;
+	opts->metadata = raid_io->md_buf;
+}
+
+/*
+ * Check if a partial write needs to read the old contents of the chunk before
+ * calculating parity and return the range to read, in blocks from the chunk start.
+ */
+static bool
+raid5f_partial_write_chunk_needs_read(struct stripe_request *stripe_req, struct chunk *chunk,
+				      uint64_t *offset, uint64_t *num_blocks)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	bool read_rows;
+
+	if (raid5f_base_channel(raid_io, chunk->index, stripe_req->stripe_index) == NULL ||
+	    stripe_req->partial.skip_parity) {
+		return false;
+	}
+
+	if (stripe_req->partial.reconstruct_chunk != NULL) {
+		read_rows = true;
+	} else if (chunk == stripe_req->parity_chunk) {
+		read_rows = stripe_req->partial.mode == PARTIAL_WRITE_RMW;
+	} else if (stripe_req->partial.mode == PARTIAL_WRITE_RMW) {
+		if (chunk->req_blocks == 0) {
+			return false;
+		}
+		*offset = chunk->req_offset;
+		*num_blocks = chunk->req_blocks;
+		return true;
+	} else {
+		read_rows = chunk->req_blocks != stripe_req->partial.row_blocks;
+	}
+
+	if (read_rows) {
+		*offset = stripe_req->partial.row_offset;
+		*num_blocks = stripe_req->partial.row_blocks;
+	}
+
+	return read_rows;
+}
+
+static uint64_t
+raid5f_stripe_request_chunks_pending(struct stripe_request *stripe_req, struct chunk *from)
+{
+	struct chunk *chunk;
+	uint64_t offset, num_blocks;
+	uint64_t count = 0;
+
+	if (stripe_req->type == STRIPE_REQ_WRITE && stripe_req->write.parity_deferred) {
+		/* The deferred parity chunk is accounted by its own submission */
+		count = raid5f_ch_to_r5f_info(stripe_req->r5ch)->raid_bdev->num_base_bdevs - from->index;
+		if (stripe_req->parity_chunk->index > from->index) {
+			count--;
+		}
+		return count;
+	}
+
+	if (stripe_req->type != STRIPE_REQ_PARTIAL_WRITE || stripe_req->partial.writing) {
+		return raid5f_ch_to_r5f_info(stripe_req->r5ch)->raid_bdev->num_base_bdevs - from->index;
+	}
+
+	FOR_EACH_CHUNK_FROM(stripe_req, chunk, from) {
+		if (raid5f_partial_write_chunk_needs_read(stripe_req, chunk, &offset, &num_blocks)) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static int
+raid5f_chunk_submit(struct chunk *chunk)
+{
+	struct stripe_request *stripe_req = raid5f_chunk_stripe_req(chunk);
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[chunk->index];
+	struct spdk_io_channel *base_ch = raid5f_base_channel(raid_io, chunk->index,
+					  stripe_req->stripe_index);
+	uint64_t base_offset_blocks = (stripe_req->stripe_index << raid_bdev->strip_size_shift);
+	uint64_t offset, num_blocks;
+	int ret;
+
+	raid5f_init_ext_io_opts(raid_io, &chunk->ext_opts);
+	chunk->ext_opts.metadata = chunk->md_buf;
+
+	raid_io->base_bdev_io_submitted++;
+
+	switch (stripe_req->type) {
+	case STRIPE_REQ_WRITE:
+		if (base_ch == NULL) {
+			raid5f_stripe_request_chunks_complete(stripe_req, 1, SPDK_BDEV_IO_STATUS_SUCCESS);
+			return 0;
+		}
+
+		ret = raid_bdev_writev_blocks_ext(base_info, base_ch, chunk->iovs, chunk->iovcnt,
+						  base_offset_blocks + chunk->req_offset, chunk->req_blocks,
+						  raid5f_chunk_complete_bdev_io, chunk,
+						  &chunk->ext_opts);
+		break;
+	case STRIPE_REQ_RECONSTRUCT:
+		if (chunk == stripe_req->reconstruct.chunk) {
+			raid5f_stripe_request_chunks_complete(stripe_req, 1, SPDK_BDEV_IO_STATUS_SUCCESS);
+			return 0;
+		}
+
+		base_offset_blocks += chunk->req_offset;
+
+		ret = raid_bdev_readv_blocks_ext(base_info, base_ch, chunk->iovs, chunk->iovcnt,
+						 base_offset_blocks, chunk->req_blocks,
+						 raid5f_chunk_complete_bdev_io, chunk,
+						 &chunk->ext_opts);
+		break;
+	case STRIPE_REQ_PARTIAL_WRITE:
+		if (stripe_req->partial.writing) {
+			if (base_ch == NULL || chunk->req_blocks == 0) {
+				raid5f_stripe_request_chunks_complete(stripe_req, 1, SPDK_BDEV_IO_STATUS_SUCCESS);
+				return 0;
+			}
+
+			ret = raid_bdev_writev_blocks_ext(base_info, base_ch, chunk->iovs, chunk->iovcnt,
+							  base_offset_blocks + chunk->req_offset, chunk->req_blocks,
+							  raid5f_chunk_complete_bdev_io, chunk,
+							  &chunk->ext_opts);
+			break;
+		}
+
+		if (!raid5f_partial_write_chunk_needs_read(stripe_req, chunk, &offset, &num_blocks)) {
+			return 0;
+		}
+
+		/* Old contents are read into the request's own buffers, aligned to the written rows */
+		chunk->old_iovs[0].iov_base = stripe_req->partial.chunk_buffers[chunk->index] +
+					      ((offset - stripe_req->partial.row_offset) << raid_bdev->blocklen_shift);
+		chunk->old_iovs[0].iov_len = num_blocks << raid_bdev->blocklen_shift;
+		chunk->old_iovcnt = 1;
+
+		chunk->ext_opts.memory_domain = NULL;
+		chunk->ext_opts.memory_domain_ctx = NULL;
+		chunk->ext_opts.metadata = NULL;
+		if (raid_io->md_buf) {
+			chunk->ext_opts.metadata = stripe_req->partial.chunk_md_buffers[chunk->index] +
+						   (offset - stripe_req->partial.row_offset) *
+						   spdk_bdev_get_md_size(&raid_bdev->bdev);
+		}
+
+		ret = raid_bdev_readv_blocks_ext(base_info, base_ch, chunk->old_iovs, chunk->old_iovcnt,
+						 base_offset_blocks + offset, num_blocks,
+						 raid5f_chunk_complete_bdev_io, chunk,
+						 &chunk->ext_opts);
+		break;
+	default:
+		assert(false);
+		ret = -EINVAL;
+		break;
+	}
+
+	if (spdk_unlikely(ret)) {
+		raid_io->base_bdev_io_submitted--;
+		if (ret == -ENOMEM) {
+		  //		  SPDK_ERRLOG("read returned ENOMEM in reconstruct, chunk->index is %d\n", chunk->index);
+
+			raid5f_queue_io_wait(raid_io, base_info, base_ch, raid5f_chunk_submit_retry);
+		} else {
+			/*
+			 * Implicitly complete any I/Os not yet submitted as FAILED. If completing
+			 * these means there are no more to complete for the stripe request, we can
+			 * release the stripe request as well.
+			 */
+			uint64_t base_bdev_io_not_submitted;
+
+			base_bdev_io_not_submitted = raid5f_stripe_request_chunks_pending(stripe_req, chunk);
+
+			raid5f_stripe_request_chunks_complete(stripe_req, base_bdev_io_not_submitted,
+							      SPDK_BDEV_IO_STATUS_FAILED);
+		}
+	}
+
+	return ret;
+}
+
+static int
+raid5f_chunk_set_iovcnt(struct chunk *chunk, int iovcnt)
+{
+	if (iovcnt > chunk->iovcnt_max) {
+		struct iovec *iovs = chunk->iovs;
+
+		iovs = realloc(iovs, iovcnt * sizeof(*iovs));
+		if (!iovs) {
+			return -ENOMEM;
+		}
+		chunk->iovs = iovs;
+		chunk->iovcnt_max = iovcnt;
+	}
+	chunk->iovcnt = iovcnt;
+
+	return 0;
+}
+
+static int
+raid5f_stripe_request_map_iovecs(struct stripe_request *stripe_req)
+{
+	struct raid_bdev *raid_bdev = stripe_req->raid_io->raid_bdev;
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	const struct iovec *raid_io_iovs = raid_io->iovs;
+	int raid_io_iovcnt = raid_io->iovcnt;
+	void *raid_io_md = raid_io->md_buf;
+	uint32_t raid_io_md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	struct chunk *chunk;
+	int raid_io_iov_idx = 0;
+	size_t raid_io_offset = 0;
+	size_t raid_io_iov_offset = 0;
+	int i;
+
+	FOR_EACH_DATA_CHUNK(stripe_req, chunk) {
+		int chunk_iovcnt = 0;
+		uint64_t len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+		size_t off = raid_io_iov_offset;
+		int ret;
+
+		for (i = raid_io_iov_idx; i < raid_io_iovcnt; i++) {
+			chunk_iovcnt++;
+			off += raid_io_iovs[i].iov_len;
+			if (off >= raid_io_offset + len) {
+				break;
+			}
+		}
+
+		assert(raid_io_iov_idx + chunk_iovcnt <= raid_io_iovcnt);
+
+		ret = raid5f_chunk_set_iovcnt(chunk, chunk_iovcnt);
+		if (ret) {
+			return ret;
+		}
+
+		if (raid_io_md) {
+			chunk->md_buf = raid_io_md +
+					(raid_io_offset >> raid_bdev->blocklen_shift) * raid_io_md_size;
+		}
+
+		for (i = 0; i < chunk_iovcnt; i++) {
+			struct iovec *chunk_iov = &chunk->iovs[i];
+			const struct iovec *raid_io_iov = &raid_io_iovs[raid_io_iov_idx];
+			size_t chunk_iov_offset = raid_io_offset - raid_io_iov_offset;
+
+			chunk_iov->iov_base = raid_io_iov->iov_base + chunk_iov_offset;
+			chunk_iov->iov_len = spdk_min(len, raid_io_iov->iov_len - chunk_iov_offset);
+			raid_io_offset += chunk_iov->iov_len;
+			len -= chunk_iov->iov_len;
+
+			if (raid_io_offset >= raid_io_iov_offset + raid_io_iov->iov_len) {
+				raid_io_iov_idx++;
+				raid_io_iov_offset += raid_io_iov->iov_len;
+			}
+		}
+
+		if (spdk_unlikely(len > 0)) {
+			return -EINVAL;
+		}
+
+		chunk->req_offset = 0;
+		chunk->req_blocks = raid_bdev->strip_size;
+	}
+
+	stripe_req->parity_chunk->iovs[0].iov_base = stripe_req->write.parity_buf;
+	stripe_req->parity_chunk->iovs[0].iov_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+	stripe_req->parity_chunk->iovcnt = 1;
+	stripe_req->parity_chunk->md_buf = stripe_req->write.parity_md_buf;
+	stripe_req->parity_chunk->req_offset = 0;
+	stripe_req->parity_chunk->req_blocks = raid_bdev->strip_size;
+
+	return 0;
+}
+
+static void
+raid5f_stripe_request_submit_chunks(struct stripe_request *stripe_req)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct chunk *start = &stripe_req->chunks[raid_io->base_bdev_io_submitted];
+	struct chunk *chunk;
+
+	FOR_EACH_CHUNK_FROM(stripe_req, chunk, start) {
+		if (chunk == stripe_req->parity_chunk && stripe_req->type == STRIPE_REQ_WRITE &&
+		    stripe_req->write.parity_deferred) {
+			raid_io->base_bdev_io_submitted++;
+			continue;
+		}
+
+		if (spdk_unlikely(raid5f_chunk_submit(chunk) != 0)) {
+			break;
+		}
+	}
+}
+
+static inline void
+raid5f_stripe_request_init(struct stripe_request *stripe_req, struct raid_bdev_io *raid_io,
+			   uint64_t stripe_index)
+{
+	stripe_req->raid_io = raid_io;
+	stripe_req->stripe_index = stripe_index;
+	stripe_req->parity_chunk = &stripe_req->chunks[raid5f_stripe_parity_chunk_index(raid_io->raid_bdev,
+				   stripe_index)];
+	stripe_req->poisoned = 0;
+}
+
+/*
+ * shawgerj fault injection: each data chunk written gets a flipped bit with 0.1 percent
+ * probability, at most one per stripe. The chunk is picked before the xor and flipped after
+ * it, so the parity doesn't cover the bit and the stripe is inconsistent on the disks.
+ */
+static struct chunk *
+raid5f_stripe_poison_pick(struct stripe_request *stripe_req)
+{
+	struct chunk *chunk;
+
+	FOR_EACH_DATA_CHUNK(stripe_req, chunk) {
+		if (raid5f_base_channel(stripe_req->raid_io, chunk->index,
+					stripe_req->stripe_index) != NULL && (rand() % 1000) < 1) {
+			return chunk;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+raid5f_stripe_poison(struct stripe_request *stripe_req)
+{
+	struct chunk *chunk = stripe_req->write.poison_chunk;
+
+	if (chunk != NULL && !stripe_req->poisoned) {
+		*(char *)(chunk->iovs[0].iov_base) ^= 1; // flip bit of iov
+		stripe_req->poisoned = 1;
+	}
+}
+
+/*
+ * Check the protection information of num_blocks blocks at offset_blocks of the raid bdev,
+ * with separate metadata in md_buf if the raid bdev has it
+ */
+static int
+raid5f_verify_pi(struct raid_bdev *raid_bdev, struct iovec *iovs, int iovcnt, void *md_buf,
+		 uint64_t num_blocks, uint64_t offset_blocks)
+{
+	struct spdk_bdev *bdev = &raid_bdev->bdev;
+	struct spdk_dif_ctx_init_ext_opts dif_opts;
+	struct spdk_dif_ctx dif_ctx;
+	struct spdk_dif_error err_blk;
+	struct iovec md_iov;
+	int ret;
+
+	dif_opts.size = SPDK_SIZEOF(&dif_opts, dif_pi_format);
+	dif_opts.dif_pi_format = raid_bdev->opts.dif_pi_format;
+
+	/* Reference tags are the lower bits of the block address of the raid bdev */
+	ret = spdk_dif_ctx_init(&dif_ctx, bdev->blocklen, bdev->md_len, bdev->md_interleave,
+				bdev->dif_is_head_of_md, bdev->dif_type, bdev->dif_check_flags,
+				offset_blocks, 0, 0, 0, 0, &dif_opts);
+	if (ret != 0) {
+		return ret;
+	}
+
+	if (bdev->md_interleave) {
+		return spdk_dif_verify(iovs, iovcnt, num_blocks, &dif_ctx, &err_blk);
+	}
+
+	md_iov.iov_base = md_buf;
+	md_iov.iov_len = num_blocks * bdev->md_len;
+
+	return spdk_dix_verify(iovs, iovcnt, &md_iov, num_blocks, &dif_ctx, &err_blk);
+}
+
+/*
+ * Repairs run in the background after a read or the scrubber found a stripe range whose
+ * chunks don't match. Under the stripe lock, the range is read again from all members. If
+ * the stripe is consistent now, the mismatch was transient or raced with a write and nothing
+ * is done. Otherwise a chunk is rewritten with the xor of all other members: the data chunk
+ * queued if the read identified it as bad, else the only data chunk whose protection
+ * information or checksum doesn't match, else the parity. Only a few repairs per channel run
+ * at a time, so they can't take all stripe requests from foreground I/O.
+ */
+static void
+raid5f_repair_done(struct raid5f_repair *repair, bool repaired)
+{
+	struct raid_bdev *raid_bdev = repair->raid_io.raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_io_channel *r5ch = repair->stripe_req->r5ch;
+	uint8_t p_idx = raid5f_stripe_parity_chunk_index(raid_bdev, repair->stripe_index);
+	bool parity = repair->chunk_idx == p_idx;
+
+	raid5f_mismatch_record(r5ch, repair->stripe_index, repair->chunk_idx, RAID5F_MISMATCH_SRC_REPAIR,
+			       repair->failed ? RAID5F_MISMATCH_REPAIR_FAILED :
+			       !repaired ? RAID5F_MISMATCH_TRANSIENT :
+			       parity ? RAID5F_MISMATCH_PARITY_REWRITTEN :
+			       RAID5F_MISMATCH_REPAIRED);
+
+	if (repair->failed) {
+		__atomic_fetch_add(&r5f_info->repair_stats.failed, 1, __ATOMIC_RELAXED);
+		SPDK_ERRLOG("Failed to repair stripe %" PRIu64 " of raid bdev %s\n",
+			    repair->stripe_index, raid_bdev->bdev.name);
+	} else if (repaired) {
+		__atomic_fetch_add(&r5f_info->repair_stats.repaired, 1, __ATOMIC_RELAXED);
+		if (r5f_info->csum != NULL && !parity) {
+			raid5f_csum_update(r5f_info->csum, repair->chunk_idx, repair->stripe_index,
+					   0);
+		}
+		SPDK_NOTICELOG("Repaired blocks %" PRIu64 "-%" PRIu64 " of chunk %u of stripe %" PRIu64
+			       " of raid bdev %s\n", repair->offset, repair->offset + repair->num_blocks - 1,
+			       repair->chunk_idx, repair->stripe_index, raid_bdev->bdev.name);
+	} else {
+		__atomic_fetch_add(&r5f_info->repair_stats.consistent, 1, __ATOMIC_RELAXED);
+	}
+
+	r5ch->repairs_active--;
+	raid5f_stripe_request_release(repair->stripe_req);
+
+	spdk_put_io_channel(repair->ch);
+	free(repair);
+}
+
+/* Separate metadata buffers of the chunks, NULL if the raid bdev has none */
+static inline void **
+raid5f_repair_md_buffers(struct raid5f_repair *repair)
+{
+	if (!spdk_bdev_is_md_separate(&repair->raid_io.raid_bdev->bdev)) {
+		return NULL;
+	}
+
+	return repair->stripe_req->partial.chunk_md_buffers;
+}
+
+static void
+raid5f_repair_write_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_repair *repair = cb_arg;
+
+	spdk_bdev_free_io(bdev_io);
+
+	if (!success) {
+		repair->failed = true;
+	}
+
+	raid5f_repair_done(repair, true);
+}
+
+static void
+_raid5f_repair_write(void *_raid_io)
+{
+	struct raid5f_repair *repair = SPDK_CONTAINEROF(_raid_io, struct raid5f_repair, raid_io);
+	struct stripe_request *stripe_req = repair->stripe_req;
+	struct raid_bdev *raid_bdev = repair->raid_io.raid_bdev;
+	struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[repair->chunk_idx];
+	struct spdk_io_channel *base_ch = raid5f_base_channel(&repair->raid_io, repair->chunk_idx,
+					  repair->stripe_index);
+	struct chunk *chunk = &stripe_req->chunks[repair->chunk_idx];
+	void **md_bufs = raid5f_repair_md_buffers(repair);
+	int ret;
+
+	if (base_ch == NULL) {
+		repair->failed = true;
+		raid5f_repair_done(repair, false);
+		return;
+	}
+
+	memset(&chunk->ext_opts, 0, sizeof(chunk->ext_opts));
+	chunk->ext_opts.size = sizeof(chunk->ext_opts);
+	if (md_bufs) {
+		chunk->ext_opts.metadata = md_bufs[repair->chunk_idx];
+	}
+
+	chunk->old_iovs[0].iov_base = stripe_req->partial.chunk_buffers[repair->chunk_idx];
+	chunk->old_iovs[0].iov_len = repair->num_blocks << raid_bdev->blocklen_shift;
+
+	ret = raid_bdev_writev_blocks_ext(base_info, base_ch, chunk->old_iovs, 1,
+					  (repair->stripe_index << raid_bdev->strip_size_shift) + repair->offset,
+					  repair->num_blocks, raid5f_repair_write_complete, repair,
+					  &chunk->ext_opts);
+	if (spdk_unlikely(ret == -ENOMEM)) {
+		raid5f_queue_io_wait(&repair->raid_io, base_info, base_ch, _raid5f_repair_write);
+	} else if (spdk_unlikely(ret != 0)) {
+		repair->failed = true;
+		raid5f_repair_done(repair, false);
+	}
+}
+
+/* Check a data chunk read for the repair with its protection information and checksum */
+static bool
+raid5f_repair_chunk_bad(struct raid5f_repair *repair, uint8_t idx)
+{
+	struct raid_bdev *raid_bdev = repair->raid_io.raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	void **md_bufs = raid5f_repair_md_buffers(repair);
+	void *md_buf = md_bufs ? md_bufs[idx] : NULL;
+	uint8_t data_idx = raid5f_stripe_chunk_data_index(raid_bdev, repair->stripe_index, idx);
+	uint64_t offset_blocks = repair->stripe_index * r5f_info->stripe_blocks + repair->offset +
+				 ((uint64_t)data_idx << raid_bdev->strip_size_shift);
+	struct iovec iov;
+	uint32_t value;
+
+	iov.iov_base = repair->stripe_req->partial.chunk_buffers[idx];
+	iov.iov_len = repair->num_blocks << raid_bdev->blocklen_shift;
+
+	if (raid_bdev->bdev.dif_type != SPDK_DIF_DISABLE &&
+	    raid5f_verify_pi(raid_bdev, &iov, 1, md_buf, repair->num_blocks, offset_blocks) != 0) {
+		return true;
+	}
+
+	/* Checksums cover whole chunks */
+	if (r5f_info->csum == NULL || repair->offset != 0 ||
+	    repair->num_blocks != raid_bdev->strip_size ||
+	    !raid5f_csum_lookup(r5f_info->csum, idx, repair->stripe_index, &value)) {
+		return false;
+	}
+
+	return raid5f_csum_calc(&iov, 1, md_buf, md_buf ? repair->num_blocks *
+				spdk_bdev_get_md_size(&raid_bdev->bdev) : 0) != value;
+}
+
+/*
+ * Get the data chunk to rewrite instead of the parity, the only one which is bad. Returns the
+ * parity chunk if none is and RAID5F_MISMATCH_NO_MEMBER if more than one is.
+ */
+static uint8_t
+raid5f_repair_find_bad_chunk(struct raid5f_repair *repair)
+{
+	struct raid_bdev *raid_bdev = repair->raid_io.raid_bdev;
+	uint8_t p_idx = raid5f_stripe_parity_chunk_index(raid_bdev, repair->stripe_index);
+	uint8_t bad_idx = p_idx;
+	uint8_t i;
+
+	for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+		if (i == p_idx || !raid5f_repair_chunk_bad(repair, i)) {
+			continue;
+		}
+		if (bad_idx != p_idx) {
+			return RAID5F_MISMATCH_NO_MEMBER;
+		}
+		bad_idx = i;
+	}
+
+	return bad_idx;
+}
+
+static void
+raid5f_repair_reads_done(struct raid5f_repair *repair)
+{
+	struct stripe_request *stripe_req = repair->stripe_req;
+	struct raid_bdev *raid_bdev = repair->raid_io.raid_bdev;
+	void **bufs = stripe_req->partial.chunk_buffers;
+	void **md_bufs = raid5f_repair_md_buffers(repair);
+	size_t len = repair->num_blocks << raid_bdev->blocklen_shift;
+	size_t md_len = repair->num_blocks * spdk_bdev_get_md_size(&raid_bdev->bdev);
+	uint8_t p_idx = raid5f_stripe_parity_chunk_index(raid_bdev, repair->stripe_index);
+	void *srcs[2];
+	bool consistent;
+
+	if (repair->failed) {
+		raid5f_repair_done(repair, false);
+		return;
+	}
+
+	raid5f_xor_gen(stripe_req->partial.parity_buf, bufs, raid_bdev->num_base_bdevs, len);
+	consistent = spdk_mem_all_zero(stripe_req->partial.parity_buf, len);
+
+	if (md_bufs) {
+		raid5f_xor_gen(stripe_req->partial.parity_md_buf, md_bufs, raid_bdev->num_base_bdevs, md_len);
+		consistent = consistent && spdk_mem_all_zero(stripe_req->partial.parity_md_buf, md_len);
+	}
+
+	if (consistent) {
+		raid5f_repair_done(repair, false);
+		return;
+	}
+
+	/* Without a chunk identified as bad by the read, the parity is rewritten */
+	if (repair->chunk_idx == p_idx) {
+		repair->chunk_idx = raid5f_repair_find_bad_chunk(repair);
+		if (repair->chunk_idx == RAID5F_MISMATCH_NO_MEMBER) {
+			SPDK_ERRLOG("More than one data chunk of stripe %" PRIu64
+				    " of raid bdev %s is bad\n", repair->stripe_index,
+				    raid_bdev->bdev.name);
+			repair->failed = true;
+			raid5f_repair_done(repair, false);
+			return;
+		}
+	}
+
+	/* The xor of all chunks xor-ed with the bad chunk is the xor of all the others */
+	srcs[0] = bufs[repair->chunk_idx];
+	srcs[1] = stripe_req->partial.parity_buf;
+	raid5f_xor_gen(bufs[repair->chunk_idx], srcs, 2, len);
+
+	if (md_bufs) {
+		srcs[0] = md_bufs[repair->chunk_idx];
+		srcs[1] = stripe_req->partial.parity_md_buf;
+		raid5f_xor_gen(md_bufs[repair->chunk_idx], srcs, 2, md_len);
+	}
+
+	_raid5f_repair_write(&repair->raid_io);
+}
+
+static void
+raid5f_repair_read_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_repair *repair = cb_arg;
+
+	spdk_bdev_free_io(bdev_io);
+
+	if (!success) {
+		repair->failed = true;
+	}
+
+	assert(repair->remaining > 0);
+	if (--repair->remaining == 0) {
+		raid5f_repair_reads_done(repair);
+	}
+}
+
+static void
+_raid5f_repair_read(void *_raid_io)
+{
+	struct raid5f_repair *repair = SPDK_CONTAINEROF(_raid_io, struct raid5f_repair, raid_io);
+	struct stripe_request *stripe_req = repair->stripe_req;
+	struct raid_bdev *raid_bdev = repair->raid_io.raid_bdev;
+	void **md_bufs = raid5f_repair_md_buffers(repair);
+	struct raid_base_bdev_info *base_info;
+	struct spdk_io_channel *base_ch;
+	struct chunk *chunk;
+	int ret;
+
+	while (repair->next_read < raid_bdev->num_base_bdevs) {
+		chunk = &stripe_req->chunks[repair->next_read];
+		base_info = &raid_bdev->base_bdev_info[chunk->index];
+		base_ch = raid5f_base_channel(&repair->raid_io, chunk->index, repair->stripe_index);
+
+		memset(&chunk->ext_opts, 0, sizeof(chunk->ext_opts));
+		chunk->ext_opts.size = sizeof(chunk->ext_opts);
+		if (md_bufs) {
+			chunk->ext_opts.metadata = md_bufs[chunk->index];
+		}
+
+		chunk->old_iovs[0].iov_base = stripe_req->partial.chunk_buffers[chunk->index];
+		chunk->old_iovs[0].iov_len = repair->num_blocks << raid_bdev->blocklen_shift;
+
+		/* The stripe can't be repaired without all members */
+		if (base_ch == NULL) {
+			ret = -ENODEV;
+		} else {
+			ret = raid_bdev_readv_blocks_ext(base_info, base_ch, chunk->old_iovs, 1,
+							 (repair->stripe_index << raid_bdev->strip_size_shift) +
+							 repair->offset, repair->num_blocks,
+							 raid5f_repair_read_complete, repair, &chunk->ext_opts);
+		}
+
+		if (spdk_unlikely(ret == -ENOMEM)) {
+			raid5f_queue_io_wait(&repair->raid_io, base_info, base_ch, _raid5f_repair_read);
+			return;
+		}
+
+		repair->next_read++;
+
+		if (spdk_unlikely(ret != 0)) {
+			repair->failed = true;
+			if (--repair->remaining == 0) {
+				raid5f_repair_reads_done(repair);
+				return;
+			}
+		}
+	}
+}
+
+static void
+raid5f_repair_stripe_locked(struct stripe_request *stripe_req)
+{
+	struct raid5f_repair *repair = SPDK_CONTAINEROF(stripe_req->raid_io, struct raid5f_repair,
+				       raid_io);
+
+	repair->next_read = 0;
+	repair->remaining = repair->raid_io.raid_bdev->num_base_bdevs;
+
+	_raid5f_repair_read(&repair->raid_io);
+}
+
+/* Start queued repairs while there are free slots and partial write requests */
+static void
+raid5f_repair_kick(struct raid5f_io_channel *r5ch)
+{
+	struct raid5f_repair *repair;
+	struct stripe_request *stripe_req;
+
+	while (r5ch->repairs_active < RAID5F_MAX_REPAIRS) {
+		/* Repairs are background work, they don't grow the pool */
+		repair = TAILQ_FIRST(&r5ch->repair_queue);
+		stripe_req = TAILQ_FIRST(&r5ch->stripe_pools[STRIPE_REQ_PARTIAL_WRITE].free);
+		if (repair == NULL || stripe_req == NULL) {
+			break;
+		}
+
+		TAILQ_REMOVE(&r5ch->repair_queue, repair, link);
+		r5ch->repairs_queued--;
+		raid5f_stripe_request_take(stripe_req);
+		r5ch->repairs_active++;
+
+		raid5f_stripe_request_init(stripe_req, &repair->raid_io, repair->stripe_index);
+		repair->stripe_req = stripe_req;
+
+		if (raid5f_stripe_lock(stripe_req, raid5f_repair_stripe_locked)) {
+			raid5f_repair_stripe_locked(stripe_req);
+		}
+	}
+}
+
+/*
+ * Queue a repair of a chunk range of a stripe on the current thread's channel. Returns 0
+ * if the repair is queued or already was, a negative errno if it is dropped.
+ */
+static int
+raid5f_repair_queue(struct raid_bdev_io_channel *raid_ch, uint64_t stripe_index,
+		    uint8_t chunk_idx, uint64_t offset, uint64_t num_blocks)
+{
+	struct spdk_io_channel *ch = spdk_io_channel_from_ctx(raid_ch);
+	struct raid_bdev *raid_bdev = spdk_io_channel_get_io_device(ch);
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_ch->module_channel);
+	uint8_t p_idx = raid5f_stripe_parity_chunk_index(raid_bdev, stripe_index);
+	struct raid5f_repair *repair;
+
+	TAILQ_FOREACH(repair, &r5ch->repair_queue, link) {
+		if (repair->stripe_index != stripe_index) {
+			continue;
+		}
+		if (repair->chunk_idx == chunk_idx && repair->offset <= offset &&
+		    repair->offset + repair->num_blocks >= offset + num_blocks) {
+			return 0;
+		}
+		/* A data chunk found bad is rewritten instead of the parity of the same range */
+		if (repair->offset == offset && repair->num_blocks == num_blocks &&
+		    (repair->chunk_idx == p_idx || chunk_idx == p_idx)) {
+			if (chunk_idx != p_idx) {
+				repair->chunk_idx = chunk_idx;
+			}
+			return 0;
+		}
+	}
+
+	if (r5ch->repairs_queued >= RAID5F_REPAIR_QUEUE_MAX) {
+		__atomic_fetch_add(&r5f_info->repair_stats.dropped, 1, __ATOMIC_RELAXED);
+		return -EBUSY;
+	}
+
+	repair = calloc(1, sizeof(*repair));
+	if (!repair) {
+		__atomic_fetch_add(&r5f_info->repair_stats.dropped, 1, __ATOMIC_RELAXED);
+		return -ENOMEM;
+	}
+
+	/* Keep the channel until the repair is done */
+	repair->ch = spdk_get_io_channel(raid_bdev);
+	if (!repair->ch) {
+		__atomic_fetch_add(&r5f_info->repair_stats.dropped, 1, __ATOMIC_RELAXED);
+		free(repair);
+		return -ENOMEM;
+	}
+
+	raid_bdev_io_init(&repair->raid_io, spdk_io_channel_get_ctx(repair->ch), SPDK_BDEV_IO_TYPE_WRITE,
+			  stripe_index * r5f_info->stripe_blocks, 0, NULL, 0, NULL, NULL, NULL);
+	repair->stripe_index = stripe_index;
+	repair->chunk_idx = chunk_idx;
+	repair->offset = offset;
+	repair->num_blocks = num_blocks;
+
+	TAILQ_INSERT_TAIL(&r5ch->repair_queue, repair, link);
+	r5ch->repairs_queued++;
+
+	raid5f_repair_kick(r5ch);
+
+	return 0;
+}
+
+static void
+raid5f_stripe_write_request_xor_done(struct stripe_request *stripe_req, int status)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+
+	if (status != 0) {
+		raid5f_stripe_request_release(stripe_req);
+		raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_FAILED);
+	} else {
+		raid5f_stripe_poison(stripe_req);
+		raid5f_stripe_request_submit_chunks(stripe_req);
+	}
+}
+
+static void
+raid5f_stripe_write_request_submit_parity(void *_stripe_req)
+{
+	struct stripe_request *stripe_req = _stripe_req;
+	struct chunk *chunk = stripe_req->parity_chunk;
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[chunk->index];
+	struct spdk_io_channel *base_ch = raid5f_base_channel(raid_io, chunk->index,
+					  stripe_req->stripe_index);
+	int ret;
+
+	raid5f_init_ext_io_opts(raid_io, &chunk->ext_opts);
+	chunk->ext_opts.metadata = chunk->md_buf;
+
+	ret = raid_bdev_writev_blocks_ext(base_info, base_ch, chunk->iovs, chunk->iovcnt,
+					  (stripe_req->stripe_index << raid_bdev->strip_size_shift) + chunk->req_offset,
+					  chunk->req_blocks, raid5f_chunk_complete_bdev_io, chunk,
+					  &chunk->ext_opts);
+	if (spdk_unlikely(ret)) {
+		if (ret == -ENOMEM) {
+			/* Data chunks may be waiting with raid_io's entry, use a separate one */
+			__atomic_fetch_add(&r5f_info->pool_stats.base_io_retries, 1, __ATOMIC_RELAXED);
+			stripe_req->write.parity_waitq.bdev = spdk_bdev_desc_get_bdev(base_info->desc);
+			stripe_req->write.parity_waitq.cb_fn = raid5f_stripe_write_request_submit_parity;
+			stripe_req->write.parity_waitq.cb_arg = stripe_req;
+			spdk_bdev_queue_io_wait(stripe_req->write.parity_waitq.bdev, base_ch,
+						&stripe_req->write.parity_waitq);
+		} else {
+			raid5f_stripe_request_chunks_complete(stripe_req, 1, SPDK_BDEV_IO_STATUS_FAILED);
+		}
+	}
+}
+
+static void
+raid5f_stripe_write_request_parity_xor_done(struct stripe_request *stripe_req, int status)
+{
+	if (status != 0) {
+		raid5f_stripe_request_chunks_complete(stripe_req, 1, SPDK_BDEV_IO_STATUS_FAILED);
+	} else {
+		raid5f_stripe_write_request_submit_parity(stripe_req);
+	}
+}
+
+static void
+raid5f_stripe_write_request_start(struct stripe_request *stripe_req)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+
+	raid5f_csum_stripe_write(stripe_req);
+	raid5f_stripe_clear_zero(raid5f_ch_to_r5f_info(stripe_req->r5ch), stripe_req->stripe_index);
+
+	if (raid5f_base_channel(raid_io, stripe_req->parity_chunk->index,
+				stripe_req->stripe_index) == NULL) {
+		raid5f_stripe_write_request_xor_done(stripe_req, 0);
+	} else if (stripe_req->write.poison_chunk != NULL) {
+		/* The poisoned bit must not reach the parity, calculate it before any write */
+		raid5f_xor_stripe(stripe_req, raid5f_stripe_write_request_xor_done);
+	} else {
+		/*
+		 * Data chunks don't depend on the parity, write them while the xor runs.
+		 * raid_io is not completed before the parity chunk write, so the data
+		 * buffers stay valid for the xor.
+		 */
+		stripe_req->write.parity_deferred = true;
+		raid5f_xor_stripe(stripe_req, raid5f_stripe_write_request_parity_xor_done);
+		raid5f_stripe_request_submit_chunks(stripe_req);
+	}
+}
+
+static int
+raid5f_submit_write_request(struct raid_bdev_io *raid_io, uint64_t stripe_index)
+{
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
+	struct stripe_request *stripe_req;
+	int ret;
+
+
+	stripe_req = raid5f_stripe_request_peek(r5ch, STRIPE_REQ_WRITE);
+	if (!stripe_req) {
+		return -ENOMEM;
+	}
+
+	raid5f_stripe_request_init(stripe_req, raid_io, stripe_index);
+	stripe_req->write.parity_deferred = false;
+	stripe_req->write.poison_chunk = raid5f_stripe_poison_pick(stripe_req);
+
+	ret = raid5f_stripe_request_map_iovecs(stripe_req);
+	if (spdk_unlikely(ret)) {
+		return ret;
+	}
+
+	raid5f_stripe_request_take(stripe_req);
+
+	raid_io->module_private = stripe_req;
+	raid_io->base_bdev_io_remaining = raid_bdev->num_base_bdevs;
+
+	if (raid5f_stripe_lock(stripe_req, raid5f_stripe_write_request_start)) {
+		raid5f_stripe_write_request_start(stripe_req);
+	}
+
+	return 0;
+}
+
+static void
+raid5f_partial_write_fail(struct stripe_request *stripe_req)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+
+	raid5f_stripe_request_release(stripe_req);
+	raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_FAILED);
+}
+
+static void
+raid5f_partial_write_submit_writes(struct stripe_request *stripe_req)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+
+	stripe_req->partial.writing = true;
+	raid_io->base_bdev_io_status = SPDK_BDEV_IO_STATUS_SUCCESS;
+	raid_io->base_bdev_io_remaining = raid_io->raid_bdev->num_base_bdevs;
+	raid_io->base_bdev_io_submitted = 0;
+
+	raid5f_stripe_request_submit_chunks(stripe_req);
+}
+
+static void
+raid5f_partial_write_parity_xor_done(struct stripe_request *stripe_req, int status)
+{
+	if (status != 0) {
+		raid5f_partial_write_fail(stripe_req);
+	} else {
+		raid5f_partial_write_submit_writes(stripe_req);
+	}
+}
+
+/*
+ * Build the chunk's old contents over the written rows for read-modify-write, padding
+ * the part that is not written with zeroes so it drops out of the parity update.
+ */
+static void
+raid5f_partial_write_chunk_old_rmw(struct stripe_request *stripe_req, struct chunk *chunk)
+{
+	struct raid_bdev *raid_bdev = stripe_req->raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	uint32_t blocklen_shift = raid_bdev->blocklen_shift;
+	uint64_t head = chunk->req_offset - stripe_req->partial.row_offset;
+	uint64_t tail = stripe_req->partial.row_blocks - head - chunk->req_blocks;
+	void *old_buf = stripe_req->partial.chunk_buffers[chunk->index];
+
+	chunk->old_iovcnt = 0;
+	if (head > 0) {
+		chunk->old_iovs[chunk->old_iovcnt].iov_base = r5f_info->zero_buf;
+		chunk->old_iovs[chunk->old_iovcnt].iov_len = head << blocklen_shift;
+		chunk->old_iovcnt++;
+	}
+	chunk->old_iovs[chunk->old_iovcnt].iov_base = old_buf + (head << blocklen_shift);
+	chunk->old_iovs[chunk->old_iovcnt].iov_len = chunk->req_blocks << blocklen_shift;
+	chunk->old_iovcnt++;
+	if (tail > 0) {
+		chunk->old_iovs[chunk->old_iovcnt].iov_base = r5f_info->zero_buf;
+		chunk->old_iovs[chunk->old_iovcnt].iov_len = tail << blocklen_shift;
+		chunk->old_iovcnt++;
+	}
+}
+
+/*
+ * Build the chunk's new contents over the written rows. The part that is not written
+ * is taken from pad, which is either the zero buffer (read-modify-write) or the chunk's
+ * old data (reconstruct-write).
+ */
+static int
+raid5f_partial_write_chunk_new(struct stripe_request *stripe_req, struct chunk *chunk,
+			       void *pad, bool pad_is_old_data)
+{
+	struct raid_bdev *raid_bdev = stripe_req->raid_io->raid_bdev;
+	uint32_t blocklen_shift = raid_bdev->blocklen_shift;
+	uint64_t head = chunk->req_offset - stripe_req->partial.row_offset;
+	uint64_t tail = stripe_req->partial.row_blocks - head - chunk->req_blocks;
+	uint64_t tail_offset = pad_is_old_data ? head + chunk->req_blocks : 0;
+	int ret;
+	int i;
+
+	chunk->new_iovcnt = 0;
+
+	if (chunk->req_blocks == 0) {
+		return raid5f_iovs_append(&chunk->new_iovs, &chunk->new_iovcnt, &chunk->new_iovcnt_max,
+					  pad, stripe_req->partial.row_blocks << blocklen_shift);
+	}
+
+	ret = raid5f_iovs_append(&chunk->new_iovs, &chunk->new_iovcnt, &chunk->new_iovcnt_max,
+				 pad, head << blocklen_shift);
+	for (i = 0; ret == 0 && i < chunk->iovcnt; i++) {
+		ret = raid5f_iovs_append(&chunk->new_iovs, &chunk->new_iovcnt, &chunk->new_iovcnt_max,
+					 chunk->iovs[i].iov_base, chunk->iovs[i].iov_len);
+	}
+	if (ret == 0) {
+		ret = raid5f_iovs_append(&chunk->new_iovs, &chunk->new_iovcnt, &chunk->new_iovcnt_max,
+					 pad + (tail_offset << blocklen_shift), tail << blocklen_shift);
+	}
+
+	return ret;
+}
+
+static void
+raid5f_partial_write_parity(struct stripe_request *stripe_req)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
+	struct chunk *parity_chunk = stripe_req->parity_chunk;
+	uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	bool has_md = raid_io->md_buf != NULL;
+	uint64_t row_blocks = stripe_req->partial.row_blocks;
+	struct chunk *chunk;
+	uint32_t n_src = 0;
+	int ret;
+
+	if (stripe_req->partial.skip_parity) {
+		raid5f_partial_write_submit_writes(stripe_req);
+		return;
+	}
+
+	if (stripe_req->partial.mode == PARTIAL_WRITE_RMW) {
+		/* new parity = old parity ^ old data ^ new data */
+		parity_chunk->old_iovs[0].iov_base = stripe_req->partial.chunk_buffers[parity_chunk->index];
+		parity_chunk->old_iovs[0].iov_len = row_blocks << raid_bdev->blocklen_shift;
+		parity_chunk->old_iovcnt = 1;
+		r5ch->chunk_xor_iovs[n_src] = parity_chunk->old_iovs;
+		r5ch->chunk_xor_iovcnt[n_src] = parity_chunk->old_iovcnt;
+		stripe_req->chunk_xor_md_buffers[n_src] = stripe_req->partial.chunk_md_buffers[parity_chunk->index];
+		n_src++;
+
+		FOR_EACH_DATA_CHUNK(stripe_req, chunk) {
+			uint64_t head, tail;
+			void *old_md, *new_md;
+
+			if (chunk->req_blocks == 0) {
+				continue;
+			}
+
+			raid5f_partial_write_chunk_old_rmw(stripe_req, chunk);
+			ret = raid5f_partial_write_chunk_new(stripe_req, chunk, r5f_info->zero_buf, false);
+			if (spdk_unlikely(ret)) {
+				raid5f_partial_write_fail(stripe_req);
+				return;
+			}
+
+			r5ch->chunk_xor_iovs[n_src] = chunk->old_iovs;
+			r5ch->chunk_xor_iovcnt[n_src] = chunk->old_iovcnt;
+			r5ch->chunk_xor_iovs[n_src + 1] = chunk->new_iovs;
+			r5ch->chunk_xor_iovcnt[n_src + 1] = chunk->new_iovcnt;
+
+			if (has_md) {
+				head = chunk->req_offset - stripe_req->partial.row_offset;
+				tail = row_blocks - head - chunk->req_blocks;
+				old_md = stripe_req->partial.chunk_md_buffers[chunk->index];
+				new_md = stripe_req->partial.chunk_new_md_buffers[chunk->index];
+
+				memset(old_md, 0, head * md_size);
+				memset(old_md + (head + chunk->req_blocks) * md_size, 0, tail * md_size);
+				memset(new_md, 0, row_blocks * md_size);
+				memcpy(new_md + head * md_size, chunk->md_buf, chunk->req_blocks * md_size);
+
+				stripe_req->chunk_xor_md_buffers[n_src] = old_md;
+				stripe_req->chunk_xor_md_buffers[n_src + 1] = new_md;
+			}
+
+			n_src += 2;
+		}
+	} else {
+		/* new parity = xor of new contents of all data chunks */
+		FOR_EACH_DATA_CHUNK(stripe_req, chunk) {
+			void *old_buf = stripe_req->partial.chunk_buffers[chunk->index];
+			void *old_md = stripe_req->partial.chunk_md_buffers ?
+				       stripe_req->partial.chunk_md_buffers[chunk->index] : NULL;
+			uint64_t head = chunk->req_offset - stripe_req->partial.row_offset;
+
+			ret = raid5f_partial_write_chunk_new(stripe_req, chunk, old_buf, true);
+			if (spdk_unlikely(ret)) {
+				raid5f_partial_write_fail(stripe_req);
+				return;
+			}
+
+			r5ch->chunk_xor_iovs[n_src] = chunk->new_iovs;
+			r5ch->chunk_xor_iovcnt[n_src] = chunk->new_iovcnt;
+
+			if (has_md) {
+				if (chunk->req_blocks == row_blocks) {
+					stripe_req->chunk_xor_md_buffers[n_src] = chunk->md_buf;
+				} else {
+					if (chunk->req_blocks > 0) {
+						memcpy(old_md + head * md_size, chunk->md_buf,
+						       chunk->req_blocks * md_size);
+					}
+					stripe_req->chunk_xor_md_buffers[n_src] = old_md;
+				}
+			}
+
+			n_src++;
+		}
+	}
+
+	r5ch->chunk_xor_iovs[n_src] = parity_chunk->iovs;
+	r5ch->chunk_xor_iovcnt[n_src] = parity_chunk->iovcnt;
+
+	raid5f_xor_stripe_iovs(stripe_req, n_src, row_blocks, has_md ? parity_chunk->md_buf : NULL,
+			       raid5f_partial_write_parity_xor_done);
+}
+
+static void
+raid5f_partial_write_reconstruct_xor_done(struct stripe_request *stripe_req, int status)
+{
+	if (status != 0) {
+		raid5f_partial_write_fail(stripe_req);
+	} else {
+		raid5f_partial_write_parity(stripe_req);
+	}
+}
+
+/* Reconstruct the old contents of a missing chunk from all the other chunks */
+static void
+raid5f_partial_write_reconstruct(struct stripe_request *stripe_req)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
+	struct chunk *dest_chunk = stripe_req->partial.reconstruct_chunk;
+	bool has_md = raid_io->md_buf != NULL;
+	struct chunk *chunk;
+	uint32_t n_src = 0;
+
+	dest_chunk->old_iovs[0].iov_base = stripe_req->partial.chunk_buffers[dest_chunk->index];
+	dest_chunk->old_iovs[0].iov_len = stripe_req->partial.row_blocks << raid_bdev->blocklen_shift;
+	dest_chunk->old_iovcnt = 1;
+
+	FOR_EACH_CHUNK(stripe_req, chunk) {
+		if (chunk == dest_chunk) {
+			continue;
+		}
+		r5ch->chunk_xor_iovs[n_src] = chunk->old_iovs;
+		r5ch->chunk_xor_iovcnt[n_src] = chunk->old_iovcnt;
+		if (has_md) {
+			stripe_req->chunk_xor_md_buffers[n_src] = stripe_req->partial.chunk_md_buffers[chunk->index];
+		}
+		n_src++;
+	}
+	r5ch->chunk_xor_iovs[n_src] = dest_chunk->old_iovs;
+	r5ch->chunk_xor_iovcnt[n_src] = dest_chunk->old_iovcnt;
+
+	raid5f_xor_stripe_iovs(stripe_req, n_src, stripe_req->partial.row_blocks,
+			       has_md ? stripe_req->partial.chunk_md_buffers[dest_chunk->index] : NULL,
+			       raid5f_partial_write_reconstruct_xor_done);
+}
+
+static void
+raid5f_partial_write_reads_done(struct stripe_request *stripe_req)
+{
+	if (stripe_req->partial.reconstruct_chunk != NULL) {
+		raid5f_partial_write_reconstruct(stripe_req);
+	} else {
+		raid5f_partial_write_parity(stripe_req);
+	}
+}
+
+static void
+raid5f_partial_write_start(struct stripe_request *stripe_req)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(stripe_req->r5ch);
+	struct chunk *chunk;
+	uint64_t reads;
+
+	/* A zeroed stripe holds zeroes with consistent parity on the base bdevs */
+	raid5f_stripe_clear_zero(r5f_info, stripe_req->stripe_index);
+
+	stripe_req->partial.writing = false;
+
+	/* Only the written range of a chunk is at hand, its checksum becomes unknown */
+	if (r5f_info->csum != NULL) {
+		FOR_EACH_DATA_CHUNK(stripe_req, chunk) {
+			if (chunk->req_blocks > 0) {
+				raid5f_csum_update(r5f_info->csum, chunk->index,
+						   stripe_req->stripe_index, 0);
+			}
+		}
+	}
+
+	reads = raid5f_stripe_request_chunks_pending(stripe_req, stripe_req->chunks);
+
+	raid_io->base_bdev_io_status = SPDK_BDEV_IO_STATUS_SUCCESS;
+	raid_io->base_bdev_io_remaining = reads;
+	raid_io->base_bdev_io_submitted = 0;
+
+	if (reads == 0) {
+		raid5f_partial_write_reads_done(stripe_req);
+	} else {
+		raid5f_stripe_request_submit_chunks(stripe_req);
+	}
+}
+
+/*
+ * Choose how to calculate parity of a partial stripe write. Read-modify-write reads
+ * the old data of the written chunks and the old parity, reconstruct-write reads the
+ * data chunks which are not fully overwritten. The one needing fewer reads is used,
+ * unless a missing base bdev rules one of them out.
+ */
+static void
+raid5f_partial_write_select_mode(struct stripe_request *stripe_req)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	uint64_t row_blocks = stripe_req->partial.row_blocks;
+	uint64_t rmw_reads = 1, rcw_reads = 0;
+	uint64_t rmw_blocks = row_blocks, rcw_blocks = 0;
+	struct chunk *missing = NULL;
+	struct chunk *chunk;
+
+	FOR_EACH_CHUNK(stripe_req, chunk) {
+		if (raid5f_base_channel(raid_io, chunk->index, stripe_req->stripe_index) == NULL) {
+			missing = chunk;
+		}
+	}
+
+	FOR_EACH_DATA_CHUNK(stripe_req, chunk) {
+		if (chunk->req_blocks > 0) {
+			rmw_reads++;
+			rmw_blocks += chunk->req_blocks;
+		}
+		if (chunk->req_blocks != row_blocks) {
+			rcw_reads++;
+			rcw_blocks += row_blocks;
+		}
+	}
+
+	stripe_req->partial.skip_parity = false;
+	stripe_req->partial.reconstruct_chunk = NULL;
+
+	if (missing == NULL) {
+		if (rcw_reads < rmw_reads || (rcw_reads == rmw_reads && rcw_blocks < rmw_blocks)) {
+			stripe_req->partial.mode = PARTIAL_WRITE_RCW;
+		} else {
+			stripe_req->partial.mode = PARTIAL_WRITE_RMW;
+		}
+	} else if (missing == stripe_req->parity_chunk) {
+		stripe_req->partial.skip_parity = true;
+	} else if (missing->req_blocks == 0) {
+		/* old data of the missing chunk is not needed for read-modify-write */
+		stripe_req->partial.mode = PARTIAL_WRITE_RMW;
+	} else {
+		stripe_req->partial.mode = PARTIAL_WRITE_RCW;
+		if (missing->req_blocks != row_blocks) {
+			stripe_req->partial.reconstruct_chunk = missing;
+		}
+	}
+}
+
+static int
+raid5f_partial_write_map_iovecs(struct stripe_request *stripe_req, uint64_t stripe_offset)
+{
+	struct raid_bdev *raid_bdev = stripe_req->raid_io->raid_bdev;
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	void *raid_io_md = raid_io->md_buf;
+	uint32_t raid_io_md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	uint64_t stripe_end = stripe_offset + raid_io->num_blocks;
+	uint64_t row_start = UINT64_MAX, row_end = 0;
+	uint64_t chunk_start = 0;
+	struct chunk *chunk;
+	int ret;
+
+	FOR_EACH_DATA_CHUNK(stripe_req, chunk) {
+		uint64_t start = spdk_max(stripe_offset, chunk_start);
+		uint64_t end = spdk_min(stripe_end, chunk_start + raid_bdev->strip_size);
+
+		chunk->iovcnt = 0;
+		chunk->md_buf = NULL;
+
+		if (start >= end) {
+			chunk->req_offset = 0;
+			chunk->req_blocks = 0;
+		} else {
+			chunk->req_offset = start - chunk_start;
+			chunk->req_blocks = end - start;
+
+			ret = raid5f_iovs_append_slice(&chunk->iovs, &chunk->iovcnt, &chunk->iovcnt_max,
+						       raid_io->iovs, raid_io->iovcnt,
+						       (start - stripe_offset) << raid_bdev->blocklen_shift,
+						       chunk->req_blocks << raid_bdev->blocklen_shift);
+			if (spdk_unlikely(ret)) {
+				return ret;
+			}
+
+			if (raid_io_md) {
+				chunk->md_buf = raid_io_md + (start - stripe_offset) * raid_io_md_size;
+			}
+
+			row_start = spdk_min(row_start, chunk->req_offset);
+			row_end = spdk_max(row_end, chunk->req_offset + chunk->req_blocks);
+		}
+
+		chunk_start += raid_bdev->strip_size;
+	}
+
+	assert(row_start < row_end);
+	stripe_req->partial.row_offset = row_start;
+	stripe_req->partial.row_blocks = row_end - row_start;
+
+	chunk = stripe_req->parity_chunk;
+	chunk->iovs[0].iov_base = stripe_req->partial.parity_buf;
+	chunk->iovs[0].iov_len = stripe_req->partial.row_blocks << raid_bdev->blocklen_shift;
+	chunk->iovcnt = 1;
+	chunk->md_buf = stripe_req->partial.parity_md_buf;
+	chunk->req_offset = stripe_req->partial.row_offset;
+	chunk->req_blocks = stripe_req->partial.row_blocks;
+
+	return 0;
+}
+
+static int
+raid5f_submit_partial_write_request(struct raid_bdev_io *raid_io, uint64_t stripe_index,
+				    uint64_t stripe_offset)
+{
+	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
+	struct stripe_request *stripe_req;
+	int ret;
+
+	stripe_req = raid5f_stripe_request_peek(r5ch, STRIPE_REQ_PARTIAL_WRITE);
+	if (!stripe_req) {
+		return -ENOMEM;
+	}
+
+	raid5f_stripe_request_init(stripe_req, raid_io, stripe_index);
+
+	ret = raid5f_partial_write_map_iovecs(stripe_req, stripe_offset);
+	if (spdk_unlikely(ret)) {
+		return ret;
+	}
+
+	raid5f_partial_write_select_mode(stripe_req);
+
+	raid5f_stripe_request_take(stripe_req);
+
+	raid_io->module_private = stripe_req;
+
+	if (raid5f_stripe_lock(stripe_req, raid5f_partial_write_start)) {
+		raid5f_partial_write_start(stripe_req);
+	}
+
+	return 0;
+}
+
+/*
+ * Read the other chunks of the stripe to reconstruct the part of the chunk being read.
+ * With verify, the chunk was read successfully and is compared with the reconstruction.
+ * With a cache entry, the whole chunk is reconstructed into it. With a hedge, the chunk
+ * is reconstructed into the verify buffers while it is still being read.
+ */
+static int
+raid5f_submit_reconstruct_read(struct raid5f_read_ctx *read_ctx, bool verify,
+			       struct raid5f_degraded_cache_entry *entry,
+			       struct raid5f_read_hedge *hedge)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
+	struct stripe_request *stripe_req;
+	struct chunk *chunk;
+	uint64_t chunk_offset = read_ctx->chunk_offset;
+	uint64_t num_blocks = read_ctx->num_blocks;
+	int buf_idx;
+	int ret;
+
+	stripe_req = raid5f_stripe_request_peek(r5ch, STRIPE_REQ_RECONSTRUCT);
+
+	if (!stripe_req) {
+		return -ENOMEM;
+	}
+
+	if (entry) {
+		chunk_offset = 0;
+		num_blocks = raid_bdev->strip_size;
+	}
+
+	ret = raid5f_reconstruct_get_buffers(stripe_req, num_blocks,
+					     (verify || hedge) && entry == NULL,
+					     read_ctx->md_buf != NULL);
+	if (ret) {
+		return ret;
+	}
+
+	raid5f_stripe_request_init(stripe_req, raid_io, read_ctx->stripe_index);
+
+	stripe_req->reconstruct.chunk = &stripe_req->chunks[read_ctx->chunk_idx];
+	stripe_req->reconstruct.chunk_offset = chunk_offset;
+	stripe_req->reconstruct.num_blocks = num_blocks;
+	stripe_req->reconstruct.read_ctx = read_ctx;
+	stripe_req->reconstruct.verify = verify;
+	stripe_req->reconstruct.cache_entry = entry;
+	stripe_req->reconstruct.hedge = hedge;
+	buf_idx = 0;
+
+	FOR_EACH_CHUNK(stripe_req, chunk) {
+		chunk->req_offset = chunk_offset;
+		chunk->req_blocks = num_blocks;
+
+		if (chunk == stripe_req->reconstruct.chunk && (verify || entry || hedge)) {
+			chunk->iovs[0].iov_base = entry ? entry->buf : stripe_req->reconstruct.verify_buf;
+			chunk->iovs[0].iov_len = num_blocks << raid_bdev->blocklen_shift;
+			chunk->iovcnt = 1;
+
+			if (read_ctx->md_buf) {
+				chunk->md_buf = entry ? entry->md_buf : stripe_req->reconstruct.verify_md_buf;
+			}
+		} else if (chunk == stripe_req->reconstruct.chunk) {
+			int i;
+
+			ret = raid5f_chunk_set_iovcnt(chunk, read_ctx->iovcnt);
+			if (ret) {
+				raid5f_reconstruct_put_buffers(stripe_req);
+				return ret;
+			}
+
+			for (i = 0; i < read_ctx->iovcnt; i++) {
+				chunk->iovs[i] = read_ctx->iovs[i];
+			}
+
+			chunk->md_buf = read_ctx->md_buf;
+		} else {
+			struct iovec *iov = &chunk->iovs[0];
+
+			iov->iov_base = stripe_req->reconstruct.chunk_buffers[buf_idx];
+			iov->iov_len = num_blocks << raid_bdev->blocklen_shift;
+			chunk->iovcnt = 1;
+
+			if (read_ctx->md_buf) {
+				chunk->md_buf = stripe_req->reconstruct.chunk_md_buffers[buf_idx];
+			}
+
+			buf_idx++;
+		}
+	}
+
+	raid_io->module_private = stripe_req;
+	raid_io->base_bdev_io_remaining = raid_bdev->num_base_bdevs;
+	raid_io->base_bdev_io_submitted = 0;
+	raid_io->base_bdev_io_status = SPDK_BDEV_IO_STATUS_SUCCESS;
+
+	raid5f_stripe_request_take(stripe_req);
+
+	if (entry) {
+		entry->stripe_index = read_ctx->stripe_index;
+		entry->chunk_idx = read_ctx->chunk_idx;
+		entry->gen = raid5f_stripe_gen(raid5f_ch_to_r5f_info(r5ch), read_ctx->stripe_index);
+		entry->md_valid = read_ctx->md_buf != NULL;
+		entry->filling = true;
+	}
+
+	raid5f_stripe_request_submit_chunks(stripe_req);
+
+	return 0;
+}
+
+/* Copy the part of a cached chunk the read needs to its buffers */
+static void
+raid5f_degraded_cache_copy(struct raid5f_read_ctx *read_ctx,
+			   struct raid5f_degraded_cache_entry *entry)
+{
+	struct raid_bdev *raid_bdev = read_ctx->raid_io->raid_bdev;
+
+	spdk_copy_buf_to_iovs(read_ctx->iovs, read_ctx->iovcnt,
+			      entry->buf + (read_ctx->chunk_offset << raid_bdev->blocklen_shift),
+			      read_ctx->num_blocks << raid_bdev->blocklen_shift);
+
+	if (read_ctx->md_buf) {
+		uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+
+		memcpy(read_ctx->md_buf, entry->md_buf + read_ctx->chunk_offset * md_size,
+		       read_ctx->num_blocks * md_size);
+	}
+}
+
+/*
+ * Look up the chunk of a degraded read in the channel's cache. Returns true if the
+ * read was served from it. Otherwise *entry is set to an entry to reconstruct the
+ * chunk into, or NULL if the chunk can't be cached now.
+ */
+static bool
+raid5f_degraded_cache_lookup(struct raid5f_read_ctx *read_ctx,
+			     struct raid5f_degraded_cache_entry **entry)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
+	struct raid5f_degraded_cache_entry *e, *victim = NULL;
+	uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+
+	*entry = NULL;
+
+	TAILQ_FOREACH(e, &r5ch->degraded_cache, link) {
+		if (e->stripe_index != read_ctx->stripe_index || e->chunk_idx != read_ctx->chunk_idx) {
+			continue;
+		}
+
+		if (e->filling) {
+			/* Being reconstructed for another read, don't duplicate it */
+			return false;
+		}
+
+		if (e->gen == raid5f_stripe_gen(r5f_info, read_ctx->stripe_index) &&
+		    (e->md_valid || read_ctx->md_buf == NULL)) {
+			raid5f_degraded_cache_copy(read_ctx, e);
+			TAILQ_REMOVE(&r5ch->degraded_cache, e, link);
+			TAILQ_INSERT_HEAD(&r5ch->degraded_cache, e, link);
+			return true;
+		}
+
+		/* Stale, reconstruct it again */
+		victim = e;
+		break;
+	}
+
+	if (victim == NULL && r5ch->degraded_cache_entries < r5ch->degraded_cache_max_entries) {
+		victim = calloc(1, sizeof(*victim));
+		if (!victim) {
+			return false;
+		}
+
+		victim->buf = spdk_dma_malloc(raid_bdev->strip_size << raid_bdev->blocklen_shift,
+					      r5f_info->buf_alignment, NULL);
+		if (md_size != 0) {
+			victim->md_buf = spdk_dma_malloc(raid_bdev->strip_size * md_size,
+							 r5f_info->buf_alignment, NULL);
+		}
+		if (!victim->buf || (md_size != 0 && !victim->md_buf)) {
+			spdk_dma_free(victim->buf);
+			spdk_dma_free(victim->md_buf);
+			free(victim);
+			return false;
+		}
+
+		r5ch->degraded_cache_entries++;
+	} else {
+		if (victim == NULL) {
+			/* Evict the least recently used entry */
+			TAILQ_FOREACH_REVERSE(e, &r5ch->degraded_cache, raid5f_degraded_cache_head, link) {
+				if (!e->filling) {
+					victim = e;
+					break;
+				}
+			}
+
+			if (victim == NULL) {
+				return false;
+			}
+		}
+
+		TAILQ_REMOVE(&r5ch->degraded_cache, victim, link);
+	}
+
+	victim->stripe_index = UINT64_MAX;
+	TAILQ_INSERT_HEAD(&r5ch->degraded_cache, victim, link);
+	*entry = victim;
+
+	return false;
+}
+
+static void
+raid5f_read_ctx_complete(struct raid5f_read_ctx *read_ctx, enum spdk_bdev_io_status status)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+
+	if (read_ctx->locked) {
+		raid5f_range_unlock(&read_ctx->lock);
+	}
+
+	free(read_ctx->slice_iovs);
+	free(read_ctx);
+
+	if (status == SPDK_BDEV_IO_STATUS_NOMEM) {
+		raid5f_io_complete_nomem(raid_io);
+	} else {
+		raid_bdev_io_complete(raid_io, status);
+	}
+}
+
+static inline struct raid5f_io_channel *
+raid5f_read_ctx_r5ch(struct raid5f_read_ctx *read_ctx)
+{
+	return spdk_io_channel_get_ctx(read_ctx->raid_io->raid_ch->module_channel);
+}
+
+static inline void
+raid5f_member_read_start(struct raid5f_io_channel *r5ch, uint8_t idx)
+{
+	r5ch->member_lat[idx].outstanding++;
+}
+
+static void
+raid5f_member_read_done(struct raid5f_io_channel *r5ch, uint8_t idx, uint64_t submit_tsc)
+{
+	struct raid5f_member_latency *lat = &r5ch->member_lat[idx];
+	uint64_t ticks = spdk_get_ticks() - submit_tsc;
+
+	assert(lat->outstanding > 0);
+	lat->outstanding--;
+
+	lat->ewma_ticks = lat->ewma_ticks == 0 ? ticks : (lat->ewma_ticks * 7 + ticks) / 8;
+	lat->hist[spdk_u64log2(spdk_max(ticks, 1))]++;
+}
+
+/* Check the protection information of the part read into the read's buffers */
+static int
+raid5f_read_ctx_verify_pi(struct raid5f_read_ctx *read_ctx)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+
+	return raid5f_verify_pi(raid_io->raid_bdev, read_ctx->iovs, read_ctx->iovcnt,
+				read_ctx->md_buf, read_ctx->num_blocks,
+				raid_io->offset_blocks + read_ctx->blocks_done);
+}
+
+static bool raid5f_wib_resync_pending(struct raid5f_info *r5f_info, uint64_t stripe_index);
+
+/*
+ * The part was read into the read's buffers. Verify it by its protection information if
+ * the raid bdev has it and against the other chunks if it has none, by policy or if the
+ * protection information doesn't match.
+ */
+static void
+raid5f_chunk_read_done(struct raid5f_read_ctx *read_ctx)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+	bool degraded = raid5f_stripe_degraded(raid_io, read_ctx->stripe_index);
+	bool resync = raid5f_wib_resync_pending(r5f_info, read_ctx->stripe_index);
+	int ret;
+
+	/* Buffers of a memory domain can't be accessed, they are only compared by the xor */
+	if (r5f_info->pi_verify && raid_io->memory_domain == NULL &&
+	    (raid_io->raid_bdev->bdev.md_interleave || read_ctx->md_buf != NULL)) {
+		if (raid5f_read_ctx_verify_pi(read_ctx) != 0) {
+			__atomic_fetch_add(&r5f_info->repair_stats.pi_errors, 1, __ATOMIC_RELAXED);
+			read_ctx->chunk_bad = true;
+			if (degraded || resync) {
+				SPDK_ERRLOG("Protection information of blocks %" PRIu64 "-%" PRIu64
+					    " of raid bdev %s doesn't match and their stripe is "
+					    "%s\n",
+					    raid_io->offset_blocks + read_ctx->blocks_done,
+					    raid_io->offset_blocks + read_ctx->blocks_done + read_ctx->num_blocks - 1,
+					    raid_io->raid_bdev->bdev.name, degraded ? "degraded" :
+					    "not resynced yet");
+				raid5f_read_ctx_complete(read_ctx, SPDK_BDEV_IO_STATUS_FAILED);
+				return;
+			}
+		} else if (!r5f_info->parity_verify) {
+			raid5f_csum_learn(read_ctx);
+			raid5f_read_ctx_part_done(read_ctx, SPDK_BDEV_IO_STATUS_SUCCESS);
+			return;
+		}
+	}
+
+	/*
+	 * Parity can't be checked without all base bdevs, nor before the resync of the
+	 * write-intent bitmap recalculated it from the data
+	 */
+	if (degraded || resync) {
+		raid5f_read_ctx_part_done(read_ctx, SPDK_BDEV_IO_STATUS_SUCCESS);
+		return;
+	}
+
+	ret = raid5f_submit_reconstruct_read(read_ctx, true, NULL, NULL);
+	if (spdk_unlikely(ret)) {
+		raid5f_read_ctx_complete(read_ctx, ret == -ENOMEM ? SPDK_BDEV_IO_STATUS_NOMEM :
+					 SPDK_BDEV_IO_STATUS_FAILED);
+	}
+}
+
+static void
+raid5f_chunk_read_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_read_ctx *read_ctx = cb_arg;
+
+	spdk_bdev_free_io(bdev_io);
+
+	raid5f_member_read_done(raid5f_read_ctx_r5ch(read_ctx), read_ctx->chunk_idx,
+				read_ctx->submit_tsc);
+
+	if (!success) {
+		raid5f_read_ctx_complete(read_ctx, SPDK_BDEV_IO_STATUS_FAILED);
+		return;
+	}
+
+	raid5f_chunk_read_done(read_ctx);
+}
+
+/* Copy the data of the part from a bounce buffer to the read's buffers */
+static void
+raid5f_read_ctx_copy_part(struct raid5f_read_ctx *read_ctx, void *buf, void *md_buf)
+{
+	struct raid_bdev *raid_bdev = read_ctx->raid_io->raid_bdev;
+
+	spdk_copy_buf_to_iovs(read_ctx->iovs, read_ctx->iovcnt, buf,
+			      read_ctx->num_blocks << raid_bdev->blocklen_shift);
+	if (read_ctx->md_buf) {
+		memcpy(read_ctx->md_buf, md_buf,
+		       read_ctx->num_blocks * spdk_bdev_get_md_size(&raid_bdev->bdev));
+	}
+}
+
+static void
+raid5f_read_hedge_free(struct raid5f_read_hedge *hedge)
+{
+	if (hedge->r5ch != NULL) {
+		raid5f_buf_put(hedge->r5ch, hedge->iov.iov_base, hedge->iov.iov_len);
+		if (hedge->md_buf) {
+			raid5f_buf_put(hedge->r5ch, hedge->md_buf, hedge->md_len);
+		}
+	} else {
+		spdk_dma_free(hedge->iov.iov_base);
+		spdk_dma_free(hedge->md_buf);
+	}
+	free(hedge);
+}
+
+static void
+raid5f_read_hedge_read_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_read_hedge *hedge = cb_arg;
+	struct raid5f_read_ctx *read_ctx = hedge->read_ctx;
+
+	spdk_bdev_free_io(bdev_io);
+
+	if (hedge->r5ch != NULL) {
+		TAILQ_REMOVE(&hedge->r5ch->hedge_reads, hedge, link);
+		raid5f_member_read_done(hedge->r5ch, hedge->chunk_idx, hedge->submit_tsc);
+	}
+	hedge->read_pending = false;
+	hedge->read_success = success;
+
+	if (read_ctx == NULL) {
+		/* The reconstruction completed the part already */
+		raid5f_read_hedge_free(hedge);
+		return;
+	}
+
+	if (hedge->hedge_pending) {
+		/* The reconstruction verifies the data or replaces it if the read failed */
+		return;
+	}
+
+	if (success) {
+		raid5f_read_ctx_copy_part(read_ctx, hedge->iov.iov_base, hedge->md_buf);
+	}
+	raid5f_read_hedge_free(hedge);
+
+	if (!success) {
+		raid5f_read_ctx_complete(read_ctx, SPDK_BDEV_IO_STATUS_FAILED);
+		return;
+	}
+
+	raid5f_chunk_read_done(read_ctx);
+}
+
+static void
+raid5f_read_hedge_reconstructed(struct stripe_request *stripe_req,
+				enum spdk_bdev_io_status status)
+{
+	struct raid5f_read_hedge *hedge = stripe_req->reconstruct.hedge;
+	struct raid5f_read_ctx *read_ctx = hedge->read_ctx;
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(stripe_req->r5ch);
+
+	hedge->hedge_pending = false;
+	stripe_req->r5ch->hedges_active--;
+	read_ctx->raid_io->module_private = read_ctx;
+
+	if (hedge->read_pending) {
+		if (status != SPDK_BDEV_IO_STATUS_SUCCESS) {
+			/* Let the read complete the part */
+			raid5f_stripe_request_release(stripe_req);
+			return;
+		}
+
+		raid5f_read_ctx_copy_part(read_ctx, stripe_req->reconstruct.verify_buf,
+					  stripe_req->reconstruct.verify_md_buf);
+		raid5f_stripe_request_release(stripe_req);
+		__atomic_fetch_add(&r5f_info->hedge_stats.wins, 1, __ATOMIC_RELAXED);
+
+		/* The read finishes in the background and frees the hedge */
+		hedge->read_ctx = NULL;
+		raid5f_read_ctx_part_done(read_ctx, SPDK_BDEV_IO_STATUS_SUCCESS);
+		return;
+	}
+
+	/* The read completed first, the reconstruction serves as its verification */
+	if (hedge->read_success) {
+		raid5f_read_ctx_copy_part(read_ctx, hedge->iov.iov_base, hedge->md_buf);
+		if (status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+			raid5f_reconstruct_verify(stripe_req);
+		}
+	} else if (status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+		raid5f_read_ctx_copy_part(read_ctx, stripe_req->reconstruct.verify_buf,
+					  stripe_req->reconstruct.verify_md_buf);
+	}
+
+	raid5f_stripe_request_release(stripe_req);
+	raid5f_read_hedge_free(hedge);
+
+	raid5f_read_ctx_part_done(read_ctx, status == SPDK_BDEV_IO_STATUS_SUCCESS ?
+				  SPDK_BDEV_IO_STATUS_SUCCESS : SPDK_BDEV_IO_STATUS_FAILED);
+}
+
+/* Start reconstructing the part of a slow read from the other base bdevs */
+static int
+raid5f_read_hedge_start(struct raid5f_read_hedge *hedge)
+{
+	struct raid5f_read_ctx *read_ctx = hedge->read_ctx;
+	struct raid5f_io_channel *r5ch = hedge->r5ch;
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(r5ch);
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	uint32_t outstanding = r5ch->member_lat[hedge->chunk_idx].outstanding;
+	uint8_t i;
+	int ret;
+
+	if (raid5f_stripe_degraded(read_ctx->raid_io, read_ctx->stripe_index)) {
+		/* The chunk can't be reconstructed, don't try again */
+		hedge->hedged = true;
+		return -ENODEV;
+	}
+
+	/* The reconstruction would wait behind the reads queued on busier base bdevs */
+	for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+		if (i != hedge->chunk_idx && r5ch->member_lat[i].outstanding > outstanding) {
+			return -EBUSY;
+		}
+	}
+
+	ret = raid5f_submit_reconstruct_read(read_ctx, false, NULL, hedge);
+	if (ret) {
+		return ret;
+	}
+
+	hedge->hedged = true;
+	hedge->hedge_pending = true;
+	r5ch->hedges_active++;
+	__atomic_fetch_add(&r5f_info->hedge_stats.hedged, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*
+ * Set the hedge threshold of each base bdev to the configured percentile of its latency
+ * histogram and publish the statistics of the channel.
+ */
+static void
+raid5f_read_hedge_update(struct raid5f_io_channel *r5ch)
+{
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(r5ch);
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	uint64_t min_ticks = spdk_get_ticks_hz() * RAID5F_READ_HEDGE_MIN_DELAY_US / SPDK_SEC_TO_USEC;
+	struct raid5f_member_latency *lat;
+	uint64_t total, target, sum;
+	uint8_t i;
+	int b;
+
+	for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+		lat = &r5ch->member_lat[i];
+
+		total = 0;
+		for (b = 0; b < RAID5F_LATENCY_HIST_BUCKETS; b++) {
+			total += lat->hist[b];
+		}
+
+		if (total >= RAID5F_READ_HEDGE_MIN_SAMPLES) {
+			target = SPDK_CEIL_DIV(total * r5f_info->read_hedge_permille, 1000);
+			sum = 0;
+			for (b = 0; b < RAID5F_LATENCY_HIST_BUCKETS - 1; b++) {
+				sum += lat->hist[b];
+				if (sum >= target) {
+					break;
+				}
+			}
+			/* Upper bound of the bucket */
+			lat->threshold_ticks = 2ULL << b;
+		} else if (lat->ewma_ticks != 0) {
+			lat->threshold_ticks = lat->ewma_ticks * RAID5F_READ_HEDGE_EWMA_FACTOR;
+		} else {
+			lat->threshold_ticks = UINT64_MAX;
+		}
+		lat->threshold_ticks = spdk_max(lat->threshold_ticks, min_ticks);
+
+		/* Decay, so that the thresholds follow changes of the latency */
+		for (b = 0; b < RAID5F_LATENCY_HIST_BUCKETS; b++) {
+			lat->hist[b] /= 2;
+		}
+
+		__atomic_store_n(&r5f_info->member_stats[i].ewma_ticks, lat->ewma_ticks,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&r5f_info->member_stats[i].threshold_ticks, lat->threshold_ticks,
+				 __ATOMIC_RELAXED);
+		__atomic_fetch_add(&r5f_info->member_stats[i].outstanding,
+				   (int64_t)lat->outstanding - lat->published_outstanding,
+				   __ATOMIC_RELAXED);
+		lat->published_outstanding = lat->outstanding;
+	}
+}
+
+static int
+raid5f_read_hedge_poll(void *ctx)
+{
+	struct raid5f_io_channel *r5ch = ctx;
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(r5ch);
+	struct raid5f_read_hedge *hedge;
+	uint64_t now = spdk_get_ticks();
+	int busy = 0;
+
+	if (now >= r5ch->hedge_update_tsc) {
+		raid5f_read_hedge_update(r5ch);
+		r5ch->hedge_update_tsc = now + RAID5F_READ_HEDGE_UPDATE_PERIOD_US *
+					 spdk_get_ticks_hz() / SPDK_SEC_TO_USEC;
+	}
+
+	if (r5f_info->read_hedge_permille == 0) {
+		return SPDK_POLLER_IDLE;
+	}
+
+	TAILQ_FOREACH(hedge, &r5ch->hedge_reads, link) {
+		if (r5ch->hedges_active >= RAID5F_READ_HEDGE_MAX_ACTIVE) {
+			break;
+		}
+
+		if (hedge->hedged ||
+		    now - hedge->submit_tsc < r5ch->member_lat[hedge->chunk_idx].threshold_ticks) {
+			continue;
+		}
+
+		if (raid5f_read_hedge_start(hedge) == 0) {
+			busy = 1;
+		}
+	}
+
+	return busy ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+/*
+ * Read the part into a bounce buffer, so that it can be hedged. Returns -EAGAIN if bounce
+ * buffers aren't available.
+ */
+static int
+raid5f_read_hedge_submit(struct raid5f_read_ctx *read_ctx, struct raid_base_bdev_info *base_info,
+			 struct spdk_io_channel *base_ch, uint64_t base_offset_blocks)
+{
+	struct raid_bdev *raid_bdev = read_ctx->raid_io->raid_bdev;
+	struct raid5f_io_channel *r5ch = raid5f_read_ctx_r5ch(read_ctx);
+	struct spdk_bdev_ext_io_opts io_opts;
+	struct raid5f_read_hedge *hedge;
+	int ret;
+
+	hedge = calloc(1, sizeof(*hedge));
+	if (!hedge) {
+		return -EAGAIN;
+	}
+
+	hedge->read_ctx = read_ctx;
+	hedge->r5ch = r5ch;
+	hedge->chunk_idx = read_ctx->chunk_idx;
+	hedge->iov.iov_len = read_ctx->num_blocks << raid_bdev->blocklen_shift;
+	hedge->iov.iov_base = raid5f_buf_get(r5ch, hedge->iov.iov_len);
+	if (!hedge->iov.iov_base) {
+		free(hedge);
+		return -EAGAIN;
+	}
+
+	if (read_ctx->md_buf) {
+		hedge->md_len = read_ctx->num_blocks * spdk_bdev_get_md_size(&raid_bdev->bdev);
+		hedge->md_buf = raid5f_buf_get(r5ch, hedge->md_len);
+		if (!hedge->md_buf) {
+			raid5f_read_hedge_free(hedge);
+			return -EAGAIN;
+		}
+	}
+
+	/* The bounce buffers are local memory, not in the memory domain of the raid I/O */
+	memset(&io_opts, 0, sizeof(io_opts));
+	io_opts.size = sizeof(io_opts);
+	io_opts.metadata = hedge->md_buf;
+
+	ret = raid_bdev_readv_blocks_ext(base_info, base_ch, &hedge->iov, 1, base_offset_blocks,
+					 read_ctx->num_blocks, raid5f_read_hedge_read_complete, hedge,
+					 &io_opts);
+	if (spdk_unlikely(ret)) {
+		raid5f_read_hedge_free(hedge);
+		return ret;
+	}
+
+	hedge->read_pending = true;
+	hedge->submit_tsc = spdk_get_ticks();
+	raid5f_member_read_start(r5ch, hedge->chunk_idx);
+	TAILQ_INSERT_TAIL(&r5ch->hedge_reads, hedge, link);
+
+	return 0;
+}
+
+static void
+raid5f_csum_read_put_buffers(struct raid5f_read_ctx *read_ctx)
+{
+	struct raid5f_io_channel *r5ch = raid5f_read_ctx_r5ch(read_ctx);
+	struct raid_bdev *raid_bdev = read_ctx->raid_io->raid_bdev;
+
+	if (read_ctx->csum_iov.iov_base != NULL) {
+		raid5f_buf_put(r5ch, read_ctx->csum_iov.iov_base, read_ctx->csum_iov.iov_len);
+		read_ctx->csum_iov.iov_base = NULL;
+	}
+	if (read_ctx->csum_md_buf != NULL) {
+		raid5f_buf_put(r5ch, read_ctx->csum_md_buf,
+			       raid_bdev->strip_size * spdk_bdev_get_md_size(&raid_bdev->bdev));
+		read_ctx->csum_md_buf = NULL;
+	}
+}
+
+static void
+raid5f_csum_read_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_read_ctx *read_ctx = cb_arg;
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_csum *csum = r5f_info->csum;
+	uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	void *md_buf = read_ctx->csum_md_buf ? read_ctx->csum_md_buf : read_ctx->md_buf;
+	size_t md_len = 0;
+	uint32_t value;
+
+	spdk_bdev_free_io(bdev_io);
+
+	raid5f_member_read_done(raid5f_read_ctx_r5ch(read_ctx), read_ctx->chunk_idx,
+				read_ctx->submit_tsc);
+
+	if (!success) {
+		raid5f_csum_read_put_buffers(read_ctx);
+		raid5f_read_ctx_complete(read_ctx, SPDK_BDEV_IO_STATUS_FAILED);
+		return;
+	}
+
+	if (spdk_bdev_is_md_separate(&raid_bdev->bdev)) {
+		md_len = raid_bdev->strip_size * md_size;
+	}
+
+	if (read_ctx->csum_iov.iov_base != NULL) {
+		value = raid5f_csum_calc(&read_ctx->csum_iov, 1, md_buf, md_len);
+		spdk_copy_buf_to_iovs(read_ctx->iovs, read_ctx->iovcnt,
+				      (uint8_t *)read_ctx->csum_iov.iov_base +
+				      (read_ctx->chunk_offset << raid_bdev->blocklen_shift),
+				      read_ctx->num_blocks << raid_bdev->blocklen_shift);
+	} else {
+		value = raid5f_csum_calc(read_ctx->iovs, read_ctx->iovcnt, md_buf, md_len);
+	}
+	if (read_ctx->csum_md_buf != NULL && read_ctx->md_buf != NULL) {
+		memcpy(read_ctx->md_buf,
+		       (uint8_t *)read_ctx->csum_md_buf + read_ctx->chunk_offset * md_size,
+		       read_ctx->num_blocks * md_size);
+	}
+	raid5f_csum_read_put_buffers(read_ctx);
+
+	if (value == read_ctx->csum) {
+		__atomic_fetch_add(&csum->stats.verified, 1, __ATOMIC_RELAXED);
+		raid5f_read_ctx_part_done(read_ctx, SPDK_BDEV_IO_STATUS_SUCCESS);
+		return;
+	}
+
+	/*
+	 * The chunk or its entry may be stale, e.g. after a crash before the table was written.
+	 * Forget the entry, the verification against the other chunks sets it again.
+	 */
+	__atomic_fetch_add(&csum->stats.mismatches, 1, __ATOMIC_RELAXED);
+	raid5f_csum_update(csum, read_ctx->chunk_idx, read_ctx->stripe_index, 0);
+	read_ctx->chunk_bad = true;
+
+	raid5f_chunk_read_done(read_ctx);
+}
+
+/*
+ * Read the whole chunk of the part to verify it with its checksum, directly into the read's
+ * buffers if the part is all of the chunk. Returns -EAGAIN if the checksum isn't known or
+ * bounce buffers aren't available.
+ */
+static int
+raid5f_csum_read_submit(struct raid5f_read_ctx *read_ctx, struct raid_base_bdev_info *base_info,
+			struct spdk_io_channel *base_ch)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_io_channel *r5ch = raid5f_read_ctx_r5ch(read_ctx);
+	size_t md_len = raid_bdev->strip_size * spdk_bdev_get_md_size(&raid_bdev->bdev);
+	struct spdk_bdev_ext_io_opts io_opts;
+	struct iovec *iovs = read_ctx->iovs;
+	int iovcnt = read_ctx->iovcnt;
+	int ret;
+
+	/* Buffers of a memory domain can't be accessed */
+	if (raid_io->memory_domain != NULL ||
+	    !raid5f_csum_lookup(r5f_info->csum, read_ctx->chunk_idx, read_ctx->stripe_index,
+				&read_ctx->csum)) {
+		return -EAGAIN;
+	}
+
+	memset(&io_opts, 0, sizeof(io_opts));
+	io_opts.size = sizeof(io_opts);
+	io_opts.metadata = read_ctx->md_buf;
+
+	if (read_ctx->num_blocks != raid_bdev->strip_size) {
+		read_ctx->csum_iov.iov_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+		read_ctx->csum_iov.iov_base = raid5f_buf_get(r5ch, read_ctx->csum_iov.iov_len);
+		if (read_ctx->csum_iov.iov_base == NULL) {
+			return -EAGAIN;
+		}
+		iovs = &read_ctx->csum_iov;
+		iovcnt = 1;
+	}
+
+	if (spdk_bdev_is_md_separate(&raid_bdev->bdev) &&
+	    (read_ctx->num_blocks != raid_bdev->strip_size || read_ctx->md_buf == NULL)) {
+		read_ctx->csum_md_buf = raid5f_buf_get(r5ch, md_len);
+		if (read_ctx->csum_md_buf == NULL) {
+			raid5f_csum_read_put_buffers(read_ctx);
+			return -EAGAIN;
+		}
+		io_opts.metadata = read_ctx->csum_md_buf;
+	}
+
+	ret = raid_bdev_readv_blocks_ext(base_info, base_ch, iovs, iovcnt,
+					 read_ctx->stripe_index << raid_bdev->strip_size_shift,
+					 raid_bdev->strip_size, raid5f_csum_read_complete, read_ctx,
+					 &io_opts);
+	if (spdk_unlikely(ret)) {
+		raid5f_csum_read_put_buffers(read_ctx);
+		return ret;
+	}
+
+	read_ctx->submit_tsc = spdk_get_ticks();
+	raid5f_member_read_start(r5ch, read_ctx->chunk_idx);
+
+	return 0;
+}
+
+/* Xor len bytes of iovs, starting at byte offset, into buf */
+static void
+raid5f_xor_iovs_into_buf(void *buf, const struct iovec *iovs, int iovcnt, size_t offset,
+			 size_t len)
+{
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		void *srcs[2];
+		size_t n;
+
+		if (offset >= iovs[i].iov_len) {
+			offset -= iovs[i].iov_len;
+			continue;
+		}
+
+		n = spdk_min(len, iovs[i].iov_len - offset);
+		srcs[0] = buf;
+		srcs[1] = iovs[i].iov_base + offset;
+		raid5f_xor_gen(buf, srcs, 2, n);
+
+		buf = (uint8_t *)buf + n;
+		len -= n;
+		offset = 0;
+	}
+}
+
+static void
+raid5f_stripes_read_free(struct raid5f_stripes_read *stripes_read)
+{
+	struct raid5f_read_ctx *read_ctx = stripes_read->read_ctx;
+	struct raid_bdev *raid_bdev = read_ctx->raid_io->raid_bdev;
+	struct raid5f_io_channel *r5ch = raid5f_read_ctx_r5ch(read_ctx);
+	size_t strip_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+	uint64_t i;
+	uint8_t idx;
+
+	for (i = 0; i < stripes_read->num_stripes; i++) {
+		if (stripes_read->parity_bufs[i] != NULL) {
+			raid5f_buf_put(r5ch, stripes_read->parity_bufs[i], strip_len);
+		}
+	}
+
+	for (idx = 0; idx < raid_bdev->num_base_bdevs; idx++) {
+		free(stripes_read->members[idx].iovs);
+	}
+
+	read_ctx->stripes_read = NULL;
+	free(stripes_read);
+}
+
+/*
+ * Check that the chunks of every stripe xor to zero. Returns the number of stripes before
+ * the first one which doesn't.
+ */
+static uint64_t
+raid5f_stripes_read_verify(struct raid5f_stripes_read *stripes_read)
+{
+	struct raid_bdev_io *raid_io = stripes_read->read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	size_t strip_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+	size_t offset = stripes_read->read_ctx->blocks_done << raid_bdev->blocklen_shift;
+	uint64_t i;
+	uint8_t d;
+
+	for (i = 0; i < stripes_read->num_stripes; i++) {
+		for (d = 0; d < raid5f_stripe_data_chunks_num(raid_bdev); d++) {
+			raid5f_xor_iovs_into_buf(stripes_read->parity_bufs[i], raid_io->iovs, raid_io->iovcnt,
+						 offset, strip_len);
+			offset += strip_len;
+		}
+
+		if (!spdk_mem_all_zero(stripes_read->parity_bufs[i], strip_len)) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+static void
+raid5f_stripes_read_done(struct raid5f_stripes_read *stripes_read)
+{
+	struct raid5f_read_ctx *read_ctx = stripes_read->read_ctx;
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	uint64_t num_stripes = stripes_read->num_stripes;
+	uint64_t stripe_index;
+	uint64_t verified;
+	int ret;
+
+	if (stripes_read->failed) {
+		raid5f_stripes_read_free(stripes_read);
+		raid5f_read_ctx_complete(read_ctx, SPDK_BDEV_IO_STATUS_FAILED);
+		return;
+	}
+
+	verified = raid5f_stripes_read_verify(stripes_read);
+	stripe_index = stripes_read->stripe_index + verified;
+	raid5f_stripes_read_free(stripes_read);
+
+	/*
+	 * The parity doesn't tell which chunk of a mismatched stripe is wrong. Queue a rewrite of
+	 * the parity, which the repair turns into a rewrite of a data chunk whose protection
+	 * information or checksum doesn't match. If reads check those, read the stripe again chunk
+	 * by chunk to return the reconstruction of such a chunk, otherwise return it as read.
+	 */
+	if (verified < num_stripes && raid5f_wib_resync_pending(r5f_info, stripe_index)) {
+		/* The resync recalculates the parity from the data, which is returned as read */
+		verified++;
+	} else if (verified < num_stripes) {
+		__atomic_fetch_add(&r5f_info->repair_stats.read_mismatches, 1, __ATOMIC_RELAXED);
+
+		ret = raid5f_repair_queue(raid_io->raid_ch, stripe_index,
+					  raid5f_stripe_parity_chunk_index(raid_bdev, stripe_index),
+					  0, raid_bdev->strip_size);
+		raid5f_mismatch_record(raid5f_read_ctx_r5ch(read_ctx), stripe_index,
+				       RAID5F_MISMATCH_NO_MEMBER, RAID5F_MISMATCH_SRC_READ,
+				       ret == 0 ? RAID5F_MISMATCH_REPAIR_QUEUED :
+				       RAID5F_MISMATCH_REPAIR_DROPPED);
+
+		if (r5f_info->pi_verify || r5f_info->csum != NULL) {
+			read_ctx->verify_chunks_end = read_ctx->blocks_done +
+						      (verified + 1) * r5f_info->stripe_blocks;
+		} else {
+			verified++;
+		}
+	}
+
+	read_ctx->num_blocks = verified * r5f_info->stripe_blocks;
+	raid5f_read_ctx_part_done(read_ctx, SPDK_BDEV_IO_STATUS_SUCCESS);
+}
+
+static void
+raid5f_stripes_read_member_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_stripes_read_member *member = cb_arg;
+	struct raid5f_stripes_read *stripes_read = member->stripes_read;
+
+	spdk_bdev_free_io(bdev_io);
+
+	if (!success) {
+		stripes_read->failed = true;
+	}
+
+	assert(stripes_read->remaining > 0);
+	if (--stripes_read->remaining == 0) {
+		raid5f_stripes_read_done(stripes_read);
+	}
+}
+
+static void raid5f_stripes_read_submit(struct raid5f_stripes_read *stripes_read);
+
+static void
+_raid5f_stripes_read_submit(void *_raid_io)
+{
+	struct raid_bdev_io *raid_io = _raid_io;
+	struct raid5f_read_ctx *read_ctx = raid_io->module_private;
+
+	raid5f_stripes_read_submit(read_ctx->stripes_read);
+}
+
+static void
+raid5f_stripes_read_submit(struct raid5f_stripes_read *stripes_read)
+{
+	struct raid_bdev_io *raid_io = stripes_read->read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	uint64_t base_offset_blocks = stripes_read->stripe_index << raid_bdev->strip_size_shift;
+	uint64_t base_num_blocks = stripes_read->num_stripes << raid_bdev->strip_size_shift;
+	struct raid5f_stripes_read_member *member;
+	struct raid_base_bdev_info *base_info;
+	struct spdk_io_channel *base_ch;
+	struct spdk_bdev_ext_io_opts io_opts;
+	int ret;
+
+	raid5f_init_ext_io_opts(raid_io, &io_opts);
+
+	while (stripes_read->submitted < raid_bdev->num_base_bdevs) {
+		member = &stripes_read->members[stripes_read->submitted];
+		base_info = &raid_bdev->base_bdev_info[member->idx];
+		base_ch = raid5f_base_channel(raid_io, member->idx, stripes_read->stripe_index);
+
+		ret = raid_bdev_readv_blocks_ext(base_info, base_ch, member->iovs, member->iovcnt,
+						 base_offset_blocks, base_num_blocks,
+						 raid5f_stripes_read_member_complete, member, &io_opts);
+		if (spdk_unlikely(ret == -ENOMEM)) {
+			raid5f_queue_io_wait(raid_io, base_info, base_ch, _raid5f_stripes_read_submit);
+			return;
+		} else if (spdk_unlikely(ret != 0)) {
+			stripes_read->failed = true;
+			stripes_read->remaining -= raid_bdev->num_base_bdevs - stripes_read->submitted;
+			stripes_read->submitted = raid_bdev->num_base_bdevs;
+			if (stripes_read->remaining == 0) {
+				raid5f_stripes_read_done(stripes_read);
+			}
+			return;
+		}
+
+		stripes_read->submitted++;
+	}
+}
+
+/*
+ * Read up to num_stripes whole stripes from the current block of the read, which is at a
+ * stripe boundary. Returns -EAGAIN if they have to be read chunk by chunk instead.
+ */
+static int
+raid5f_stripes_read_start(struct raid5f_read_ctx *read_ctx, uint64_t stripe_index,
+			  uint64_t num_stripes)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_io_channel *r5ch = raid5f_read_ctx_r5ch(read_ctx);
+	size_t strip_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+	size_t offset = read_ctx->blocks_done << raid_bdev->blocklen_shift;
+	struct raid5f_stripes_read *stripes_read;
+	struct raid5f_stripes_read_member *member;
+	uint64_t i;
+	uint8_t idx, d;
+	int ret;
+
+	/*
+	 * The separate metadata of a member isn't contiguous in the read's buffer and the parity
+	 * bounce buffers can't be read along with buffers of a memory domain.
+	 */
+	if (raid_io->md_buf != NULL || raid_io->memory_domain != NULL) {
+		return -EAGAIN;
+	}
+
+	/* Stripes missing a chunk are read chunk by chunk to reconstruct it */
+	num_stripes = spdk_min(num_stripes, RAID5F_STRIPES_READ_MAX);
+	for (i = 0; i < num_stripes; i++) {
+		if (raid5f_stripe_degraded(raid_io, stripe_index + i)) {
+			break;
+		}
+	}
+	num_stripes = i;
+
+	if (num_stripes == 0) {
+		return -EAGAIN;
+	}
+
+	stripes_read = calloc(1, sizeof(*stripes_read) +
+			      raid_bdev->num_base_bdevs * sizeof(stripes_read->members[0]));
+	if (!stripes_read) {
+		return -EAGAIN;
+	}
+
+	stripes_read->read_ctx = read_ctx;
+	stripes_read->stripe_index = stripe_index;
+	stripes_read->num_stripes = num_stripes;
+	read_ctx->stripes_read = stripes_read;
+
+	for (idx = 0; idx < raid_bdev->num_base_bdevs; idx++) {
+		stripes_read->members[idx].stripes_read = stripes_read;
+		stripes_read->members[idx].idx = idx;
+	}
+
+	/* The chunks of a member in consecutive stripes are contiguous on its base bdev */
+	for (i = 0; i < num_stripes; i++) {
+		stripes_read->parity_bufs[i] = raid5f_buf_get(r5ch, strip_len);
+		if (!stripes_read->parity_bufs[i]) {
+			goto err;
+		}
+
+		member = &stripes_read->members[raid5f_stripe_parity_chunk_index(raid_bdev,
+					  stripe_index + i)];
+		ret = raid5f_iovs_append(&member->iovs, &member->iovcnt, &member->iovcnt_max,
+					 stripes_read->parity_bufs[i], strip_len);
+		if (ret) {
+			goto err;
+		}
+
+		for (d = 0; d < raid5f_stripe_data_chunks_num(raid_bdev); d++) {
+			member = &stripes_read->members[raid5f_stripe_data_chunk_index(raid_bdev,
+						  stripe_index + i, d)];
+			ret = raid5f_iovs_append_slice(&member->iovs, &member->iovcnt, &member->iovcnt_max,
+						       raid_io->iovs, raid_io->iovcnt, offset, strip_len);
+			if (ret) {
+				goto err;
+			}
+			offset += strip_len;
+		}
+	}
+
+	stripes_read->remaining = raid_bdev->num_base_bdevs;
+	raid5f_stripes_read_submit(stripes_read);
+
+	return 0;
+err:
+	raid5f_stripes_read_free(stripes_read);
+	return -EAGAIN;
+}
+
+static void raid5f_read_ctx_submit_locked(struct raid5f_read_ctx *read_ctx);
+
+static void
+_raid5f_read_ctx_submit(void *_raid_io)
+{
+	struct raid_bdev_io *raid_io = _raid_io;
+
+	raid5f_read_ctx_submit_locked(raid_io->module_private);
+}
+
+/* Fill the part of the read over stripes known to be zeroed without reading them */
+static void
+raid5f_read_ctx_zero_part(struct raid5f_read_ctx *read_ctx, uint64_t num_blocks)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	int ret;
+
+	read_ctx->num_blocks = num_blocks;
+	read_ctx->iovcnt = 0;
+	ret = raid5f_iovs_append_slice(&read_ctx->slice_iovs, &read_ctx->iovcnt,
+				       &read_ctx->slice_iovcnt_max, raid_io->iovs, raid_io->iovcnt,
+				       read_ctx->blocks_done << raid_bdev->blocklen_shift,
+				       num_blocks << raid_bdev->blocklen_shift);
+	if (spdk_unlikely(ret)) {
+		raid5f_read_ctx_complete(read_ctx, ret == -ENOMEM ? SPDK_BDEV_IO_STATUS_NOMEM :
+					 SPDK_BDEV_IO_STATUS_FAILED);
+		return;
+	}
+
+	spdk_iov_memset(read_ctx->slice_iovs, read_ctx->iovcnt, 0);
+	if (raid_io->md_buf != NULL) {
+		memset(raid_io->md_buf + read_ctx->blocks_done * md_size, 0, num_blocks * md_size);
+	}
+
+	raid5f_read_ctx_part_done(read_ctx, SPDK_BDEV_IO_STATUS_SUCCESS);
+}
+
+/* Submit the part of the read over the stripes locked for it */
+static void
+raid5f_read_ctx_submit_locked(struct raid5f_read_ctx *read_ctx)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	void *raid_io_md = raid_io->md_buf;
+	uint64_t offset_blocks = raid_io->offset_blocks + read_ctx->blocks_done;
+	uint64_t remaining = raid_io->num_blocks - read_ctx->blocks_done;
+	uint64_t stripe_offset = offset_blocks % r5f_info->stripe_blocks;
+	uint8_t chunk_data_idx = stripe_offset >> raid_bdev->strip_size_shift;
+	struct raid_base_bdev_info *base_info;
+	struct spdk_io_channel *base_ch;
+	struct spdk_bdev_ext_io_opts io_opts;
+	uint64_t base_offset_blocks;
+	int ret;
+
+	if (read_ctx->lock.num_stripes > 1 || (stripe_offset == 0 &&
+					       remaining >= r5f_info->stripe_blocks &&
+					       read_ctx->blocks_done >= read_ctx->verify_chunks_end)) {
+		ret = raid5f_stripes_read_start(read_ctx, read_ctx->stripe_index,
+						read_ctx->lock.num_stripes);
+		if (ret == 0) {
+			return;
+		}
+	}
+
+	read_ctx->chunk_idx = raid5f_stripe_data_chunk_index(raid_bdev, read_ctx->stripe_index,
+			      chunk_data_idx);
+	read_ctx->chunk_bad = false;
+	read_ctx->chunk_offset = stripe_offset - ((uint64_t)chunk_data_idx << raid_bdev->strip_size_shift);
+	read_ctx->num_blocks = spdk_min(remaining, raid_bdev->strip_size - read_ctx->chunk_offset);
+
+	if (read_ctx->num_blocks == raid_io->num_blocks) {
+		read_ctx->iovs = raid_io->iovs;
+		read_ctx->iovcnt = raid_io->iovcnt;
+	} else {
+		read_ctx->iovcnt = 0;
+		ret = raid5f_iovs_append_slice(&read_ctx->slice_iovs, &read_ctx->iovcnt,
+					       &read_ctx->slice_iovcnt_max,
+					       raid_io->iovs, raid_io->iovcnt,
+					       read_ctx->blocks_done << raid_bdev->blocklen_shift,
+					       read_ctx->num_blocks << raid_bdev->blocklen_shift);
+		if (spdk_unlikely(ret)) {
+			raid5f_read_ctx_complete(read_ctx, ret == -ENOMEM ? SPDK_BDEV_IO_STATUS_NOMEM :
+						 SPDK_BDEV_IO_STATUS_FAILED);
+			return;
+		}
+		read_ctx->iovs = read_ctx->slice_iovs;
+	}
+
+	read_ctx->md_buf = NULL;
+	if (raid_io_md) {
+		read_ctx->md_buf = raid_io_md + read_ctx->blocks_done * spdk_bdev_get_md_size(&raid_bdev->bdev);
+	}
+
+	base_info = &raid_bdev->base_bdev_info[read_ctx->chunk_idx];
+	base_ch = raid5f_base_channel(raid_io, read_ctx->chunk_idx, read_ctx->stripe_index);
+
+	if (base_ch == NULL) {
+		struct raid5f_degraded_cache_entry *entry;
+
+		if (raid5f_degraded_cache_lookup(read_ctx, &entry)) {
+			raid5f_read_ctx_part_done(read_ctx, SPDK_BDEV_IO_STATUS_SUCCESS);
+			return;
+		}
+
+		ret = raid5f_submit_reconstruct_read(read_ctx, false, entry, NULL);
+		if (spdk_unlikely(ret)) {
+			if (entry) {
+				entry->stripe_index = UINT64_MAX;
+			}
+			raid5f_read_ctx_complete(read_ctx, ret == -ENOMEM ? SPDK_BDEV_IO_STATUS_NOMEM :
+						 SPDK_BDEV_IO_STATUS_FAILED);
+		}
+		return;
+	}
+
+	raid5f_init_ext_io_opts(raid_io, &io_opts);
+	io_opts.metadata = read_ctx->md_buf;
+
+	base_offset_blocks = (read_ctx->stripe_index << raid_bdev->strip_size_shift) +
+			     read_ctx->chunk_offset;
+
+	ret = -EAGAIN;
+	if (r5f_info->csum != NULL) {
+		ret = raid5f_csum_read_submit(read_ctx, base_info, base_ch);
+	}
+	if (ret == -EAGAIN &&
+	    raid5f_ch_to_r5f_info(raid5f_read_ctx_r5ch(read_ctx))->read_hedge_permille != 0) {
+		ret = raid5f_read_hedge_submit(read_ctx, base_info, base_ch, base_offset_blocks);
+	}
+
+	if (ret == -EAGAIN) {
+		ret = raid_bdev_readv_blocks_ext(base_info, base_ch, read_ctx->iovs, read_ctx->iovcnt,
+						 base_offset_blocks, read_ctx->num_blocks,
+						 raid5f_chunk_read_complete, read_ctx, &io_opts);
+		if (ret == 0) {
+			read_ctx->submit_tsc = spdk_get_ticks();
+			raid5f_member_read_start(raid5f_read_ctx_r5ch(read_ctx), read_ctx->chunk_idx);
+		}
+	}
+
+	if (spdk_unlikely(ret == -ENOMEM)) {
+	  SPDK_ERRLOG("readv returned ENOMEM\n");
+		raid5f_queue_io_wait(raid_io, base_info, base_ch, _raid5f_read_ctx_submit);
+	} else if (spdk_unlikely(ret != 0)) {
+		raid5f_read_ctx_complete(read_ctx, SPDK_BDEV_IO_STATUS_FAILED);
+	}
+}
+
+static void
+raid5f_read_ctx_locked(void *cb_arg)
+{
+	struct raid5f_read_ctx *read_ctx = cb_arg;
+
+	read_ctx->locked = true;
+	raid5f_read_ctx_submit_locked(read_ctx);
+}
+
+/*
+ * Submit the next part of the read. Whole stripes are read at once, otherwise the part ends
+ * at the chunk boundary or the end of the read. Stripes known to be zeroed are not read.
+ * The stripes of the part are locked shared, so that they aren't written while the part is
+ * read and verified.
+ */
+static void
+raid5f_read_ctx_submit(struct raid5f_read_ctx *read_ctx)
+{
+	struct raid_bdev_io *raid_io = read_ctx->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	uint64_t offset_blocks = raid_io->offset_blocks + read_ctx->blocks_done;
+	uint64_t remaining = raid_io->num_blocks - read_ctx->blocks_done;
+	uint64_t stripe_offset = offset_blocks % r5f_info->stripe_blocks;
+	uint64_t num_blocks, num_stripes, i;
+
+	read_ctx->stripe_index = offset_blocks / r5f_info->stripe_blocks;
+
+	if (raid_io->memory_domain == NULL &&
+	    raid5f_stripe_zero(r5f_info, read_ctx->stripe_index)) {
+		/* Take the following zeroed stripes too, the part completes inline */
+		num_blocks = spdk_min(remaining, r5f_info->stripe_blocks - stripe_offset);
+		i = read_ctx->stripe_index + 1;
+		while (num_blocks < remaining && raid5f_stripe_zero(r5f_info, i)) {
+			num_blocks += spdk_min(remaining - num_blocks, r5f_info->stripe_blocks);
+			i++;
+		}
+		raid5f_read_ctx_zero_part(read_ctx, num_blocks);
+		return;
+	}
+
+	i = 1;
+	if (stripe_offset == 0 && remaining >= r5f_info->stripe_blocks &&
+	    read_ctx->blocks_done >= read_ctx->verify_chunks_end) {
+		num_stripes = spdk_min(remaining / r5f_info->stripe_blocks, RAID5F_STRIPES_READ_MAX);
+		for (; i < num_stripes; i++) {
+			if (raid5f_stripe_zero(r5f_info, read_ctx->stripe_index + i)) {
+				break;
+			}
+		}
+	}
+
+	if (raid5f_range_lock(&read_ctx->lock, r5f_info, read_ctx->stripe_index, i, false,
+			      raid5f_read_ctx_locked, read_ctx)) {
+		raid5f_read_ctx_locked(read_ctx);
+	}
+}
+
+static void
+raid5f_read_ctx_part_done(struct raid5f_read_ctx *read_ctx, enum spdk_bdev_io_status status)
+{
+	if (read_ctx->locked) {
+		raid5f_range_unlock(&read_ctx->lock);
+		read_ctx->locked = false;
+	}
+
+	read_ctx->blocks_done += read_ctx->num_blocks;
+
+	if (status != SPDK_BDEV_IO_STATUS_SUCCESS ||
+	    read_ctx->blocks_done == read_ctx->raid_io->num_blocks) {
+		raid5f_read_ctx_complete(read_ctx, status);
+	} else {
+		raid5f_read_ctx_submit(read_ctx);
+	}
+}
+
+static int
+raid5f_submit_read_request(struct raid_bdev_io *raid_io)
+{
+	struct raid5f_read_ctx *read_ctx;
+
+	read_ctx = calloc(1, sizeof(*read_ctx));
+	if (!read_ctx) {
+		return -ENOMEM;
+	}
+
+	read_ctx->raid_io = raid_io;
+
+	raid_io->module_private = read_ctx;
+
+	raid5f_read_ctx_submit(read_ctx);
+
+	return 0;
+}
+
+static int raid5f_submit_split_write_request(struct raid_bdev_io *raid_io);
+static int raid5f_wib_submit_write(struct raid_bdev_io *raid_io);
+static int raid5f_submit_zero_request(struct raid_bdev_io *raid_io);
+
+/*
+ * Submit a write to the array, split into its stripes if it spans several. Unmaps and
+ * writes of zeroes take the same way through the write-intent bitmap and end up here.
+ */
+static int
+raid5f_submit_array_write(struct raid_bdev_io *raid_io)
+{
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+	uint64_t stripe_index = raid_io->offset_blocks / r5f_info->stripe_blocks;
+	uint64_t stripe_offset = raid_io->offset_blocks % r5f_info->stripe_blocks;
+
+	if (raid_io->type != SPDK_BDEV_IO_TYPE_WRITE) {
+		return raid5f_submit_zero_request(raid_io);
+	}
+
+	if (stripe_offset + raid_io->num_blocks > r5f_info->stripe_blocks) {
+		return raid5f_submit_split_write_request(raid_io);
+	}
+
+	raid5f_stripe_gen_bump(r5f_info, stripe_index);
+	if (stripe_offset == 0 && raid_io->num_blocks == r5f_info->stripe_blocks) {
+		return raid5f_submit_write_request(raid_io, stripe_index);
+	}
+
+	return raid5f_submit_partial_write_request(raid_io, stripe_index, stripe_offset);
+}
+
+/* Submit the request to the array, bypassing the stripe cache */
+static int
+raid5f_submit_array_request(struct raid_bdev_io *raid_io)
+{
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+	int ret;
+
+	switch (raid_io->type) {
+	case SPDK_BDEV_IO_TYPE_READ:
+		ret = raid5f_submit_read_request(raid_io);
+		break;
+	case SPDK_BDEV_IO_TYPE_WRITE:
+	case SPDK_BDEV_IO_TYPE_UNMAP:
+	case SPDK_BDEV_IO_TYPE_WRITE_ZEROES:
+		if (r5f_info->wib != NULL) {
+			ret = raid5f_wib_submit_write(raid_io);
+		} else {
+			ret = raid5f_submit_array_write(raid_io);
+		}
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	return ret;
+}
+
+static void raid5f_split_write_submit(struct raid5f_split_write *split);
+
+static void
+raid5f_split_write_stripe_free(struct raid5f_split_write_stripe *stripe)
+{
+	free(stripe->iovs);
+	free(stripe);
+}
+
+static void
+raid5f_split_write_stripe_done(struct raid_bdev_io *raid_io, enum spdk_bdev_io_status status)
+{
+	struct raid5f_split_write_stripe *stripe = SPDK_CONTAINEROF(raid_io,
+			struct raid5f_split_write_stripe, raid_io);
+	struct raid5f_split_write *split = stripe->split;
+
+	assert(split->active > 0);
+	split->active--;
+
+	if (status == SPDK_BDEV_IO_STATUS_NOMEM) {
+		TAILQ_INSERT_TAIL(&split->retry_queue, stripe, link);
+	} else {
+		if (status != SPDK_BDEV_IO_STATUS_SUCCESS) {
+			split->status = status;
+		}
+		raid5f_split_write_stripe_free(stripe);
+	}
+
+	if (!split->submitting) {
+		raid5f_split_write_submit(split);
+	}
+}
+
+/* Set up the write of the next stripe of the split write */
+static struct raid5f_split_write_stripe *
+raid5f_split_write_next_stripe(struct raid5f_split_write *split)
+{
+	struct raid_bdev_io *raid_io = split->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	uint64_t offset_blocks = raid_io->offset_blocks + split->blocks_submitted;
+	uint64_t num_blocks = spdk_min(raid_io->num_blocks - split->blocks_submitted,
+				       r5f_info->stripe_blocks - offset_blocks % r5f_info->stripe_blocks);
+	struct raid5f_split_write_stripe *stripe;
+	void *md_buf = NULL;
+	int ret;
+
+	stripe = calloc(1, sizeof(*stripe));
+	if (!stripe) {
+		return NULL;
+	}
+
+	ret = raid5f_iovs_append_slice(&stripe->iovs, &stripe->iovcnt, &stripe->iovcnt_max,
+				       raid_io->iovs, raid_io->iovcnt,
+				       split->blocks_submitted << raid_bdev->blocklen_shift,
+				       num_blocks << raid_bdev->blocklen_shift);
+	if (ret) {
+		raid5f_split_write_stripe_free(stripe);
+		return NULL;
+	}
+
+	if (raid_io->md_buf) {
+		md_buf = raid_io->md_buf + split->blocks_submitted * spdk_bdev_get_md_size(&raid_bdev->bdev);
+	}
+
+	raid_bdev_io_init(&stripe->raid_io, raid_io->raid_ch, SPDK_BDEV_IO_TYPE_WRITE, offset_blocks,
+			  num_blocks, stripe->iovs, stripe->iovcnt, md_buf, raid_io->memory_domain,
+			  raid_io->memory_domain_ctx);
+	stripe->raid_io.completion_cb = raid5f_split_write_stripe_done;
+	stripe->split = split;
+	split->blocks_submitted += num_blocks;
+
+	return stripe;
+}
+
+static inline struct raid5f_write_batch *
+raid5f_stripe_req_write_batch(struct stripe_request *stripe_req)
+{
+	return SPDK_CONTAINEROF(stripe_req->raid_io, struct raid5f_split_write_stripe, raid_io)->batch;
+}
+
+static void
+raid5f_write_batch_free(struct raid5f_write_batch *batch)
+{
+	uint8_t idx;
+
+	raid5f_range_unlock(&batch->lock);
+
+	for (idx = 0; idx < batch->num_members; idx++) {
+		free(batch->members[idx].iovs);
+	}
+
+	free(batch);
+}
+
+static void
+raid5f_write_batch_put(struct raid5f_write_batch *batch)
+{
+	assert(batch->remaining > 0);
+	if (--batch->remaining == 0) {
+		raid5f_write_batch_free(batch);
+	}
+}
+
+/* Account the write of a member to every stripe of the batch */
+static void
+raid5f_write_batch_member_complete(struct raid5f_write_batch *batch,
+				   enum spdk_bdev_io_status status)
+{
+	uint32_t i;
+
+	/* Requests completing their last chunk are released, the later ones are still held */
+	for (i = 0; i < batch->num_stripes; i++) {
+		raid5f_stripe_request_chunks_complete(batch->stripe_reqs[i], 1, status);
+	}
+
+	raid5f_write_batch_put(batch);
+}
+
+static void
+raid5f_write_batch_member_write_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_write_batch_member *member = cb_arg;
+
+	spdk_bdev_free_io(bdev_io);
+
+	raid5f_write_batch_member_complete(member->batch, success ? SPDK_BDEV_IO_STATUS_SUCCESS :
+					   SPDK_BDEV_IO_STATUS_FAILED);
+}
+
+static void raid5f_write_batch_submit(struct raid5f_write_batch *batch);
+
+static void
+_raid5f_write_batch_submit(void *_raid_io)
+{
+	struct raid_bdev_io *raid_io = _raid_io;
+
+	raid5f_write_batch_submit(SPDK_CONTAINEROF(raid_io, struct raid5f_split_write_stripe,
+				  raid_io)->batch);
+}
+
+/* Write the chunks of all stripes of the batch with one write per member */
+static void
+raid5f_write_batch_submit(struct raid5f_write_batch *batch)
+{
+	struct stripe_request *first = batch->stripe_reqs[0];
+	struct raid_bdev_io *raid_io = first->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	uint64_t base_offset_blocks = first->stripe_index << raid_bdev->strip_size_shift;
+	uint64_t base_num_blocks = (uint64_t)batch->num_stripes << raid_bdev->strip_size_shift;
+	struct raid5f_write_batch_member *member;
+	struct raid_base_bdev_info *base_info;
+	struct spdk_io_channel *base_ch;
+	struct spdk_bdev_ext_io_opts io_opts;
+	int ret;
+
+	raid5f_init_ext_io_opts(raid_io, &io_opts);
+
+	while (batch->submitted < raid_bdev->num_base_bdevs) {
+		member = &batch->members[batch->submitted];
+		base_info = &raid_bdev->base_bdev_info[member->idx];
+		base_ch = raid5f_base_channel(raid_io, member->idx, first->stripe_index);
+
+		if (base_ch == NULL) {
+			batch->submitted++;
+			raid5f_write_batch_member_complete(batch, SPDK_BDEV_IO_STATUS_SUCCESS);
+			continue;
+		}
+
+		ret = raid_bdev_writev_blocks_ext(base_info, base_ch, member->iovs, member->iovcnt,
+						  base_offset_blocks, base_num_blocks,
+						  raid5f_write_batch_member_write_complete, member, &io_opts);
+		if (spdk_unlikely(ret == -ENOMEM)) {
+			/* The first stripe's raid_io isn't waiting for anything else meanwhile */
+			raid5f_queue_io_wait(raid_io, base_info, base_ch, _raid5f_write_batch_submit);
+			return;
+		}
+
+		batch->submitted++;
+		if (spdk_unlikely(ret != 0)) {
+			raid5f_write_batch_member_complete(batch, SPDK_BDEV_IO_STATUS_FAILED);
+		}
+	}
+
+	/* Drop the reference held while submitting */
+	raid5f_write_batch_put(batch);
+}
+
+static void
+raid5f_write_batch_poison(struct raid5f_write_batch *batch)
+{
+	uint32_t i;
+
+	for (i = 0; i < batch->num_stripes; i++) {
+		raid5f_stripe_poison(batch->stripe_reqs[i]);
+	}
+}
+
+static void
+raid5f_write_batch_xor_done(struct stripe_request *stripe_req, int status)
+{
+	struct raid5f_write_batch *batch = raid5f_stripe_req_write_batch(stripe_req);
+	struct raid_bdev_io *raid_io;
+	uint32_t i;
+
+	if (status != 0) {
+		batch->xor_failed = true;
+	}
+
+	assert(batch->xor_remaining > 0);
+	if (--batch->xor_remaining > 0) {
+		return;
+	}
+
+	if (batch->xor_failed) {
+		for (i = 0; i < batch->num_stripes; i++) {
+			stripe_req = batch->stripe_reqs[i];
+			raid_io = stripe_req->raid_io;
+			raid5f_stripe_request_release(stripe_req);
+			raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_FAILED);
+		}
+		raid5f_write_batch_free(batch);
+		return;
+	}
+
+	raid5f_write_batch_poison(batch);
+
+	/* One reference per member plus one held while submitting */
+	batch->remaining = batch->num_members + 1;
+	raid5f_write_batch_submit(batch);
+}
+
+static void
+raid5f_write_batch_stripe_start(struct stripe_request *stripe_req)
+{
+	raid5f_csum_stripe_write(stripe_req);
+	raid5f_stripe_clear_zero(raid5f_ch_to_r5f_info(stripe_req->r5ch), stripe_req->stripe_index);
+
+	if (raid5f_base_channel(stripe_req->raid_io, stripe_req->parity_chunk->index,
+				stripe_req->stripe_index) == NULL) {
+		raid5f_write_batch_xor_done(stripe_req, 0);
+	} else {
+		raid5f_xor_stripe(stripe_req, raid5f_write_batch_xor_done);
+	}
+}
+
+static void
+raid5f_write_batch_locked(void *cb_arg)
+{
+	struct raid5f_write_batch *batch = cb_arg;
+	uint32_t num_stripes = batch->num_stripes;
+	uint32_t i;
+
+	/* The batch may be completed and freed by the last stripe started */
+	for (i = 0; i < num_stripes; i++) {
+		raid5f_write_batch_stripe_start(batch->stripe_reqs[i]);
+	}
+}
+
+/* Undo raid5f_split_write_next_stripe() for the last stripe set up */
+static void
+raid5f_split_write_put_back_stripe(struct raid5f_split_write *split,
+				   struct raid5f_split_write_stripe *stripe)
+{
+	split->blocks_submitted -= stripe->raid_io.num_blocks;
+	raid5f_split_write_stripe_free(stripe);
+}
+
+/*
+ * Start writing up to max_stripes whole stripes from the current block of the split write
+ * as a batch. Returns the number of stripes in the batch, or 0 if the next stripe has to be
+ * written on its own.
+ */
+static uint32_t
+raid5f_split_write_batch_start(struct raid5f_split_write *split, uint32_t max_stripes)
+{
+	struct raid_bdev_io *raid_io = split->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
+	uint64_t offset_blocks = raid_io->offset_blocks + split->blocks_submitted;
+	uint64_t stripe_index = offset_blocks / r5f_info->stripe_blocks;
+	size_t strip_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+	struct raid5f_split_write_stripe *stripe;
+	struct raid5f_write_batch_member *member;
+	struct raid5f_write_batch *batch;
+	struct stripe_request *stripe_req;
+	uint32_t num_stripes, i;
+	uint8_t idx;
+	int ret;
+
+	/*
+	 * The separate metadata of a member isn't contiguous in the write's buffer and the
+	 * parity buffers can't be written along with buffers of a memory domain.
+	 */
+	if (raid_io->md_buf != NULL || raid_io->memory_domain != NULL ||
+	    offset_blocks % r5f_info->stripe_blocks != 0) {
+		return 0;
+	}
+
+	num_stripes = (raid_io->num_blocks - split->blocks_submitted) / r5f_info->stripe_blocks;
+	num_stripes = spdk_min(num_stripes, spdk_min(max_stripes, RAID5F_WRITE_BATCH_MAX));
+
+	/* All stripes must be written to the same members */
+	for (i = 1; i < num_stripes; i++) {
+		for (idx = 0; idx < raid_bdev->num_base_bdevs; idx++) {
+			if ((raid5f_base_channel(raid_io, idx, stripe_index) == NULL) !=
+			    (raid5f_base_channel(raid_io, idx, stripe_index + i) == NULL)) {
+				break;
+			}
+		}
+		if (idx < raid_bdev->num_base_bdevs) {
+			break;
+		}
+	}
+	num_stripes = spdk_min(num_stripes, i);
+
+	if (num_stripes < 2) {
+		return 0;
+	}
+
+	batch = calloc(1, sizeof(*batch) + raid_bdev->num_base_bdevs * sizeof(batch->members[0]));
+	if (!batch) {
+		return 0;
+	}
+
+	batch->num_members = raid_bdev->num_base_bdevs;
+	for (idx = 0; idx < raid_bdev->num_base_bdevs; idx++) {
+		batch->members[idx].batch = batch;
+		batch->members[idx].idx = idx;
+	}
+
+	for (i = 0; i < num_stripes; i++) {
+		stripe = raid5f_split_write_next_stripe(split);
+		if (!stripe) {
+			break;
+		}
+
+		stripe_req = raid5f_stripe_request_peek(r5ch, STRIPE_REQ_WRITE);
+		if (!stripe_req) {
+			raid5f_split_write_put_back_stripe(split, stripe);
+			break;
+		}
+
+		raid5f_stripe_request_init(stripe_req, &stripe->raid_io, stripe_index + i);
+		stripe_req->write.parity_deferred = false;
+		stripe_req->write.poison_chunk = raid5f_stripe_poison_pick(stripe_req);
+
+		if (raid5f_stripe_request_map_iovecs(stripe_req) != 0) {
+			raid5f_split_write_put_back_stripe(split, stripe);
+			break;
+		}
+
+		raid5f_stripe_request_take(stripe_req);
+
+		stripe->batch = batch;
+		stripe->raid_io.module_private = stripe_req;
+		stripe->raid_io.base_bdev_io_remaining = raid_bdev->num_base_bdevs;
+		batch->stripe_reqs[i] = stripe_req;
+	}
+	batch->num_stripes = i;
+
+	/* The chunks of a member in consecutive stripes are contiguous on its base bdev */
+	ret = batch->num_stripes > 0 ? 0 : -ENOMEM;
+	for (idx = 0; idx < raid_bdev->num_base_bdevs && ret == 0; idx++) {
+		member = &batch->members[idx];
+		for (i = 0; i < batch->num_stripes && ret == 0; i++) {
+			struct chunk *chunk = &batch->stripe_reqs[i]->chunks[idx];
+
+			ret = raid5f_iovs_append_slice(&member->iovs, &member->iovcnt,
+						       &member->iovcnt_max, chunk->iovs, chunk->iovcnt,
+						       0, strip_len);
+		}
+	}
+
+	if (ret != 0) {
+		for (i = batch->num_stripes; i > 0; i--) {
+			stripe_req = batch->stripe_reqs[i - 1];
+			stripe = SPDK_CONTAINEROF(stripe_req->raid_io, struct raid5f_split_write_stripe,
+						  raid_io);
+			raid5f_stripe_request_release(stripe_req);
+			raid5f_split_write_put_back_stripe(split, stripe);
+		}
+		raid5f_write_batch_free(batch);
+		return 0;
+	}
+
+	num_stripes = batch->num_stripes;
+	batch->xor_remaining = num_stripes;
+	split->active += num_stripes;
+
+	for (i = 0; i < num_stripes; i++) {
+		raid5f_stripe_gen_bump(r5f_info, batch->stripe_reqs[i]->stripe_index);
+	}
+
+	if (raid5f_range_lock(&batch->lock, r5f_info, stripe_index, num_stripes, true,
+			      raid5f_write_batch_locked, batch)) {
+		raid5f_write_batch_locked(batch);
+	}
+
+	return num_stripes;
+}
+
+/*
+ * Submit stripe writes until RAID5F_SPLIT_WRITE_DEPTH are in progress, and complete the write
+ * when none are left. Consecutive whole stripes are written in batches. If some stripe can't
+ * get a resource while no other stripe write is in progress to free one, the whole write
+ * completes with NOMEM. The bdev layer then retries it from the start, rewriting the stripes
+ * already written with the same data.
+ */
+static void
+raid5f_split_write_submit(struct raid5f_split_write *split)
+{
+	struct raid_bdev_io *raid_io = split->raid_io;
+	struct raid5f_split_write_stripe *stripe;
+	enum spdk_bdev_io_status status;
+	uint32_t max_stripes;
+	int ret;
+
+	split->submitting = true;
+
+	while (split->active < RAID5F_SPLIT_WRITE_DEPTH &&
+	       split->status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+		stripe = TAILQ_FIRST(&split->retry_queue);
+		if (stripe != NULL) {
+			TAILQ_REMOVE(&split->retry_queue, stripe, link);
+		} else if (split->blocks_submitted < raid_io->num_blocks) {
+			max_stripes = RAID5F_SPLIT_WRITE_DEPTH - split->active;
+			if (raid5f_split_write_batch_start(split, max_stripes) > 0) {
+				continue;
+			}
+
+			stripe = raid5f_split_write_next_stripe(split);
+			if (!stripe) {
+				split->status = SPDK_BDEV_IO_STATUS_NOMEM;
+				break;
+			}
+		} else {
+			break;
+		}
+
+		/* The regions of the whole write are already in the write-intent bitmap */
+		split->active++;
+		ret = raid5f_submit_array_write(&stripe->raid_io);
+		if (spdk_unlikely(ret == -ENOMEM)) {
+			split->active--;
+			TAILQ_INSERT_HEAD(&split->retry_queue, stripe, link);
+			break;
+		} else if (spdk_unlikely(ret != 0)) {
+			split->active--;
+			split->status = SPDK_BDEV_IO_STATUS_FAILED;
+			raid5f_split_write_stripe_free(stripe);
+			break;
+		}
+	}
+
+	split->submitting = false;
+
+	if (split->active > 0) {
+		return;
+	}
+
+	if (split->status == SPDK_BDEV_IO_STATUS_SUCCESS &&
+	    (!TAILQ_EMPTY(&split->retry_queue) || split->blocks_submitted < raid_io->num_blocks)) {
+		split->status = SPDK_BDEV_IO_STATUS_NOMEM;
+	}
+
+	while ((stripe = TAILQ_FIRST(&split->retry_queue)) != NULL) {
+		TAILQ_REMOVE(&split->retry_queue, stripe, link);
+		raid5f_split_write_stripe_free(stripe);
+	}
+
+	status = split->status;
+	free(split);
+
+	if (status == SPDK_BDEV_IO_STATUS_NOMEM) {
+		raid5f_io_complete_nomem(raid_io);
+	} else {
+		raid_bdev_io_complete(raid_io, status);
+	}
+}
+
+static int
+raid5f_submit_split_write_request(struct raid_bdev_io *raid_io)
+{
+	struct raid5f_split_write *split;
+
+	split = calloc(1, sizeof(*split));
+	if (!split) {
+		return -ENOMEM;
+	}
+
+	split->raid_io = raid_io;
+	split->status = SPDK_BDEV_IO_STATUS_SUCCESS;
+	TAILQ_INIT(&split->retry_queue);
+
+	raid_io->module_private = split;
+
+	raid5f_split_write_submit(split);
+
+	return 0;
+}
+
+static void raid5f_submit_rw_request(struct raid_bdev_io *raid_io);
+static void raid5f_submit_null_payload_request(struct raid_bdev_io *raid_io);
+static void raid5f_submit_flush_request(struct raid_bdev_io *raid_io);
+static void raid5f_cache_stop_entry_done(struct raid5f_cache_stop *stop, bool failed);
+
+static inline struct raid5f_cache_bucket *
+raid5f_cache_bucket(struct raid5f_cache *cache, uint64_t stripe_index)
+{
+	return &cache->buckets[stripe_index & cache->buckets_mask];
+}
+
+static struct raid5f_cache_entry *
+raid5f_cache_lookup(struct raid5f_cache *cache, uint64_t stripe_index)
+{
+	struct raid5f_cache_entry *entry;
+
+	TAILQ_FOREACH(entry, raid5f_cache_bucket(cache, stripe_index), hash_link) {
+		if (entry->stripe_index == stripe_index) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static inline bool
+raid5f_cache_block_dirty(struct raid5f_cache_entry *entry, uint64_t block)
+{
+	return entry->dirty[block / 64] & (1ULL << (block % 64));
+}
+
+static uint64_t
+raid5f_cache_count_dirty(struct raid5f_cache_entry *entry, uint64_t offset, uint64_t num_blocks)
+{
+	uint64_t count = 0;
+	uint64_t i;
+
+	for (i = offset; i < offset + num_blocks; i++) {
+		if (raid5f_cache_block_dirty(entry, i)) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static void
+raid5f_cache_entry_release(struct raid5f_cache *cache, struct raid5f_cache_entry *entry,
+			   uint64_t stripe_blocks)
+{
+	assert(spdk_spin_held(&cache->lock));
+	assert(TAILQ_EMPTY(&entry->waiters));
+
+	TAILQ_REMOVE(raid5f_cache_bucket(cache, entry->stripe_index), entry, hash_link);
+	memset(entry->dirty, 0, SPDK_CEIL_DIV(stripe_blocks, 64) * sizeof(uint64_t));
+	entry->dirty_blocks = 0;
+	entry->state = RAID5F_CACHE_ENTRY_FREE;
+	TAILQ_INSERT_HEAD(&cache->free_entries, entry, link);
+}
+
+/* Mark a dirty entry as being flushed. The flush must be started after releasing the lock. */
+static void
+raid5f_cache_entry_start_flush(struct raid5f_cache *cache, struct raid5f_cache_entry *entry)
+{
+	assert(spdk_spin_held(&cache->lock));
+	assert(entry->state == RAID5F_CACHE_ENTRY_DIRTY);
+
+	TAILQ_REMOVE(&cache->dirty_entries, entry, link);
+	entry->state = RAID5F_CACHE_ENTRY_FLUSHING;
+	TAILQ_INSERT_TAIL(&cache->flushing_entries, entry, link);
+}
+
+static int
+raid5f_cache_entry_add_waiter(struct raid5f_cache_entry *entry, struct raid_bdev_io *raid_io)
+{
+	struct raid5f_cache_waiter *waiter;
+
+	waiter = calloc(1, sizeof(*waiter));
+	if (!waiter) {
+		return -ENOMEM;
+	}
+
+	waiter->raid_io = raid_io;
+	waiter->thread = spdk_get_thread();
+	TAILQ_INSERT_TAIL(&entry->waiters, waiter, link);
+
+	return 0;
+}
+
+static void
+raid5f_cache_waiter_resume(void *ctx)
+{
+	struct raid5f_cache_waiter *waiter = ctx;
+	struct raid_bdev_io *raid_io = waiter->raid_io;
+	struct raid5f_cache_stop *stop = waiter->stop;
+	bool failed = waiter->failed;
+
+	free(waiter);
+
+	if (stop != NULL) {
+		raid5f_cache_stop_entry_done(stop, failed);
+		return;
+	}
+
+	if (raid_io->type != SPDK_BDEV_IO_TYPE_FLUSH) {
+		raid5f_submit_rw_request(raid_io);
+		return;
+	}
+
+	/* A flush request waits for all stripes which were dirty when it was submitted */
+	if (failed) {
+		raid_io->base_bdev_io_status = SPDK_BDEV_IO_STATUS_FAILED;
+	}
+
+	assert(raid_io->base_bdev_io_remaining > 0);
+	if (--raid_io->base_bdev_io_remaining > 0) {
+		return;
+	}
+
+	if (raid_io->base_bdev_io_status != SPDK_BDEV_IO_STATUS_SUCCESS) {
+		raid_bdev_io_complete(raid_io, raid_io->base_bdev_io_status);
+	} else {
+		raid5f_submit_flush_request(raid_io);
+	}
+}
+
+static void
+raid5f_cache_entry_flush_done(struct raid_bdev *raid_bdev, struct raid5f_cache_entry *entry,
+			      enum spdk_bdev_io_status status)
+{
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_cache *cache = r5f_info->cache;
+	struct raid5f_cache_waiter *waiter;
+	TAILQ_HEAD(, raid5f_cache_waiter) waiters;
+
+	TAILQ_INIT(&waiters);
+
+	spdk_spin_lock(&cache->lock);
+	assert(entry->state == RAID5F_CACHE_ENTRY_FLUSHING);
+	TAILQ_REMOVE(&cache->flushing_entries, entry, link);
+	TAILQ_CONCAT(&waiters, &entry->waiters, link);
+
+	if (status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+		raid5f_cache_entry_release(cache, entry, r5f_info->stripe_blocks);
+	} else {
+		SPDK_ERRLOG("Failed to flush stripe %" PRIu64 " of raid bdev %s from stripe cache\n",
+			    entry->stripe_index, raid_bdev->bdev.name);
+		/* Keep the data and retry after the flush timeout */
+		entry->state = RAID5F_CACHE_ENTRY_DIRTY;
+		entry->dirty_tsc = spdk_get_ticks();
+		TAILQ_INSERT_TAIL(&cache->dirty_entries, entry, link);
+	}
+	spdk_spin_unlock(&cache->lock);
+
+	while ((waiter = TAILQ_FIRST(&waiters))) {
+		TAILQ_REMOVE(&waiters, waiter, link);
+		waiter->failed = status != SPDK_BDEV_IO_STATUS_SUCCESS;
+		spdk_thread_send_msg(waiter->thread, raid5f_cache_waiter_resume, waiter);
+	}
+}
+
+static void
+raid5f_cache_flush_done(struct raid5f_cache_flush *flush, enum spdk_bdev_io_status status)
+{
+	struct raid_bdev *raid_bdev = spdk_io_channel_get_io_device(flush->ch);
+	struct raid5f_cache_entry *entry = flush->entry;
+
+	spdk_put_io_channel(flush->ch);
+	free(flush);
+
+	raid5f_cache_entry_flush_done(raid_bdev, entry, status);
+}
+
+static void raid5f_cache_flush_next(struct raid5f_cache_flush *flush);
+
+static void
+raid5f_cache_flush_write_done(struct raid_bdev_io *raid_io, enum spdk_bdev_io_status status)
+{
+	struct raid5f_cache_flush *flush = SPDK_CONTAINEROF(raid_io, struct raid5f_cache_flush, raid_io);
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+
+	__atomic_fetch_sub(&r5f_info->cache_flushes_active, 1, __ATOMIC_SEQ_CST);
+
+	if (status != SPDK_BDEV_IO_STATUS_SUCCESS) {
+		raid5f_cache_flush_done(flush, status);
+	} else {
+		raid5f_cache_flush_next(flush);
+	}
+}
+
+static void
+raid5f_cache_flush_submit(struct raid5f_cache_flush *flush)
+{
+	struct raid5f_info *r5f_info = flush->raid_io.raid_bdev->module_private;
+	uint64_t stripe_index = flush->entry->stripe_index;
+	struct raid5f_io_channel *r5ch;
+	int ret;
+
+	/*
+	 * Flushes bypass the bdev layer, so they don't wait for the stripes quiesced by the
+	 * rebuild. Announce the flush before checking the window, the rebuild sets the window
+	 * before waiting for the announced flushes to complete.
+	 */
+	__atomic_fetch_add(&r5f_info->cache_flushes_active, 1, __ATOMIC_SEQ_CST);
+	if (spdk_unlikely(stripe_index >= __atomic_load_n(&r5f_info->rebuild_checkpoint,
+			  __ATOMIC_SEQ_CST) &&
+			  stripe_index < __atomic_load_n(&r5f_info->rebuild_window_end, __ATOMIC_SEQ_CST))) {
+		ret = -ENOMEM;
+	} else {
+		ret = raid5f_submit_array_request(&flush->raid_io);
+	}
+
+	if (spdk_unlikely(ret != 0)) {
+		__atomic_fetch_sub(&r5f_info->cache_flushes_active, 1, __ATOMIC_SEQ_CST);
+	}
+
+	if (spdk_unlikely(ret == -ENOMEM)) {
+		r5ch = spdk_io_channel_get_ctx(flush->raid_io.raid_ch->module_channel);
+		TAILQ_INSERT_TAIL(&r5ch->cache_flush_retry_queue, flush, link);
+	} else if (spdk_unlikely(ret != 0)) {
+		raid5f_cache_flush_done(flush, SPDK_BDEV_IO_STATUS_FAILED);
+	}
+}
+
+/* Write the next contiguous range of dirty blocks of the stripe */
+static void
+raid5f_cache_flush_next(struct raid5f_cache_flush *flush)
+{
+	struct raid5f_cache_entry *entry = flush->entry;
+	struct raid_bdev *raid_bdev = spdk_io_channel_get_io_device(flush->ch);
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	uint64_t start, end;
+	void *md_buf = NULL;
+
+	start = flush->offset;
+	while (start < r5f_info->stripe_blocks && !raid5f_cache_block_dirty(entry, start)) {
+		start++;
+	}
+
+	if (start == r5f_info->stripe_blocks) {
+		raid5f_cache_flush_done(flush, SPDK_BDEV_IO_STATUS_SUCCESS);
+		return;
+	}
+
+	end = start + 1;
+	while (end < r5f_info->stripe_blocks && raid5f_cache_block_dirty(entry, end)) {
+		end++;
+	}
+
+	flush->offset = end;
+	flush->iov.iov_base = entry->buf + (start << raid_bdev->blocklen_shift);
+	flush->iov.iov_len = (end - start) << raid_bdev->blocklen_shift;
+	if (entry->md_buf) {
+		md_buf = entry->md_buf + start * md_size;
+	}
+
+	raid_bdev_io_init(&flush->raid_io, spdk_io_channel_get_ctx(flush->ch), SPDK_BDEV_IO_TYPE_WRITE,
+			  entry->stripe_index * r5f_info->stripe_blocks + start, end - start,
+			  &flush->iov, 1, md_buf, NULL, NULL);
+	flush->raid_io.completion_cb = raid5f_cache_flush_write_done;
+
+	raid5f_cache_flush_submit(flush);
+}
+
+/* Start writing an entry marked as flushing to the array from the current thread */
+static void
+raid5f_cache_flush_entry(struct raid_bdev *raid_bdev, struct raid5f_cache_entry *entry)
+{
+	struct raid5f_cache_flush *flush;
+
+	flush = calloc(1, sizeof(*flush));
+	if (!flush) {
+		SPDK_ERRLOG("Failed to allocate stripe cache flush\n");
+		raid5f_cache_entry_flush_done(raid_bdev, entry, SPDK_BDEV_IO_STATUS_FAILED);
+		return;
+	}
+
+	flush->entry = entry;
+	flush->ch = spdk_get_io_channel(raid_bdev);
+	if (!flush->ch) {
+		SPDK_ERRLOG("Failed to get io channel for stripe cache flush\n");
+		free(flush);
+		raid5f_cache_entry_flush_done(raid_bdev, entry, SPDK_BDEV_IO_STATUS_FAILED);
+		return;
+	}
+
+	raid5f_cache_flush_next(flush);
+}
+
+/*
+ * Handle a write in the stripe cache. Returns true if the write was completed
+ * or queued by the cache, false if it must be written to the array.
+ */
+static bool
+raid5f_cache_submit_write(struct raid_bdev_io *raid_io)
+{
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_cache *cache = r5f_info->cache;
+	uint64_t stripe_index = raid_io->offset_blocks / r5f_info->stripe_blocks;
+	uint64_t stripe_offset = raid_io->offset_blocks % r5f_info->stripe_blocks;
+	uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	struct raid5f_cache_entry *entry, *flush_entry = NULL;
+	struct iovec iov;
+	uint64_t i;
+
+	spdk_spin_lock(&cache->lock);
+
+	entry = raid5f_cache_lookup(cache, stripe_index);
+	if (entry != NULL && entry->state == RAID5F_CACHE_ENTRY_FLUSHING) {
+		/* Don't modify the data being flushed, retry when the flush is done */
+		if (raid5f_cache_entry_add_waiter(entry, raid_io) != 0) {
+			spdk_spin_unlock(&cache->lock);
+			raid5f_io_complete_nomem(raid_io);
+		} else {
+			spdk_spin_unlock(&cache->lock);
+		}
+		return true;
+	}
+
+	if (raid_io->num_blocks == r5f_info->stripe_blocks) {
+		/* A full stripe write doesn't need the cache and supersedes the cached data */
+		if (entry != NULL) {
+			TAILQ_REMOVE(&cache->dirty_entries, entry, link);
+			raid5f_cache_entry_release(cache, entry, r5f_info->stripe_blocks);
+		}
+		spdk_spin_unlock(&cache->lock);
+		return false;
+	}
+
+	if (cache->stopping) {
+		/* Write through the cache, after flushing the cached data of the stripe */
+		if (entry == NULL) {
+			spdk_spin_unlock(&cache->lock);
+			return false;
+		}
+
+		if (raid5f_cache_entry_add_waiter(entry, raid_io) != 0) {
+			spdk_spin_unlock(&cache->lock);
+			raid5f_io_complete_nomem(raid_io);
+			return true;
+		}
+		raid5f_cache_entry_start_flush(cache, entry);
+		spdk_spin_unlock(&cache->lock);
+
+		raid5f_cache_flush_entry(raid_bdev, entry);
+		return true;
+	}
+
+	if (entry == NULL) {
+		entry = TAILQ_FIRST(&cache->free_entries);
+		if (entry == NULL) {
+			/* The cache is full, make room and write this one to the array */
+			flush_entry = TAILQ_FIRST(&cache->dirty_entries);
+			if (flush_entry != NULL) {
+				raid5f_cache_entry_start_flush(cache, flush_entry);
+			}
+			spdk_spin_unlock(&cache->lock);
+
+			if (flush_entry != NULL) {
+				raid5f_cache_flush_entry(raid_bdev, flush_entry);
+			}
+			return false;
+		}
+
+		TAILQ_REMOVE(&cache->free_entries, entry, link);
+		entry->stripe_index = stripe_index;
+		entry->state = RAID5F_CACHE_ENTRY_DIRTY;
+		entry->dirty_tsc = spdk_get_ticks();
+		TAILQ_INSERT_HEAD(raid5f_cache_bucket(cache, stripe_index), entry, hash_link);
+		TAILQ_INSERT_TAIL(&cache->dirty_entries, entry, link);
+	}
+
+	iov.iov_base = entry->buf + (stripe_offset << raid_bdev->blocklen_shift);
+	iov.iov_len = raid_io->num_blocks << raid_bdev->blocklen_shift;
+	spdk_iovcpy(raid_io->iovs, raid_io->iovcnt, &iov, 1);
+
+	if (entry->md_buf && raid_io->md_buf) {
+		memcpy(entry->md_buf + stripe_offset * md_size, raid_io->md_buf,
+		       raid_io->num_blocks * md_size);
+	}
+
+	for (i = stripe_offset; i < stripe_offset + raid_io->num_blocks; i++) {
+		if (!raid5f_cache_block_dirty(entry, i)) {
+			entry->dirty[i / 64] |= 1ULL << (i % 64);
+			entry->dirty_blocks++;
+		}
+	}
+
+	if (entry->dirty_blocks == r5f_info->stripe_blocks) {
+		/* The stripe is complete, write it to the array with a full stripe write */
+		raid5f_cache_entry_start_flush(cache, entry);
+		flush_entry = entry;
+	}
+
+	spdk_spin_unlock(&cache->lock);
+
+	raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_SUCCESS);
+
+	if (flush_entry != NULL) {
+		raid5f_cache_flush_entry(raid_bdev, flush_entry);
+	}
+
+	return true;
+}
+
+/*
+ * Handle a read in the stripe cache. Returns true if the read was completed
+ * or queued by the cache, false if it must be read from the array.
+ */
+static bool
+raid5f_cache_submit_read(struct raid_bdev_io *raid_io)
+{
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_cache *cache = r5f_info->cache;
+	uint64_t stripe_index = raid_io->offset_blocks / r5f_info->stripe_blocks;
+	uint64_t stripe_offset = raid_io->offset_blocks % r5f_info->stripe_blocks;
+	uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	struct raid5f_cache_entry *entry;
+	uint64_t dirty_blocks;
+	struct iovec iov;
+
+	spdk_spin_lock(&cache->lock);
+
+	entry = raid5f_cache_lookup(cache, stripe_index);
+	if (entry == NULL) {
+		spdk_spin_unlock(&cache->lock);
+		return false;
+	}
+
+	dirty_blocks = raid5f_cache_count_dirty(entry, stripe_offset, raid_io->num_blocks);
+	if (dirty_blocks == 0) {
+		spdk_spin_unlock(&cache->lock);
+		return false;
+	}
+
+	if (dirty_blocks == raid_io->num_blocks) {
+		iov.iov_base = entry->buf + (stripe_offset << raid_bdev->blocklen_shift);
+		iov.iov_len = raid_io->num_blocks << raid_bdev->blocklen_shift;
+		spdk_iovcpy(&iov, 1, raid_io->iovs, raid_io->iovcnt);
+
+		if (entry->md_buf && raid_io->md_buf) {
+			memcpy(raid_io->md_buf, entry->md_buf + stripe_offset * md_size,
+			       raid_io->num_blocks * md_size);
+		}
+
+		spdk_spin_unlock(&cache->lock);
+		raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_SUCCESS);
+		return true;
+	}
+
+	/* Partially cached, flush the stripe and read it from the array afterwards */
+	if (raid5f_cache_entry_add_waiter(entry, raid_io) != 0) {
+		spdk_spin_unlock(&cache->lock);
+		raid5f_io_complete_nomem(raid_io);
+		return true;
+	}
+
+	if (entry->state == RAID5F_CACHE_ENTRY_DIRTY) {
+		raid5f_cache_entry_start_flush(cache, entry);
+	} else {
+		entry = NULL;
+	}
+
+	spdk_spin_unlock(&cache->lock);
+
+	if (entry != NULL) {
+		raid5f_cache_flush_entry(raid_bdev, entry);
+	}
+
+	return true;
+}
+
+/*
+ * Flush all stripes dirty in the cache before a flush request. Returns true
+ * if the request was completed or waits for stripes being flushed.
+ */
+static bool
+raid5f_cache_submit_flush(struct raid_bdev_io *raid_io)
+{
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_cache *cache = r5f_info->cache;
+	struct raid5f_cache_entry *entry, *tmp;
+	struct raid5f_cache_entry **flush_entries = NULL;
+	struct raid5f_cache_waiter **waiters = NULL;
+	uint32_t num_dirty = 0, num_flushing = 0;
+	uint32_t i;
+
+	spdk_spin_lock(&cache->lock);
+
+	TAILQ_FOREACH(entry, &cache->dirty_entries, link) {
+		num_dirty++;
+	}
+	TAILQ_FOREACH(entry, &cache->flushing_entries, link) {
+		num_flushing++;
+	}
+
+	if (num_dirty + num_flushing == 0) {
+		spdk_spin_unlock(&cache->lock);
+		return false;
+	}
+
+	/* Allocate everything first, so that failing leaves the cache untouched */
+	waiters = calloc(num_dirty + num_flushing, sizeof(*waiters));
+	flush_entries = calloc(num_dirty + 1, sizeof(*flush_entries));
+	if (!waiters || !flush_entries) {
+		goto nomem;
+	}
+
+	for (i = 0; i < num_dirty + num_flushing; i++) {
+		waiters[i] = calloc(1, sizeof(**waiters));
+		if (!waiters[i]) {
+			goto nomem;
+		}
+		waiters[i]->raid_io = raid_io;
+		waiters[i]->thread = spdk_get_thread();
+	}
+
+	i = 0;
+	TAILQ_FOREACH_SAFE(entry, &cache->dirty_entries, link, tmp) {
+		raid5f_cache_entry_start_flush(cache, entry);
+		flush_entries[i++] = entry;
+	}
+
+	i = 0;
+	TAILQ_FOREACH(entry, &cache->flushing_entries, link) {
+		TAILQ_INSERT_TAIL(&entry->waiters, waiters[i++], link);
+	}
+	assert(i == num_dirty + num_flushing);
+
+	raid_io->base_bdev_io_remaining = num_dirty + num_flushing;
+
+	spdk_spin_unlock(&cache->lock);
+
+	for (i = 0; i < num_dirty; i++) {
+		raid5f_cache_flush_entry(raid_bdev, flush_entries[i]);
+	}
+
+	free(flush_entries);
+	free(waiters);
+
+	return true;
+nomem:
+	spdk_spin_unlock(&cache->lock);
+
+	if (waiters) {
+		for (i = 0; i < num_dirty + num_flushing; i++) {
+			free(waiters[i]);
+		}
+	}
+	free(waiters);
+	free(flush_entries);
+
+	raid5f_io_complete_nomem(raid_io);
+
+	return true;
+}
+
+static int
+raid5f_cache_poll(void *ctx)
+{
+	struct raid5f_io_channel *r5ch = ctx;
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(r5ch);
+	struct raid5f_cache *cache = r5f_info->cache;
+	struct raid5f_cache_entry *entry;
+	struct raid5f_cache_flush *flush;
+	uint64_t now = spdk_get_ticks();
+	int rc = SPDK_POLLER_IDLE;
+
+	flush = TAILQ_FIRST(&r5ch->cache_flush_retry_queue);
+	if (flush != NULL) {
+		TAILQ_REMOVE(&r5ch->cache_flush_retry_queue, flush, link);
+		raid5f_cache_flush_submit(flush);
+		rc = SPDK_POLLER_BUSY;
+	}
+
+	while (true) {
+		spdk_spin_lock(&cache->lock);
+		entry = TAILQ_FIRST(&cache->dirty_entries);
+		if (entry == NULL || cache->stopping ||
+		    now - entry->dirty_tsc < cache->flush_timeout_ticks) {
+			spdk_spin_unlock(&cache->lock);
+			break;
+		}
+		raid5f_cache_entry_start_flush(cache, entry);
+		spdk_spin_unlock(&cache->lock);
+
+		raid5f_cache_flush_entry(r5f_info->raid_bdev, entry);
+		rc = SPDK_POLLER_BUSY;
+	}
+
+	return rc;
+}
+
+static void
+raid5f_cache_stop_entry_done(struct raid5f_cache_stop *stop, bool failed)
+{
+	struct raid_bdev *raid_bdev = stop->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_cache *cache = r5f_info->cache;
+
+	if (failed) {
+		stop->failed = true;
+	}
+
+	assert(stop->remaining > 0);
+	if (--stop->remaining > 0) {
+		return;
+	}
+
+	if (stop->failed) {
+		SPDK_ERRLOG("Failed to flush stripe cache of raid bdev %s\n", raid_bdev->bdev.name);
+		/* The data is kept in the cache, which is used again if the stop is aborted */
+		spdk_spin_lock(&cache->lock);
+		cache->stopping = false;
+		spdk_spin_unlock(&cache->lock);
+	}
+
+	stop->cb_fn(stop->cb_ctx, stop->failed ? -EIO : 0);
+	free(stop);
+}
+
+/*
+ * Flush all dirty stripes of the cache to the array and stop caching writes. Returns 0 if
+ * cb_fn is called when the stripes are flushed, -ENOENT if there was nothing to flush.
+ */
+static int
+raid5f_cache_stop_with_cb(struct raid_bdev *raid_bdev, raid_bdev_stop_background_cb cb_fn,
+			  void *cb_ctx)
+{
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_cache *cache = r5f_info->cache;
+	struct raid5f_cache_entry *entry, *tmp;
+	struct raid5f_cache_entry **flush_entries = NULL;
+	struct raid5f_cache_waiter **waiters = NULL;
+	struct raid5f_cache_stop *stop = NULL;
+	uint32_t num_dirty = 0, num_flushing = 0;
+	uint32_t i;
+
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
+
+	spdk_spin_lock(&cache->lock);
+
+	cache->stopping = true;
+
+	TAILQ_FOREACH(entry, &cache->dirty_entries, link) {
+		num_dirty++;
+	}
+	TAILQ_FOREACH(entry, &cache->flushing_entries, link) {
+		num_flushing++;
+	}
+
+	if (num_dirty + num_flushing == 0) {
+		spdk_spin_unlock(&cache->lock);
+		return -ENOENT;
+	}
+
+	stop = calloc(1, sizeof(*stop));
+	waiters = calloc(num_dirty + num_flushing, sizeof(*waiters));
+	flush_entries = calloc(num_dirty + 1, sizeof(*flush_entries));
+	if (!stop || !waiters || !flush_entries) {
+		goto nomem;
+	}
+
+	for (i = 0; i < num_dirty + num_flushing; i++) {
+		waiters[i] = calloc(1, sizeof(**waiters));
+		if (!waiters[i]) {
+			goto nomem;
+		}
+		waiters[i]->stop = stop;
+		waiters[i]->thread = spdk_get_thread();
+	}
+
+	stop->raid_bdev = raid_bdev;
+	stop->cb_fn = cb_fn;
+	stop->cb_ctx = cb_ctx;
+	stop->remaining = num_dirty + num_flushing;
+
+	i = 0;
+	TAILQ_FOREACH_SAFE(entry, &cache->dirty_entries, link, tmp) {
+		raid5f_cache_entry_start_flush(cache, entry);
+		flush_entries[i++] = entry;
+	}
+
+	i = 0;
+	TAILQ_FOREACH(entry, &cache->flushing_entries, link) {
+		TAILQ_INSERT_TAIL(&entry->waiters, waiters[i++], link);
+	}
+	assert(i == num_dirty + num_flushing);
+
+	spdk_spin_unlock(&cache->lock);
+
+	SPDK_NOTICELOG("Flushing %" PRIu32 " stripes from stripe cache of raid bdev %s\n",
+		       num_dirty + num_flushing, raid_bdev->bdev.name);
+
+	for (i = 0; i < num_dirty; i++) {
+		raid5f_cache_flush_entry(raid_bdev, flush_entries[i]);
+	}
+
+	free(flush_entries);
+	free(waiters);
+
+	return 0;
+nomem:
+	cache->stopping = false;
+	spdk_spin_unlock(&cache->lock);
+
+	if (waiters) {
+		for (i = 0; i < num_dirty + num_flushing; i++) {
+			free(waiters[i]);
+		}
+	}
+	free(waiters);
+	free(flush_entries);
+	free(stop);
+
+	return -ENOMEM;
+}
+
+/*
+ * I/O with buffers of a memory domain. The module accesses the data of reads and writes for
+ * parity and verification, so it is served through local buffers which accel copies from the
+ * memory domain before a write and to it after a read.
+ */
+struct raid5f_domain_io {
+	struct raid_bdev_io raid_io;
+	struct raid_bdev_io *parent;
+	struct raid5f_io_channel *r5ch;
+	struct iovec iov;
+	struct iovec md_iov;
+	struct iovec parent_md_iov;
+};
+
+static void
+raid5f_domain_io_free(struct raid5f_domain_io *domain_io)
+{
+	if (domain_io->iov.iov_base != NULL) {
+		raid5f_buf_put(domain_io->r5ch, domain_io->iov.iov_base, domain_io->iov.iov_len);
+	}
+	if (domain_io->md_iov.iov_base != NULL) {
+		raid5f_buf_put(domain_io->r5ch, domain_io->md_iov.iov_base, domain_io->md_iov.iov_len);
+	}
+	free(domain_io);
+}
+
+static void
+raid5f_domain_io_complete(struct raid5f_domain_io *domain_io, enum spdk_bdev_io_status status)
+{
+	struct raid_bdev_io *parent = domain_io->parent;
+
+	raid5f_domain_io_free(domain_io);
+
+	raid_bdev_io_complete(parent, status);
+}
+
+/*
+ * Append copies between the local buffers and those of the parent to a sequence, from the
+ * parent for a write and to it for a read, and execute it.
+ */
+static int
+raid5f_domain_io_copy(struct raid5f_domain_io *domain_io, spdk_accel_completion_cb cb_fn)
+{
+	struct raid_bdev_io *parent = domain_io->parent;
+	struct spdk_io_channel *accel_ch = domain_io->r5ch->accel_ch;
+	struct spdk_accel_sequence *seq = NULL;
+	int ret;
+
+	if (parent->type == SPDK_BDEV_IO_TYPE_WRITE) {
+		ret = spdk_accel_append_copy(&seq, accel_ch, &domain_io->iov, 1, NULL, NULL,
+					     parent->iovs, parent->iovcnt, parent->memory_domain,
+					     parent->memory_domain_ctx, 0, NULL, NULL);
+		if (ret == 0 && parent->md_buf != NULL) {
+			ret = spdk_accel_append_copy(&seq, accel_ch, &domain_io->md_iov, 1, NULL, NULL,
+						     &domain_io->parent_md_iov, 1, parent->memory_domain,
+						     parent->memory_domain_ctx, 0, NULL, NULL);
+		}
+	} else {
+		ret = spdk_accel_append_copy(&seq, accel_ch, parent->iovs, parent->iovcnt,
+					     parent->memory_domain, parent->memory_domain_ctx,
+					     &domain_io->iov, 1, NULL, NULL, 0, NULL, NULL);
+		if (ret == 0 && parent->md_buf != NULL) {
+			ret = spdk_accel_append_copy(&seq, accel_ch, &domain_io->parent_md_iov, 1,
+						     parent->memory_domain, parent->memory_domain_ctx,
+						     &domain_io->md_iov, 1, NULL, NULL, 0, NULL, NULL);
+		}
+	}
+
+	if (spdk_unlikely(ret != 0)) {
+		if (seq != NULL) {
+			spdk_accel_sequence_abort(seq);
+		}
+		return ret;
+	}
+
+	return spdk_accel_sequence_finish(seq, cb_fn, domain_io);
+}
+
+static void
+raid5f_domain_io_pushed(void *cb_arg, int status)
+{
+	raid5f_domain_io_complete(cb_arg, status == 0 ? SPDK_BDEV_IO_STATUS_SUCCESS :
+				  SPDK_BDEV_IO_STATUS_FAILED);
+}
+
+static void
+raid5f_domain_io_done(struct raid_bdev_io *raid_io, enum spdk_bdev_io_status status)
+{
+	struct raid5f_domain_io *domain_io = SPDK_CONTAINEROF(raid_io, struct raid5f_domain_io,
+					     raid_io);
+	int ret;
+
+	if (raid_io->type == SPDK_BDEV_IO_TYPE_READ && status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+		ret = raid5f_domain_io_copy(domain_io, raid5f_domain_io_pushed);
+		if (spdk_unlikely(ret == -ENOMEM)) {
+			struct raid_bdev_io *parent = domain_io->parent;
+
+			raid5f_domain_io_free(domain_io);
+			raid5f_io_complete_nomem(parent);
+		} else if (spdk_unlikely(ret != 0)) {
+			raid5f_domain_io_complete(domain_io, SPDK_BDEV_IO_STATUS_FAILED);
+		}
+		return;
+	}
+
+	raid5f_domain_io_complete(domain_io, status);
+}
+
+static void
+raid5f_domain_io_pulled(void *cb_arg, int status)
+{
+	struct raid5f_domain_io *domain_io = cb_arg;
+
+	if (spdk_unlikely(status != 0)) {
+		raid5f_domain_io_complete(domain_io, SPDK_BDEV_IO_STATUS_FAILED);
+		return;
+	}
+
+	raid5f_submit_rw_request(&domain_io->raid_io);
+}
+
+static int
+raid5f_submit_domain_request(struct raid_bdev_io *raid_io)
+{
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
+	struct raid5f_domain_io *domain_io;
+	int ret;
+
+	domain_io = calloc(1, sizeof(*domain_io));
+	if (!domain_io) {
+		return -ENOMEM;
+	}
+
+	domain_io->parent = raid_io;
+	domain_io->r5ch = r5ch;
+	domain_io->iov.iov_len = raid_io->num_blocks << raid_bdev->blocklen_shift;
+	domain_io->iov.iov_base = raid5f_buf_get(r5ch, domain_io->iov.iov_len);
+	if (!domain_io->iov.iov_base) {
+		raid5f_domain_io_free(domain_io);
+		return -ENOMEM;
+	}
+
+	if (raid_io->md_buf != NULL) {
+		domain_io->md_iov.iov_len = raid_io->num_blocks * spdk_bdev_get_md_size(&raid_bdev->bdev);
+		domain_io->md_iov.iov_base = raid5f_buf_get(r5ch, domain_io->md_iov.iov_len);
+		if (!domain_io->md_iov.iov_base) {
+			raid5f_domain_io_free(domain_io);
+			return -ENOMEM;
+		}
+		domain_io->parent_md_iov.iov_base = raid_io->md_buf;
+		domain_io->parent_md_iov.iov_len = domain_io->md_iov.iov_len;
+	}
+
+	raid_bdev_io_init(&domain_io->raid_io, raid_io->raid_ch, raid_io->type,
+			  raid_io->offset_blocks, raid_io->num_blocks, &domain_io->iov, 1,
+			  domain_io->md_iov.iov_base, NULL, NULL);
+	domain_io->raid_io.completion_cb = raid5f_domain_io_done;
+
+	if (raid_io->type == SPDK_BDEV_IO_TYPE_READ) {
+		raid5f_submit_rw_request(&domain_io->raid_io);
+		return 0;
+	}
+
+	ret = raid5f_domain_io_copy(domain_io, raid5f_domain_io_pulled);
+	if (spdk_unlikely(ret != 0)) {
+		raid5f_domain_io_free(domain_io);
+	}
+
+	return ret;
+}
+
+/*
+ * Part of an I/O forwarded to the owner thread of its stripes in the sharded mode. It is
+ * submitted on the owner's raid bdev io channel and its status is sent back to the thread
+ * the I/O was received on.
+ */
+struct raid5f_owner_io {
+	struct raid_bdev_io raid_io;
+	struct raid5f_owner_fwd *fwd;
+	struct raid5f_owner *owner;
+	uint64_t offset_blocks;
+	uint64_t num_blocks;
+	struct iovec *iovs;
+	int iovcnt;
+	int iovcnt_max;
+	void *md_buf;
+	enum spdk_bdev_io_status status;
+};
+
+struct raid5f_owner_fwd {
+	struct raid_bdev_io *parent;
+	struct spdk_thread *thread;
+	uint32_t num_parts;
+	uint32_t remaining;
+	enum spdk_bdev_io_status status;
+	struct raid5f_owner_io parts[];
+};
+
+static inline struct raid5f_owner *
+raid5f_stripe_owner(struct raid5f_info *r5f_info, uint64_t stripe_index)
+{
+	return &r5f_info->owners[(stripe_index / RAID5F_STRIPE_OWNER_RUN) % r5f_info->num_owners];
+}
+
+static void
+raid5f_owner_fwd_free(struct raid5f_owner_fwd *fwd)
+{
+	uint32_t i;
+
+	for (i = 0; i < fwd->num_parts; i++) {
+		if (fwd->parts[i].iovs != fwd->parent->iovs) {
+			free(fwd->parts[i].iovs);
+		}
+	}
+	free(fwd);
+}
+
+/* Called on the thread the I/O was received on */
+static void
+raid5f_owner_io_returned(void *ctx)
+{
+	struct raid5f_owner_io *part = ctx;
+	struct raid5f_owner_fwd *fwd = part->fwd;
+	struct raid_bdev_io *parent = fwd->parent;
+	enum spdk_bdev_io_status status;
+
+	/* A failure takes precedence over a lack of resources, which retries the whole I/O */
+	if (part->status == SPDK_BDEV_IO_STATUS_FAILED ||
+	    (part->status != SPDK_BDEV_IO_STATUS_SUCCESS &&
+	     fwd->status == SPDK_BDEV_IO_STATUS_SUCCESS)) {
+		fwd->status = part->status;
+	}
+
+	assert(fwd->remaining > 0);
+	if (--fwd->remaining > 0) {
+		return;
+	}
+
+	status = fwd->status;
+	raid5f_owner_fwd_free(fwd);
+
+	if (status == SPDK_BDEV_IO_STATUS_NOMEM) {
+		raid5f_io_complete_nomem(parent);
+	} else {
+		raid_bdev_io_complete(parent, status);
+	}
+}
+
+static void
+raid5f_owner_io_return(struct raid5f_owner_io *part, enum spdk_bdev_io_status status)
+{
+	part->status = status;
+
+	if (spdk_unlikely(spdk_thread_send_msg(part->fwd->thread, raid5f_owner_io_returned,
+					       part) != 0)) {
+		SPDK_ERRLOG("Failed to return the status of a forwarded I/O\n");
+		assert(false);
+	}
+}
+
+static void
+raid5f_owner_io_done(struct raid_bdev_io *raid_io, enum spdk_bdev_io_status status)
+{
+	raid5f_owner_io_return(SPDK_CONTAINEROF(raid_io, struct raid5f_owner_io, raid_io), status);
+}
+
+/* Called on the owner thread */
+static void
+raid5f_owner_io_submit(void *ctx)
+{
+	struct raid5f_owner_io *part = ctx;
+	struct raid5f_owner *owner = part->owner;
+	struct raid_bdev_io *parent = part->fwd->parent;
+
+	if (spdk_unlikely(owner->ch == NULL)) {
+		owner->ch = spdk_get_io_channel(parent->raid_bdev);
+		if (owner->ch == NULL) {
+			raid5f_owner_io_return(part, SPDK_BDEV_IO_STATUS_NOMEM);
+			return;
+		}
+	}
+
+	raid_bdev_io_init(&part->raid_io, spdk_io_channel_get_ctx(owner->ch), parent->type,
+			  part->offset_blocks, part->num_blocks, part->iovs, part->iovcnt, part->md_buf,
+			  NULL, NULL);
+	part->raid_io.completion_cb = raid5f_owner_io_done;
+
+	raid5f_submit_rw_request(&part->raid_io);
+}
+
+/*
+ * Forward the I/O to the owner threads of its stripes, split where the owner changes.
+ * Returns -EAGAIN if the current thread owns all of them, the I/O is then submitted here.
+ */
+static int
+raid5f_owner_forward(struct raid_bdev_io *raid_io)
+{
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	uint64_t run_blocks = r5f_info->stripe_blocks * RAID5F_STRIPE_OWNER_RUN;
+	uint64_t first_run = raid_io->offset_blocks / run_blocks;
+	uint64_t last_run = (raid_io->offset_blocks + raid_io->num_blocks - 1) / run_blocks;
+	uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	struct raid5f_owner *owner = raid5f_stripe_owner(r5f_info,
+				     raid_io->offset_blocks / r5f_info->stripe_blocks);
+	struct raid5f_owner_fwd *fwd;
+	struct raid5f_owner_io *part;
+	uint64_t offset_blocks, end_blocks;
+	uint32_t num_parts, i;
+	int ret;
+
+	/* Consecutive runs of stripes have different owners unless there is only one */
+	num_parts = r5f_info->num_owners == 1 ? 1 : last_run - first_run + 1;
+	if (num_parts == 1 && owner->thread == spdk_get_thread()) {
+		return -EAGAIN;
+	}
+
+	fwd = calloc(1, sizeof(*fwd) + num_parts * sizeof(fwd->parts[0]));
+	if (!fwd) {
+		return -ENOMEM;
+	}
+
+	fwd->parent = raid_io;
+	fwd->thread = spdk_get_thread();
+	fwd->num_parts = num_parts;
+	fwd->status = SPDK_BDEV_IO_STATUS_SUCCESS;
+
+	offset_blocks = raid_io->offset_blocks;
+	for (i = 0; i < num_parts; i++) {
+		part = &fwd->parts[i];
+		end_blocks = i == num_parts - 1 ? raid_io->offset_blocks + raid_io->num_blocks :
+			     (first_run + i + 1) * run_blocks;
+
+		part->fwd = fwd;
+		part->owner = raid5f_stripe_owner(r5f_info,
+						   offset_blocks / r5f_info->stripe_blocks);
+		part->offset_blocks = offset_blocks;
+		part->num_blocks = end_blocks - offset_blocks;
+
+		if (num_parts == 1) {
+			part->iovs = raid_io->iovs;
+			part->iovcnt = raid_io->iovcnt;
+			part->md_buf = raid_io->md_buf;
+			break;
+		}
+
+		ret = raid5f_iovs_append_slice(&part->iovs, &part->iovcnt, &part->iovcnt_max,
+					       raid_io->iovs, raid_io->iovcnt,
+					       (offset_blocks - raid_io->offset_blocks) << raid_bdev->blocklen_shift,
+					       part->num_blocks << raid_bdev->blocklen_shift);
+		if (spdk_unlikely(ret != 0)) {
+			raid5f_owner_fwd_free(fwd);
+			return ret;
+		}
+		if (raid_io->md_buf != NULL) {
+			part->md_buf = raid_io->md_buf + (offset_blocks - raid_io->offset_blocks) * md_size;
+		}
+
+		offset_blocks = end_blocks;
+	}
+
+	fwd->remaining = num_parts;
+	for (i = 0; i < num_parts; i++) {
+		part = &fwd->parts[i];
+		if (part->owner->thread == fwd->thread) {
+			raid5f_owner_io_submit(part);
+		} else if (spdk_thread_send_msg(part->owner->thread, raid5f_owner_io_submit, part) != 0) {
+			part->status = SPDK_BDEV_IO_STATUS_NOMEM;
+			raid5f_owner_io_returned(part);
+		}
+	}
+
+	return 0;
+}
+
+static void
+raid5f_fg_io_complete(struct raid_bdev_io *raid_io, enum spdk_bdev_io_status status)
+{
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+
+	__atomic_fetch_sub(&r5f_info->fg_outstanding, 1, __ATOMIC_RELAXED);
+
+	spdk_bdev_io_complete(spdk_bdev_io_from_ctx(raid_io), status);
+}
+
+static void
+raid5f_submit_rw_request(struct raid_bdev_io *raid_io)
+{
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+	int ret;
+
+	/* Count I/Os from the bdev layer so that the scrubber and the rebuild can yield to them */
+	if (raid_io->completion_cb == NULL &&
+	    (__atomic_load_n(&r5f_info->scrub_active, __ATOMIC_RELAXED) ||
+	     __atomic_load_n(&r5f_info->rebuild_active, __ATOMIC_RELAXED))) {
+		__atomic_fetch_add(&r5f_info->fg_outstanding, 1, __ATOMIC_RELAXED);
+		raid_io->completion_cb = raid5f_fg_io_complete;
+	}
+
+	if (raid_io->memory_domain != NULL) {
+		ret = raid5f_submit_domain_request(raid_io);
+		if (spdk_unlikely(ret == -ENOMEM)) {
+			raid5f_io_complete_nomem(raid_io);
+		} else if (spdk_unlikely(ret)) {
+			raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_FAILED);
+		}
+		return;
+	}
+
+	if (r5f_info->owners != NULL) {
+		ret = raid5f_owner_forward(raid_io);
+		if (ret != -EAGAIN) {
+			if (spdk_unlikely(ret == -ENOMEM)) {
+				raid5f_io_complete_nomem(raid_io);
+			} else if (spdk_unlikely(ret)) {
+				raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_FAILED);
+			}
+			return;
+		}
+	}
+
+	if (r5f_info->cache != NULL) {
+		if (raid_io->type == SPDK_BDEV_IO_TYPE_WRITE && raid5f_cache_submit_write(raid_io)) {
+			return;
+		}
+		if (raid_io->type == SPDK_BDEV_IO_TYPE_READ && raid5f_cache_submit_read(raid_io)) {
+			return;
+		}
+	}
+
+	ret = raid5f_submit_array_request(raid_io);
+	if (spdk_unlikely(ret == -ENOMEM)) {
+		raid5f_io_complete_nomem(raid_io);
+	} else if (spdk_unlikely(ret)) {
+		raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_FAILED);
+	}
+}
+
+static void
+raid5f_base_io_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid_bdev_io *raid_io = cb_arg;
+
+	spdk_bdev_free_io(bdev_io);
+
+	raid_bdev_io_complete_part(raid_io, 1, success ?
+				   SPDK_BDEV_IO_STATUS_SUCCESS :
+				   SPDK_BDEV_IO_STATUS_FAILED);
+}
+
+static void
+_raid5f_submit_flush_request(void *_raid_io)
+{
+	struct raid_bdev_io *raid_io = _raid_io;
+
+	raid5f_submit_flush_request(raid_io);
+}
+
+/* Flush the strips of the stripes covered by the request on all base bdevs */
+static void
+raid5f_submit_flush_request(struct raid_bdev_io *raid_io)
+{
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	uint64_t start_stripe = raid_io->offset_blocks / r5f_info->stripe_blocks;
+	uint64_t end_stripe = (raid_io->offset_blocks + raid_io->num_blocks - 1) / r5f_info->stripe_blocks;
+	uint64_t base_offset_blocks = start_stripe << raid_bdev->strip_size_shift;
+	uint64_t base_num_blocks = (end_stripe - start_stripe + 1) << raid_bdev->strip_size_shift;
+	struct raid_base_bdev_info *base_info;
+	struct spdk_io_channel *base_ch;
+	uint8_t idx;
+	int ret;
+
+	if (raid_io->base_bdev_io_submitted == 0) {
+		raid_io->base_bdev_io_remaining = raid_bdev->num_base_bdevs;
+		raid_io->base_bdev_io_status = SPDK_BDEV_IO_STATUS_SUCCESS;
+	}
+
+	while (raid_io->base_bdev_io_submitted < raid_bdev->num_base_bdevs) {
+		idx = raid_io->base_bdev_io_submitted;
+		base_info = &raid_bdev->base_bdev_info[idx];
+		base_ch = raid_io->raid_ch->base_channel[idx];
+
+		if (base_ch == NULL) {
+			raid_io->base_bdev_io_submitted++;
+			raid_bdev_io_complete_part(raid_io, 1, SPDK_BDEV_IO_STATUS_SUCCESS);
+			continue;
+		}
+
+		ret = raid_bdev_flush_blocks(base_info, base_ch, base_offset_blocks, base_num_blocks,
+					     raid5f_base_io_complete, raid_io);
+		if (ret == 0) {
+			raid_io->base_bdev_io_submitted++;
+		} else if (ret == -ENOMEM) {
+			raid5f_queue_io_wait(raid_io, base_info, base_ch, _raid5f_submit_flush_request);
+			return;
+		} else {
+			raid_bdev_io_complete_part(raid_io, raid_bdev->num_base_bdevs -
+						   raid_io->base_bdev_io_submitted,
+						   SPDK_BDEV_IO_STATUS_FAILED);
+			return;
+		}
+	}
+}
+
+static void raid5f_zero_request_submit(struct raid5f_zero_request *zero_req);
+
+static void
+raid5f_zero_request_free(struct raid5f_zero_request *zero_req)
+{
+	uint8_t i;
+
+	for (i = 0; i < zero_req->num_partials; i++) {
+		free(zero_req->partials[i].iovs);
+		spdk_dma_free(zero_req->partials[i].md_buf);
+	}
+	free(zero_req);
+}
+
+/* Complete the request once nothing is in progress */
+static void
+raid5f_zero_request_check_done(struct raid5f_zero_request *zero_req)
+{
+	struct raid_bdev_io *raid_io = zero_req->raid_io;
+	enum spdk_bdev_io_status status = zero_req->status;
+	uint8_t p;
+
+	if (zero_req->active > 0 || zero_req->submitting) {
+		return;
+	}
+	assert(!zero_req->locked);
+
+	/* A partial stripe write is stuck without a resource and nothing would retry it */
+	for (p = 0; p < zero_req->num_partials; p++) {
+		if (!zero_req->partials[p].submitted && status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+			status = SPDK_BDEV_IO_STATUS_NOMEM;
+		}
+	}
+
+	raid5f_zero_request_free(zero_req);
+
+	if (status == SPDK_BDEV_IO_STATUS_NOMEM) {
+		raid5f_io_complete_nomem(raid_io);
+	} else {
+		raid_bdev_io_complete(raid_io, status);
+	}
+}
+
+static void
+raid5f_zero_request_locked(void *cb_arg)
+{
+	struct raid5f_zero_request *zero_req = cb_arg;
+
+	/* Drop the reference held while waiting */
+	assert(zero_req->active > 0);
+	zero_req->active--;
+
+	zero_req->locked = true;
+	raid5f_zero_request_submit(zero_req);
+}
+
+/* Lock the next whole stripes to zero. Returns true if they were locked at once. */
+static bool
+raid5f_zero_request_lock(struct raid5f_zero_request *zero_req)
+{
+	struct raid5f_info *r5f_info = zero_req->raid_io->raid_bdev->module_private;
+	uint64_t num_stripes = spdk_min(zero_req->num_stripes, RAID5F_ZERO_REQUEST_MAX_STRIPES);
+	uint64_t i;
+
+	/* Invalidate reconstructions cached for the stripes */
+	for (i = 0; i < spdk_min(num_stripes, RAID5F_STRIPE_GEN_BUCKETS); i++) {
+		raid5f_stripe_gen_bump(r5f_info, zero_req->first_stripe + i);
+	}
+
+	zero_req->next_member = 0;
+	if (!raid5f_range_lock(&zero_req->lock, r5f_info, zero_req->first_stripe, num_stripes,
+			       true, raid5f_zero_request_locked, zero_req)) {
+		/* Hold a reference while waiting */
+		zero_req->active++;
+		return false;
+	}
+	zero_req->locked = true;
+
+	return true;
+}
+
+/*
+ * Mark the locked stripes zeroed and unlock them once all base bdevs are done with them. Returns
+ * true if the next stripes of the range were locked at once and can be submitted.
+ */
+static bool
+raid5f_zero_request_stripes_done(struct raid5f_zero_request *zero_req)
+{
+	struct raid_bdev *raid_bdev = zero_req->raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	uint64_t num_stripes = zero_req->lock.num_stripes;
+	uint64_t i;
+
+	if (!zero_req->locked || zero_req->base_active > 0 ||
+	    (zero_req->next_member < raid_bdev->num_base_bdevs &&
+	     zero_req->status == SPDK_BDEV_IO_STATUS_SUCCESS)) {
+		return false;
+	}
+
+	if (zero_req->status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+		raid5f_stripes_set_zero(r5f_info, zero_req->first_stripe, num_stripes);
+	}
+	for (i = 0; i < spdk_min(num_stripes, RAID5F_STRIPE_GEN_BUCKETS); i++) {
+		raid5f_stripe_gen_bump(r5f_info, zero_req->first_stripe + i);
+	}
+
+	raid5f_range_unlock(&zero_req->lock);
+	zero_req->locked = false;
+
+	zero_req->first_stripe += num_stripes;
+	zero_req->num_stripes -= num_stripes;
+	if (zero_req->num_stripes == 0 || zero_req->status != SPDK_BDEV_IO_STATUS_SUCCESS) {
+		zero_req->num_stripes = 0;
+		return false;
+	}
+
+	return raid5f_zero_request_lock(zero_req);
+}
+
+static void
+raid5f_zero_request_part_done(struct raid5f_zero_request *zero_req, bool success)
+{
+	assert(zero_req->active > 0);
+	zero_req->active--;
+
+	if (!success) {
+		zero_req->status = SPDK_BDEV_IO_STATUS_FAILED;
+	}
+
+	raid5f_zero_request_submit(zero_req);
+}
+
+static void
+raid5f_zero_partial_done(struct raid_bdev_io *raid_io, enum spdk_bdev_io_status status)
+{
+	struct raid5f_zero_partial *partial = SPDK_CONTAINEROF(raid_io, struct raid5f_zero_partial,
+					      raid_io);
+
+	raid5f_zero_request_part_done(partial->zero_req, status == SPDK_BDEV_IO_STATUS_SUCCESS);
+}
+
+static void
+raid5f_zero_request_base_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_zero_request *zero_req = cb_arg;
+
+	spdk_bdev_free_io(bdev_io);
+
+	assert(zero_req->base_active > 0);
+	zero_req->base_active--;
+
+	raid5f_zero_request_part_done(zero_req, success);
+}
+
+static void
+_raid5f_zero_request_submit(void *_raid_io)
+{
+	struct raid_bdev_io *raid_io = _raid_io;
+
+	/* Drop the reference taken when queued */
+	raid5f_zero_request_part_done(raid_io->module_private, true);
+}
+
+/*
+ * Submit what is left of the request. Called again as parts complete, to retry the partial
+ * stripe writes which couldn't get a resource.
+ */
+static void
+raid5f_zero_request_submit(struct raid5f_zero_request *zero_req)
+{
+	struct raid_bdev_io *raid_io = zero_req->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	uint64_t base_offset_blocks, base_num_blocks;
+	struct raid5f_zero_partial *partial;
+	struct raid_base_bdev_info *base_info;
+	struct spdk_io_channel *base_ch;
+	uint8_t i;
+	int ret;
+
+	if (zero_req->submitting) {
+		return;
+	}
+	zero_req->submitting = true;
+
+	for (i = 0; i < zero_req->num_partials; i++) {
+		partial = &zero_req->partials[i];
+		if (partial->submitted) {
+			continue;
+		}
+
+		ret = raid5f_submit_array_write(&partial->raid_io);
+		if (ret == -ENOMEM) {
+			continue;
+		}
+		partial->submitted = true;
+		if (spdk_unlikely(ret != 0)) {
+			zero_req->status = SPDK_BDEV_IO_STATUS_FAILED;
+		} else {
+			zero_req->active++;
+		}
+	}
+
+	/* Zero the locked stripes and go on with the next ones while they can be locked at once */
+	do {
+		base_offset_blocks = zero_req->first_stripe << raid_bdev->strip_size_shift;
+		base_num_blocks = zero_req->lock.num_stripes << raid_bdev->strip_size_shift;
+
+		while (zero_req->locked && zero_req->next_member < raid_bdev->num_base_bdevs &&
+		       zero_req->status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+			base_info = &raid_bdev->base_bdev_info[zero_req->next_member];
+			base_ch = raid_io->raid_ch->base_channel[zero_req->next_member];
+
+			if (base_ch == NULL) {
+				zero_req->next_member++;
+				continue;
+			}
+
+			ret = raid_bdev_write_zeroes_blocks(base_info, base_ch, base_offset_blocks,
+							    base_num_blocks,
+							    raid5f_zero_request_base_complete,
+							    zero_req);
+
+			if (spdk_unlikely(ret == -ENOMEM)) {
+				/* The queued retry holds a reference */
+				zero_req->active++;
+				raid5f_queue_io_wait(raid_io, base_info, base_ch,
+						     _raid5f_zero_request_submit);
+				break;
+			} else if (spdk_unlikely(ret != 0)) {
+				zero_req->status = SPDK_BDEV_IO_STATUS_FAILED;
+				break;
+			}
+			zero_req->active++;
+			zero_req->base_active++;
+			zero_req->next_member++;
+		}
+	} while (raid5f_zero_request_stripes_done(zero_req));
+
+	zero_req->submitting = false;
+
+	raid5f_zero_request_check_done(zero_req);
+}
+
+/* Set up a write of zeroes to the part of a stripe */
+static int
+raid5f_zero_partial_init(struct raid5f_zero_request *zero_req, uint64_t offset_blocks,
+			 uint64_t num_blocks)
+{
+	struct raid_bdev_io *raid_io = zero_req->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_zero_partial *partial = &zero_req->partials[zero_req->num_partials];
+	uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	uint64_t remaining = num_blocks;
+	int iovcnt = 0;
+
+	partial->zero_req = zero_req;
+	partial->iovs = calloc(raid5f_stripe_data_chunks_num(raid_bdev), sizeof(*partial->iovs));
+	if (!partial->iovs) {
+		return -ENOMEM;
+	}
+	zero_req->num_partials++;
+
+	/* The zero buffer spans a strip, point to it as many times as needed */
+	while (remaining > 0) {
+		uint64_t len = spdk_min(remaining, raid_bdev->strip_size);
+
+		partial->iovs[iovcnt].iov_base = r5f_info->zero_buf;
+		partial->iovs[iovcnt].iov_len = len << raid_bdev->blocklen_shift;
+		iovcnt++;
+		remaining -= len;
+	}
+
+	if (md_size != 0 && !spdk_bdev_is_md_interleaved(&raid_bdev->bdev)) {
+		partial->md_buf = spdk_dma_zmalloc(num_blocks * md_size, r5f_info->buf_alignment, NULL);
+		if (!partial->md_buf) {
+			return -ENOMEM;
+		}
+	}
+
+	raid_bdev_io_init(&partial->raid_io, raid_io->raid_ch, SPDK_BDEV_IO_TYPE_WRITE,
+			  offset_blocks, num_blocks, partial->iovs, iovcnt, partial->md_buf, NULL, NULL);
+	partial->raid_io.completion_cb = raid5f_zero_partial_done;
+
+	return 0;
+}
+
+/*
+ * Write zeroes to the whole stripes of the range on all base bdevs at once, parity included,
+ * and to the partial stripes at its ends through the regular write path. The whole stripes
+ * are then known to read as zeroes. An unmap is done the same way: an unmap of the base bdevs
+ * guarantees neither zeroes nor consistent parity, and the zeroed stripes aren't persistent.
+ */
+static int
+raid5f_submit_zero_request(struct raid_bdev_io *raid_io)
+{
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+	uint64_t stripe_blocks = r5f_info->stripe_blocks;
+	uint64_t start = raid_io->offset_blocks;
+	uint64_t end = raid_io->offset_blocks + raid_io->num_blocks;
+	uint64_t first_stripe = SPDK_CEIL_DIV(start, stripe_blocks);
+	uint64_t end_stripe = end / stripe_blocks;
+	struct raid5f_zero_request *zero_req;
+	int ret;
+
+	zero_req = calloc(1, sizeof(*zero_req));
+	if (!zero_req) {
+		return -ENOMEM;
+	}
+
+	zero_req->raid_io = raid_io;
+	zero_req->status = SPDK_BDEV_IO_STATUS_SUCCESS;
+
+	if (first_stripe > end_stripe) {
+		/* Within a single stripe */
+		ret = raid5f_zero_partial_init(zero_req, start, end - start);
+	} else {
+		zero_req->first_stripe = first_stripe;
+		zero_req->num_stripes = end_stripe - first_stripe;
+		ret = 0;
+		if (start < first_stripe * stripe_blocks) {
+			ret = raid5f_zero_partial_init(zero_req, start, first_stripe * stripe_blocks - start);
+		}
+		if (ret == 0 && end > end_stripe * stripe_blocks) {
+			ret = raid5f_zero_partial_init(zero_req, end_stripe * stripe_blocks,
+						       end - end_stripe * stripe_blocks);
+		}
+	}
+	if (spdk_unlikely(ret != 0)) {
+		raid5f_zero_request_free(zero_req);
+		return ret;
+	}
+
+	raid_io->module_private = zero_req;
+
+	/* The partial stripes are written right away, the whole ones once locked */
+	if (zero_req->num_stripes > 0) {
+		raid5f_zero_request_lock(zero_req);
+	}
+
+	raid5f_zero_request_submit(zero_req);
+
+	return 0;
+}
+
+static void
+raid5f_submit_null_payload_request(struct raid_bdev_io *raid_io)
+{
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+	int ret;
+
+	if (raid_io->type != SPDK_BDEV_IO_TYPE_FLUSH) {
+		ret = raid5f_submit_array_request(raid_io);
+		if (spdk_unlikely(ret == -ENOMEM)) {
+			raid5f_io_complete_nomem(raid_io);
+		} else if (spdk_unlikely(ret)) {
+			raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_FAILED);
+		}
+		return;
+	}
+
+	if (r5f_info->cache != NULL && raid5f_cache_submit_flush(raid_io)) {
+		return;
+	}
+
+	raid5f_submit_flush_request(raid_io);
+}
+
+/*
+ * Unmap and write zeroes bypass the stripe cache, so they aren't supported with it. Neither
+ * are they with protection information, which zeroes would not carry.
+ */
+static bool
+raid5f_io_type_supported(struct raid_bdev *raid_bdev, enum spdk_bdev_io_type io_type)
+{
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+
+	switch (io_type) {
+	case SPDK_BDEV_IO_TYPE_FLUSH:
+		return true;
+	case SPDK_BDEV_IO_TYPE_UNMAP:
+	case SPDK_BDEV_IO_TYPE_WRITE_ZEROES:
+		return r5f_info != NULL && r5f_info->cache == NULL &&
+		       raid_bdev->bdev.dif_type == SPDK_DIF_DISABLE;
+	default:
+		return false;
+	}
+}
+
+static void
+raid5f_cache_free(struct raid5f_cache *cache)
+{
+	uint32_t i;
+
+	if (cache->entries) {
+		for (i = 0; i < cache->num_entries; i++) {
+			spdk_dma_free(cache->entries[i].buf);
+			spdk_dma_free(cache->entries[i].md_buf);
+			free(cache->entries[i].dirty);
+		}
+		free(cache->entries);
+	}
+	free(cache->buckets);
+	spdk_spin_destroy(&cache->lock);
+	free(cache);
+}
+
+static struct raid5f_cache *
+raid5f_cache_alloc(struct raid5f_info *r5f_info)
+{
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	uint32_t md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	uint32_t flush_timeout_ms = raid_bdev->opts.stripe_cache_flush_timeout_ms;
+	struct raid5f_cache *cache;
+	struct raid5f_cache_entry *entry;
+	uint32_t num_buckets;
+	uint32_t i;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		return NULL;
+	}
+
+	spdk_spin_init(&cache->lock);
+	TAILQ_INIT(&cache->free_entries);
+	TAILQ_INIT(&cache->dirty_entries);
+	TAILQ_INIT(&cache->flushing_entries);
+
+	if (flush_timeout_ms == 0) {
+		flush_timeout_ms = RAID5F_STRIPE_CACHE_FLUSH_TIMEOUT_MS;
+	}
+	cache->flush_timeout_ticks = spdk_get_ticks_hz() * flush_timeout_ms / 1000;
+
+	num_buckets = spdk_align32pow2(raid_bdev->opts.stripe_cache_size);
+	cache->buckets_mask = num_buckets - 1;
+	cache->buckets = calloc(num_buckets, sizeof(*cache->buckets));
+	if (!cache->buckets) {
+		goto err;
+	}
+	for (i = 0; i < num_buckets; i++) {
+		TAILQ_INIT(&cache->buckets[i]);
+	}
+
+	cache->num_entries = raid_bdev->opts.stripe_cache_size;
+	cache->entries = calloc(cache->num_entries, sizeof(*cache->entries));
+	if (!cache->entries) {
+		goto err;
+	}
+
+	for (i = 0; i < cache->num_entries; i++) {
+		entry = &cache->entries[i];
+
+		TAILQ_INIT(&entry->waiters);
+
+		entry->buf = spdk_dma_malloc(r5f_info->stripe_blocks << raid_bdev->blocklen_shift,
+					     r5f_info->buf_alignment, NULL);
+		if (!entry->buf) {
+			goto err;
+		}
+
+		if (md_size != 0) {
+			entry->md_buf = spdk_dma_malloc(r5f_info->stripe_blocks * md_size,
+							r5f_info->buf_alignment, NULL);
+			if (!entry->md_buf) {
+				goto err;
+			}
+		}
+
+		entry->dirty = calloc(SPDK_CEIL_DIV(r5f_info->stripe_blocks, 64), sizeof(uint64_t));
+		if (!entry->dirty) {
+			goto err;
+		}
+
+		TAILQ_INSERT_TAIL(&cache->free_entries, entry, link);
+	}
+
+	return cache;
+err:
+	raid5f_cache_free(cache);
+	return NULL;
+}
+
+/* Callback waiting for a background operation to stop */
+struct raid5f_stop_waiter {
+	raid_bdev_stop_background_cb cb_fn;
+	void *cb_ctx;
+	TAILQ_ENTRY(raid5f_stop_waiter) link;
+};
+
+/*
+ * Write-intent bitmap. The array is divided into regions of a power of 2 stripes and a
+ * region's bit is written to all base bdevs before the first write to it starts, so that
+ * after a crash only the regions whose bits are set may have stripes with stale parity.
+ * Bits needed by writes arriving while the bitmap is written go out with the next write of
+ * the bitmap. Regions are cleared lazily, once they had no writes for a clear period, and
+ * the dirty regions found at start are resynced before they are written again.
+ */
+
+/* Header in the first block of the bitmap on each base bdev, the bits follow in the next blocks */
+struct raid5f_wib_header {
+	uint64_t magic;
+	uint32_t version;
+	/* A region covers 1 << region_shift stripes */
+	uint32_t region_shift;
+	uint32_t num_regions;
+	uint32_t reserved;
+	/* Incremented with each write of the bitmap */
+	uint64_t seq;
+};
+
+/* Write passed on to the array once the bits of the regions it touches are on disk */
+struct raid5f_wib_write {
+	/* Internal request the write is submitted to the array with */
+	struct raid_bdev_io raid_io;
+
+	/* The original write, completed with the internal request */
+	struct raid_bdev_io *parent;
+
+	/* Thread the write is submitted on */
+	struct spdk_thread *thread;
+
+	uint32_t first_region;
+	uint32_t last_region;
+
+	TAILQ_ENTRY(raid5f_wib_write) link;
+};
+
+/* Stripe of a dirty region whose parity is recalculated */
+struct raid5f_wib_resync_stripe {
+	struct raid5f_wib *wib;
+
+	uint64_t stripe_index;
+
+	/* The stripe, held exclusive while its parity is recalculated */
+	struct raid5f_range_lock lock;
+
+	bool active;
+	bool failed;
+
+	/* Index of the next base bdev to read from and number of base bdev I/Os in progress */
+	uint8_t next_read;
+	uint8_t remaining;
+
+	/* Strips of all base bdevs, with separate metadata if the raid bdev has it */
+	struct iovec *iovs;
+	void **bufs;
+	void **md_bufs;
+
+	/* Xor of all strips, zero if the parity is consistent */
+	void *result;
+	void *md_result;
+
+	struct spdk_bdev_ext_io_opts ext_opts;
+	struct spdk_bdev_io_wait_entry waitq_entry;
+};
+
+struct raid5f_wib {
+	struct raid5f_info *r5f_info;
+
+	/* raid bdev io channel of the app thread, providing the base bdev channels */
+	struct spdk_io_channel *ch;
+
+	enum raid5f_wib_state {
+		/* Reading the bitmap from the base bdevs, writes wait for it */
+		RAID5F_WIB_LOADING,
+		RAID5F_WIB_ONLINE,
+		/* Writing the bitmap a last time, writes don't wait anymore */
+		RAID5F_WIB_STOPPING,
+		RAID5F_WIB_STOPPED,
+	} state;
+
+	uint32_t region_shift;
+	uint32_t num_regions;
+	uint32_t num_words;
+
+	/* Location and size of the bitmap on each base bdev, from the start of the base bdev */
+	uint64_t offset_blocks;
+	uint64_t num_blocks;
+
+	/*
+	 * Bitmaps with a bit per region, modified on the app thread only except touched.
+	 * dirty: regions which are or will be set on disk
+	 * persisted: regions set on disk
+	 * resync: dirty regions found at start whose parity wasn't recalculated yet
+	 * writable: persisted regions not waiting for a resync, writes to them don't wait
+	 * touched: regions written since the last clear pass, set by the writes
+	 */
+	uint64_t *dirty;
+	uint64_t *persisted;
+	uint64_t *resync;
+	uint64_t *writable;
+	uint64_t *touched;
+
+	/* Number of writes in progress in each region, counted by the writes on all threads */
+	uint32_t *active;
+
+	/* Writes waiting on the app thread for their regions */
+	TAILQ_HEAD(, raid5f_wib_write) waiters;
+
+	/*
+	 * On-disk bitmap, the bits of the write in progress and the base bdev I/Os of it. The
+	 * bitmap is written to all base bdevs, then their caches are flushed.
+	 */
+	void *buf;
+	uint64_t *flushing;
+	uint64_t seq;
+	bool flush_active;
+	bool flush_syncing;
+	bool flush_failed;
+	uint8_t slot;
+	uint8_t writes_remaining;
+	uint8_t copies_written;
+	struct spdk_bdev_io_wait_entry waitq_entry;
+
+	/* Set until the bitmap is read from all base bdevs */
+	bool loading;
+
+	/* Set once the last write of the bitmap was started by the stop */
+	bool stop_flushed;
+
+	struct spdk_poller *poller;
+	uint64_t next_clear_tsc;
+
+	/* Region being resynced, num_regions if none, and its next and last stripes */
+	uint32_t resync_region;
+	uint64_t resync_next_stripe;
+	uint64_t resync_end_stripe;
+	uint8_t resync_active;
+	struct raid5f_wib_resync_stripe resync_stripes[RAID5F_WIB_RESYNC_DEPTH];
+
+	/* Statistics, updated on the app thread */
+	struct {
+		/* Writes of the bitmap and writes which waited for one */
+		uint64_t flushes;
+		uint64_t waits;
+		uint64_t regions_cleared;
+		uint64_t regions_resynced;
+		/* Stripes whose parity was rewritten by the resync */
+		uint64_t stripes_repaired;
+		uint64_t errors;
+	} stats;
+
+	TAILQ_HEAD(, raid5f_stop_waiter) stop_waiters;
+};
+
+static inline bool
+raid5f_wib_test(uint64_t *bits, uint32_t region)
+{
+	return __atomic_load_n(&bits[region / 64], __ATOMIC_SEQ_CST) & (1ULL << (region % 64));
+}
+
+static inline void
+raid5f_wib_set(uint64_t *bits, uint32_t region)
+{
+	__atomic_fetch_or(&bits[region / 64], 1ULL << (region % 64), __ATOMIC_SEQ_CST);
+}
+
+static inline void
+raid5f_wib_clear(uint64_t *bits, uint32_t region)
+{
+	__atomic_fetch_and(&bits[region / 64], ~(1ULL << (region % 64)), __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t
+raid5f_wib_region(struct raid5f_info *r5f_info, uint64_t offset_blocks)
+{
+	return (offset_blocks / r5f_info->stripe_blocks) >> r5f_info->wib->region_shift;
+}
+
+/*
+ * Check if the parity of the stripe may be stale after an unclean stop, until the bitmap is
+ * loaded and its region is resynced
+ */
+static bool
+raid5f_wib_resync_pending(struct raid5f_info *r5f_info, uint64_t stripe_index)
+{
+	struct raid5f_wib *wib = r5f_info->wib;
+
+	if (wib == NULL) {
+		return false;
+	}
+
+	return __atomic_load_n(&wib->loading, __ATOMIC_RELAXED) ||
+	       raid5f_wib_test(wib->resync, stripe_index >> wib->region_shift);
+}
+
+static void raid5f_wib_flush(struct raid5f_wib *wib);
+static void raid5f_wib_stop_continue(struct raid5f_wib *wib);
+static void raid5f_wib_resync_next(struct raid5f_wib *wib);
+
+static struct raid5f_wib_write *
+raid5f_wib_write_get(struct raid5f_io_channel *r5ch)
+{
+	struct raid5f_wib_write *wib_write = TAILQ_FIRST(&r5ch->wib_writes);
+
+	if (wib_write != NULL) {
+		TAILQ_REMOVE(&r5ch->wib_writes, wib_write, link);
+		return wib_write;
+	}
+
+	return calloc(1, sizeof(*wib_write));
+}
+
+/* Drop the write from the active writes of its regions and return the context to the channel */
+static void
+raid5f_wib_write_release(struct raid5f_wib_write *wib_write)
+{
+	struct raid_bdev_io *raid_io = wib_write->parent;
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
+	uint32_t region;
+
+	for (region = wib_write->first_region; region <= wib_write->last_region; region++) {
+		__atomic_fetch_sub(&r5f_info->wib->active[region], 1, __ATOMIC_SEQ_CST);
+	}
+
+	TAILQ_INSERT_HEAD(&r5ch->wib_writes, wib_write, link);
+}
+
+static void
+raid5f_wib_write_done(struct raid_bdev_io *raid_io, enum spdk_bdev_io_status status)
+{
+	struct raid5f_wib_write *wib_write = SPDK_CONTAINEROF(raid_io, struct raid5f_wib_write,
+					     raid_io);
+	struct raid_bdev_io *parent = wib_write->parent;
+
+	raid5f_wib_write_release(wib_write);
+
+	raid_bdev_io_complete(parent, status);
+}
+
+static int
+raid5f_wib_write_submit(struct raid5f_wib_write *wib_write)
+{
+	int ret;
+
+	ret = raid5f_submit_array_write(&wib_write->raid_io);
+	if (spdk_unlikely(ret != 0)) {
+		raid5f_wib_write_release(wib_write);
+	}
+
+	return ret;
+}
+
+/* Submit a write on its thread after waiting for the bitmap */
+static void
+raid5f_wib_write_resume(void *ctx)
+{
+	struct raid5f_wib_write *wib_write = ctx;
+	struct raid_bdev_io *parent = wib_write->parent;
+	int ret;
+
+	ret = raid5f_wib_write_submit(wib_write);
+	if (spdk_unlikely(ret == -ENOMEM)) {
+		raid5f_io_complete_nomem(parent);
+	} else if (spdk_unlikely(ret != 0)) {
+		raid_bdev_io_complete(parent, SPDK_BDEV_IO_STATUS_FAILED);
+	}
+}
+
+/*
+ * Resume the waiting writes whose regions are writable now. Regions not on disk yet are
+ * marked dirty and the bitmap is written, regions waiting for a resync keep their writes
+ * waiting. After the bitmap is stopped, writes don't wait anymore.
+ */
+static void
+raid5f_wib_process_waiters(struct raid5f_wib *wib)
+{
+	struct raid5f_wib_write *wib_write, *tmp;
+	bool flush = false;
+	bool ready;
+	uint32_t region;
+
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
+
+	if (wib->state == RAID5F_WIB_LOADING) {
+		return;
+	}
+
+	TAILQ_FOREACH_SAFE(wib_write, &wib->waiters, link, tmp) {
+		ready = true;
+
+		for (region = wib_write->first_region;
+		     region <= wib_write->last_region && wib->state == RAID5F_WIB_ONLINE; region++) {
+			if (raid5f_wib_test(wib->resync, region)) {
+				ready = false;
+			} else if (!raid5f_wib_test(wib->persisted, region)) {
+				raid5f_wib_set(wib->dirty, region);
+				ready = false;
+				flush = true;
+			}
+		}
+
+		if (ready) {
+			TAILQ_REMOVE(&wib->waiters, wib_write, link);
+			spdk_thread_send_msg(wib_write->thread, raid5f_wib_write_resume, wib_write);
+		}
+	}
+
+	if (flush) {
+		raid5f_wib_flush(wib);
+	}
+}
+
+static void
+raid5f_wib_write_wait(void *ctx)
+{
+	struct raid5f_wib_write *wib_write = ctx;
+	struct raid5f_info *r5f_info = wib_write->parent->raid_bdev->module_private;
+	struct raid5f_wib *wib = r5f_info->wib;
+
+	wib->stats.waits++;
+	TAILQ_INSERT_TAIL(&wib->waiters, wib_write, link);
+	raid5f_wib_process_waiters(wib);
+}
+
+/*
+ * Submit a write to the array once its regions are set in the bitmap on disk. A write counts
+ * itself in its regions before checking them, so a region found without writes by the clear
+ * pass can't get a write which still sees it writable.
+ */
+static int
+raid5f_wib_submit_write(struct raid_bdev_io *raid_io)
+{
+	struct raid5f_info *r5f_info = raid_io->raid_bdev->module_private;
+	struct raid5f_wib *wib = r5f_info->wib;
+	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
+	struct raid5f_wib_write *wib_write;
+	bool wait = false;
+	uint32_t region;
+	int ret;
+
+	wib_write = raid5f_wib_write_get(r5ch);
+	if (spdk_unlikely(wib_write == NULL)) {
+		return -ENOMEM;
+	}
+
+	raid_bdev_io_init(&wib_write->raid_io, raid_io->raid_ch, raid_io->type,
+			  raid_io->offset_blocks, raid_io->num_blocks, raid_io->iovs, raid_io->iovcnt,
+			  raid_io->md_buf, raid_io->memory_domain, raid_io->memory_domain_ctx);
+	wib_write->raid_io.completion_cb = raid5f_wib_write_done;
+	wib_write->parent = raid_io;
+	wib_write->first_region = raid5f_wib_region(r5f_info, raid_io->offset_blocks);
+	wib_write->last_region = raid5f_wib_region(r5f_info,
+				 raid_io->offset_blocks + raid_io->num_blocks - 1);
+
+	for (region = wib_write->first_region; region <= wib_write->last_region; region++) {
+		__atomic_fetch_add(&wib->active[region], 1, __ATOMIC_SEQ_CST);
+		if (spdk_unlikely(!raid5f_wib_test(wib->writable, region))) {
+			wait = true;
+		}
+		if (!(__atomic_load_n(&wib->touched[region / 64], __ATOMIC_RELAXED) &
+		      (1ULL << (region % 64)))) {
+			raid5f_wib_set(wib->touched, region);
+		}
+	}
+
+	if (spdk_likely(!wait)) {
+		return raid5f_wib_write_submit(wib_write);
+	}
+
+	wib_write->thread = spdk_get_thread();
+	ret = spdk_thread_send_msg(spdk_thread_get_app_thread(), raid5f_wib_write_wait, wib_write);
+	if (spdk_unlikely(ret != 0)) {
+		raid5f_wib_write_release(wib_write);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Clear the dirty regions without writes in progress. Unless all is set, regions written
+ * since the last pass are kept for another one. Returns true if any region was cleared.
+ */
+static bool
+raid5f_wib_clear_regions(struct raid5f_wib *wib, bool all)
+{
+	uint64_t bits;
+	uint32_t w, region;
+	bool cleared = false;
+
+	for (w = 0; w < wib->num_words; w++) {
+		bits = wib->dirty[w] & ~wib->resync[w];
+
+		while (bits != 0) {
+			region = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+
+			if (!all && raid5f_wib_test(wib->touched, region)) {
+				raid5f_wib_clear(wib->touched, region);
+				continue;
+			}
+
+			/* Writes counted after this see the region not writable and wait */
+			raid5f_wib_clear(wib->writable, region);
+			if (__atomic_load_n(&wib->active[region], __ATOMIC_SEQ_CST) != 0) {
+				raid5f_wib_set(wib->writable, region);
+				continue;
+			}
+
+			raid5f_wib_clear(wib->dirty, region);
+			raid5f_wib_clear(wib->persisted, region);
+			wib->stats.regions_cleared++;
+			cleared = true;
+		}
+	}
+
+	return cleared;
+}
+
+static void raid5f_wib_flush_next(struct raid5f_wib *wib);
+
+static void
+raid5f_wib_flush_done(struct raid5f_wib *wib)
+{
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+	bool persisted = !wib->flush_failed && wib->copies_written > 0;
+	uint32_t w;
+
+	wib->flush_active = false;
+
+	if (!persisted) {
+		/* The waiting writes are retried by the poller */
+		wib->stats.errors++;
+		SPDK_ERRLOG("Failed to write the write-intent bitmap of raid bdev %s\n",
+			    raid_bdev->bdev.name);
+	} else {
+		/* Regions cleared during the write are only cleared between writes */
+		for (w = 0; w < wib->num_words; w++) {
+			__atomic_store_n(&wib->persisted[w], wib->flushing[w], __ATOMIC_SEQ_CST);
+			__atomic_store_n(&wib->writable[w], wib->flushing[w] & ~wib->resync[w],
+					 __ATOMIC_SEQ_CST);
+		}
+	}
+
+	if (wib->state == RAID5F_WIB_STOPPING) {
+		raid5f_wib_stop_continue(wib);
+	} else if (persisted) {
+		raid5f_wib_process_waiters(wib);
+	}
+}
+
+/* The bitmap was written to all base bdevs or their caches flushed */
+static void
+raid5f_wib_flush_pass_done(struct raid5f_wib *wib)
+{
+	/* The bits are only on disk once every present base bdev has them in stable storage */
+	if (!wib->flush_failed && !wib->flush_syncing) {
+		wib->flush_syncing = true;
+		wib->slot = 0;
+		raid5f_wib_flush_next(wib);
+		return;
+	}
+
+	raid5f_wib_flush_done(wib);
+}
+
+static void
+raid5f_wib_flush_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_wib *wib = cb_arg;
+
+	spdk_bdev_free_io(bdev_io);
+
+	if (!success) {
+		wib->flush_failed = true;
+	}
+
+	assert(wib->writes_remaining > 0);
+	if (--wib->writes_remaining == 0 && wib->slot == wib->r5f_info->raid_bdev->num_base_bdevs) {
+		raid5f_wib_flush_pass_done(wib);
+	}
+}
+
+static void
+_raid5f_wib_flush_next(void *ctx)
+{
+	raid5f_wib_flush_next(ctx);
+}
+
+/* Write the bitmap to the base bdevs from wib->slot on, or flush it once written */
+static void
+raid5f_wib_flush_next(struct raid5f_wib *wib)
+{
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+	struct raid_bdev_io_channel *raid_ch = spdk_io_channel_get_ctx(wib->ch);
+	struct raid_base_bdev_info *base_info;
+	struct spdk_io_channel *base_ch;
+	int ret;
+
+	while (wib->slot < raid_bdev->num_base_bdevs) {
+		base_info = &raid_bdev->base_bdev_info[wib->slot];
+		base_ch = raid_ch->base_channel[wib->slot];
+
+		if (base_ch == NULL) {
+			wib->slot++;
+			continue;
+		}
+
+		if (wib->flush_syncing) {
+			ret = spdk_bdev_flush_blocks(base_info->desc, base_ch, wib->offset_blocks,
+						     wib->num_blocks, raid5f_wib_flush_complete,
+						     wib);
+		} else {
+			ret = spdk_bdev_write_blocks(base_info->desc, base_ch, wib->buf,
+						     wib->offset_blocks, wib->num_blocks,
+						     raid5f_wib_flush_complete, wib);
+		}
+		if (ret == -ENOMEM) {
+			wib->waitq_entry.bdev = spdk_bdev_desc_get_bdev(base_info->desc);
+			wib->waitq_entry.cb_fn = _raid5f_wib_flush_next;
+			wib->waitq_entry.cb_arg = wib;
+			spdk_bdev_queue_io_wait(wib->waitq_entry.bdev, base_ch, &wib->waitq_entry);
+			return;
+		}
+
+		wib->slot++;
+		if (ret != 0) {
+			wib->flush_failed = true;
+		} else {
+			wib->writes_remaining++;
+			if (!wib->flush_syncing) {
+				wib->copies_written++;
+			}
+		}
+	}
+
+	if (wib->writes_remaining == 0) {
+		raid5f_wib_flush_pass_done(wib);
+	}
+}
+
+/* Write the dirty regions to all base bdevs, unless a write of the bitmap is in progress */
+static void
+raid5f_wib_flush(struct raid5f_wib *wib)
+{
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+	struct raid5f_wib_header *header = wib->buf;
+	size_t bitmap_len = wib->num_words * sizeof(uint64_t);
+
+	/* Whoever waits for the bitmap checks it again when the write in progress is done */
+	if (wib->flush_active) {
+		return;
+	}
+
+	memcpy(wib->flushing, wib->dirty, bitmap_len);
+
+	memset(wib->buf, 0, wib->num_blocks << raid_bdev->blocklen_shift);
+	header->magic = RAID5F_WIB_MAGIC;
+	header->version = RAID5F_WIB_VERSION;
+	header->region_shift = wib->region_shift;
+	header->num_regions = wib->num_regions;
+	header->seq = ++wib->seq;
+	memcpy((uint8_t *)wib->buf + raid_bdev->bdev.blocklen, wib->flushing, bitmap_len);
+
+	wib->flush_active = true;
+	wib->flush_syncing = false;
+	wib->flush_failed = false;
+	wib->slot = 0;
+	wib->writes_remaining = 0;
+	wib->copies_written = 0;
+	wib->stats.flushes++;
+
+	raid5f_wib_flush_next(wib);
+}
+
+static int
+raid5f_wib_poll(void *ctx)
+{
+	struct raid5f_wib *wib = ctx;
+	uint64_t now = spdk_get_ticks();
+
+	if (wib->flush_active) {
+		return SPDK_POLLER_IDLE;
+	}
+
+	/* Retry writing the bitmap for the waiting writes if the last write failed */
+	if (!TAILQ_EMPTY(&wib->waiters)) {
+		raid5f_wib_process_waiters(wib);
+		if (wib->flush_active) {
+			return SPDK_POLLER_BUSY;
+		}
+	}
+
+	if (now < wib->next_clear_tsc) {
+		return SPDK_POLLER_IDLE;
+	}
+	wib->next_clear_tsc = now + RAID5F_WIB_CLEAR_PERIOD_US * spdk_get_ticks_hz() /
+			      SPDK_SEC_TO_USEC;
+
+	if (!raid5f_wib_clear_regions(wib, false)) {
+		return SPDK_POLLER_IDLE;
+	}
+
+	raid5f_wib_flush(wib);
+
+	return SPDK_POLLER_BUSY;
+}
+
+static void
+raid5f_wib_resync_free(struct raid5f_wib *wib)
+{
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+	struct raid5f_wib_resync_stripe *stripe;
+	uint8_t s, i;
+
+	for (s = 0; s < RAID5F_WIB_RESYNC_DEPTH; s++) {
+		stripe = &wib->resync_stripes[s];
+
+		for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+			if (stripe->bufs) {
+				spdk_dma_free(stripe->bufs[i]);
+			}
+			if (stripe->md_bufs) {
+				spdk_dma_free(stripe->md_bufs[i]);
+			}
+		}
+		free(stripe->bufs);
+		free(stripe->md_bufs);
+		free(stripe->iovs);
+		spdk_dma_free(stripe->result);
+		spdk_dma_free(stripe->md_result);
+
+		stripe->bufs = NULL;
+		stripe->md_bufs = NULL;
+		stripe->iovs = NULL;
+		stripe->result = NULL;
+		stripe->md_result = NULL;
+	}
+}
+
+static int
+raid5f_wib_resync_alloc(struct raid5f_wib *wib)
+{
+	struct raid5f_info *r5f_info = wib->r5f_info;
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	size_t strip_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+	size_t md_len = raid_bdev->strip_size * spdk_bdev_get_md_size(&raid_bdev->bdev);
+	bool md_separate = spdk_bdev_is_md_separate(&raid_bdev->bdev);
+	struct raid5f_wib_resync_stripe *stripe;
+	uint8_t s, i;
+
+	for (s = 0; s < RAID5F_WIB_RESYNC_DEPTH; s++) {
+		stripe = &wib->resync_stripes[s];
+
+		stripe->iovs = calloc(raid_bdev->num_base_bdevs, sizeof(*stripe->iovs));
+		stripe->bufs = calloc(raid_bdev->num_base_bdevs, sizeof(*stripe->bufs));
+		stripe->result = spdk_dma_malloc(strip_len, r5f_info->buf_alignment, NULL);
+		if (!stripe->iovs || !stripe->bufs || !stripe->result) {
+			goto err;
+		}
+
+		for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+			stripe->bufs[i] = spdk_dma_malloc(strip_len, r5f_info->buf_alignment, NULL);
+			if (!stripe->bufs[i]) {
+				goto err;
+			}
+			stripe->iovs[i].iov_base = stripe->bufs[i];
+			stripe->iovs[i].iov_len = strip_len;
+		}
+
+		if (md_separate) {
+			stripe->md_bufs = calloc(raid_bdev->num_base_bdevs, sizeof(*stripe->md_bufs));
+			stripe->md_result = spdk_dma_malloc(md_len, r5f_info->buf_alignment, NULL);
+			if (!stripe->md_bufs || !stripe->md_result) {
+				goto err;
+			}
+
+			for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+				stripe->md_bufs[i] = spdk_dma_malloc(md_len, r5f_info->buf_alignment,
+								     NULL);
+				if (!stripe->md_bufs[i]) {
+					goto err;
+				}
+			}
+		}
+	}
+
+	return 0;
+err:
+	raid5f_wib_resync_free(wib);
+	return -ENOMEM;
+}
+
+static void
+raid5f_wib_resync_stripe_done(struct raid5f_wib_resync_stripe *stripe)
+{
+	struct raid5f_wib *wib = stripe->wib;
+
+	if (stripe->failed) {
+		wib->stats.errors++;
+		SPDK_ERRLOG("Failed to resync stripe %" PRIu64 " of raid bdev %s\n",
+			    stripe->stripe_index, wib->r5f_info->raid_bdev->bdev.name);
+	}
+
+	raid5f_range_unlock(&stripe->lock);
+
+	stripe->active = false;
+	wib->resync_active--;
+
+	if (wib->state == RAID5F_WIB_STOPPING) {
+		raid5f_wib_stop_continue(wib);
+	} else {
+		raid5f_wib_resync_next(wib);
+	}
+}
+
+static void
+raid5f_wib_resync_write_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_wib_resync_stripe *stripe = cb_arg;
+	struct raid5f_wib *wib = stripe->wib;
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+
+	spdk_bdev_free_io(bdev_io);
+
+	if (!success) {
+		stripe->failed = true;
+	} else {
+		wib->stats.stripes_repaired++;
+	}
+
+	raid5f_mismatch_record(raid5f_raid_ch_to_r5ch(spdk_io_channel_get_ctx(wib->ch)),
+			       stripe->stripe_index,
+			       raid5f_stripe_parity_chunk_index(raid_bdev, stripe->stripe_index),
+			       RAID5F_MISMATCH_SRC_RESYNC, success ? RAID5F_MISMATCH_PARITY_REWRITTEN :
+			       RAID5F_MISMATCH_REPAIR_FAILED);
+
+	raid5f_wib_resync_stripe_done(stripe);
+}
+
+static void
+_raid5f_wib_resync_write(void *ctx)
+{
+	struct raid5f_wib_resync_stripe *stripe = ctx;
+	struct raid5f_wib *wib = stripe->wib;
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+	struct raid_bdev_io_channel *raid_ch = spdk_io_channel_get_ctx(wib->ch);
+	uint8_t p = raid5f_stripe_parity_chunk_index(raid_bdev, stripe->stripe_index);
+	struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[p];
+	struct spdk_io_channel *base_ch = raid_ch->base_channel[p];
+	int ret;
+
+	if (base_ch == NULL) {
+		stripe->failed = true;
+		raid5f_wib_resync_stripe_done(stripe);
+		return;
+	}
+
+	memset(&stripe->ext_opts, 0, sizeof(stripe->ext_opts));
+	stripe->ext_opts.size = sizeof(stripe->ext_opts);
+	stripe->ext_opts.metadata = stripe->md_bufs ? stripe->md_bufs[p] : NULL;
+
+	ret = raid_bdev_writev_blocks_ext(base_info, base_ch, &stripe->iovs[p], 1,
+					  stripe->stripe_index << raid_bdev->strip_size_shift,
+					  raid_bdev->strip_size, raid5f_wib_resync_write_complete, stripe,
+					  &stripe->ext_opts);
+	if (ret == -ENOMEM) {
+		stripe->waitq_entry.bdev = spdk_bdev_desc_get_bdev(base_info->desc);
+		stripe->waitq_entry.cb_fn = _raid5f_wib_resync_write;
+		stripe->waitq_entry.cb_arg = stripe;
+		spdk_bdev_queue_io_wait(stripe->waitq_entry.bdev, base_ch, &stripe->waitq_entry);
+	} else if (ret != 0) {
+		stripe->failed = true;
+		raid5f_wib_resync_stripe_done(stripe);
+	}
+}
+
+/* Rewrite the parity of the stripe with the xor of its data strips if it doesn't match */
+static void
+raid5f_wib_resync_stripe_verify(struct raid5f_wib_resync_stripe *stripe)
+{
+	struct raid_bdev *raid_bdev = stripe->wib->r5f_info->raid_bdev;
+	size_t strip_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+	size_t md_len = raid_bdev->strip_size * spdk_bdev_get_md_size(&raid_bdev->bdev);
+	uint8_t p = raid5f_stripe_parity_chunk_index(raid_bdev, stripe->stripe_index);
+	bool consistent;
+	void *srcs[2];
+
+	if (stripe->failed) {
+		raid5f_wib_resync_stripe_done(stripe);
+		return;
+	}
+
+	raid5f_xor_gen(stripe->result, stripe->bufs, raid_bdev->num_base_bdevs, strip_len);
+	consistent = spdk_mem_all_zero(stripe->result, strip_len);
+
+	if (stripe->md_bufs) {
+		raid5f_xor_gen(stripe->md_result, stripe->md_bufs, raid_bdev->num_base_bdevs, md_len);
+		consistent = consistent && spdk_mem_all_zero(stripe->md_result, md_len);
+	}
+
+	if (consistent) {
+		raid5f_wib_resync_stripe_done(stripe);
+		return;
+	}
+
+	/* The xor of all strips xor-ed with the parity is the xor of the data strips */
+	srcs[0] = stripe->bufs[p];
+	srcs[1] = stripe->result;
+	raid5f_xor_gen(stripe->bufs[p], srcs, 2, strip_len);
+
+	if (stripe->md_bufs) {
+		srcs[0] = stripe->md_bufs[p];
+		srcs[1] = stripe->md_result;
+		raid5f_xor_gen(stripe->md_bufs[p], srcs, 2, md_len);
+	}
+
+	_raid5f_wib_resync_write(stripe);
+}
+
+static void
+raid5f_wib_resync_read_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_wib_resync_stripe *stripe = cb_arg;
+
+	spdk_bdev_free_io(bdev_io);
+
+	if (!success) {
+		stripe->failed = true;
+	}
+
+	assert(stripe->remaining > 0);
+	if (--stripe->remaining == 0) {
+		raid5f_wib_resync_stripe_verify(stripe);
+	}
+}
+
+static void raid5f_wib_resync_stripe_read(struct raid5f_wib_resync_stripe *stripe);
+
+static void
+_raid5f_wib_resync_stripe_read(void *ctx)
+{
+	raid5f_wib_resync_stripe_read(ctx);
+}
+
+static void
+raid5f_wib_resync_stripe_read(struct raid5f_wib_resync_stripe *stripe)
+{
+	struct raid5f_wib *wib = stripe->wib;
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+	struct raid_bdev_io_channel *raid_ch = spdk_io_channel_get_ctx(wib->ch);
+	struct spdk_bdev_ext_io_opts opts;
+	struct raid_base_bdev_info *base_info;
+	struct spdk_io_channel *base_ch;
+	uint8_t i;
+	int ret;
+
+	while (stripe->next_read < raid_bdev->num_base_bdevs) {
+		i = stripe->next_read;
+		base_info = &raid_bdev->base_bdev_info[i];
+		base_ch = raid_ch->base_channel[i];
+
+		if (base_ch == NULL) {
+			ret = -ENODEV;
+		} else {
+			memset(&opts, 0, sizeof(opts));
+			opts.size = sizeof(opts);
+			opts.metadata = stripe->md_bufs ? stripe->md_bufs[i] : NULL;
+
+			ret = raid_bdev_readv_blocks_ext(base_info, base_ch, &stripe->iovs[i], 1,
+							 stripe->stripe_index << raid_bdev->strip_size_shift,
+							 raid_bdev->strip_size, raid5f_wib_resync_read_complete,
+							 stripe, &opts);
+		}
+
+		if (ret == -ENOMEM) {
+			stripe->waitq_entry.bdev = spdk_bdev_desc_get_bdev(base_info->desc);
+			stripe->waitq_entry.cb_fn = _raid5f_wib_resync_stripe_read;
+			stripe->waitq_entry.cb_arg = stripe;
+			spdk_bdev_queue_io_wait(stripe->waitq_entry.bdev, base_ch, &stripe->waitq_entry);
+			return;
+		}
+
+		stripe->next_read++;
+
+		if (ret != 0) {
+			stripe->failed = true;
+			if (--stripe->remaining == 0) {
+				raid5f_wib_resync_stripe_verify(stripe);
+				return;
+			}
+		}
+	}
+}
+
+/* Select the first region from the given one on which waits for a resync */
+static void
+raid5f_wib_resync_select(struct raid5f_wib *wib, uint32_t region)
+{
+	struct raid5f_info *r5f_info = wib->r5f_info;
+
+	while (region < wib->num_regions && !raid5f_wib_test(wib->resync, region)) {
+		region++;
+	}
+
+	wib->resync_region = region;
+	if (region < wib->num_regions) {
+		wib->resync_next_stripe = (uint64_t)region << wib->region_shift;
+		wib->resync_end_stripe = spdk_min((uint64_t)(region + 1) << wib->region_shift,
+						  r5f_info->total_stripes);
+	}
+}
+
+/*
+ * Recalculate the parity of the stripes of the regions found dirty at start, a region at a
+ * time. Writes to a region wait until it is resynced, but repairs and other background I/O
+ * don't, so each stripe is locked exclusive while its parity is recalculated.
+ */
+static void
+raid5f_wib_resync_next(struct raid5f_wib *wib)
+{
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+	struct raid5f_wib_resync_stripe *stripe = NULL;
+	uint32_t region;
+	uint8_t s;
+
+	while (wib->state == RAID5F_WIB_ONLINE && wib->resync_region < wib->num_regions) {
+		if (wib->resync_next_stripe == wib->resync_end_stripe) {
+			if (wib->resync_active > 0) {
+				return;
+			}
+
+			region = wib->resync_region;
+			raid5f_wib_clear(wib->resync, region);
+			if (raid5f_wib_test(wib->persisted, region)) {
+				raid5f_wib_set(wib->writable, region);
+			}
+			wib->stats.regions_resynced++;
+
+			raid5f_wib_resync_select(wib, region + 1);
+			if (wib->resync_region == wib->num_regions) {
+				SPDK_NOTICELOG("Resync of raid bdev %s completed\n",
+					       raid_bdev->bdev.name);
+				raid5f_wib_resync_free(wib);
+			}
+
+			raid5f_wib_process_waiters(wib);
+			continue;
+		}
+
+		for (s = 0; s < RAID5F_WIB_RESYNC_DEPTH; s++) {
+			stripe = &wib->resync_stripes[s];
+			if (!stripe->active) {
+				break;
+			}
+		}
+		if (s == RAID5F_WIB_RESYNC_DEPTH) {
+			return;
+		}
+
+		stripe->active = true;
+		stripe->failed = false;
+		stripe->stripe_index = wib->resync_next_stripe++;
+		stripe->next_read = 0;
+		stripe->remaining = raid_bdev->num_base_bdevs;
+		wib->resync_active++;
+
+		if (raid5f_range_lock(&stripe->lock, wib->r5f_info, stripe->stripe_index, 1, true,
+				      _raid5f_wib_resync_stripe_read, stripe)) {
+			raid5f_wib_resync_stripe_read(stripe);
+		}
+	}
+}
+
+/* Set the regions found in the bitmaps of the base bdevs as written and start resyncing them */
+static void
+raid5f_wib_loaded(struct raid5f_wib *wib)
+{
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+	uint32_t num_dirty = 0;
+	uint32_t w;
+
+	wib->loading = false;
+
+	if (wib->state == RAID5F_WIB_STOPPING) {
+		/* Keep the bits on disk, the regions weren't resynced */
+		wib->stop_flushed = true;
+		raid5f_wib_stop_continue(wib);
+		return;
+	}
+
+	for (w = 0; w < wib->num_words; w++) {
+		wib->persisted[w] = wib->dirty[w];
+		num_dirty += __builtin_popcountll(wib->dirty[w]);
+	}
+
+	if (num_dirty > 0 && raid_bdev->num_base_bdevs_discovered < raid_bdev->num_base_bdevs) {
+		SPDK_WARNLOG("%" PRIu32 " regions of raid bdev %s were being written when it "
+			     "stopped and can't be resynced without all base bdevs\n", num_dirty,
+			     raid_bdev->bdev.name);
+	} else if (num_dirty > 0 && raid5f_wib_resync_alloc(wib) != 0) {
+		SPDK_ERRLOG("Failed to allocate resync buffers of raid bdev %s, %" PRIu32
+			    " regions are not resynced\n", raid_bdev->bdev.name, num_dirty);
+	} else if (num_dirty > 0) {
+		SPDK_NOTICELOG("Resyncing %" PRIu32 " regions of raid bdev %s which were being written "
+			       "when it stopped\n", num_dirty, raid_bdev->bdev.name);
+		memcpy(wib->resync, wib->dirty, wib->num_words * sizeof(uint64_t));
+	}
+
+	for (w = 0; w < wib->num_words; w++) {
+		__atomic_store_n(&wib->writable[w], wib->persisted[w] & ~wib->resync[w],
+				 __ATOMIC_SEQ_CST);
+	}
+
+	wib->state = RAID5F_WIB_ONLINE;
+	wib->next_clear_tsc = spdk_get_ticks() + RAID5F_WIB_CLEAR_PERIOD_US * spdk_get_ticks_hz() /
+			      SPDK_SEC_TO_USEC;
+	wib->poller = SPDK_POLLER_REGISTER(raid5f_wib_poll, wib, RAID5F_WIB_POLL_PERIOD_US);
+	if (!wib->poller) {
+		SPDK_ERRLOG("Failed to register the write-intent bitmap poller of raid bdev %s, regions "
+			    "are not cleared\n", raid_bdev->bdev.name);
+	}
+
+	raid5f_wib_resync_select(wib, 0);
+	raid5f_wib_resync_next(wib);
+	raid5f_wib_process_waiters(wib);
+}
+
+static void raid5f_wib_load_next(struct raid5f_wib *wib);
+
+static void
+raid5f_wib_load_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_wib *wib = cb_arg;
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+	struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[wib->slot];
+	struct raid5f_wib_header *header = wib->buf;
+	uint64_t *bits = (uint64_t *)((uint8_t *)wib->buf + raid_bdev->bdev.blocklen);
+	uint32_t w;
+
+	spdk_bdev_free_io(bdev_io);
+
+	if (!success) {
+		wib->stats.errors++;
+		SPDK_ERRLOG("Failed to read the write-intent bitmap from base bdev %s of raid bdev %s\n",
+			    base_info->name, raid_bdev->bdev.name);
+	} else if (header->magic == RAID5F_WIB_MAGIC && header->version == RAID5F_WIB_VERSION) {
+		if (header->region_shift == wib->region_shift &&
+		    header->num_regions == wib->num_regions) {
+			for (w = 0; w < wib->num_words; w++) {
+				wib->dirty[w] |= bits[w];
+			}
+			wib->seq = spdk_max(wib->seq, header->seq);
+		} else {
+			SPDK_WARNLOG("Ignoring the write-intent bitmap of another layout on base "
+				     "bdev %s of raid bdev %s\n", base_info->name, raid_bdev->bdev.name);
+		}
+	}
+
+	wib->slot++;
+	raid5f_wib_load_next(wib);
+}
+
+static void
+_raid5f_wib_load_next(void *ctx)
+{
+	raid5f_wib_load_next(ctx);
+}
+
+/* Read the bitmap from the base bdevs from wib->slot on, one at a time */
+static void
+raid5f_wib_load_next(struct raid5f_wib *wib)
+{
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+	struct raid_bdev_io_channel *raid_ch = spdk_io_channel_get_ctx(wib->ch);
+	struct raid_base_bdev_info *base_info;
+	struct spdk_io_channel *base_ch;
+	int ret;
+
+	while (wib->slot < raid_bdev->num_base_bdevs && wib->state == RAID5F_WIB_LOADING) {
+		base_info = &raid_bdev->base_bdev_info[wib->slot];
+		base_ch = raid_ch->base_channel[wib->slot];
+
+		if (base_ch == NULL) {
+			wib->slot++;
+			continue;
+		}
+
+		ret = spdk_bdev_read_blocks(base_info->desc, base_ch, wib->buf, wib->offset_blocks,
+					    wib->num_blocks, raid5f_wib_load_complete, wib);
+		if (ret == 0) {
+			return;
+		} else if (ret == -ENOMEM) {
+			wib->waitq_entry.bdev = spdk_bdev_desc_get_bdev(base_info->desc);
+			wib->waitq_entry.cb_fn = _raid5f_wib_load_next;
+			wib->waitq_entry.cb_arg = wib;
+			spdk_bdev_queue_io_wait(wib->waitq_entry.bdev, base_ch, &wib->waitq_entry);
+			return;
+		}
+
+		wib->stats.errors++;
+		SPDK_ERRLOG("Failed to read the write-intent bitmap from base bdev %s of raid "
+			    "bdev %s: %s\n", base_info->name, raid_bdev->bdev.name, spdk_strerror(-ret));
+		wib->slot++;
+	}
+
+	raid5f_wib_loaded(wib);
+}
+
+/* Start loading the bitmap on the app thread once the raid bdev is registered */
+static void
+raid5f_wib_load(void *ctx)
+{
+	struct raid5f_wib *wib = ctx;
+	struct raid_bdev *raid_bdev = wib->r5f_info->raid_bdev;
+
+	if (wib->state == RAID5F_WIB_STOPPING) {
+		raid5f_wib_loaded(wib);
+		return;
+	}
+
+	wib->ch = spdk_get_io_channel(raid_bdev);
+	if (!wib->ch) {
+		SPDK_ERRLOG("Failed to get io channel for the write-intent bitmap of raid bdev %s, "
+			    "writes are not tracked\n", raid_bdev->bdev.name);
+		wib->loading = false;
+		wib->state = RAID5F_WIB_STOPPED;
+		raid5f_wib_process_waiters(wib);
+		return;
+	}
+
+	wib->slot = 0;
+	raid5f_wib_load_next(wib);
+}
+
+static void
+raid5f_wib_stop_continue(struct raid5f_wib *wib)
+{
+	struct raid5f_stop_waiter *waiter;
+
+	if (wib->loading || wib->flush_active || wib->resync_active > 0) {
+		return;
+	}
+
+	if (!wib->stop_flushed && wib->ch != NULL) {
+		wib->stop_flushed = true;
+		if (raid5f_wib_clear_regions(wib, true)) {
+			raid5f_wib_flush(wib);
+			return;
+		}
+	}
+
+	if (wib->ch != NULL) {
+		spdk_put_io_channel(wib->ch);
+		wib->ch = NULL;
+	}
+	raid5f_wib_resync_free(wib);
+	wib->state = RAID5F_WIB_STOPPED;
+
+	while ((waiter = TAILQ_FIRST(&wib->stop_waiters))) {
+		TAILQ_REMOVE(&wib->stop_waiters, waiter, link);
+		waiter->cb_fn(waiter->cb_ctx, 0);
+		free(waiter);
+	}
+}
+
+/*
+ * Stop the bitmap, clearing the regions without writes in progress on disk. Writes don't wait
+ * for the bitmap anymore from now on.
+ */
+static int
+raid5f_wib_stop_with_cb(struct raid5f_wib *wib, raid_bdev_stop_background_cb cb_fn,
+			void *cb_ctx)
+{
+	struct raid5f_stop_waiter *waiter = NULL;
+
+	assert(wib->state != RAID5F_WIB_STOPPED);
+
+	if (cb_fn != NULL) {
+		waiter = calloc(1, sizeof(*waiter));
+		if (!waiter) {
+			SPDK_ERRLOG("Failed to allocate write-intent bitmap stop waiter\n");
+		} else {
+			waiter->cb_fn = cb_fn;
+			waiter->cb_ctx = cb_ctx;
+			TAILQ_INSERT_TAIL(&wib->stop_waiters, waiter, link);
+		}
+	}
+
+	if (wib->state != RAID5F_WIB_STOPPING) {
+		wib->state = RAID5F_WIB_STOPPING;
+		spdk_poller_unregister(&wib->poller);
+		raid5f_wib_process_waiters(wib);
+		raid5f_wib_stop_continue(wib);
+	}
+
+	return (cb_fn != NULL && waiter == NULL) ? -ENOMEM : 0;
+}
+
+static void
+raid5f_wib_free(struct raid5f_wib *wib)
+{
+	assert(TAILQ_EMPTY(&wib->waiters));
+
+	raid5f_wib_resync_free(wib);
+	spdk_dma_free(wib->buf);
+	free(wib->dirty);
+	free(wib->persisted);
+	free(wib->resync);
+	free(wib->writable);
+	free(wib->touched);
+	free(wib->flushing);
+	free(wib->active);
+	free(wib);
+}
+
+/*
+ * Set up the bitmap if the base bdevs have space reserved for it before their data. Its
+ * regions cover at least RAID5F_WIB_MIN_REGION_SIZE and there are at most
+ * RAID5F_WIB_MAX_REGIONS of them.
+ */
+static int
+raid5f_wib_alloc(struct raid5f_info *r5f_info)
+{
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	uint64_t stripe_bytes = r5f_info->stripe_blocks << raid_bdev->blocklen_shift;
+	uint64_t data_offset = UINT64_MAX;
+	struct raid_base_bdev_info *base_info;
+	struct raid5f_wib *wib;
+	uint8_t s;
+
+	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
+		data_offset = spdk_min(data_offset, base_info->data_offset);
+	}
+
+	wib = calloc(1, sizeof(*wib));
+	if (!wib) {
+		return -ENOMEM;
+	}
+
+	wib->r5f_info = r5f_info;
+	wib->state = RAID5F_WIB_LOADING;
+	wib->loading = true;
+	TAILQ_INIT(&wib->waiters);
+	TAILQ_INIT(&wib->stop_waiters);
+
+	while ((stripe_bytes << wib->region_shift) < RAID5F_WIB_MIN_REGION_SIZE ||
+	       spdk_divide_round_up(r5f_info->total_stripes,
+				    1ULL << wib->region_shift) > RAID5F_WIB_MAX_REGIONS) {
+		wib->region_shift++;
+	}
+	wib->num_regions = spdk_divide_round_up(r5f_info->total_stripes, 1ULL << wib->region_shift);
+	wib->num_words = SPDK_CEIL_DIV(wib->num_regions, 64);
+	wib->resync_region = wib->num_regions;
+
+	wib->offset_blocks = RAID5F_WIB_OFFSET >> raid_bdev->blocklen_shift;
+	wib->num_blocks = 1 + SPDK_CEIL_DIV(wib->num_words * sizeof(uint64_t),
+					    raid_bdev->bdev.blocklen);
+	if (wib->offset_blocks + wib->num_blocks > data_offset) {
+		SPDK_WARNLOG("No space for the write-intent bitmap on the base bdevs of raid bdev %s\n",
+			     raid_bdev->bdev.name);
+		free(wib);
+		return 0;
+	}
+
+	wib->dirty = calloc(wib->num_words, sizeof(uint64_t));
+	wib->persisted = calloc(wib->num_words, sizeof(uint64_t));
+	wib->resync = calloc(wib->num_words, sizeof(uint64_t));
+	wib->writable = calloc(wib->num_words, sizeof(uint64_t));
+	wib->touched = calloc(wib->num_words, sizeof(uint64_t));
+	wib->flushing = calloc(wib->num_words, sizeof(uint64_t));
+	wib->active = calloc(wib->num_regions, sizeof(uint32_t));
+	wib->buf = spdk_dma_zmalloc(wib->num_blocks << raid_bdev->blocklen_shift,
+				    r5f_info->buf_alignment, NULL);
+	if (!wib->dirty || !wib->persisted || !wib->resync || !wib->writable || !wib->touched ||
+	    !wib->flushing || !wib->active || !wib->buf) {
+		raid5f_wib_free(wib);
+		return -ENOMEM;
+	}
+
+	for (s = 0; s < RAID5F_WIB_RESYNC_DEPTH; s++) {
+		wib->resync_stripes[s].wib = wib;
+	}
+
+	r5f_info->wib = wib;
+
+	return 0;
+}
+
+static void raid5f_csum_stop_continue(struct raid5f_csum *csum);
+
+static void
+raid5f_csum_page_write_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_csum_page *page = cb_arg;
+	struct raid5f_csum *csum = page->csum;
+
+	spdk_bdev_free_io(bdev_io);
+
+	/* A failed write isn't retried, the page is written again with its next update */
+	spdk_spin_lock(&csum->lock);
+	page->writing = false;
+	spdk_spin_unlock(&csum->lock);
+
+	__atomic_fetch_add(success ? &csum->stats.page_writes : &csum->stats.errors, 1,
+			   __ATOMIC_RELAXED);
+
+	assert(csum->writes_active > 0);
+	csum->writes_active--;
+
+	if (csum->stopping) {
+		raid5f_csum_stop_continue(csum);
+	}
+}
+
+/*
+ * Write the dirty pages of the table, up to RAID5F_CSUM_WRITE_DEPTH at a time, on the app
+ * thread. The entries are written directly from the cache, an update racing with the write
+ * marks the page dirty again. Pages not read yet are read first, unless stopping. Returns
+ * the number of writes started.
+ */
+static uint32_t
+raid5f_csum_writeback(struct raid5f_csum *csum)
+{
+	struct raid_bdev *raid_bdev = csum->r5f_info->raid_bdev;
+	struct raid_bdev_io_channel *raid_ch = spdk_io_channel_get_ctx(csum->ch);
+	struct raid5f_csum_page *writes[RAID5F_CSUM_WRITE_DEPTH];
+	struct raid5f_csum_page *loads[RAID5F_CSUM_WRITE_DEPTH];
+	struct raid5f_csum_page *page;
+	struct raid_base_bdev_info *base_info;
+	uint32_t num_writes = 0, num_loads = 0, started = 0;
+	uint32_t i;
+	int ret;
+
+	spdk_spin_lock(&csum->lock);
+	TAILQ_FOREACH(page, &csum->lru, lru_link) {
+		if (csum->writes_active + num_writes == RAID5F_CSUM_WRITE_DEPTH) {
+			break;
+		}
+		if (!page->dirty || page->loading || page->writing) {
+			continue;
+		}
+		if (raid_ch->base_channel[page->member] == NULL) {
+			/* The base bdev is missing, its table is rebuilt by reads */
+			page->dirty = false;
+		} else if (page->loaded) {
+			page->dirty = false;
+			page->writing = true;
+			writes[num_writes++] = page;
+		} else if (!csum->stopping && num_loads < RAID5F_CSUM_WRITE_DEPTH) {
+			page->loading = true;
+			loads[num_loads++] = page;
+		}
+	}
+	spdk_spin_unlock(&csum->lock);
+
+	for (i = 0; i < num_writes; i++) {
+		page = writes[i];
+		base_info = &raid_bdev->base_bdev_info[page->member];
+
+		ret = spdk_bdev_write_blocks(base_info->desc, raid_ch->base_channel[page->member],
+					     page->entries,
+					     raid5f_csum_page_offset(csum, base_info, page->page_idx),
+					     csum->page_blocks, raid5f_csum_page_write_complete,
+					     page);
+		if (ret == 0) {
+			csum->writes_active++;
+			started++;
+			continue;
+		}
+
+		/* Retried by the next pass */
+		spdk_spin_lock(&csum->lock);
+		page->writing = false;
+		page->dirty = true;
+		spdk_spin_unlock(&csum->lock);
+	}
+
+	for (i = 0; i < num_loads; i++) {
+		raid5f_csum_page_load(csum, loads[i]);
+	}
+
+	return started;
+}
+
+static int
+raid5f_csum_poll(void *ctx)
+{
+	struct raid5f_csum *csum = ctx;
+
+	return raid5f_csum_writeback(csum) > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+/* Start writing back the table on the app thread once the raid bdev is registered */
+static void
+raid5f_csum_start(void *ctx)
+{
+	struct raid5f_csum *csum = ctx;
+	struct raid_bdev *raid_bdev = csum->r5f_info->raid_bdev;
+
+	if (csum->stopping) {
+		return;
+	}
+
+	csum->ch = spdk_get_io_channel(raid_bdev);
+	if (!csum->ch) {
+		SPDK_ERRLOG("Failed to get io channel for the chunk checksums of raid bdev %s, "
+			    "they are not written\n", raid_bdev->bdev.name);
+		return;
+	}
+
+	csum->poller = SPDK_POLLER_REGISTER(raid5f_csum_poll, csum, RAID5F_CSUM_POLL_PERIOD_US);
+	if (!csum->poller) {
+		SPDK_ERRLOG("Failed to register the chunk checksum poller of raid bdev %s, they "
+			    "are only written when it stops\n", raid_bdev->bdev.name);
+	}
+}
+
+static void
+raid5f_csum_stop_continue(struct raid5f_csum *csum)
+{
+	struct raid5f_stop_waiter *waiter;
+
+	if (csum->writes_active > 0) {
+		return;
+	}
+
+	if (csum->ch != NULL) {
+		if (raid5f_csum_writeback(csum) > 0) {
+			return;
+		}
+		spdk_put_io_channel(csum->ch);
+		csum->ch = NULL;
+	}
+	csum->stopped = true;
+
+	while ((waiter = TAILQ_FIRST(&csum->stop_waiters))) {
+		TAILQ_REMOVE(&csum->stop_waiters, waiter, link);
+		waiter->cb_fn(waiter->cb_ctx, 0);
+		free(waiter);
+	}
+}
+
+/*
+ * Stop the table, writing its dirty pages which were read from the base bdevs a last time.
+ * Updates after that stay in memory.
+ */
+static int
+raid5f_csum_stop_with_cb(struct raid5f_csum *csum, raid_bdev_stop_background_cb cb_fn,
+			 void *cb_ctx)
+{
+	struct raid5f_stop_waiter *waiter = NULL;
+
+	assert(!csum->stopped);
+
+	if (cb_fn != NULL) {
+		waiter = calloc(1, sizeof(*waiter));
+		if (!waiter) {
+			SPDK_ERRLOG("Failed to allocate chunk checksum stop waiter\n");
+		} else {
+			waiter->cb_fn = cb_fn;
+			waiter->cb_ctx = cb_ctx;
+			TAILQ_INSERT_TAIL(&csum->stop_waiters, waiter, link);
+		}
+	}
+
+	if (!csum->stopping) {
+		csum->stopping = true;
+		spdk_poller_unregister(&csum->poller);
+		raid5f_csum_stop_continue(csum);
+	}
+
+	return (cb_fn != NULL && waiter == NULL) ? -ENOMEM : 0;
+}
+
+static void
+raid5f_csum_free(struct raid5f_csum *csum)
+{
+	spdk_spin_destroy(&csum->lock);
+	spdk_dma_free(csum->entries_buf);
+	free(csum->known_buf);
+	free(csum->pages);
+	free(csum->buckets);
+	free(csum);
+}
+
+static inline uint32_t
+raid5f_csum_page_blocks(struct raid_bdev *raid_bdev)
+{
+	return SPDK_CEIL_DIV(RAID5F_CSUM_PAGE_SIZE, raid_bdev->bdev.blocklen);
+}
+
+/*
+ * Number of stripes fitting on base bdevs of blockcnt data blocks along with a page of the
+ * checksum table for each entries_per_page of them
+ */
+static uint64_t
+raid5f_csum_total_stripes(struct raid_bdev *raid_bdev, uint64_t blockcnt)
+{
+	uint64_t page_blocks = raid5f_csum_page_blocks(raid_bdev);
+	uint64_t entries_per_page = page_blocks * raid_bdev->bdev.blocklen / sizeof(uint32_t);
+	uint64_t group_blocks = entries_per_page * raid_bdev->strip_size + page_blocks;
+	uint64_t rem = blockcnt % group_blocks;
+	uint64_t total_stripes = blockcnt / group_blocks * entries_per_page;
+
+	if (rem > page_blocks) {
+		total_stripes += (rem - page_blocks) / raid_bdev->strip_size;
+	}
+
+	return total_stripes;
+}
+
+/*
+ * Set up the cache of the table, which follows the r5f_info->total_stripes chunks on each
+ * base bdev. It holds up to RAID5F_CSUM_CACHE_SIZE of pages.
+ */
+static int
+raid5f_csum_alloc(struct raid5f_info *r5f_info)
+{
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	struct raid5f_csum *csum;
+	size_t page_len, known_words;
+	uint32_t num_buckets = 1;
+	uint32_t i;
+
+	csum = calloc(1, sizeof(*csum));
+	if (!csum) {
+		return -ENOMEM;
+	}
+
+	csum->r5f_info = r5f_info;
+	csum->offset_blocks = r5f_info->total_stripes * raid_bdev->strip_size;
+	csum->page_blocks = raid5f_csum_page_blocks(raid_bdev);
+	page_len = (size_t)csum->page_blocks * raid_bdev->bdev.blocklen;
+	csum->entries_per_page = page_len / sizeof(uint32_t);
+	csum->num_pages = spdk_divide_round_up(r5f_info->total_stripes, csum->entries_per_page);
+	csum->num_cached = spdk_min(RAID5F_CSUM_CACHE_SIZE / page_len,
+				    csum->num_pages * raid_bdev->num_base_bdevs);
+	known_words = SPDK_CEIL_DIV(csum->entries_per_page, 64);
+	spdk_spin_init(&csum->lock);
+	TAILQ_INIT(&csum->free_pages);
+	TAILQ_INIT(&csum->lru);
+	TAILQ_INIT(&csum->stop_waiters);
+
+	while (num_buckets < csum->num_cached) {
+		num_buckets <<= 1;
+	}
+	csum->buckets_mask = num_buckets - 1;
+
+	csum->pages = calloc(csum->num_cached, sizeof(*csum->pages));
+	csum->buckets = calloc(num_buckets, sizeof(*csum->buckets));
+	csum->known_buf = calloc(csum->num_cached * known_words, sizeof(uint64_t));
+	csum->entries_buf = spdk_dma_zmalloc(csum->num_cached * page_len, r5f_info->buf_alignment,
+					     NULL);
+	if (!csum->pages || !csum->buckets || !csum->known_buf || !csum->entries_buf) {
+		raid5f_csum_free(csum);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < num_buckets; i++) {
+		TAILQ_INIT(&csum->buckets[i]);
+	}
+
+	for (i = 0; i < csum->num_cached; i++) {
+		struct raid5f_csum_page *page = &csum->pages[i];
+
+		page->csum = csum;
+		page->member = UINT8_MAX;
+		page->entries = (uint32_t *)((uint8_t *)csum->entries_buf + i * page_len);
+		page->known = &csum->known_buf[i * known_words];
+		TAILQ_INSERT_TAIL(&csum->free_pages, page, lru_link);
+	}
+
+	r5f_info->csum = csum;
+
+	return 0;
+}
+
+static void
+raid5f_stripe_request_free_buffers(struct raid_bdev *raid_bdev, void **buffers, uint8_t n)
+{
+	uint8_t i;
+
+	if (buffers) {
+		for (i = 0; i < n; i++) {
+			spdk_dma_free(buffers[i]);
+		}
+		free(buffers);
+	}
+}
+
+static void
+raid5f_stripe_request_free(struct stripe_request *stripe_req)
+{
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(stripe_req->r5ch);
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	struct chunk *chunk;
+
+	FOR_EACH_CHUNK(stripe_req, chunk) {
+		free(chunk->iovs);
+		free(chunk->new_iovs);
+	}
+
+	if (stripe_req->type == STRIPE_REQ_WRITE) {
+		spdk_dma_free(stripe_req->write.parity_buf);
+		spdk_dma_free(stripe_req->write.parity_md_buf);
+	} else if (stripe_req->type == STRIPE_REQ_RECONSTRUCT) {
+		free(stripe_req->reconstruct.chunk_buffers);
+		free(stripe_req->reconstruct.chunk_md_buffers);
+	} else if (stripe_req->type == STRIPE_REQ_PARTIAL_WRITE) {
+		uint8_t n = raid_bdev->num_base_bdevs;
+
+		spdk_dma_free(stripe_req->partial.parity_buf);
+		spdk_dma_free(stripe_req->partial.parity_md_buf);
+		raid5f_stripe_request_free_buffers(raid_bdev, stripe_req->partial.chunk_buffers, n);
+		raid5f_stripe_request_free_buffers(raid_bdev, stripe_req->partial.chunk_md_buffers, n);
+		raid5f_stripe_request_free_buffers(raid_bdev, stripe_req->partial.chunk_new_md_buffers, n);
+	} else {
+		assert(false);
+	}
+
+	free(stripe_req->chunk_xor_buffers);
+	free(stripe_req->chunk_xor_md_buffers);
+	free(stripe_req->chunk_iov_iters);
+
+	free(stripe_req);
+}
+
+static void **
+raid5f_stripe_request_alloc_buffers(struct raid5f_info *r5f_info, uint8_t n, size_t len)
+{
+	void **buffers;
+	uint8_t i;
+
+	buffers = calloc(n, sizeof(void *));
+	if (!buffers) {
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		buffers[i] = spdk_dma_malloc(len, r5f_info->buf_alignment, NULL);
+		if (!buffers[i]) {
+			raid5f_stripe_request_free_buffers(r5f_info->raid_bdev, buffers, n);
+			return NULL;
+		}
+	}
+
+	return buffers;
+}
+
+static struct stripe_request *
+raid5f_stripe_request_alloc(struct raid5f_io_channel *r5ch, enum stripe_request_type type)
+{
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(r5ch);
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	uint32_t raid_io_md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
+	struct stripe_request *stripe_req;
+	struct chunk *chunk;
+	size_t chunk_len;
+
+	stripe_req = calloc(1, sizeof(*stripe_req) + sizeof(*chunk) * raid_bdev->num_base_bdevs);
+	if (!stripe_req) {
+		return NULL;
+	}
+
+	stripe_req->r5ch = r5ch;
+	stripe_req->type = type;
+
+	FOR_EACH_CHUNK(stripe_req, chunk) {
+		chunk->index = chunk - stripe_req->chunks;
+		chunk->iovcnt_max = 4;
+		chunk->iovs = calloc(chunk->iovcnt_max, sizeof(chunk->iovs[0]));
+		if (!chunk->iovs) {
+			goto err;
+		}
+	}
+
+	chunk_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+
+	if (type == STRIPE_REQ_WRITE) {
+		stripe_req->write.parity_buf = spdk_dma_malloc(chunk_len, r5f_info->buf_alignment, NULL);
+		if (!stripe_req->write.parity_buf) {
+			goto err;
+		}
+
+		if (raid_io_md_size != 0) {
+			stripe_req->write.parity_md_buf = spdk_dma_malloc(raid_bdev->strip_size * raid_io_md_size,
+							  r5f_info->buf_alignment, NULL);
+			if (!stripe_req->write.parity_md_buf) {
+				goto err;
+			}
+		}
+	} else if (type == STRIPE_REQ_RECONSTRUCT) {
+		uint8_t n = raid5f_stripe_data_chunks_num(raid_bdev);
+
+		/* The buffers are borrowed from the io channel's pool when the request is used */
+		stripe_req->reconstruct.chunk_buffers = calloc(n, sizeof(void *));
+		if (!stripe_req->reconstruct.chunk_buffers) {
+			goto err;
+		}
+
+		stripe_req->reconstruct.chunk_md_buffers = calloc(n, sizeof(void *));
+		if (!stripe_req->reconstruct.chunk_md_buffers) {
+			goto err;
+		}
+	} else if (type == STRIPE_REQ_PARTIAL_WRITE) {
+		uint8_t n = raid_bdev->num_base_bdevs;
+
+		stripe_req->partial.parity_buf = spdk_dma_malloc(chunk_len, r5f_info->buf_alignment, NULL);
+		if (!stripe_req->partial.parity_buf) {
+			goto err;
+		}
+
+		stripe_req->partial.chunk_buffers = raid5f_stripe_request_alloc_buffers(r5f_info, n, chunk_len);
+		if (!stripe_req->partial.chunk_buffers) {
+			goto err;
+		}
+
+		if (raid_io_md_size != 0) {
+			size_t md_len = raid_bdev->strip_size * raid_io_md_size;
+
+			stripe_req->partial.parity_md_buf = spdk_dma_malloc(md_len, r5f_info->buf_alignment, NULL);
+			if (!stripe_req->partial.parity_md_buf) {
+				goto err;
+			}
+
+			stripe_req->partial.chunk_md_buffers = raid5f_stripe_request_alloc_buffers(r5f_info, n, md_len);
+			if (!stripe_req->partial.chunk_md_buffers) {
+				goto err;
+			}
+
+			stripe_req->partial.chunk_new_md_buffers = raid5f_stripe_request_alloc_buffers(r5f_info, n,
+					md_len);
+			if (!stripe_req->partial.chunk_new_md_buffers) {
+				goto err;
+			}
+		}
+	} else {
+		assert(false);
+		return NULL;
+	}
+
+	stripe_req->chunk_iov_iters = malloc(SPDK_IOVITER_SIZE(raid5f_xor_buffers_max(raid_bdev)));
+	if (!stripe_req->chunk_iov_iters) {
+		goto err;
+	}
+
+	stripe_req->chunk_xor_buffers = calloc(raid5f_xor_buffers_max(raid_bdev),
+					       sizeof(stripe_req->chunk_xor_buffers[0]));
+	if (!stripe_req->chunk_xor_buffers) {
+		goto err;
+	}
+
+	stripe_req->chunk_xor_md_buffers = calloc(raid5f_xor_buffers_max(raid_bdev),
+					   sizeof(stripe_req->chunk_xor_md_buffers[0]));
+	if (!stripe_req->chunk_xor_md_buffers) {
+		goto err;
+	}
+
+	return stripe_req;
+err:
+	raid5f_stripe_request_free(stripe_req);
+	return NULL;
+}
+
+/*
+ * Free the stripe requests the pools grew by and which weren't needed since the last run.
+ * A pool keeps at least its preallocated size and the most requests in use at once recently.
+ */
+static int
+raid5f_stripe_pool_shrink(void *ctx)
+{
+	struct raid5f_io_channel *r5ch = ctx;
+	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(r5ch);
+	struct raid5f_stripe_pool *pool;
+	struct stripe_request *stripe_req;
+	uint32_t keep, freed = 0;
+	int i;
+
+	for (i = 0; i < RAID5F_STRIPE_REQ_TYPES; i++) {
+		pool = &r5ch->stripe_pools[i];
+		keep = spdk_max(r5f_info->stripe_pool_size, pool->peak_in_use);
+
+		/* The least recently used ones are at the tail */
+		while (pool->num_allocated > keep && pool->num_free > 0) {
+			stripe_req = TAILQ_LAST(&pool->free, raid5f_stripe_request_head);
+			TAILQ_REMOVE(&pool->free, stripe_req, link);
+			raid5f_stripe_request_free(stripe_req);
+			pool->num_allocated--;
+			pool->num_free--;
+			freed++;
+		}
+
+		pool->peak_in_use = pool->num_allocated - pool->num_free;
+	}
+
+	if (freed == 0) {
+		return SPDK_POLLER_IDLE;
+	}
+
+	__atomic_fetch_add(&r5f_info->pool_stats.shrunk, freed, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&r5f_info->pool_stats.allocated, freed, __ATOMIC_RELAXED);
+
+	return SPDK_POLLER_BUSY;
+}
+
+static void
+raid5f_ioch_destroy(void *io_device, void *ctx_buf)
+{
+	struct raid5f_io_channel *r5ch = ctx_buf;
+	struct raid5f_info *r5f_info = io_device;
+	struct raid5f_stripe_pool *pool;
+	struct stripe_request *stripe_req;
+	struct raid5f_degraded_cache_entry *entry;
+	struct raid5f_read_hedge *hedge;
+	struct raid5f_wib_write *wib_write;
+	struct raid5f_buf *buf;
+	int i;
+
+	assert(TAILQ_EMPTY(&r5ch->cache_flush_retry_queue));
+	assert(TAILQ_EMPTY(&r5ch->repair_queue));
+
+	while ((wib_write = TAILQ_FIRST(&r5ch->wib_writes))) {
+		TAILQ_REMOVE(&r5ch->wib_writes, wib_write, link);
+		free(wib_write);
+	}
+
+	while ((entry = TAILQ_FIRST(&r5ch->degraded_cache))) {
+		TAILQ_REMOVE(&r5ch->degraded_cache, entry, link);
+		spdk_dma_free(entry->buf);
+		spdk_dma_free(entry->md_buf);
+		free(entry);
+	}
+
+	spdk_poller_unregister(&r5ch->cache_poller);
+	spdk_poller_unregister(&r5ch->stripe_pool_poller);
+	spdk_poller_unregister(&r5ch->hedge_poller);
+
+	spdk_poller_unregister(&r5ch->mismatch_poller);
+	raid5f_mismatch_drain(r5ch);
+
+	/* Reads left behind by hedges which won free their buffers themselves */
+	while ((hedge = TAILQ_FIRST(&r5ch->hedge_reads))) {
+		assert(hedge->read_ctx == NULL);
+		TAILQ_REMOVE(&r5ch->hedge_reads, hedge, link);
+		hedge->r5ch = NULL;
+	}
+
+	if (r5ch->member_lat) {
+		for (i = 0; i < r5f_info->raid_bdev->num_base_bdevs; i++) {
+			__atomic_fetch_sub(&r5f_info->member_stats[i].outstanding,
+					   (int64_t)r5ch->member_lat[i].published_outstanding,
+					   __ATOMIC_RELAXED);
+		}
+		free(r5ch->member_lat);
+	}
+
+	for (i = 0; i < RAID5F_STRIPE_REQ_TYPES; i++) {
+		pool = &r5ch->stripe_pools[i];
+		assert(pool->num_free == pool->num_allocated);
+
+		while ((stripe_req = TAILQ_FIRST(&pool->free))) {
+			TAILQ_REMOVE(&pool->free, stripe_req, link);
+			raid5f_stripe_request_free(stripe_req);
+		}
+		__atomic_fetch_sub(&r5f_info->pool_stats.allocated, pool->num_allocated,
+				   __ATOMIC_RELAXED);
+		pool->num_allocated = 0;
+		pool->num_free = 0;
+	}
+
+	for (i = 0; i < RAID5F_BUF_POOL_CLASSES; i++) {
+		while ((buf = SLIST_FIRST(&r5ch->buf_pool[i]))) {
+			SLIST_REMOVE_HEAD(&r5ch->buf_pool[i], link);
+			spdk_dma_free(buf);
+		}
+	}
+	r5ch->buf_pool_cached = 0;
+
+	if (r5ch->accel_ch) {
+		spdk_put_io_channel(r5ch->accel_ch);
+	}
+
+	free(r5ch->chunk_xor_buffers);
+	free(r5ch->chunk_xor_iovs);
+	free(r5ch->chunk_xor_iovcnt);
+}
+
+static int
+raid5f_ioch_create(void *io_device, void *ctx_buf)
+{
+	struct raid5f_io_channel *r5ch = ctx_buf;
+	struct raid5f_info *r5f_info = io_device;
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	struct raid5f_stripe_pool *pool;
+	enum stripe_request_type type;
+	struct stripe_request *stripe_req;
+	int i;
+
+	for (i = 0; i < RAID5F_STRIPE_REQ_TYPES; i++) {
+		TAILQ_INIT(&r5ch->stripe_pools[i].free);
+	}
+	for (i = 0; i < RAID5F_BUF_POOL_CLASSES; i++) {
+		SLIST_INIT(&r5ch->buf_pool[i]);
+	}
+	TAILQ_INIT(&r5ch->hedge_reads);
+	TAILQ_INIT(&r5ch->cache_flush_retry_queue);
+	TAILQ_INIT(&r5ch->repair_queue);
+	TAILQ_INIT(&r5ch->wib_writes);
+	TAILQ_INIT(&r5ch->degraded_cache);
+	r5ch->degraded_cache_max_entries = RAID5F_DEGRADED_CACHE_SIZE /
+					   (raid_bdev->strip_size << raid_bdev->blocklen_shift);
+	r5ch->degraded_cache_max_entries = spdk_max(1, spdk_min(r5ch->degraded_cache_max_entries,
+					   RAID5F_DEGRADED_CACHE_MAX_ENTRIES));
+
+	for (type = 0; type < RAID5F_STRIPE_REQ_TYPES; type++) {
+		pool = &r5ch->stripe_pools[type];
+
+		for (i = 0; i < (int)r5f_info->stripe_pool_size; i++) {
+			stripe_req = raid5f_stripe_request_alloc(r5ch, type);
+			if (!stripe_req) {
+				goto err;
+			}
+
+			TAILQ_INSERT_HEAD(&pool->free, stripe_req, link);
+			pool->num_allocated++;
+			pool->num_free++;
+		}
+		__atomic_fetch_add(&r5f_info->pool_stats.allocated, pool->num_allocated,
+				   __ATOMIC_RELAXED);
+	}
+
+	if (r5f_info->stripe_pool_max > r5f_info->stripe_pool_size) {
+		r5ch->stripe_pool_poller = SPDK_POLLER_REGISTER(raid5f_stripe_pool_shrink, r5ch,
+					   RAID5F_STRIPE_POOL_SHRINK_PERIOD_US);
+		if (!r5ch->stripe_pool_poller) {
+			goto err;
+		}
+	}
+
+	r5ch->accel_ch = spdk_accel_get_io_channel();
+	if (!r5ch->accel_ch) {
+		SPDK_ERRLOG("Failed to get accel framework's IO channel\n");
+		goto err;
+	}
+
+	r5ch->chunk_xor_buffers = calloc(raid5f_xor_buffers_max(raid_bdev),
+					 sizeof(*r5ch->chunk_xor_buffers));
+	if (!r5ch->chunk_xor_buffers) {
+		goto err;
+	}
+
+	r5ch->chunk_xor_iovs = calloc(raid5f_xor_buffers_max(raid_bdev), sizeof(*r5ch->chunk_xor_iovs));
+	if (!r5ch->chunk_xor_iovs) {
+		goto err;
+	}
+
+	r5ch->chunk_xor_iovcnt = calloc(raid5f_xor_buffers_max(raid_bdev),
+					sizeof(*r5ch->chunk_xor_iovcnt));
+	if (!r5ch->chunk_xor_iovcnt) {
+		goto err;
+	}
+
+	r5ch->member_lat = calloc(raid_bdev->num_base_bdevs, sizeof(*r5ch->member_lat));
+	if (!r5ch->member_lat) {
+		goto err;
+	}
+
+	/* Without hedging, the poller only publishes the latency statistics */
+	r5ch->hedge_poller = SPDK_POLLER_REGISTER(raid5f_read_hedge_poll, r5ch,
+			     r5f_info->read_hedge_permille != 0 ? RAID5F_READ_HEDGE_POLL_PERIOD_US :
+			     RAID5F_READ_HEDGE_UPDATE_PERIOD_US);
+	if (!r5ch->hedge_poller) {
+		goto err;
+	}
+
+	r5ch->mismatch_poller = SPDK_POLLER_REGISTER(raid5f_mismatch_poll, r5ch,
+				RAID5F_MISMATCH_DRAIN_PERIOD_US);
+	if (!r5ch->mismatch_poller) {
+		goto err;
+	}
+
+	if (r5f_info->cache != NULL) {
+		/* Check for expired stripes a few times per flush timeout */
+		r5ch->cache_poller = SPDK_POLLER_REGISTER(raid5f_cache_poll, r5ch,
+				     r5f_info->cache->flush_timeout_ticks * SPDK_SEC_TO_USEC /
+				     spdk_get_ticks_hz() / 4);
+		if (!r5ch->cache_poller) {
+			goto err;
+		}
+	}
+
+	return 0;
+err:
+	SPDK_ERRLOG("Failed to initialize io channel\n");
+	raid5f_ioch_destroy(r5f_info, r5ch);
+	return -ENOMEM;
+}
+
+/*
+ * Expose the protection information of the options on the raid bdev. It is kept in the
+ * metadata of the base bdevs like the rest of the metadata, so the parity covers it.
+ */
+static int
+raid5f_configure_pi(struct raid_bdev *raid_bdev)
+{
+	struct spdk_bdev *bdev = &raid_bdev->bdev;
+	struct spdk_dif_ctx_init_ext_opts dif_opts;
+	struct spdk_dif_ctx dif_ctx;
+	uint32_t check_flags = SPDK_DIF_FLAGS_GUARD_CHECK;
+	int ret;
+
+	if (raid_bdev->opts.dif_type == SPDK_DIF_DISABLE) {
+		return 0;
+	}
+
+	if (raid_bdev->opts.dif_type != SPDK_DIF_TYPE3) {
+		check_flags |= SPDK_DIF_FLAGS_REFTAG_CHECK;
+	}
+
+	/* Check that the metadata of the base bdevs fits the protection information */
+	dif_opts.size = SPDK_SIZEOF(&dif_opts, dif_pi_format);
+	dif_opts.dif_pi_format = raid_bdev->opts.dif_pi_format;
+	ret = spdk_dif_ctx_init(&dif_ctx, bdev->blocklen, bdev->md_len, bdev->md_interleave, false,
+				raid_bdev->opts.dif_type, check_flags, 0, 0, 0, 0, 0, &dif_opts);
+	if (ret != 0) {
+		SPDK_ERRLOG("Protection information type %d format %d doesn't fit the %u bytes of "
+			    "metadata of raid bdev %s\n", raid_bdev->opts.dif_type,
+			    raid_bdev->opts.dif_pi_format, bdev->md_len, bdev->name);
+		return ret;
+	}
+
+	bdev->dif_type = raid_bdev->opts.dif_type;
+	bdev->dif_is_head_of_md = false;
+	bdev->dif_check_flags = check_flags;
+
+	return 0;
+}
+
+static void
+raid5f_owner_thread_exit(void *ctx)
+{
+	spdk_thread_exit(spdk_get_thread());
+}
+
+/* Create the threads owning the stripes, placed on the cores of the application in turn */
+static int
+raid5f_owners_alloc(struct raid5f_info *r5f_info, uint32_t num_owners)
+{
+	struct raid5f_owner *owner;
+	struct spdk_cpuset cpumask;
+	char name[64];
+	uint32_t core = spdk_env_get_first_core();
+	uint32_t i;
+
+	r5f_info->owners = calloc(num_owners, sizeof(*r5f_info->owners));
+	if (!r5f_info->owners) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < num_owners; i++) {
+		owner = &r5f_info->owners[i];
+		owner->r5f_info = r5f_info;
+
+		spdk_cpuset_zero(&cpumask);
+		spdk_cpuset_set_cpu(&cpumask, core, true);
+		snprintf(name, sizeof(name), "%s_owner%" PRIu32, r5f_info->raid_bdev->bdev.name, i);
+
+		owner->thread = spdk_thread_create(name, &cpumask);
+		if (owner->thread == NULL) {
+			while (i-- > 0) {
+				spdk_thread_send_msg(r5f_info->owners[i].thread, raid5f_owner_thread_exit, NULL);
+			}
+			free(r5f_info->owners);
+			r5f_info->owners = NULL;
+			return -ENOMEM;
+		}
+
+		core = spdk_env_get_next_core(core);
+		if (core == UINT32_MAX) {
+			core = spdk_env_get_first_core();
+		}
+	}
+
+	r5f_info->num_owners = num_owners;
+
+	return 0;
+}
+
+static void raid5f_io_device_unregister_done(void *io_device);
+
+static void
+raid5f_owner_released(void *ctx)
 {
-	struct stripe_request *stripe_req = _stripe_req;
+	struct raid5f_info *r5f_info = ctx;
 
-	stripe_req->xor.remaining -= stripe_req->xor.len;
-	
-	if (stripe_req->xor.remaining > 0) {
-		stripe_req->xor.len = spdk_ioviter_nextv(stripe_req->chunk_iov_iters,
-				      stripe_req->r5ch->chunk_xor_buffers);
-		raid5f_xor_stripe_continue(stripe_req);
+	assert(r5f_info->owners_active > 0);
+	if (--r5f_info->owners_active == 0) {
+		spdk_io_device_unregister(r5f_info, raid5f_io_device_unregister_done);
+	}
+}
+
+static void
+raid5f_owner_release(void *ctx)
+{
+	struct raid5f_owner *owner = ctx;
+
+	if (owner->ch != NULL) {
+		spdk_put_io_channel(owner->ch);
+		owner->ch = NULL;
+	}
+	spdk_thread_exit(spdk_get_thread());
+
+	spdk_thread_send_msg(spdk_thread_get_app_thread(), raid5f_owner_released, owner->r5f_info);
+}
+
+/* Release the io channels of the owner threads and exit them, then unregister the io device */
+static void
+raid5f_owners_release(struct raid5f_info *r5f_info)
+{
+	uint32_t i;
+
+	r5f_info->owners_active = r5f_info->num_owners;
+	for (i = 0; i < r5f_info->num_owners; i++) {
+		spdk_thread_send_msg(r5f_info->owners[i].thread, raid5f_owner_release,
+				     &r5f_info->owners[i]);
+	}
+}
+
+static int
+raid5f_start(struct raid_bdev *raid_bdev)
+{
+	uint64_t min_blockcnt = UINT64_MAX;
+	uint64_t base_bdev_data_size;
+	struct raid_base_bdev_info *base_info;
+	struct raid5f_info *r5f_info;
+	size_t alignment = 0;
+	int rc;
+
+	r5f_info = calloc(1, sizeof(*r5f_info));
+	if (!r5f_info) {
+		SPDK_ERRLOG("Failed to allocate r5f_info\n");
+		return -ENOMEM;
+	}
+	r5f_info->raid_bdev = raid_bdev;
+	r5f_info->rebuild_slot = UINT8_MAX;
+	r5f_info->rebuild_checkpoint = UINT64_MAX;
+
+	r5f_info->stripe_pool_size = raid_bdev->opts.stripe_pool_size;
+	if (r5f_info->stripe_pool_size == 0) {
+		r5f_info->stripe_pool_size = RAID5F_DEFAULT_STRIPE_POOL_SIZE;
+	}
+	r5f_info->stripe_pool_max = raid_bdev->opts.stripe_pool_max;
+	if (r5f_info->stripe_pool_max == 0) {
+		r5f_info->stripe_pool_max = spdk_max(r5f_info->stripe_pool_size,
+						     RAID5F_DEFAULT_STRIPE_POOL_MAX);
+	}
+	if (r5f_info->stripe_pool_max < r5f_info->stripe_pool_size) {
+		SPDK_ERRLOG("Stripe pool max %u is less than stripe pool size %u\n",
+			    r5f_info->stripe_pool_max, r5f_info->stripe_pool_size);
+		rc = -EINVAL;
+		goto err;
+	}
+
+	r5f_info->read_hedge_permille = raid_bdev->opts.read_hedge_permille;
+	if (r5f_info->read_hedge_permille >= 1000) {
+		SPDK_ERRLOG("Read hedge percentile %u must be below 1000 per mille\n",
+			    r5f_info->read_hedge_permille);
+		rc = -EINVAL;
+		goto err;
+	}
+
+	if (raid_bdev->opts.stripe_owner_threads > RAID5F_MAX_STRIPE_OWNERS) {
+		SPDK_ERRLOG("Number of stripe owner threads %u is above the maximum %u\n",
+			    raid_bdev->opts.stripe_owner_threads, RAID5F_MAX_STRIPE_OWNERS);
+		rc = -EINVAL;
+		goto err;
+	}
+
+	if (raid5f_configure_pi(raid_bdev) != 0) {
+		rc = -EINVAL;
+		goto err;
+	}
+	r5f_info->pi_verify = raid_bdev->bdev.dif_type != SPDK_DIF_DISABLE &&
+			      raid_bdev->opts.read_verify != RAID_READ_VERIFY_PARITY;
+	r5f_info->parity_verify = !r5f_info->pi_verify ||
+				  raid_bdev->opts.read_verify == RAID_READ_VERIFY_FULL;
+
+	r5f_info->member_stats = calloc(raid_bdev->num_base_bdevs, sizeof(*r5f_info->member_stats));
+	if (!r5f_info->member_stats) {
+		SPDK_ERRLOG("Failed to allocate base bdev statistics\n");
+		rc = -ENOMEM;
+		goto err;
+	}
+
+	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
+		struct spdk_bdev *base_bdev = spdk_bdev_desc_get_bdev(base_info->desc);
+
+		min_blockcnt = spdk_min(min_blockcnt, base_info->data_size);
+		alignment = spdk_max(alignment, spdk_bdev_get_buf_align(base_bdev));
+	}
+
+	/* The chunk checksum table takes the end of the data of the base bdevs */
+	if (raid_bdev->opts.chunk_checksums) {
+		r5f_info->total_stripes = raid5f_csum_total_stripes(raid_bdev, min_blockcnt);
+	} else {
+		r5f_info->total_stripes = min_blockcnt / raid_bdev->strip_size;
+	}
+	base_bdev_data_size = r5f_info->total_stripes * raid_bdev->strip_size;
+
+	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
+		base_info->data_size = base_bdev_data_size;
+	}
+
+	r5f_info->stripe_blocks = raid_bdev->strip_size * raid5f_stripe_data_chunks_num(raid_bdev);
+	r5f_info->buf_alignment = alignment;
+
+	r5f_info->zero_buf = spdk_dma_zmalloc(raid_bdev->strip_size << raid_bdev->blocklen_shift,
+					      alignment, NULL);
+	if (!r5f_info->zero_buf) {
+		SPDK_ERRLOG("Failed to allocate zero buffer\n");
+		rc = -ENOMEM;
+		goto err;
+	}
+
+	r5f_info->zero_stripes = calloc(SPDK_CEIL_DIV(r5f_info->total_stripes, 64),
+					sizeof(*r5f_info->zero_stripes));
+	if (!r5f_info->zero_stripes) {
+		SPDK_ERRLOG("Failed to allocate zeroed stripes bitmap\n");
+		rc = -ENOMEM;
+		goto err;
+	}
+
+	if (raid5f_stripe_locks_alloc(r5f_info) != 0) {
+		SPDK_ERRLOG("Failed to allocate stripe locks\n");
+		rc = -ENOMEM;
+		goto err;
+	}
+
+	/*
+	 * Reads and writes may span several stripes and are split by the module where needed.
+	 * The stripe cache works on a single stripe, so with it I/Os are split on stripe
+	 * boundaries by the bdev layer. Writes smaller than a stripe are handled with
+	 * read-modify-write or reconstruct-write, so no write unit is required.
+	 */
+	raid_bdev->bdev.blockcnt = r5f_info->stripe_blocks * r5f_info->total_stripes;
+	raid_bdev->bdev.optimal_io_boundary = r5f_info->stripe_blocks;
+	raid_bdev->bdev.split_on_optimal_io_boundary = raid_bdev->opts.stripe_cache_size != 0;
+
+	if (raid_bdev->opts.stripe_cache_size != 0) {
+		r5f_info->cache = raid5f_cache_alloc(r5f_info);
+		if (!r5f_info->cache) {
+			SPDK_ERRLOG("Failed to allocate stripe cache\n");
+			rc = -ENOMEM;
+			goto err;
+		}
+		raid_bdev->bdev.write_cache = 1;
+	}
+
+	/* The superblock reserves the space before the data the write-intent bitmap is kept in */
+	if (raid_bdev->superblock_enabled && raid5f_wib_alloc(r5f_info) != 0) {
+		SPDK_ERRLOG("Failed to allocate write-intent bitmap\n");
+		rc = -ENOMEM;
+		goto err;
+	}
+
+	if (raid_bdev->opts.chunk_checksums && raid5f_csum_alloc(r5f_info) != 0) {
+		SPDK_ERRLOG("Failed to allocate chunk checksum cache\n");
+		rc = -ENOMEM;
+		goto err;
+	}
+
+	if (raid_bdev->opts.stripe_owner_threads != 0 &&
+	    raid5f_owners_alloc(r5f_info, raid_bdev->opts.stripe_owner_threads) != 0) {
+		SPDK_ERRLOG("Failed to create stripe owner threads\n");
+		rc = -ENOMEM;
+		goto err;
+	}
+
+	spdk_spin_init(&r5f_info->mismatch_history.lock);
+
+	raid_bdev->module_private = r5f_info;
+
+	spdk_io_device_register(r5f_info, raid5f_ioch_create, raid5f_ioch_destroy,
+				sizeof(struct raid5f_io_channel), NULL);
+
+	/* Writes wait until the bitmap is read, which needs the raid bdev io channel */
+	if (r5f_info->wib != NULL) {
+		spdk_thread_send_msg(spdk_thread_get_app_thread(), raid5f_wib_load, r5f_info->wib);
+	}
+	if (r5f_info->csum != NULL) {
+		spdk_thread_send_msg(spdk_thread_get_app_thread(), raid5f_csum_start,
+				     r5f_info->csum);
+	}
+
+	return 0;
+err:
+	if (r5f_info->csum) {
+		raid5f_csum_free(r5f_info->csum);
+	}
+	if (r5f_info->wib) {
+		raid5f_wib_free(r5f_info->wib);
+	}
+	if (r5f_info->cache) {
+		raid5f_cache_free(r5f_info->cache);
+	}
+	raid5f_stripe_locks_free(r5f_info);
+	free(r5f_info->zero_stripes);
+	spdk_dma_free(r5f_info->zero_buf);
+	free(r5f_info->member_stats);
+	free(r5f_info);
+	return rc;
+}
+
+struct raid5f_scrub_stripe {
+	struct raid5f_scrub *scrub;
+
+	/* Index of the verified stripe */
+	uint64_t stripe_index;
+
+	bool active;
+
+	/* Shared lock of the stripe, keeping writes out while it is read */
+	struct raid5f_range_lock lock;
+
+	/* Set if reading a strip failed */
+	bool failed;
+
+	/* Index of the next base bdev to read from and number of reads in progress */
+	uint8_t next_read;
+	uint8_t reads_remaining;
+
+	/* Strips of all base bdevs, with separate metadata if the raid bdev has it */
+	struct iovec *iovs;
+	void **bufs;
+	void **md_bufs;
+
+	/* Xor of all strips, zero if the parity is consistent */
+	void *result;
+	void *md_result;
+
+	struct spdk_bdev_io_wait_entry waitq_entry;
+};
+
+struct raid5f_scrub {
+	struct raid5f_info *r5f_info;
+
+	struct raid5f_scrub_opts opts;
+
+	/* raid bdev io channel of the app thread, providing the base bdev channels */
+	struct spdk_io_channel *ch;
+
+	struct spdk_poller *poller;
+
+	/* Next stripe to verify */
+	uint64_t next_stripe;
+
+	/* Number of times the scrubber went over all stripes */
+	uint64_t passes;
+
+	uint64_t stripes_verified;
+	uint64_t read_errors;
+
+	/* Token buckets limiting the read bandwidth and IOPS */
+	int64_t byte_tokens;
+	int64_t byte_tokens_max;
+	int64_t io_tokens;
+	int64_t io_tokens_max;
+	uint64_t refill_tsc;
+
+	uint8_t active_stripes;
+	struct raid5f_scrub_stripe stripes[RAID5F_SCRUB_MAX_STRIPES];
+
+	/* Mismatches logged in the current second and not logged since the last one was */
+	uint64_t log_tsc;
+	uint32_t log_count;
+	uint64_t log_suppressed;
+
+	bool stopping;
+	TAILQ_HEAD(, raid5f_stop_waiter) stop_waiters;
+};
+
+static void raid5f_scrub_stripe_read(struct raid5f_scrub_stripe *stripe);
+
+static void
+raid5f_scrub_free(struct raid5f_scrub *scrub)
+{
+	struct raid_bdev *raid_bdev = scrub->r5f_info->raid_bdev;
+	struct raid5f_scrub_stripe *stripe;
+	uint8_t i;
+	int s;
+
+	for (s = 0; s < RAID5F_SCRUB_MAX_STRIPES; s++) {
+		stripe = &scrub->stripes[s];
+
+		if (stripe->bufs) {
+			for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+				spdk_dma_free(stripe->bufs[i]);
+			}
+		}
+		if (stripe->md_bufs) {
+			for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+				spdk_dma_free(stripe->md_bufs[i]);
+			}
+		}
+		free(stripe->bufs);
+		free(stripe->md_bufs);
+		free(stripe->iovs);
+		spdk_dma_free(stripe->result);
+		spdk_dma_free(stripe->md_result);
+	}
+
+	if (scrub->ch) {
+		spdk_put_io_channel(scrub->ch);
+	}
+
+	free(scrub);
+}
+
+static struct raid5f_scrub *
+raid5f_scrub_alloc(struct raid5f_info *r5f_info)
+{
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	size_t strip_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+	size_t md_len = 0;
+	struct raid5f_scrub *scrub;
+	struct raid5f_scrub_stripe *stripe;
+	uint8_t i;
+	int s;
+
+	if (spdk_bdev_is_md_separate(&raid_bdev->bdev)) {
+		md_len = raid_bdev->strip_size * spdk_bdev_get_md_size(&raid_bdev->bdev);
+	}
+
+	scrub = calloc(1, sizeof(*scrub));
+	if (!scrub) {
+		return NULL;
+	}
+	scrub->r5f_info = r5f_info;
+	TAILQ_INIT(&scrub->stop_waiters);
+
+	for (s = 0; s < RAID5F_SCRUB_MAX_STRIPES; s++) {
+		stripe = &scrub->stripes[s];
+		stripe->scrub = scrub;
+
+		stripe->iovs = calloc(raid_bdev->num_base_bdevs, sizeof(*stripe->iovs));
+		stripe->bufs = calloc(raid_bdev->num_base_bdevs, sizeof(void *));
+		stripe->result = spdk_dma_malloc(strip_len, r5f_info->buf_alignment, NULL);
+		if (!stripe->iovs || !stripe->bufs || !stripe->result) {
+			goto err;
+		}
+
+		for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+			stripe->bufs[i] = spdk_dma_malloc(strip_len, r5f_info->buf_alignment, NULL);
+			if (!stripe->bufs[i]) {
+				goto err;
+			}
+			stripe->iovs[i].iov_base = stripe->bufs[i];
+			stripe->iovs[i].iov_len = strip_len;
+		}
+
+		if (md_len == 0) {
+			continue;
+		}
+
+		stripe->md_bufs = calloc(raid_bdev->num_base_bdevs, sizeof(void *));
+		stripe->md_result = spdk_dma_malloc(md_len, r5f_info->buf_alignment, NULL);
+		if (!stripe->md_bufs || !stripe->md_result) {
+			goto err;
+		}
+
+		for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+			stripe->md_bufs[i] = spdk_dma_malloc(md_len, r5f_info->buf_alignment, NULL);
+			if (!stripe->md_bufs[i]) {
+				goto err;
+			}
+		}
+	}
+
+	return scrub;
+err:
+	raid5f_scrub_free(scrub);
+	return NULL;
+}
+
+/* Stripe index the scrubber would continue from if stopped now */
+static uint64_t
+raid5f_scrub_checkpoint(struct raid5f_scrub *scrub)
+{
+	uint64_t total_stripes = scrub->r5f_info->total_stripes;
+	uint64_t behind = 0;
+	int s;
+
+	/* Stripes still in flight are behind next_stripe, possibly wrapped around */
+	for (s = 0; s < RAID5F_SCRUB_MAX_STRIPES; s++) {
+		struct raid5f_scrub_stripe *stripe = &scrub->stripes[s];
+
+		if (stripe->active) {
+			behind = spdk_max(behind, (scrub->next_stripe + total_stripes - stripe->stripe_index) %
+					  total_stripes);
+		}
+	}
+
+	return (scrub->next_stripe + total_stripes - behind) % total_stripes;
+}
+
+static void
+raid5f_scrub_finish(struct raid5f_scrub *scrub)
+{
+	struct raid5f_info *r5f_info = scrub->r5f_info;
+	struct raid5f_stop_waiter *waiter;
+
+	assert(scrub->active_stripes == 0);
+
+	SPDK_NOTICELOG("Scrub of raid bdev %s stopped at stripe %" PRIu64 "\n",
+		       r5f_info->raid_bdev->bdev.name, scrub->next_stripe);
+
+	r5f_info->scrub_checkpoint = scrub->next_stripe;
+	r5f_info->scrub = NULL;
+
+	while ((waiter = TAILQ_FIRST(&scrub->stop_waiters))) {
+		TAILQ_REMOVE(&scrub->stop_waiters, waiter, link);
+		waiter->cb_fn(waiter->cb_ctx, 0);
+		free(waiter);
+	}
+
+	raid5f_scrub_free(scrub);
+}
+
+/* Log a mismatch, at most RAID5F_SCRUB_LOG_PER_SEC per second */
+static void
+raid5f_scrub_log_mismatch(struct raid5f_scrub *scrub, uint64_t stripe_index)
+{
+	struct raid5f_info *r5f_info = scrub->r5f_info;
+	uint64_t now = spdk_get_ticks();
+
+	r5f_info->num_mismatches++;
+
+	if (now - scrub->log_tsc >= spdk_get_ticks_hz()) {
+		scrub->log_tsc = now;
+		scrub->log_count = 0;
+	}
+
+	if (scrub->log_count == RAID5F_SCRUB_LOG_PER_SEC) {
+		scrub->log_suppressed++;
+		return;
+	}
+	scrub->log_count++;
+
+	if (scrub->log_suppressed > 0) {
+		SPDK_ERRLOG("%" PRIu64 " more parity mismatches of raid bdev %s were not logged, "
+			    "see its mismatch events\n", scrub->log_suppressed,
+			    r5f_info->raid_bdev->bdev.name);
+		scrub->log_suppressed = 0;
+	}
+
+	SPDK_ERRLOG("Parity mismatch in stripe %" PRIu64 " of raid bdev %s\n",
+		    stripe_index, r5f_info->raid_bdev->bdev.name);
+}
+
+static void
+raid5f_scrub_stripe_done(struct raid5f_scrub_stripe *stripe)
+{
+	struct raid5f_scrub *scrub = stripe->scrub;
+
+	raid5f_range_unlock(&stripe->lock);
+
+	stripe->active = false;
+	scrub->active_stripes--;
+
+	if (scrub->stopping && scrub->active_stripes == 0) {
+		raid5f_scrub_finish(scrub);
+	}
+}
+
+static void
+raid5f_scrub_stripe_verify(struct raid5f_scrub_stripe *stripe)
+{
+	struct raid5f_scrub *scrub = stripe->scrub;
+	struct raid_bdev *raid_bdev = scrub->r5f_info->raid_bdev;
+	size_t strip_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+	bool consistent;
+
+	if (stripe->failed) {
+		scrub->read_errors++;
+		SPDK_ERRLOG("Failed to read stripe %" PRIu64 " of raid bdev %s for scrubbing\n",
+			    stripe->stripe_index, raid_bdev->bdev.name);
+		raid5f_scrub_stripe_done(stripe);
+		return;
+	}
+
+	raid5f_xor_gen(stripe->result, stripe->bufs, raid_bdev->num_base_bdevs, strip_len);
+	consistent = spdk_mem_all_zero(stripe->result, strip_len);
+
+	if (consistent && stripe->md_bufs) {
+		size_t md_len = raid_bdev->strip_size * spdk_bdev_get_md_size(&raid_bdev->bdev);
+
+		raid5f_xor_gen(stripe->md_result, stripe->md_bufs, raid_bdev->num_base_bdevs, md_len);
+		consistent = spdk_mem_all_zero(stripe->md_result, md_len);
+	}
+
+	if (!consistent) {
+		struct raid_bdev_io_channel *raid_ch = spdk_io_channel_get_ctx(scrub->ch);
+		enum raid5f_mismatch_action action = RAID5F_MISMATCH_LOGGED;
+
+		raid5f_scrub_log_mismatch(scrub, stripe->stripe_index);
+
+		if (scrub->opts.repair) {
+			action = raid5f_repair_queue(raid_ch, stripe->stripe_index,
+						     raid5f_stripe_parity_chunk_index(raid_bdev, stripe->stripe_index),
+						     0, raid_bdev->strip_size) == 0 ?
+				 RAID5F_MISMATCH_REPAIR_QUEUED : RAID5F_MISMATCH_REPAIR_DROPPED;
+		}
+
+		/* The parity doesn't tell which member is wrong */
+		raid5f_mismatch_record(raid5f_raid_ch_to_r5ch(raid_ch), stripe->stripe_index,
+				       RAID5F_MISMATCH_NO_MEMBER, RAID5F_MISMATCH_SRC_SCRUB, action);
+	}
+	scrub->stripes_verified++;
+
+	raid5f_scrub_stripe_done(stripe);
+}
+
+static void
+raid5f_scrub_read_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid5f_scrub_stripe *stripe = cb_arg;
+
+	spdk_bdev_free_io(bdev_io);
+
+	if (!success) {
+		stripe->failed = true;
 	}
 
-	_raid5f_xor_stripe_cb(stripe_req, status);
+	assert(stripe->reads_remaining > 0);
+	if (--stripe->reads_remaining == 0) {
+		raid5f_scrub_stripe_verify(stripe);
+	}
 }
 
 static void
-raid5f_xor_stripe_md_cb(void *_stripe_req, int status)
+_raid5f_scrub_stripe_read(void *ctx)
 {
-	struct stripe_request *stripe_req = _stripe_req;
-
-	stripe_req->xor.remaining_md = 0;
-
-	_raid5f_xor_stripe_cb(stripe_req, status);
+	raid5f_scrub_stripe_read(ctx);
 }
 
 static void
-raid5f_xor_stripe_continue(struct stripe_request *stripe_req)
+raid5f_scrub_stripe_read(struct raid5f_scrub_stripe *stripe)
 {
-	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
-	struct raid_bdev_io *raid_io = stripe_req->raid_io;
-	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
-	uint8_t n_src = raid5f_stripe_data_chunks_num(raid_bdev);
+	struct raid5f_scrub *scrub = stripe->scrub;
+	struct raid_bdev *raid_bdev = scrub->r5f_info->raid_bdev;
+	struct raid_bdev_io_channel *raid_ch = spdk_io_channel_get_ctx(scrub->ch);
+	struct spdk_bdev_ext_io_opts opts;
+	struct raid_base_bdev_info *base_info;
+	struct spdk_io_channel *base_ch;
 	uint8_t i;
 	int ret;
 
-	assert(stripe_req->xor.len > 0);
+	while (stripe->next_read < raid_bdev->num_base_bdevs) {
+		i = stripe->next_read;
+		base_info = &raid_bdev->base_bdev_info[i];
+		base_ch = raid_ch->base_channel[i];
 
-	for (i = 0; i < n_src; i++) {
-		stripe_req->chunk_xor_buffers[i] = r5ch->chunk_xor_buffers[i];
-	}
+		if (base_ch == NULL) {
+			ret = -ENODEV;
+		} else {
+			memset(&opts, 0, sizeof(opts));
+			opts.size = sizeof(opts);
+			opts.metadata = stripe->md_bufs ? stripe->md_bufs[i] : NULL;
+
+			ret = raid_bdev_readv_blocks_ext(base_info, base_ch, &stripe->iovs[i], 1,
+							 stripe->stripe_index << raid_bdev->strip_size_shift,
+							 raid_bdev->strip_size, raid5f_scrub_read_complete,
+							 stripe, &opts);
+		}
 
-	ret = spdk_accel_submit_xor(r5ch->accel_ch, r5ch->chunk_xor_buffers[n_src],
-				    stripe_req->chunk_xor_buffers, n_src, stripe_req->xor.len,
-				    raid5f_xor_stripe_cb, stripe_req);
-	if (spdk_unlikely(ret)) {
 		if (ret == -ENOMEM) {
-			TAILQ_INSERT_HEAD(&r5ch->xor_retry_queue, stripe_req, link);
-		} else {
-			stripe_req->xor.status = ret;
-			raid5f_xor_stripe_done(stripe_req);
+			__atomic_fetch_add(&scrub->r5f_info->pool_stats.base_io_retries, 1,
+					   __ATOMIC_RELAXED);
+			stripe->waitq_entry.bdev = spdk_bdev_desc_get_bdev(base_info->desc);
+			stripe->waitq_entry.cb_fn = _raid5f_scrub_stripe_read;
+			stripe->waitq_entry.cb_arg = stripe;
+			spdk_bdev_queue_io_wait(stripe->waitq_entry.bdev, base_ch, &stripe->waitq_entry);
+			return;
+		}
+
+		stripe->next_read++;
+
+		if (ret != 0) {
+			stripe->failed = true;
+			if (--stripe->reads_remaining == 0) {
+				raid5f_scrub_stripe_verify(stripe);
+				return;
+			}
 		}
 	}
 }
 
 static void
-raid5f_xor_stripe(struct stripe_request *stripe_req, stripe_req_xor_cb cb)
+raid5f_scrub_refill(struct raid5f_scrub *scrub)
 {
-	struct raid5f_io_channel *r5ch = stripe_req->r5ch;
-	struct raid_bdev_io *raid_io = stripe_req->raid_io;
-	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
-	struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(raid_io);
-	struct chunk *chunk;
-	struct chunk *dest_chunk;
-	uint64_t num_blocks;
-	uint8_t c;
+	uint64_t now = spdk_get_ticks();
+	uint64_t ticks = now - scrub->refill_tsc;
+	uint64_t ticks_hz = spdk_get_ticks_hz();
 
-	assert(cb != NULL);
+	scrub->refill_tsc = now;
 
-	if (spdk_likely(stripe_req->type == STRIPE_REQ_WRITE)) {
-		num_blocks = raid_bdev->strip_size;
-		dest_chunk = stripe_req->parity_chunk;
-	} else if (stripe_req->type == STRIPE_REQ_RECONSTRUCT) {
-		num_blocks = bdev_io->u.bdev.num_blocks;
-		dest_chunk = stripe_req->reconstruct.chunk;
-	} else {
-		assert(false);
+	if (scrub->opts.rate_mbps != 0) {
+		scrub->byte_tokens += (uint64_t)scrub->opts.rate_mbps * 1024 * 1024 * ticks / ticks_hz;
+		scrub->byte_tokens = spdk_min(scrub->byte_tokens, scrub->byte_tokens_max);
 	}
 
-	c = 0;
-	FOR_EACH_CHUNK(stripe_req, chunk) {
-		if (chunk == dest_chunk) {
+	if (scrub->opts.rate_iops != 0) {
+		scrub->io_tokens += (uint64_t)scrub->opts.rate_iops * ticks / ticks_hz;
+		scrub->io_tokens = spdk_min(scrub->io_tokens, scrub->io_tokens_max);
+	}
+}
+
+/* Take the tokens for reading a stripe, return false if the rate limit doesn't allow it yet */
+static bool
+raid5f_scrub_take_tokens(struct raid5f_scrub *scrub)
+{
+	struct raid_bdev *raid_bdev = scrub->r5f_info->raid_bdev;
+	int64_t bytes = (int64_t)raid_bdev->num_base_bdevs *
+			(raid_bdev->strip_size << raid_bdev->blocklen_shift);
+	int64_t ios = raid_bdev->num_base_bdevs;
+
+	if ((scrub->opts.rate_mbps != 0 && scrub->byte_tokens < bytes) ||
+	    (scrub->opts.rate_iops != 0 && scrub->io_tokens < ios)) {
+		return false;
+	}
+
+	scrub->byte_tokens -= bytes;
+	scrub->io_tokens -= ios;
+
+	return true;
+}
+
+static int
+raid5f_scrub_poll(void *arg)
+{
+	struct raid5f_scrub *scrub = arg;
+	struct raid5f_info *r5f_info = scrub->r5f_info;
+	struct raid5f_scrub_stripe *stripe;
+	int started = 0;
+	int s;
+
+	if (scrub->stopping) {
+		return SPDK_POLLER_IDLE;
+	}
+
+	raid5f_scrub_refill(scrub);
+
+	for (s = 0; s < RAID5F_SCRUB_MAX_STRIPES; s++) {
+		stripe = &scrub->stripes[s];
+		if (stripe->active) {
 			continue;
 		}
-		r5ch->chunk_xor_iovs[c] = chunk->iovs;
-		r5ch->chunk_xor_iovcnt[c] = chunk->iovcnt;
-		c++;
+
+		if (__atomic_load_n(&r5f_info->fg_outstanding, __ATOMIC_RELAXED) > scrub->opts.max_fg_qd ||
+		    !raid5f_scrub_take_tokens(scrub)) {
+			break;
+		}
+
+		stripe->active = true;
+		stripe->failed = false;
+		stripe->stripe_index = scrub->next_stripe;
+		stripe->next_read = 0;
+		stripe->reads_remaining = r5f_info->raid_bdev->num_base_bdevs;
+		scrub->active_stripes++;
+		started++;
+
+		if (++scrub->next_stripe == r5f_info->total_stripes) {
+			scrub->next_stripe = 0;
+			scrub->passes++;
+			SPDK_NOTICELOG("Scrub pass %" PRIu64 " of raid bdev %s started\n",
+				       scrub->passes + 1, r5f_info->raid_bdev->bdev.name);
+		}
+
+		if (raid5f_range_lock(&stripe->lock, r5f_info, stripe->stripe_index, 1, false,
+				      _raid5f_scrub_stripe_read, stripe)) {
+			raid5f_scrub_stripe_read(stripe);
+		}
 	}
-	r5ch->chunk_xor_iovs[c] = dest_chunk->iovs;
-	r5ch->chunk_xor_iovcnt[c] = dest_chunk->iovcnt;
 
-	stripe_req->xor.len = spdk_ioviter_firstv(stripe_req->chunk_iov_iters,
-			      raid_bdev->num_base_bdevs,
-			      r5ch->chunk_xor_iovs,
-			      r5ch->chunk_xor_iovcnt,
-			      r5ch->chunk_xor_buffers);
+	return started > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
 
+int
+raid5f_scrub_start(struct raid_bdev *raid_bdev, const struct raid5f_scrub_opts *opts)
+{
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_scrub *scrub;
+	int64_t stripe_bytes;
+	uint32_t poll_hz = SPDK_SEC_TO_USEC / RAID5F_SCRUB_POLL_PERIOD_US;
 
-	stripe_req->xor.remaining = num_blocks << raid_bdev->blocklen_shift;
-	stripe_req->xor.status = 0;
-	stripe_req->xor.cb = cb;
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
 
-	if (spdk_bdev_io_get_md_buf(bdev_io)) {
-		uint8_t n_src = raid5f_stripe_data_chunks_num(raid_bdev);
-		uint64_t len = num_blocks * spdk_bdev_get_md_size(&raid_bdev->bdev);
-		int ret;
+	if (raid_bdev->state != RAID_BDEV_STATE_ONLINE || r5f_info == NULL) {
+		return -ENODEV;
+	}
 
-		stripe_req->xor.remaining_md = len;
+	if (r5f_info->scrub != NULL) {
+		return -EBUSY;
+	}
 
-		c = 0;
-		FOR_EACH_CHUNK(stripe_req, chunk) {
-			if (chunk != dest_chunk) {
-				stripe_req->chunk_xor_md_buffers[c] = chunk->md_buf;
-				c++;
-			}
+	/* Parity can only be verified if all members are present */
+	if (raid_bdev->num_base_bdevs_discovered < raid_bdev->num_base_bdevs) {
+		SPDK_ERRLOG("Can't scrub degraded raid bdev %s\n", raid_bdev->bdev.name);
+		return -EPERM;
+	}
+
+	if (opts->start_stripe >= r5f_info->total_stripes) {
+		return -EINVAL;
+	}
+
+	scrub = raid5f_scrub_alloc(r5f_info);
+	if (!scrub) {
+		return -ENOMEM;
+	}
+
+	scrub->ch = spdk_get_io_channel(raid_bdev);
+	if (!scrub->ch) {
+		raid5f_scrub_free(scrub);
+		return -ENOMEM;
+	}
+
+	scrub->opts = *opts;
+	if (scrub->opts.max_fg_qd == 0) {
+		scrub->opts.max_fg_qd = RAID5F_SCRUB_DEFAULT_MAX_FG_QD;
+	}
+	scrub->next_stripe = opts->start_stripe;
+
+	/* Allow a burst of one poll period, but at least one stripe */
+	stripe_bytes = (int64_t)raid_bdev->num_base_bdevs *
+		       (raid_bdev->strip_size << raid_bdev->blocklen_shift);
+	scrub->byte_tokens_max = spdk_max((int64_t)opts->rate_mbps * 1024 * 1024 / poll_hz, stripe_bytes);
+	scrub->io_tokens_max = spdk_max((int64_t)opts->rate_iops / poll_hz,
+					(int64_t)raid_bdev->num_base_bdevs);
+	scrub->byte_tokens = scrub->byte_tokens_max;
+	scrub->io_tokens = scrub->io_tokens_max;
+	scrub->refill_tsc = spdk_get_ticks();
+
+	scrub->poller = SPDK_POLLER_REGISTER(raid5f_scrub_poll, scrub, RAID5F_SCRUB_POLL_PERIOD_US);
+	if (!scrub->poller) {
+		raid5f_scrub_free(scrub);
+		return -ENOMEM;
+	}
+
+	r5f_info->scrub = scrub;
+	__atomic_store_n(&r5f_info->scrub_active, true, __ATOMIC_RELAXED);
+
+	SPDK_NOTICELOG("Scrub of raid bdev %s started at stripe %" PRIu64 "\n",
+		       raid_bdev->bdev.name, opts->start_stripe);
+
+	return 0;
+}
+
+static int
+raid5f_scrub_stop_with_cb(struct raid5f_info *r5f_info, raid_bdev_stop_background_cb cb_fn,
+			  void *cb_ctx)
+{
+	struct raid5f_scrub *scrub = r5f_info->scrub;
+	struct raid5f_stop_waiter *waiter = NULL;
+
+	assert(scrub != NULL);
+
+	if (cb_fn != NULL) {
+		waiter = calloc(1, sizeof(*waiter));
+		if (!waiter) {
+			SPDK_ERRLOG("Failed to allocate scrub stop waiter\n");
+		} else {
+			waiter->cb_fn = cb_fn;
+			waiter->cb_ctx = cb_ctx;
+			TAILQ_INSERT_TAIL(&scrub->stop_waiters, waiter, link);
 		}
+	}
 
-		ret = spdk_accel_submit_xor(stripe_req->r5ch->accel_ch, dest_chunk->md_buf,
-					    stripe_req->chunk_xor_md_buffers, n_src, len,
-					    raid5f_xor_stripe_md_cb, stripe_req);
-		if (spdk_unlikely(ret)) {
-			if (ret == -ENOMEM) {
-				TAILQ_INSERT_HEAD(&stripe_req->r5ch->xor_retry_queue, stripe_req, link);
-			} else {
-				stripe_req->xor.status = ret;
-				raid5f_xor_stripe_done(stripe_req);
-			}
-			return;
+	if (!scrub->stopping) {
+		scrub->stopping = true;
+		spdk_poller_unregister(&scrub->poller);
+		__atomic_store_n(&r5f_info->scrub_active, false, __ATOMIC_RELAXED);
+
+		/* Otherwise the last stripe in flight finishes the scrub */
+		if (scrub->active_stripes == 0) {
+			raid5f_scrub_finish(scrub);
 		}
 	}
 
-	raid5f_xor_stripe_continue(stripe_req);
+	return (cb_fn != NULL && waiter == NULL) ? -ENOMEM : 0;
 }
 
-static void
-raid5f_xor_stripe_retry(struct stripe_request *stripe_req)
+int
+raid5f_scrub_stop(struct raid_bdev *raid_bdev)
 {
-	if (stripe_req->xor.remaining_md) {
-		raid5f_xor_stripe(stripe_req, stripe_req->xor.cb);
-	} else {
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
 
-		raid5f_xor_stripe_continue(stripe_req);
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
+
+	if (r5f_info == NULL || r5f_info->scrub == NULL || r5f_info->scrub->stopping) {
+		return -ENOENT;
 	}
+
+	return raid5f_scrub_stop_with_cb(r5f_info, NULL, NULL);
 }
 
+/* Stripe rebuilt by an io channel: reconstruct the chunk of the new base bdev and write it */
+struct raid5f_rebuild_task {
+	/* Internal request the stripe request is attached to */
+	struct raid_bdev_io raid_io;
+
+	struct raid5f_rebuild_worker *worker;
+
+	struct stripe_request *stripe_req;
+
+	struct iovec iov;
+	struct spdk_bdev_ext_io_opts ext_opts;
+};
+
+/* Rebuild tasks of an io channel for the current window */
+struct raid5f_rebuild_worker {
+	struct raid5f_rebuild *rebuild;
+
+	/* Reference to the raid bdev io channel the tasks run on */
+	struct spdk_io_channel *ch;
+
+	uint32_t active_tasks;
+	uint32_t num_tasks;
+	struct raid5f_rebuild_task tasks[0];
+};
+
+struct raid5f_rebuild {
+	struct raid5f_info *r5f_info;
+
+	struct raid5f_rebuild_opts opts;
+
+	/* Slot of the base bdev being rebuilt */
+	uint8_t slot;
+
+	struct spdk_poller *poller;
+
+	enum raid5f_rebuild_state {
+		/* Waiting for the base bdev to be attached to all io channels */
+		RAID5F_REBUILD_ATTACHING,
+		/* No window in progress */
+		RAID5F_REBUILD_IDLE,
+		RAID5F_REBUILD_QUIESCING,
+		/* Waiting for stripe cache flushes which may write to the window */
+		RAID5F_REBUILD_WAIT_FLUSHES,
+		/* Stripes of the window left because all stripe requests were busy */
+		RAID5F_REBUILD_DISPATCH,
+		RAID5F_REBUILD_RUNNING,
+		RAID5F_REBUILD_UNQUIESCING,
+	} state;
+
+	/*
+	 * Stripes quiesced and rebuilt by the io channels. The window starts at the
+	 * checkpoint and all of it must be rebuilt before the checkpoint advances.
+	 */
+	uint64_t window_start;
+	uint64_t window_end;
+
+	/* Next stripe of the window to take, shared by the workers of all io channels */
+	uint64_t next_stripe;
+
+	/* Workers of the window plus one for the dispatch, the last one completes the window */
+	uint32_t window_refs;
+
+	/* Set if rebuilding a stripe of the window failed */
+	bool window_failed;
+
+	uint64_t stripes_rebuilt;
+	uint64_t errors;
+	uint64_t start_tsc;
+
+	/* Token bucket limiting the bandwidth */
+	int64_t byte_tokens;
+	int64_t byte_tokens_max;
+	uint64_t refill_tsc;
+
+	bool failed;
+	bool stopping;
+	TAILQ_HEAD(, raid5f_stop_waiter) stop_waiters;
+};
+
+static bool raid5f_rebuild_task_next(struct raid5f_rebuild_task *task);
+static void _raid5f_rebuild_window_done(void *ctx);
+static void raid5f_rebuild_window_end(struct raid5f_rebuild *rebuild, bool advance);
+
 static void
-raid5f_stripe_request_chunk_write_complete(struct stripe_request *stripe_req,
-		enum spdk_bdev_io_status status)
+raid5f_rebuild_finish(struct raid5f_rebuild *rebuild)
 {
-	if (raid_bdev_io_complete_part(stripe_req->raid_io, 1, status)) {
-		raid5f_stripe_request_release(stripe_req);
+	struct raid5f_info *r5f_info = rebuild->r5f_info;
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[rebuild->slot];
+	uint64_t checkpoint = __atomic_load_n(&r5f_info->rebuild_checkpoint, __ATOMIC_RELAXED);
+	struct raid5f_stop_waiter *waiter;
+
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
+
+	spdk_poller_unregister(&rebuild->poller);
+	__atomic_store_n(&r5f_info->rebuild_active, false, __ATOMIC_RELAXED);
+
+	if (!base_info->rebuilding) {
+		/* Attaching the base bdev failed or it was removed */
+		__atomic_store_n(&r5f_info->rebuild_checkpoint, UINT64_MAX, __ATOMIC_RELEASE);
+		r5f_info->rebuild_slot = UINT8_MAX;
+	} else if (checkpoint == r5f_info->total_stripes) {
+		__atomic_store_n(&r5f_info->rebuild_checkpoint, UINT64_MAX, __ATOMIC_RELEASE);
+		r5f_info->rebuild_slot = UINT8_MAX;
+		raid_bdev_base_bdev_rebuilt(base_info);
+		SPDK_NOTICELOG("Rebuild of raid bdev %s completed in %" PRIu64 " ms\n", raid_bdev->bdev.name,
+			       (spdk_get_ticks() - rebuild->start_tsc) * 1000 / spdk_get_ticks_hz());
+	} else {
+		SPDK_NOTICELOG("Rebuild of raid bdev %s %s at stripe %" PRIu64 "\n", raid_bdev->bdev.name,
+			       rebuild->failed ? "failed" : "stopped", checkpoint);
+	}
+
+	r5f_info->rebuild = NULL;
+
+	while ((waiter = TAILQ_FIRST(&rebuild->stop_waiters))) {
+		TAILQ_REMOVE(&rebuild->stop_waiters, waiter, link);
+		waiter->cb_fn(waiter->cb_ctx, 0);
+		free(waiter);
 	}
+
+	free(rebuild);
 }
 
 static void
-raid5f_stripe_request_reconstruct_xor_done(struct stripe_request *stripe_req, int status)
+raid5f_rebuild_worker_done(struct raid5f_rebuild_worker *worker)
 {
-	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid5f_rebuild *rebuild = worker->rebuild;
 
-	raid5f_stripe_request_release(stripe_req);
+	spdk_put_io_channel(worker->ch);
+	free(worker);
 
-	raid_bdev_io_complete_part(raid_io, 1,
-				   status == 0 ? SPDK_BDEV_IO_STATUS_SUCCESS : SPDK_BDEV_IO_STATUS_FAILED);
+	if (__atomic_sub_fetch(&rebuild->window_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		spdk_thread_send_msg(spdk_thread_get_app_thread(), _raid5f_rebuild_window_done, rebuild);
+	}
 }
 
 static void
-raid5f_stripe_request_chunk_read_complete(struct stripe_request *stripe_req,
-		enum spdk_bdev_io_status status)
+raid5f_rebuild_task_done(struct raid5f_rebuild_task *task, bool success)
 {
-	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid5f_rebuild_worker *worker = task->worker;
+	struct raid5f_rebuild *rebuild = worker->rebuild;
 
-	if (raid_io->base_bdev_io_remaining == 1) {
-		if (raid_io->base_bdev_io_status == SPDK_BDEV_IO_STATUS_SUCCESS &&
-		    status == SPDK_BDEV_IO_STATUS_SUCCESS) {
-			raid5f_xor_stripe(stripe_req, raid5f_stripe_request_reconstruct_xor_done);
-			return;
-		}
-		raid5f_stripe_request_release(stripe_req);
+	raid5f_stripe_request_release(task->stripe_req);
+	task->stripe_req = NULL;
+
+	if (success) {
+		__atomic_fetch_add(&rebuild->stripes_rebuilt, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&rebuild->errors, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&rebuild->window_failed, true, __ATOMIC_RELAXED);
 	}
 
-	raid_bdev_io_complete_part(raid_io, 1, status);
+	worker->active_tasks--;
+	if (!raid5f_rebuild_task_next(task) && worker->active_tasks == 0) {
+		raid5f_rebuild_worker_done(worker);
+	}
 }
 
 static void
-raid5f_chunk_complete_bdev_io(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+raid5f_rebuild_write_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
 {
-	struct chunk *chunk = cb_arg;
-	struct stripe_request *stripe_req = raid5f_chunk_stripe_req(chunk);
-	enum spdk_bdev_io_status status = success ? SPDK_BDEV_IO_STATUS_SUCCESS :
-					  SPDK_BDEV_IO_STATUS_FAILED;
+	struct raid5f_rebuild_task *task = cb_arg;
 
 	spdk_bdev_free_io(bdev_io);
 
-	if (spdk_likely(stripe_req->type == STRIPE_REQ_WRITE)) {
-		raid5f_stripe_request_chunk_write_complete(stripe_req, status);
-	} else if (stripe_req->type == STRIPE_REQ_RECONSTRUCT) {
-	  //	  SPDK_ERRLOG("reconstruct read done, freed io req\n");
-		raid5f_stripe_request_chunk_read_complete(stripe_req, status);
-	} else {
-		assert(false);
-	}
+	raid5f_rebuild_task_done(task, success);
 }
 
-static void raid5f_stripe_request_submit_chunks(struct stripe_request *stripe_req);
-
 static void
-raid5f_chunk_submit_retry(void *_raid_io)
+_raid5f_rebuild_task_write(void *_raid_io)
 {
-	struct raid_bdev_io *raid_io = _raid_io;
-	struct stripe_request *stripe_req = raid_io->module_private;
+	struct raid5f_rebuild_task *task = SPDK_CONTAINEROF(_raid_io, struct raid5f_rebuild_task,
+					   raid_io);
+	struct stripe_request *stripe_req = task->stripe_req;
+	struct raid_bdev *raid_bdev = task->raid_io.raid_bdev;
+	uint8_t slot = task->worker->rebuild->slot;
+	struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[slot];
+	/* The rebuilt base bdev is written even though the stripe counts as degraded */
+	struct spdk_io_channel *base_ch = task->raid_io.raid_ch->base_channel[slot];
+	int ret;
 
-	raid5f_stripe_request_submit_chunks(stripe_req);
+	if (base_ch == NULL) {
+		raid5f_rebuild_task_done(task, false);
+		return;
+	}
+
+	task->iov.iov_base = stripe_req->reconstruct.verify_buf;
+	task->iov.iov_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+
+	memset(&task->ext_opts, 0, sizeof(task->ext_opts));
+	task->ext_opts.size = sizeof(task->ext_opts);
+	task->ext_opts.metadata = task->raid_io.md_buf;
+
+	ret = raid_bdev_writev_blocks_ext(base_info, base_ch, &task->iov, 1,
+					  stripe_req->stripe_index << raid_bdev->strip_size_shift,
+					  raid_bdev->strip_size, raid5f_rebuild_write_complete, task,
+					  &task->ext_opts);
+	if (spdk_unlikely(ret == -ENOMEM)) {
+		raid5f_queue_io_wait(&task->raid_io, base_info, base_ch, _raid5f_rebuild_task_write);
+	} else if (spdk_unlikely(ret != 0)) {
+		raid5f_rebuild_task_done(task, false);
+	}
 }
 
-static inline void
-raid5f_init_ext_io_opts(struct spdk_bdev_io *bdev_io, struct spdk_bdev_ext_io_opts *opts)
+static void
+raid5f_rebuild_stripe_reconstructed(struct stripe_request *stripe_req,
+				    enum spdk_bdev_io_status status)
 {
-	memset(opts, 0, sizeof(*opts));
-	opts->size = sizeof(*opts);
-	opts->memory_domain = bdev_io->u.bdev.memory_domain;
-	opts->memory_domain_ctx = bdev_io->u.bdev.memory_domain_ctx;
-	opts->metadata = bdev_io->u.bdev.md_buf;
+	struct raid5f_rebuild_task *task = SPDK_CONTAINEROF(stripe_req->raid_io,
+					   struct raid5f_rebuild_task, raid_io);
+
+	if (status != SPDK_BDEV_IO_STATUS_SUCCESS) {
+		SPDK_ERRLOG("Failed to reconstruct stripe %" PRIu64 " of raid bdev %s for rebuild\n",
+			    stripe_req->stripe_index, task->raid_io.raid_bdev->bdev.name);
+		raid5f_rebuild_task_done(task, false);
+		return;
+	}
+
+	_raid5f_rebuild_task_write(&task->raid_io);
 }
 
-static int
-raid5f_chunk_submit(struct chunk *chunk)
+/* Take the next stripe of the window and start rebuilding it, return false if there is none */
+static bool
+raid5f_rebuild_task_next(struct raid5f_rebuild_task *task)
 {
-	struct stripe_request *stripe_req = raid5f_chunk_stripe_req(chunk);
-	struct raid_bdev_io *raid_io = stripe_req->raid_io;
-	struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(raid_io);
-	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
-	struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[chunk->index];
-	struct spdk_io_channel *base_ch = raid_io->raid_ch->base_channel[chunk->index];
-	uint64_t base_offset_blocks = (stripe_req->stripe_index << raid_bdev->strip_size_shift);
-	int ret;
+	struct raid5f_rebuild *rebuild = task->worker->rebuild;
+	struct raid5f_info *r5f_info = rebuild->r5f_info;
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	struct raid_bdev_io_channel *raid_ch = spdk_io_channel_get_ctx(task->worker->ch);
+	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_ch->module_channel);
+	struct stripe_request *stripe_req;
+	struct chunk *chunk;
+	uint64_t stripe_index;
+	void *md_buf = NULL;
+	int buf_idx = 0;
 
-	raid5f_init_ext_io_opts(bdev_io, &chunk->ext_opts);
-	chunk->ext_opts.metadata = chunk->md_buf;
+	stripe_req = raid5f_stripe_request_peek(r5ch, STRIPE_REQ_RECONSTRUCT);
+	if (stripe_req == NULL || __atomic_load_n(&rebuild->window_failed, __ATOMIC_RELAXED)) {
+		return false;
+	}
 
-	raid_io->base_bdev_io_submitted++;
+	if (raid5f_reconstruct_get_buffers(stripe_req, raid_bdev->strip_size, true,
+					   spdk_bdev_is_md_separate(&raid_bdev->bdev))) {
+		return false;
+	}
 
-	switch (stripe_req->type) {
-	case STRIPE_REQ_WRITE:
-		if (base_ch == NULL) {
-			raid_bdev_io_complete_part(raid_io, 1, SPDK_BDEV_IO_STATUS_SUCCESS);
-			return 0;
-		}
+	stripe_index = __atomic_fetch_add(&rebuild->next_stripe, 1, __ATOMIC_RELAXED);
+	if (stripe_index >= rebuild->window_end) {
+		raid5f_reconstruct_put_buffers(stripe_req);
+		return false;
+	}
 
-		// poison a block with 0.1 percent probability
-		if (!stripe_req->poisoned && (rand() % 1000) < 1) {
-		  //		  SPDK_ERRLOG("poisoned a block.\n");
-		  *(char*)(chunk->iovs[0].iov_base) ^= 1; // flip bit of iov
-		  stripe_req->poisoned = 1;
-		}
-		  
-		ret = raid_bdev_writev_blocks_ext(base_info, base_ch, chunk->iovs, chunk->iovcnt,
-						  base_offset_blocks, raid_bdev->strip_size,
-						  raid5f_chunk_complete_bdev_io, chunk,
-						  &chunk->ext_opts);
-		break;
-	case STRIPE_REQ_RECONSTRUCT:
-		if (chunk == stripe_req->reconstruct.chunk) {
-			raid_bdev_io_complete_part(raid_io, 1, SPDK_BDEV_IO_STATUS_SUCCESS);
-			return 0;
-		}
+	if (spdk_bdev_is_md_separate(&raid_bdev->bdev)) {
+		md_buf = stripe_req->reconstruct.verify_md_buf;
+	}
 
-		base_offset_blocks += stripe_req->reconstruct.chunk_offset;
+	raid_bdev_io_init(&task->raid_io, raid_ch, SPDK_BDEV_IO_TYPE_READ,
+			  stripe_index * r5f_info->stripe_blocks, 0, NULL, 0, md_buf, NULL, NULL);
 
-		ret = raid_bdev_readv_blocks_ext(base_info, base_ch, chunk->iovs, chunk->iovcnt,
-						 base_offset_blocks, bdev_io->u.bdev.num_blocks,
-						 raid5f_chunk_complete_bdev_io, chunk,
-						 &chunk->ext_opts);
-		break;
-	default:
-		assert(false);
-		ret = -EINVAL;
-		break;
-	}
+	raid5f_stripe_request_init(stripe_req, &task->raid_io, stripe_index);
 
-	if (spdk_unlikely(ret)) {
-		raid_io->base_bdev_io_submitted--;
-		if (ret == -ENOMEM) {
-		  //		  SPDK_ERRLOG("read returned ENOMEM in reconstruct, chunk->index is %d\n", chunk->index);
+	/* The chunk of the new base bdev is reconstructed from all the others */
+	stripe_req->reconstruct.chunk = &stripe_req->chunks[rebuild->slot];
+	stripe_req->reconstruct.chunk_offset = 0;
+	stripe_req->reconstruct.num_blocks = raid_bdev->strip_size;
+	stripe_req->reconstruct.read_ctx = NULL;
+	stripe_req->reconstruct.verify = false;
+	stripe_req->reconstruct.cache_entry = NULL;
+	stripe_req->reconstruct.hedge = NULL;
 
-			raid_bdev_queue_io_wait(raid_io, spdk_bdev_desc_get_bdev(base_info->desc),
-						base_ch, raid5f_chunk_submit_retry);
+	FOR_EACH_CHUNK(stripe_req, chunk) {
+		chunk->req_offset = 0;
+		chunk->req_blocks = raid_bdev->strip_size;
+		chunk->iovcnt = 1;
+
+		if (chunk == stripe_req->reconstruct.chunk) {
+			chunk->iovs[0].iov_base = stripe_req->reconstruct.verify_buf;
+			chunk->md_buf = md_buf;
 		} else {
-			/*
-			 * Implicitly complete any I/Os not yet submitted as FAILED. If completing
-			 * these means there are no more to complete for the stripe request, we can
-			 * release the stripe request as well.
-			 */
-			uint64_t base_bdev_io_not_submitted;
+			chunk->iovs[0].iov_base = stripe_req->reconstruct.chunk_buffers[buf_idx];
+			chunk->md_buf = md_buf ? stripe_req->reconstruct.chunk_md_buffers[buf_idx] : NULL;
+			buf_idx++;
+		}
+		chunk->iovs[0].iov_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
+	}
 
-			if (stripe_req->type == STRIPE_REQ_WRITE) {
-				base_bdev_io_not_submitted = raid_bdev->num_base_bdevs -
-							     raid_io->base_bdev_io_submitted;
-			} else {
-				base_bdev_io_not_submitted = raid5f_stripe_data_chunks_num(raid_bdev) -
-							     raid_io->base_bdev_io_submitted;
-			}
+	task->raid_io.module_private = stripe_req;
+	task->raid_io.base_bdev_io_remaining = raid_bdev->num_base_bdevs;
+	task->stripe_req = stripe_req;
 
-			if (raid_bdev_io_complete_part(raid_io, base_bdev_io_not_submitted,
-						       SPDK_BDEV_IO_STATUS_FAILED)) {
-				raid5f_stripe_request_release(stripe_req);
-			}
-		}
+	raid5f_stripe_request_take(stripe_req);
+	task->worker->active_tasks++;
+
+	/* Keep writes out of the stripe until the rebuilt chunk is written */
+	if (raid5f_stripe_lock(stripe_req, raid5f_stripe_request_submit_chunks)) {
+		raid5f_stripe_request_submit_chunks(stripe_req);
 	}
 
-	return ret;
+	return true;
 }
 
-static int
-raid5f_chunk_set_iovcnt(struct chunk *chunk, int iovcnt)
+/* Start rebuilding stripes of the window on the current io channel */
+static void
+raid5f_rebuild_channel_dispatch(struct spdk_io_channel_iter *i)
 {
-	if (iovcnt > chunk->iovcnt_max) {
-		struct iovec *iovs = chunk->iovs;
+	struct raid5f_rebuild *rebuild = spdk_io_channel_iter_get_ctx(i);
+	struct raid5f_rebuild_worker *worker;
+	uint32_t t;
+
+	worker = calloc(1, sizeof(*worker) + rebuild->opts.queue_depth * sizeof(worker->tasks[0]));
+	if (worker == NULL) {
+		/* Other io channels take the stripes */
+		spdk_for_each_channel_continue(i, 0);
+		return;
+	}
 
-		iovs = realloc(iovs, iovcnt * sizeof(*iovs));
-		if (!iovs) {
-			return -ENOMEM;
+	worker->ch = spdk_get_io_channel(rebuild->r5f_info->raid_bdev);
+	if (worker->ch == NULL) {
+		free(worker);
+		spdk_for_each_channel_continue(i, 0);
+		return;
+	}
+	worker->rebuild = rebuild;
+	worker->num_tasks = rebuild->opts.queue_depth;
+	__atomic_fetch_add(&rebuild->window_refs, 1, __ATOMIC_RELAXED);
+
+	for (t = 0; t < worker->num_tasks; t++) {
+		worker->tasks[t].worker = worker;
+		if (!raid5f_rebuild_task_next(&worker->tasks[t])) {
+			break;
 		}
-		chunk->iovs = iovs;
-		chunk->iovcnt_max = iovcnt;
 	}
-	chunk->iovcnt = iovcnt;
 
-	return 0;
+	if (worker->active_tasks == 0) {
+		raid5f_rebuild_worker_done(worker);
+	}
+
+	spdk_for_each_channel_continue(i, 0);
 }
 
-static int
-raid5f_stripe_request_map_iovecs(struct stripe_request *stripe_req)
+/* Called when all workers of the window are done */
+static void
+_raid5f_rebuild_window_done(void *ctx)
 {
-	struct raid_bdev *raid_bdev = stripe_req->raid_io->raid_bdev;
-	struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(stripe_req->raid_io);
-	const struct iovec *raid_io_iovs = bdev_io->u.bdev.iovs;
-	int raid_io_iovcnt = bdev_io->u.bdev.iovcnt;
-	void *raid_io_md = spdk_bdev_io_get_md_buf(bdev_io);
-	uint32_t raid_io_md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
-	struct chunk *chunk;
-	int raid_io_iov_idx = 0;
-	size_t raid_io_offset = 0;
-	size_t raid_io_iov_offset = 0;
-	int i;
-
-	FOR_EACH_DATA_CHUNK(stripe_req, chunk) {
-		int chunk_iovcnt = 0;
-		uint64_t len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
-		size_t off = raid_io_iov_offset;
-		int ret;
+	struct raid5f_rebuild *rebuild = ctx;
 
-		for (i = raid_io_iov_idx; i < raid_io_iovcnt; i++) {
-			chunk_iovcnt++;
-			off += raid_io_iovs[i].iov_len;
-			if (off >= raid_io_offset + len) {
-				break;
-			}
-		}
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
 
-		assert(raid_io_iov_idx + chunk_iovcnt <= raid_io_iovcnt);
+	if (__atomic_load_n(&rebuild->window_failed, __ATOMIC_RELAXED)) {
+		rebuild->failed = true;
+		raid5f_rebuild_window_end(rebuild, false);
+	} else if (__atomic_load_n(&rebuild->next_stripe, __ATOMIC_RELAXED) >= rebuild->window_end) {
+		raid5f_rebuild_window_end(rebuild, true);
+	} else if (rebuild->stopping) {
+		raid5f_rebuild_window_end(rebuild, false);
+	} else {
+		/* Stripes were left because the stripe requests were busy, retry from the poller */
+		rebuild->state = RAID5F_REBUILD_DISPATCH;
+	}
+}
 
-		ret = raid5f_chunk_set_iovcnt(chunk, chunk_iovcnt);
-		if (ret) {
-			return ret;
-		}
+static void
+raid5f_rebuild_channels_dispatch_done(struct spdk_io_channel_iter *i, int status)
+{
+	struct raid5f_rebuild *rebuild = spdk_io_channel_iter_get_ctx(i);
 
-		if (raid_io_md) {
-			chunk->md_buf = raid_io_md +
-					(raid_io_offset >> raid_bdev->blocklen_shift) * raid_io_md_size;
-		}
+	if (__atomic_sub_fetch(&rebuild->window_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		_raid5f_rebuild_window_done(rebuild);
+	}
+}
 
-		for (i = 0; i < chunk_iovcnt; i++) {
-			struct iovec *chunk_iov = &chunk->iovs[i];
-			const struct iovec *raid_io_iov = &raid_io_iovs[raid_io_iov_idx];
-			size_t chunk_iov_offset = raid_io_offset - raid_io_iov_offset;
+/*
+ * Distribute the stripes of the window not taken yet to workers on all io channels, so
+ * that the rebuild scales with the cores submitting I/O to the array. The dispatch holds
+ * a window reference until all io channels got their worker.
+ */
+static void
+raid5f_rebuild_dispatch(struct raid5f_rebuild *rebuild)
+{
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
 
-			chunk_iov->iov_base = raid_io_iov->iov_base + chunk_iov_offset;
-			chunk_iov->iov_len = spdk_min(len, raid_io_iov->iov_len - chunk_iov_offset);
-			raid_io_offset += chunk_iov->iov_len;
-			len -= chunk_iov->iov_len;
+	rebuild->state = RAID5F_REBUILD_RUNNING;
+	rebuild->window_refs = 1;
+	spdk_for_each_channel(rebuild->r5f_info->raid_bdev, raid5f_rebuild_channel_dispatch, rebuild,
+			      raid5f_rebuild_channels_dispatch_done);
+}
 
-			if (raid_io_offset >= raid_io_iov_offset + raid_io_iov->iov_len) {
-				raid_io_iov_idx++;
-				raid_io_iov_offset += raid_io_iov->iov_len;
-			}
-		}
+static void
+raid5f_rebuild_on_unquiesced(void *ctx, int status)
+{
+	struct raid5f_rebuild *rebuild = ctx;
+	struct raid5f_info *r5f_info = rebuild->r5f_info;
 
-		if (spdk_unlikely(len > 0)) {
-			return -EINVAL;
-		}
+	if (status != 0) {
+		SPDK_ERRLOG("Failed to unquiesce stripes of raid bdev %s: %s\n",
+			    r5f_info->raid_bdev->bdev.name, spdk_strerror(-status));
 	}
 
-	stripe_req->parity_chunk->iovs[0].iov_base = stripe_req->write.parity_buf;
-	stripe_req->parity_chunk->iovs[0].iov_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
-	stripe_req->parity_chunk->iovcnt = 1;
-	stripe_req->parity_chunk->md_buf = stripe_req->write.parity_md_buf;
+	rebuild->state = RAID5F_REBUILD_IDLE;
 
-	return 0;
+	if (rebuild->stopping || rebuild->failed ||
+	    __atomic_load_n(&r5f_info->rebuild_checkpoint, __ATOMIC_RELAXED) == r5f_info->total_stripes) {
+		raid5f_rebuild_finish(rebuild);
+	}
 }
 
+/* Release the window, advancing the checkpoint past it if it was rebuilt */
 static void
-raid5f_stripe_request_submit_chunks(struct stripe_request *stripe_req)
+raid5f_rebuild_window_end(struct raid5f_rebuild *rebuild, bool advance)
 {
-	struct raid_bdev_io *raid_io = stripe_req->raid_io;
-	struct chunk *start = &stripe_req->chunks[raid_io->base_bdev_io_submitted];
-	struct chunk *chunk;
-
-	FOR_EACH_CHUNK_FROM(stripe_req, chunk, start) {
-	  
-		if (spdk_unlikely(raid5f_chunk_submit(chunk) != 0)) {
-			break;
-		}
+	struct raid5f_info *r5f_info = rebuild->r5f_info;
+	uint64_t start = rebuild->window_start;
+	uint64_t end = rebuild->window_end;
+	int rc;
+
+	if (advance) {
+		/* Stripes before the checkpoint use the new base bdev once unquiesced */
+		__atomic_store_n(&r5f_info->rebuild_checkpoint, end, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&r5f_info->rebuild_window_end,
+			 __atomic_load_n(&r5f_info->rebuild_checkpoint, __ATOMIC_RELAXED), __ATOMIC_SEQ_CST);
+
+	rebuild->state = RAID5F_REBUILD_UNQUIESCING;
+	rc = raid_bdev_unquiesce_range(r5f_info->raid_bdev, start * r5f_info->stripe_blocks,
+				       (end - start) * r5f_info->stripe_blocks,
+				       raid5f_rebuild_on_unquiesced, rebuild);
+	if (rc != 0) {
+		raid5f_rebuild_on_unquiesced(rebuild, rc);
 	}
 }
 
-static inline void
-raid5f_stripe_request_init(struct stripe_request *stripe_req, struct raid_bdev_io *raid_io,
-			   uint64_t stripe_index)
+static void
+raid5f_rebuild_on_quiesced(void *ctx, int status)
 {
-	stripe_req->raid_io = raid_io;
-	stripe_req->stripe_index = stripe_index;
-	stripe_req->parity_chunk = &stripe_req->chunks[raid5f_stripe_parity_chunk_index(raid_io->raid_bdev,
-				   stripe_index)];
-	stripe_req->poisoned = 0;
+	struct raid5f_rebuild *rebuild = ctx;
+	struct raid5f_info *r5f_info = rebuild->r5f_info;
+
+	if (status != 0) {
+		SPDK_ERRLOG("Failed to quiesce stripes of raid bdev %s: %s\n",
+			    r5f_info->raid_bdev->bdev.name, spdk_strerror(-status));
+		__atomic_store_n(&r5f_info->rebuild_window_end, rebuild->window_start, __ATOMIC_SEQ_CST);
+		rebuild->state = RAID5F_REBUILD_IDLE;
+		if (rebuild->stopping) {
+			raid5f_rebuild_finish(rebuild);
+		}
+		return;
+	}
+
+	if (rebuild->stopping) {
+		raid5f_rebuild_window_end(rebuild, false);
+		return;
+	}
+
+	rebuild->state = RAID5F_REBUILD_WAIT_FLUSHES;
+	if (__atomic_load_n(&r5f_info->cache_flushes_active, __ATOMIC_SEQ_CST) == 0) {
+		raid5f_rebuild_dispatch(rebuild);
+	}
 }
 
 static void
-raid5f_stripe_write_request_xor_done(struct stripe_request *stripe_req, int status)
+raid5f_rebuild_refill(struct raid5f_rebuild *rebuild)
 {
-	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	uint64_t now = spdk_get_ticks();
+	uint64_t ticks = now - rebuild->refill_tsc;
 
-	if (status != 0) {
-		raid5f_stripe_request_release(stripe_req);
-		raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_FAILED);
-	} else {
-		raid5f_stripe_request_submit_chunks(stripe_req);
+	rebuild->refill_tsc = now;
+
+	if (rebuild->opts.rate_mbps != 0) {
+		rebuild->byte_tokens += (uint64_t)rebuild->opts.rate_mbps * 1024 * 1024 * ticks /
+					spdk_get_ticks_hz();
+		rebuild->byte_tokens = spdk_min(rebuild->byte_tokens, rebuild->byte_tokens_max);
 	}
 }
-			   
+
+/* Base bdev I/O of rebuilding stripes: all other strips are read and one is written */
+static int64_t
+raid5f_rebuild_window_bytes(struct raid5f_rebuild *rebuild, uint64_t num_stripes)
+{
+	struct raid_bdev *raid_bdev = rebuild->r5f_info->raid_bdev;
+
+	return (int64_t)num_stripes * raid_bdev->num_base_bdevs *
+	       (raid_bdev->strip_size << raid_bdev->blocklen_shift);
+}
+
 static int
-raid5f_submit_write_request(struct raid_bdev_io *raid_io, uint64_t stripe_index)
+raid5f_rebuild_poll(void *arg)
 {
-	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
-	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
-	struct stripe_request *stripe_req;
-	int ret;
+	struct raid5f_rebuild *rebuild = arg;
+	struct raid5f_info *r5f_info = rebuild->r5f_info;
+	uint64_t checkpoint = __atomic_load_n(&r5f_info->rebuild_checkpoint, __ATOMIC_RELAXED);
+	int64_t bytes;
+	int rc;
+
+	if (rebuild->stopping) {
+		return SPDK_POLLER_IDLE;
+	}
 
+	raid5f_rebuild_refill(rebuild);
 
-	stripe_req = TAILQ_FIRST(&r5ch->free_stripe_requests.write);
-	if (!stripe_req) {
-		return -ENOMEM;
+	switch (rebuild->state) {
+	case RAID5F_REBUILD_WAIT_FLUSHES:
+		if (__atomic_load_n(&r5f_info->cache_flushes_active, __ATOMIC_SEQ_CST) != 0) {
+			return SPDK_POLLER_IDLE;
+		}
+	/* fallthrough */
+	case RAID5F_REBUILD_DISPATCH:
+		raid5f_rebuild_dispatch(rebuild);
+		return SPDK_POLLER_BUSY;
+	case RAID5F_REBUILD_IDLE:
+		break;
+	default:
+		return SPDK_POLLER_IDLE;
 	}
 
-	raid5f_stripe_request_init(stripe_req, raid_io, stripe_index);
-	
-	ret = raid5f_stripe_request_map_iovecs(stripe_req);
-	if (spdk_unlikely(ret)) {
-		return ret;
+	if (__atomic_load_n(&r5f_info->fg_outstanding, __ATOMIC_RELAXED) > rebuild->opts.max_fg_qd) {
+		return SPDK_POLLER_IDLE;
 	}
 
-	TAILQ_REMOVE(&r5ch->free_stripe_requests.write, stripe_req, link);
+	rebuild->window_start = checkpoint;
+	rebuild->window_end = spdk_min(checkpoint + rebuild->opts.window_stripes,
+				       r5f_info->total_stripes);
 
-	raid_io->module_private = stripe_req;
-	raid_io->base_bdev_io_remaining = raid_bdev->num_base_bdevs;
+	bytes = raid5f_rebuild_window_bytes(rebuild, rebuild->window_end - rebuild->window_start);
+	if (rebuild->opts.rate_mbps != 0) {
+		if (rebuild->byte_tokens < bytes) {
+			return SPDK_POLLER_IDLE;
+		}
+		rebuild->byte_tokens -= bytes;
+	}
 
-	if (raid_io->raid_ch->base_channel[stripe_req->parity_chunk->index] != NULL) {
-		raid5f_xor_stripe(stripe_req, raid5f_stripe_write_request_xor_done);
-	} else {
-		raid5f_stripe_write_request_xor_done(stripe_req, 0);
+	/* Defer stripe cache flushes to the window before waiting for the ones in progress */
+	__atomic_store_n(&r5f_info->rebuild_window_end, rebuild->window_end, __ATOMIC_SEQ_CST);
+	rebuild->next_stripe = rebuild->window_start;
+	rebuild->window_failed = false;
+	rebuild->state = RAID5F_REBUILD_QUIESCING;
+
+	rc = raid_bdev_quiesce_range(r5f_info->raid_bdev, checkpoint * r5f_info->stripe_blocks,
+				     (rebuild->window_end - checkpoint) * r5f_info->stripe_blocks,
+				     raid5f_rebuild_on_quiesced, rebuild);
+	if (rc != 0) {
+		raid5f_rebuild_on_quiesced(rebuild, rc);
 	}
 
-	return 0;
+	return SPDK_POLLER_BUSY;
 }
 
-static void raid5f_submit_rw_request(struct raid_bdev_io *raid_io);
-
 static void
-_raid5f_submit_rw_request(void *_raid_io)
+raid5f_rebuild_attached(void *ctx, int status)
 {
-	struct raid_bdev_io *raid_io = _raid_io;
+	struct raid5f_rebuild *rebuild = ctx;
+	struct raid5f_info *r5f_info = rebuild->r5f_info;
+
+	if (status != 0) {
+		SPDK_ERRLOG("Failed to attach base bdev to raid bdev %s: %s\n",
+			    r5f_info->raid_bdev->bdev.name, spdk_strerror(-status));
+		rebuild->failed = true;
+		raid5f_rebuild_finish(rebuild);
+		return;
+	}
+
+	rebuild->state = RAID5F_REBUILD_IDLE;
+
+	if (rebuild->stopping) {
+		raid5f_rebuild_finish(rebuild);
+		return;
+	}
+
+	rebuild->poller = SPDK_POLLER_REGISTER(raid5f_rebuild_poll, rebuild,
+					       RAID5F_REBUILD_POLL_PERIOD_US);
+	if (!rebuild->poller) {
+		rebuild->failed = true;
+		raid5f_rebuild_finish(rebuild);
+		return;
+	}
 
-	raid5f_submit_rw_request(raid_io);
+	__atomic_store_n(&r5f_info->rebuild_active, true, __ATOMIC_RELAXED);
 }
 
-static int
-raid5f_submit_reconstruct_read(struct raid_bdev_io *raid_io, uint64_t stripe_index,
-			       uint8_t chunk_idx, uint64_t chunk_offset, struct iovec *read_iovs,
-			       size_t read_iovs_num)
+int
+raid5f_rebuild_start(struct raid_bdev *raid_bdev, const char *base_bdev_name,
+		     const struct raid5f_rebuild_opts *opts)
 {
-	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
-	struct raid5f_io_channel *r5ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
-	struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(raid_io);
-	void *bdev_io_md = spdk_bdev_io_get_md_buf(bdev_io);
-	struct stripe_request *stripe_req;
-	struct chunk *chunk;
-	int buf_idx;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid_base_bdev_info *base_info, *target = NULL;
+	struct raid5f_rebuild *rebuild;
+	uint32_t poll_hz = SPDK_SEC_TO_USEC / RAID5F_REBUILD_POLL_PERIOD_US;
+	uint64_t start_stripe = opts->start_stripe;
+	bool resume = false;
+	int rc;
 
-	stripe_req = TAILQ_FIRST(&r5ch->free_stripe_requests.reconstruct);
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
 
-	if (!stripe_req) {
-		return -ENOMEM;
+	if (raid_bdev->state != RAID_BDEV_STATE_ONLINE || r5f_info == NULL) {
+		return -ENODEV;
 	}
 
-	raid5f_stripe_request_init(stripe_req, raid_io, stripe_index);
+	if (r5f_info->rebuild != NULL || r5f_info->scrub != NULL) {
+		return -EBUSY;
+	}
 
-	stripe_req->reconstruct.chunk = &stripe_req->chunks[chunk_idx];
-	stripe_req->reconstruct.chunk_offset = chunk_offset;
-	buf_idx = 0;
+	if (opts->start_stripe >= r5f_info->total_stripes ||
+	    opts->queue_depth > r5f_info->stripe_pool_max) {
+		return -EINVAL;
+	}
 
-	// shawgerj save the iovs from the chunk we already read so we can compare them later
-	if (read_iovs != NULL) {
-	  stripe_req->saved_iovs = read_iovs;
-	  stripe_req->saved_iovs_num = read_iovs_num;
+	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
+		if (base_info->rebuilding && strcmp(base_info->name, base_bdev_name) == 0) {
+			/* Continue a stopped rebuild, but not past where it got to */
+			target = base_info;
+			resume = true;
+			start_stripe = spdk_min(start_stripe, __atomic_load_n(&r5f_info->rebuild_checkpoint,
+						__ATOMIC_RELAXED));
+			break;
+		}
+		if (target == NULL && base_info->name == NULL && base_info->desc == NULL) {
+			target = base_info;
+		}
 	}
 
-	FOR_EACH_CHUNK(stripe_req, chunk) {
-		if (chunk == stripe_req->reconstruct.chunk) {
-			int i;
-			int ret;
+	if (target == NULL) {
+		SPDK_ERRLOG("Raid bdev %s has no missing base bdev\n", raid_bdev->bdev.name);
+		return -EINVAL;
+	}
 
-			ret = raid5f_chunk_set_iovcnt(chunk, bdev_io->u.bdev.iovcnt);
-			if (ret) {
-				return ret;
-			}
+	rebuild = calloc(1, sizeof(*rebuild));
+	if (!rebuild) {
+		return -ENOMEM;
+	}
+	rebuild->r5f_info = r5f_info;
+	rebuild->slot = target - raid_bdev->base_bdev_info;
+	rebuild->state = RAID5F_REBUILD_ATTACHING;
+	rebuild->start_tsc = spdk_get_ticks();
+	TAILQ_INIT(&rebuild->stop_waiters);
+
+	rebuild->opts = *opts;
+	if (rebuild->opts.max_fg_qd == 0) {
+		rebuild->opts.max_fg_qd = RAID5F_REBUILD_DEFAULT_MAX_FG_QD;
+	}
+	if (rebuild->opts.window_stripes == 0) {
+		rebuild->opts.window_stripes = RAID5F_REBUILD_DEFAULT_WINDOW_STRIPES;
+	}
+	if (rebuild->opts.queue_depth == 0) {
+		rebuild->opts.queue_depth = RAID5F_REBUILD_DEFAULT_QUEUE_DEPTH;
+	}
 
-			for (i = 0; i < bdev_io->u.bdev.iovcnt; i++) {
-				chunk->iovs[i] = bdev_io->u.bdev.iovs[i];
-			}
+	/* Allow a burst of one poll period, but at least one window */
+	rebuild->byte_tokens_max = spdk_max((int64_t)opts->rate_mbps * 1024 * 1024 / poll_hz,
+					    raid5f_rebuild_window_bytes(rebuild, rebuild->opts.window_stripes));
+	rebuild->byte_tokens = rebuild->byte_tokens_max;
+	rebuild->refill_tsc = spdk_get_ticks();
 
-			chunk->md_buf = bdev_io_md;
-		} else {
-			struct iovec *iov = &chunk->iovs[0];
+	r5f_info->rebuild_slot = rebuild->slot;
+	__atomic_store_n(&r5f_info->rebuild_checkpoint, start_stripe, __ATOMIC_RELEASE);
+	__atomic_store_n(&r5f_info->rebuild_window_end, start_stripe, __ATOMIC_SEQ_CST);
+	r5f_info->rebuild_opts = rebuild->opts;
+	r5f_info->rebuild = rebuild;
 
-			iov->iov_base = stripe_req->reconstruct.chunk_buffers[buf_idx];
-			iov->iov_len = bdev_io->u.bdev.num_blocks << raid_bdev->blocklen_shift;
-			chunk->iovcnt = 1;
+	SPDK_NOTICELOG("Rebuild of base bdev %s in slot %u of raid bdev %s started at stripe %"
+		       PRIu64 "\n", base_bdev_name, rebuild->slot, raid_bdev->bdev.name, start_stripe);
 
-			if (bdev_io_md) {
-				chunk->md_buf = stripe_req->reconstruct.chunk_md_buffers[buf_idx];
-			}
+	if (resume) {
+		raid5f_rebuild_attached(rebuild, 0);
+		return 0;
+	}
 
-			buf_idx++;
-		}
+	rc = raid_bdev_attach_base_bdev(raid_bdev, base_bdev_name, rebuild->slot,
+					raid5f_rebuild_attached, rebuild);
+	if (rc != 0) {
+		r5f_info->rebuild = NULL;
+		r5f_info->rebuild_slot = UINT8_MAX;
+		__atomic_store_n(&r5f_info->rebuild_checkpoint, UINT64_MAX, __ATOMIC_RELEASE);
+		free(rebuild);
 	}
 
-	raid_io->module_private = stripe_req;
-	raid_io->base_bdev_io_remaining = raid_bdev->num_base_bdevs;
+	return rc;
+}
+
+static int
+raid5f_rebuild_stop_with_cb(struct raid5f_info *r5f_info, raid_bdev_stop_background_cb cb_fn,
+			    void *cb_ctx)
+{
+	struct raid5f_rebuild *rebuild = r5f_info->rebuild;
+	struct raid5f_stop_waiter *waiter = NULL;
 
-	TAILQ_REMOVE(&r5ch->free_stripe_requests.reconstruct, stripe_req, link);
+	assert(rebuild != NULL);
 
-	raid5f_stripe_request_submit_chunks(stripe_req);
+	if (cb_fn != NULL) {
+		waiter = calloc(1, sizeof(*waiter));
+		if (!waiter) {
+			SPDK_ERRLOG("Failed to allocate rebuild stop waiter\n");
+		} else {
+			waiter->cb_fn = cb_fn;
+			waiter->cb_ctx = cb_ctx;
+			TAILQ_INSERT_TAIL(&rebuild->stop_waiters, waiter, link);
+		}
+	}
 
-	return 0;
+	if (!rebuild->stopping) {
+		rebuild->stopping = true;
+		spdk_poller_unregister(&rebuild->poller);
+		__atomic_store_n(&r5f_info->rebuild_active, false, __ATOMIC_RELAXED);
+
+		/* Otherwise the window in progress finishes the rebuild */
+		if (rebuild->state == RAID5F_REBUILD_IDLE) {
+			raid5f_rebuild_finish(rebuild);
+		} else if (rebuild->state == RAID5F_REBUILD_WAIT_FLUSHES ||
+			   rebuild->state == RAID5F_REBUILD_DISPATCH) {
+			raid5f_rebuild_window_end(rebuild, false);
+		}
+	}
+
+	return (cb_fn != NULL && waiter == NULL) ? -ENOMEM : 0;
 }
 
-static void
-raid5f_chunk_read_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+int
+raid5f_rebuild_stop(struct raid_bdev *raid_bdev)
 {
-  struct read_cb_arg *read_params = cb_arg;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
 
-  struct raid_bdev_io* raid_io = read_params->raid_io;
-  uint64_t stripe_index = read_params->stripe_index;
-  uint64_t stripe_offset = read_params->stripe_offset;
-  free(cb_arg);
-  
-  if (!success) {
-    raid_bdev_io_complete(raid_io, SPDK_BDEV_IO_STATUS_FAILED);
-    return;
-  }
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
 
-  struct raid_bdev *raid_bdev = raid_io->raid_bdev;
-  uint8_t chunk_data_idx = stripe_offset >> raid_bdev->strip_size_shift;
-  uint8_t p_idx = raid5f_stripe_parity_chunk_index(raid_bdev, stripe_index);
-  uint8_t chunk_idx = chunk_data_idx < p_idx ? chunk_data_idx : chunk_data_idx + 1;
-  uint64_t chunk_offset = stripe_offset - (chunk_data_idx << raid_bdev->strip_size_shift);
-  
-  raid5f_submit_reconstruct_read(raid_io, stripe_index, chunk_idx, chunk_offset,
-				 bdev_io->u.bdev.iovs, bdev_io->u.bdev.iovcnt);
+	if (r5f_info == NULL || r5f_info->rebuild == NULL || r5f_info->rebuild->stopping) {
+		return -ENOENT;
+	}
 
-  spdk_bdev_free_io(bdev_io);
-  //  raid_bdev_io_complete_part(raid_io, 1, success);
-  //	raid_bdev_io_complete(raid_io, success ? SPDK_BDEV_IO_STATUS_SUCCESS :
-  //			      SPDK_BDEV_IO_STATUS_FAILED);
+	return raid5f_rebuild_stop_with_cb(r5f_info, NULL, NULL);
 }
 
+/* Base bdev left by an unfinished rebuild, NULL if there is none */
+static struct raid_base_bdev_info *
+raid5f_rebuild_base_info(struct raid5f_info *r5f_info)
+{
+	struct raid_base_bdev_info *base_info;
+
+	if (r5f_info->rebuild_slot == UINT8_MAX) {
+		return NULL;
+	}
 
-static int
-raid5f_submit_read_request(struct raid_bdev_io *raid_io, uint64_t stripe_index,
-			   uint64_t stripe_offset)
+	base_info = &r5f_info->raid_bdev->base_bdev_info[r5f_info->rebuild_slot];
+
+	return base_info->rebuilding ? base_info : NULL;
+}
+
+void
+raid5f_write_rebuild_status_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w)
 {
-	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
-	uint8_t chunk_data_idx = stripe_offset >> raid_bdev->strip_size_shift;
-	uint8_t p_idx = raid5f_stripe_parity_chunk_index(raid_bdev, stripe_index);
-	uint8_t chunk_idx = chunk_data_idx < p_idx ? chunk_data_idx : chunk_data_idx + 1;
-	struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[chunk_idx];
-	struct spdk_io_channel *base_ch = raid_io->raid_ch->base_channel[chunk_idx];
-	uint64_t chunk_offset = stripe_offset - (chunk_data_idx << raid_bdev->strip_size_shift);
-	uint64_t base_offset_blocks = (stripe_index << raid_bdev->strip_size_shift) + chunk_offset;
-	struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(raid_io);
-	struct spdk_bdev_ext_io_opts io_opts;
-	int ret;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_rebuild *rebuild;
+	struct raid_base_bdev_info *base_info;
+	const char *state;
 
-	raid5f_init_ext_io_opts(bdev_io, &io_opts);
-	if (base_ch == NULL) {
-	  return raid5f_submit_reconstruct_read(raid_io, stripe_index, chunk_idx, chunk_offset, NULL, 0);
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
+
+	spdk_json_write_named_string(w, "name", raid_bdev->bdev.name);
+
+	if (r5f_info == NULL) {
+		spdk_json_write_named_string(w, "state", "offline");
+		return;
 	}
 
-	// build cb arg with stripe_index and stripe_offset to use later
-	struct read_cb_arg *cb_arg = malloc(sizeof(struct read_cb_arg));
-	cb_arg->raid_io = raid_io; // struct raid_bdev_io*
-	cb_arg->stripe_index = stripe_index; // uint64_t
-	cb_arg->stripe_offset = stripe_offset; 
-	
-	ret = raid_bdev_readv_blocks_ext(base_info, base_ch, bdev_io->u.bdev.iovs,
-					 bdev_io->u.bdev.iovcnt,
-					 base_offset_blocks, bdev_io->u.bdev.num_blocks,
-					 raid5f_chunk_read_complete, cb_arg, &io_opts);
+	rebuild = r5f_info->rebuild;
+	base_info = raid5f_rebuild_base_info(r5f_info);
 
-	if (spdk_unlikely(ret == -ENOMEM)) {
-	  SPDK_ERRLOG("readv returned ENOMEM\n");
-		raid_bdev_queue_io_wait(raid_io, spdk_bdev_desc_get_bdev(base_info->desc),
-					base_ch, _raid5f_submit_rw_request);
-		return 0;
+	if (rebuild != NULL) {
+		state = rebuild->stopping ? "stopping" : "running";
+	} else if (base_info != NULL) {
+		state = "stopped";
+	} else {
+		state = "idle";
+	}
+	spdk_json_write_named_string(w, "state", state);
+
+	if (base_info != NULL) {
+		spdk_json_write_named_string(w, "base_bdev", base_info->name);
+		spdk_json_write_named_uint32(w, "slot", r5f_info->rebuild_slot);
+		spdk_json_write_named_uint64(w, "checkpoint",
+					     __atomic_load_n(&r5f_info->rebuild_checkpoint, __ATOMIC_RELAXED));
+	}
+	spdk_json_write_named_uint64(w, "total_stripes", r5f_info->total_stripes);
+
+	if (rebuild != NULL) {
+		spdk_json_write_named_uint64(w, "stripes_rebuilt",
+					     __atomic_load_n(&rebuild->stripes_rebuilt, __ATOMIC_RELAXED));
+		spdk_json_write_named_uint64(w, "errors",
+					     __atomic_load_n(&rebuild->errors, __ATOMIC_RELAXED));
+		spdk_json_write_named_uint64(w, "elapsed_ms",
+					     (spdk_get_ticks() - rebuild->start_tsc) * 1000 /
+					     spdk_get_ticks_hz());
+		spdk_json_write_named_uint32(w, "rate_mbps", rebuild->opts.rate_mbps);
+		spdk_json_write_named_uint32(w, "max_fg_qd", rebuild->opts.max_fg_qd);
+		spdk_json_write_named_uint32(w, "window_stripes", rebuild->opts.window_stripes);
+		spdk_json_write_named_uint32(w, "queue_depth", rebuild->opts.queue_depth);
+	}
+}
+
+static void
+raid5f_stop_background_tasks(struct raid_bdev *raid_bdev, raid_bdev_stop_background_cb cb_fn,
+			     void *cb_ctx)
+{
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	int rc = -ENOENT;
+
+	/* The scrubber needs all base bdevs and the rebuild a missing one, so only one runs */
+	if (r5f_info != NULL && r5f_info->scrub != NULL) {
+		rc = raid5f_scrub_stop_with_cb(r5f_info, cb_fn, cb_ctx);
+	} else if (r5f_info != NULL && r5f_info->rebuild != NULL) {
+		rc = raid5f_rebuild_stop_with_cb(r5f_info, cb_fn, cb_ctx);
 	}
 
-	return ret;
+	if (rc != 0 && cb_fn) {
+		cb_fn(cb_ctx, 0);
+	}
 }
 
+/*
+ * Stop of the scrubber or the rebuild waiting for the stripe cache to be flushed and the
+ * write-intent bitmap and the chunk checksum table to stop first
+ */
+struct raid5f_stop_background_ctx {
+	struct raid_bdev *raid_bdev;
+	raid_bdev_stop_background_cb cb_fn;
+	void *cb_ctx;
+};
+
 static void
-raid5f_submit_rw_request(struct raid_bdev_io *raid_io)
+raid5f_stop_background_continue(void *ctx, int status)
 {
-	struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(raid_io);
-	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
-	struct raid5f_info *r5f_info = raid_bdev->module_private;
-	uint64_t offset_blocks = bdev_io->u.bdev.offset_blocks;
-	uint64_t stripe_index = offset_blocks / r5f_info->stripe_blocks;
-	uint64_t stripe_offset = offset_blocks % r5f_info->stripe_blocks;
-	int ret;
+	struct raid5f_stop_background_ctx *stop_ctx = ctx;
+	struct raid5f_info *r5f_info = stop_ctx->raid_bdev->module_private;
 
-	switch (bdev_io->type) {
-	case SPDK_BDEV_IO_TYPE_READ:
-		assert(bdev_io->u.bdev.num_blocks <= raid_bdev->strip_size);
-		ret = raid5f_submit_read_request(raid_io, stripe_index, stripe_offset);
-		break;
-	case SPDK_BDEV_IO_TYPE_WRITE:
-		assert(stripe_offset == 0);
-		assert(bdev_io->u.bdev.num_blocks == r5f_info->stripe_blocks);
-		ret = raid5f_submit_write_request(raid_io, stripe_index);
-		break;
-	default:
-		ret = -EINVAL;
-		break;
+	if (r5f_info->wib != NULL && r5f_info->wib->state != RAID5F_WIB_STOPPED) {
+		if (raid5f_wib_stop_with_cb(r5f_info->wib, raid5f_stop_background_continue,
+					    stop_ctx) == 0) {
+			return;
+		}
 	}
 
-	if (spdk_unlikely(ret)) {
-		raid_bdev_io_complete(raid_io, ret == -ENOMEM ? SPDK_BDEV_IO_STATUS_NOMEM :
-				      SPDK_BDEV_IO_STATUS_FAILED);
+	if (r5f_info->csum != NULL && !r5f_info->csum->stopped) {
+		if (raid5f_csum_stop_with_cb(r5f_info->csum, raid5f_stop_background_continue,
+					     stop_ctx) == 0) {
+			return;
+		}
 	}
+
+	raid5f_stop_background_tasks(stop_ctx->raid_bdev, stop_ctx->cb_fn, stop_ctx->cb_ctx);
+	free(stop_ctx);
 }
 
 static void
-raid5f_stripe_request_free(struct stripe_request *stripe_req)
+raid5f_stop_background_offline(struct raid_bdev *raid_bdev, raid_bdev_stop_background_cb cb_fn,
+			       void *cb_ctx)
 {
-	struct chunk *chunk;
-
-	FOR_EACH_CHUNK(stripe_req, chunk) {
-		free(chunk->iovs);
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_stop_background_ctx *stop_ctx;
+	bool stop_wib, stop_csum;
+
+	/*
+	 * The write-intent bitmap and the chunk checksums are written a last time when the raid
+	 * bdev goes offline, while the base bdevs are still open. They keep running when a base
+	 * bdev is removed.
+	 */
+	if (r5f_info == NULL || raid_bdev->state == RAID_BDEV_STATE_ONLINE) {
+		raid5f_stop_background_tasks(raid_bdev, cb_fn, cb_ctx);
+		return;
 	}
 
-	if (stripe_req->type == STRIPE_REQ_WRITE) {
-		spdk_dma_free(stripe_req->write.parity_buf);
-		spdk_dma_free(stripe_req->write.parity_md_buf);
-	} else if (stripe_req->type == STRIPE_REQ_RECONSTRUCT) {
-		struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(stripe_req->r5ch);
-		struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
-		uint8_t i;
+	stop_wib = r5f_info->wib != NULL && r5f_info->wib->state != RAID5F_WIB_STOPPED;
+	stop_csum = r5f_info->csum != NULL && !r5f_info->csum->stopped;
+	if (!stop_wib && !stop_csum) {
+		raid5f_stop_background_tasks(raid_bdev, cb_fn, cb_ctx);
+		return;
+	}
 
-		if (stripe_req->reconstruct.chunk_buffers) {
-			for (i = 0; i < raid5f_stripe_data_chunks_num(raid_bdev); i++) {
-				spdk_dma_free(stripe_req->reconstruct.chunk_buffers[i]);
-			}
-			free(stripe_req->reconstruct.chunk_buffers);
+	stop_ctx = calloc(1, sizeof(*stop_ctx));
+	if (stop_ctx == NULL) {
+		if (stop_wib) {
+			raid5f_wib_stop_with_cb(r5f_info->wib, NULL, NULL);
 		}
-
-		if (stripe_req->reconstruct.chunk_md_buffers) {
-			for (i = 0; i < raid5f_stripe_data_chunks_num(raid_bdev); i++) {
-				spdk_dma_free(stripe_req->reconstruct.chunk_md_buffers[i]);
-			}
-			free(stripe_req->reconstruct.chunk_md_buffers);
+		if (stop_csum) {
+			raid5f_csum_stop_with_cb(r5f_info->csum, NULL, NULL);
 		}
-	} else {
-		assert(false);
+		raid5f_stop_background_tasks(raid_bdev, cb_fn, cb_ctx);
+		return;
 	}
 
-	free(stripe_req->chunk_xor_buffers);
-	free(stripe_req->chunk_xor_md_buffers);
-	free(stripe_req->chunk_iov_iters);
-
-	free(stripe_req);
+	stop_ctx->raid_bdev = raid_bdev;
+	stop_ctx->cb_fn = cb_fn;
+	stop_ctx->cb_ctx = cb_ctx;
+	raid5f_stop_background_continue(stop_ctx, 0);
 }
 
-static struct stripe_request *
-raid5f_stripe_request_alloc(struct raid5f_io_channel *r5ch, enum stripe_request_type type)
+static void
+raid5f_stop_background_cache_flushed(void *ctx, int status)
 {
-	struct raid5f_info *r5f_info = raid5f_ch_to_r5f_info(r5ch);
-	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
-	uint32_t raid_io_md_size = spdk_bdev_get_md_size(&raid_bdev->bdev);
-	struct stripe_request *stripe_req;
-	struct chunk *chunk;
-	size_t chunk_len;
+	struct raid5f_stop_background_ctx *stop_ctx = ctx;
 
-	stripe_req = calloc(1, sizeof(*stripe_req) + sizeof(*chunk) * raid_bdev->num_base_bdevs);
-	if (!stripe_req) {
-		return NULL;
+	if (status != 0) {
+		/* Keep everything running, the raid bdev stays online */
+		if (stop_ctx->cb_fn) {
+			stop_ctx->cb_fn(stop_ctx->cb_ctx, status);
+		}
+	} else {
+		raid5f_stop_background_offline(stop_ctx->raid_bdev, stop_ctx->cb_fn,
+					       stop_ctx->cb_ctx);
 	}
+	free(stop_ctx);
+}
 
-	stripe_req->r5ch = r5ch;
-	stripe_req->type = type;
+static void
+raid5f_stop_background(struct raid_bdev *raid_bdev, raid_bdev_stop_background_cb cb_fn,
+		       void *cb_ctx)
+{
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_stop_background_ctx *stop_ctx;
+	int rc;
+
+	/*
+	 * Writes completed from the stripe cache must survive an orderly stop, so the cache is
+	 * flushed first, while the base bdevs are still open and nothing else is stopped yet.
+	 */
+	if (r5f_info == NULL || r5f_info->cache == NULL ||
+	    raid_bdev->state == RAID_BDEV_STATE_ONLINE) {
+		raid5f_stop_background_offline(raid_bdev, cb_fn, cb_ctx);
+		return;
+	}
 
-	FOR_EACH_CHUNK(stripe_req, chunk) {
-		chunk->index = chunk - stripe_req->chunks;
-		chunk->iovcnt_max = 4;
-		chunk->iovs = calloc(chunk->iovcnt_max, sizeof(chunk->iovs[0]));
-		if (!chunk->iovs) {
-			goto err;
+	stop_ctx = calloc(1, sizeof(*stop_ctx));
+	if (stop_ctx == NULL) {
+		rc = -ENOMEM;
+	} else {
+		stop_ctx->raid_bdev = raid_bdev;
+		stop_ctx->cb_fn = cb_fn;
+		stop_ctx->cb_ctx = cb_ctx;
+		rc = raid5f_cache_stop_with_cb(raid_bdev, raid5f_stop_background_cache_flushed,
+					       stop_ctx);
+		if (rc == 0) {
+			return;
 		}
+		free(stop_ctx);
 	}
 
-	chunk_len = raid_bdev->strip_size << raid_bdev->blocklen_shift;
-
-	if (type == STRIPE_REQ_WRITE) {
-		stripe_req->write.parity_buf = spdk_dma_malloc(chunk_len, r5f_info->buf_alignment, NULL);
-		if (!stripe_req->write.parity_buf) {
-			goto err;
+	if (rc == -ENOENT) {
+		raid5f_stop_background_offline(raid_bdev, cb_fn, cb_ctx);
+	} else {
+		SPDK_ERRLOG("Failed to start flushing stripe cache of raid bdev %s: %s\n",
+			    raid_bdev->bdev.name, spdk_strerror(-rc));
+		if (cb_fn) {
+			cb_fn(cb_ctx, rc);
 		}
+	}
+}
 
-		if (raid_io_md_size != 0) {
-			stripe_req->write.parity_md_buf = spdk_dma_malloc(raid_bdev->strip_size * raid_io_md_size,
-							  r5f_info->buf_alignment, NULL);
-			if (!stripe_req->write.parity_md_buf) {
-				goto err;
-			}
-		}
-	} else if (type == STRIPE_REQ_RECONSTRUCT) {
-		uint8_t n = raid5f_stripe_data_chunks_num(raid_bdev);
-		void *buf;
-		uint8_t i;
+void
+raid5f_write_scrub_status_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w)
+{
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_scrub *scrub;
+	struct raid5f_mismatch_event *event;
+	uint64_t i, first;
 
-		stripe_req->reconstruct.chunk_buffers = calloc(n, sizeof(void *));
-		if (!stripe_req->reconstruct.chunk_buffers) {
-			goto err;
-		}
+	assert(spdk_get_thread() == spdk_thread_get_app_thread());
 
-		for (i = 0; i < n; i++) {
-			buf = spdk_dma_malloc(chunk_len, r5f_info->buf_alignment, NULL);
-			if (!buf) {
-				goto err;
-			}
-			stripe_req->reconstruct.chunk_buffers[i] = buf;
-		}
+	spdk_json_write_named_string(w, "name", raid_bdev->bdev.name);
 
-		if (raid_io_md_size != 0) {
-			stripe_req->reconstruct.chunk_md_buffers = calloc(n, sizeof(void *));
-			if (!stripe_req->reconstruct.chunk_md_buffers) {
-				goto err;
-			}
+	if (r5f_info == NULL) {
+		spdk_json_write_named_string(w, "state", "offline");
+		return;
+	}
 
-			for (i = 0; i < n; i++) {
-				buf = spdk_dma_malloc(raid_bdev->strip_size * raid_io_md_size, r5f_info->buf_alignment, NULL);
-				if (!buf) {
-					goto err;
-				}
-				stripe_req->reconstruct.chunk_md_buffers[i] = buf;
-			}
-		}
+	scrub = r5f_info->scrub;
+	if (scrub == NULL) {
+		spdk_json_write_named_string(w, "state", "idle");
+		spdk_json_write_named_uint64(w, "checkpoint", r5f_info->scrub_checkpoint);
 	} else {
-		assert(false);
-		return NULL;
+		spdk_json_write_named_string(w, "state", scrub->stopping ? "stopping" : "running");
+		spdk_json_write_named_uint64(w, "checkpoint", raid5f_scrub_checkpoint(scrub));
+		spdk_json_write_named_uint64(w, "passes", scrub->passes);
+		spdk_json_write_named_uint64(w, "stripes_verified", scrub->stripes_verified);
+		spdk_json_write_named_uint64(w, "read_errors", scrub->read_errors);
+		spdk_json_write_named_uint32(w, "rate_mbps", scrub->opts.rate_mbps);
+		spdk_json_write_named_uint32(w, "rate_iops", scrub->opts.rate_iops);
+		spdk_json_write_named_uint32(w, "max_fg_qd", scrub->opts.max_fg_qd);
+		spdk_json_write_named_bool(w, "repair", scrub->opts.repair);
 	}
+	spdk_json_write_named_uint64(w, "total_stripes", r5f_info->total_stripes);
+	spdk_json_write_named_uint64(w, "mismatches", r5f_info->num_mismatches);
+
+	spdk_json_write_named_object_begin(w, "repair_stats");
+	spdk_json_write_named_uint64(w, "read_mismatches",
+				     __atomic_load_n(&r5f_info->repair_stats.read_mismatches, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "repaired",
+				     __atomic_load_n(&r5f_info->repair_stats.repaired, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "consistent",
+				     __atomic_load_n(&r5f_info->repair_stats.consistent, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "failed",
+				     __atomic_load_n(&r5f_info->repair_stats.failed, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "dropped",
+				     __atomic_load_n(&r5f_info->repair_stats.dropped, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "pi_errors",
+				     __atomic_load_n(&r5f_info->repair_stats.pi_errors, __ATOMIC_RELAXED));
+	spdk_json_write_object_end(w);
+
+	/* The scrubber's events of the mismatch history, with the time in seconds */
+	spdk_json_write_named_array_begin(w, "mismatch_log");
+	spdk_spin_lock(&r5f_info->mismatch_history.lock);
+	first = spdk_max(r5f_info->mismatch_history.next_seq, RAID5F_MISMATCH_HISTORY_SIZE) -
+		RAID5F_MISMATCH_HISTORY_SIZE;
+	for (i = first; i < r5f_info->mismatch_history.next_seq; i++) {
+		event = &r5f_info->mismatch_history.events[i % RAID5F_MISMATCH_HISTORY_SIZE];
+		if (event->source != RAID5F_MISMATCH_SRC_SCRUB) {
+			continue;
+		}
 
-	stripe_req->chunk_iov_iters = malloc(SPDK_IOVITER_SIZE(raid_bdev->num_base_bdevs));
-	if (!stripe_req->chunk_iov_iters) {
-		goto err;
+		spdk_json_write_object_begin(w);
+		spdk_json_write_named_uint64(w, "stripe", event->stripe_index);
+		spdk_json_write_named_uint64(w, "time", event->time / SPDK_SEC_TO_USEC);
+		spdk_json_write_object_end(w);
 	}
+	spdk_spin_unlock(&r5f_info->mismatch_history.lock);
+	spdk_json_write_array_end(w);
+}
 
-	stripe_req->chunk_xor_buffers = calloc(raid5f_stripe_data_chunks_num(raid_bdev),
-					       sizeof(stripe_req->chunk_xor_buffers[0]));
-	if (!stripe_req->chunk_xor_buffers) {
-		goto err;
+void
+raid5f_write_stripe_pool_stats_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w)
+{
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+
+	spdk_json_write_named_string(w, "name", raid_bdev->bdev.name);
+
+	if (r5f_info == NULL) {
+		spdk_json_write_named_string(w, "state", "offline");
+		return;
 	}
 
-	stripe_req->chunk_xor_md_buffers = calloc(raid5f_stripe_data_chunks_num(raid_bdev),
-					   sizeof(stripe_req->chunk_xor_md_buffers[0]));
-	if (!stripe_req->chunk_xor_md_buffers) {
-		goto err;
+	spdk_json_write_named_uint32(w, "stripe_pool_size", r5f_info->stripe_pool_size);
+	spdk_json_write_named_uint32(w, "stripe_pool_max", r5f_info->stripe_pool_max);
+	spdk_json_write_named_uint64(w, "allocated",
+				     __atomic_load_n(&r5f_info->pool_stats.allocated, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "grown",
+				     __atomic_load_n(&r5f_info->pool_stats.grown, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "shrunk",
+				     __atomic_load_n(&r5f_info->pool_stats.shrunk, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "exhausted",
+				     __atomic_load_n(&r5f_info->pool_stats.exhausted, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "nomem",
+				     __atomic_load_n(&r5f_info->pool_stats.nomem, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "base_io_retries",
+				     __atomic_load_n(&r5f_info->pool_stats.base_io_retries, __ATOMIC_RELAXED));
+}
+
+static inline uint64_t
+raid5f_ticks_to_us(uint64_t ticks)
+{
+	return ticks == UINT64_MAX ? 0 : ticks * SPDK_SEC_TO_USEC / spdk_get_ticks_hz();
+}
+
+void
+raid5f_write_read_hedge_stats_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w)
+{
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_member_stats *stats;
+	struct raid_base_bdev_info *base_info;
+	uint64_t ewma_ticks, threshold_ticks;
+	uint8_t i;
+
+	spdk_json_write_named_string(w, "name", raid_bdev->bdev.name);
+
+	if (r5f_info == NULL) {
+		spdk_json_write_named_string(w, "state", "offline");
+		return;
 	}
 
-	return stripe_req;
-err:
-	raid5f_stripe_request_free(stripe_req);
-	return NULL;
+	spdk_json_write_named_uint32(w, "read_hedge_permille", r5f_info->read_hedge_permille);
+	spdk_json_write_named_uint64(w, "hedged",
+				     __atomic_load_n(&r5f_info->hedge_stats.hedged, __ATOMIC_RELAXED));
+	spdk_json_write_named_uint64(w, "wins",
+				     __atomic_load_n(&r5f_info->hedge_stats.wins, __ATOMIC_RELAXED));
+
+	spdk_json_write_named_array_begin(w, "base_bdevs");
+	for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+		base_info = &raid_bdev->base_bdev_info[i];
+		stats = &r5f_info->member_stats[i];
+
+		spdk_json_write_object_begin(w);
+		spdk_json_write_named_uint32(w, "slot", i);
+		if (base_info->name) {
+			spdk_json_write_named_string(w, "name", base_info->name);
+		}
+		ewma_ticks = __atomic_load_n(&stats->ewma_ticks, __ATOMIC_RELAXED);
+		threshold_ticks = __atomic_load_n(&stats->threshold_ticks, __ATOMIC_RELAXED);
+		spdk_json_write_named_uint64(w, "latency_ewma_us", raid5f_ticks_to_us(ewma_ticks));
+		spdk_json_write_named_uint64(w, "hedge_threshold_us", raid5f_ticks_to_us(threshold_ticks));
+		spdk_json_write_named_int64(w, "outstanding",
+					    __atomic_load_n(&stats->outstanding, __ATOMIC_RELAXED));
+		spdk_json_write_object_end(w);
+	}
+	spdk_json_write_array_end(w);
 }
 
-static void
-raid5f_ioch_destroy(void *io_device, void *ctx_buf)
+void
+raid5f_write_wib_status_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w)
 {
-	struct raid5f_io_channel *r5ch = ctx_buf;
-	struct stripe_request *stripe_req;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_wib *wib;
+	static const char *state_names[] = {
+		[RAID5F_WIB_LOADING] = "loading",
+		[RAID5F_WIB_ONLINE] = "online",
+		[RAID5F_WIB_STOPPING] = "stopping",
+		[RAID5F_WIB_STOPPED] = "stopped",
+	};
+	uint32_t num_dirty = 0, num_resync = 0;
+	uint32_t i;
 
-	assert(TAILQ_EMPTY(&r5ch->xor_retry_queue));
+	spdk_json_write_named_string(w, "name", raid_bdev->bdev.name);
 
-	while ((stripe_req = TAILQ_FIRST(&r5ch->free_stripe_requests.write))) {
-		TAILQ_REMOVE(&r5ch->free_stripe_requests.write, stripe_req, link);
-		raid5f_stripe_request_free(stripe_req);
+	if (r5f_info == NULL) {
+		spdk_json_write_named_string(w, "state", "offline");
+		return;
 	}
 
-	while ((stripe_req = TAILQ_FIRST(&r5ch->free_stripe_requests.reconstruct))) {
-		TAILQ_REMOVE(&r5ch->free_stripe_requests.reconstruct, stripe_req, link);
-		raid5f_stripe_request_free(stripe_req);
+	wib = r5f_info->wib;
+	if (wib == NULL) {
+		spdk_json_write_named_string(w, "state", "disabled");
+		return;
 	}
 
-	if (r5ch->accel_ch) {
-		spdk_put_io_channel(r5ch->accel_ch);
+	for (i = 0; i < wib->num_words; i++) {
+		num_dirty += __builtin_popcountll(wib->dirty[i]);
+		num_resync += __builtin_popcountll(wib->resync[i]);
 	}
 
-	free(r5ch->chunk_xor_buffers);
-	free(r5ch->chunk_xor_iovs);
-	free(r5ch->chunk_xor_iovcnt);
+	spdk_json_write_named_string(w, "state", state_names[wib->state]);
+	spdk_json_write_named_uint64(w, "region_stripes", 1ULL << wib->region_shift);
+	spdk_json_write_named_uint32(w, "num_regions", wib->num_regions);
+	spdk_json_write_named_uint32(w, "dirty_regions", num_dirty);
+	spdk_json_write_named_uint32(w, "resync_regions", num_resync);
+	spdk_json_write_named_uint64(w, "bitmap_writes", wib->stats.flushes);
+	spdk_json_write_named_uint64(w, "write_waits", wib->stats.waits);
+	spdk_json_write_named_uint64(w, "regions_cleared", wib->stats.regions_cleared);
+	spdk_json_write_named_uint64(w, "regions_resynced", wib->stats.regions_resynced);
+	spdk_json_write_named_uint64(w, "stripes_repaired", wib->stats.stripes_repaired);
+	spdk_json_write_named_uint64(w, "errors", wib->stats.errors);
 }
 
-static int
-raid5f_ioch_create(void *io_device, void *ctx_buf)
+void
+raid5f_write_chunk_checksum_stats_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w)
 {
-	struct raid5f_io_channel *r5ch = ctx_buf;
-	struct raid5f_info *r5f_info = io_device;
-	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
-	struct stripe_request *stripe_req;
-	int i;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_csum *csum;
+	struct raid5f_csum_page *page;
+	uint32_t num_used = 0, num_dirty = 0;
 
-	TAILQ_INIT(&r5ch->free_stripe_requests.write);
-	TAILQ_INIT(&r5ch->free_stripe_requests.reconstruct);
-	TAILQ_INIT(&r5ch->xor_retry_queue);
+	spdk_json_write_named_string(w, "name", raid_bdev->bdev.name);
 
-	for (i = 0; i < RAID5F_MAX_STRIPES; i++) {
-		stripe_req = raid5f_stripe_request_alloc(r5ch, STRIPE_REQ_WRITE);
-		if (!stripe_req) {
-			goto err;
-		}
+	if (r5f_info == NULL) {
+		spdk_json_write_named_string(w, "state", "offline");
+		return;
+	}
 
-		TAILQ_INSERT_HEAD(&r5ch->free_stripe_requests.write, stripe_req, link);
+	csum = r5f_info->csum;
+	if (csum == NULL) {
+		spdk_json_write_named_string(w, "state", "disabled");
+		return;
 	}
 
-	for (i = 0; i < RAID5F_MAX_STRIPES; i++) {
-		stripe_req = raid5f_stripe_request_alloc(r5ch, STRIPE_REQ_RECONSTRUCT);
-		if (!stripe_req) {
-			goto err;
+	spdk_spin_lock(&csum->lock);
+	TAILQ_FOREACH(page, &csum->lru, lru_link) {
+		num_used++;
+		if (page->dirty || page->writing) {
+			num_dirty++;
 		}
-
-		TAILQ_INSERT_HEAD(&r5ch->free_stripe_requests.reconstruct, stripe_req, link);
 	}
+	spdk_spin_unlock(&csum->lock);
+
+	spdk_json_write_named_string(w, "state", csum->stopped ? "stopped" :
+				     csum->stopping ? "stopping" : "online");
+	spdk_json_write_named_uint64(w, "table_pages", csum->num_pages * raid_bdev->num_base_bdevs);
+	spdk_json_write_named_uint32(w, "cached_pages", num_used);
+	spdk_json_write_named_uint32(w, "dirty_pages", num_dirty);
+	spdk_json_write_named_uint64(w, "verified", csum->stats.verified);
+	spdk_json_write_named_uint64(w, "mismatches", csum->stats.mismatches);
+	spdk_json_write_named_uint64(w, "misses", csum->stats.misses);
+	spdk_json_write_named_uint64(w, "updates_dropped", csum->stats.updates_dropped);
+	spdk_json_write_named_uint64(w, "page_reads", csum->stats.page_reads);
+	spdk_json_write_named_uint64(w, "page_writes", csum->stats.page_writes);
+	spdk_json_write_named_uint64(w, "errors", csum->stats.errors);
+}
 
-	r5ch->accel_ch = spdk_accel_get_io_channel();
-	if (!r5ch->accel_ch) {
-		SPDK_ERRLOG("Failed to get accel framework's IO channel\n");
-		goto err;
-	}
+void
+raid5f_write_mismatch_events_json(struct raid_bdev *raid_bdev, uint64_t cursor,
+				  uint32_t max_events, struct spdk_json_write_ctx *w)
+{
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_mismatch_event *event;
+	static const char *source_names[] = {
+		[RAID5F_MISMATCH_SRC_READ] = "read",
+		[RAID5F_MISMATCH_SRC_SCRUB] = "scrub",
+		[RAID5F_MISMATCH_SRC_RESYNC] = "resync",
+		[RAID5F_MISMATCH_SRC_REPAIR] = "repair",
+	};
+	static const char *action_names[] = {
+		[RAID5F_MISMATCH_LOGGED] = "logged",
+		[RAID5F_MISMATCH_REPAIR_QUEUED] = "repair_queued",
+		[RAID5F_MISMATCH_REPAIR_DROPPED] = "repair_dropped",
+		[RAID5F_MISMATCH_REPAIRED] = "repaired",
+		[RAID5F_MISMATCH_TRANSIENT] = "transient",
+		[RAID5F_MISMATCH_REPAIR_FAILED] = "repair_failed",
+		[RAID5F_MISMATCH_PARITY_REWRITTEN] = "parity_rewritten",
+	};
+	struct raid_base_bdev_info *base_info;
+	uint64_t first, next_seq, lost = 0;
+	uint32_t count, i;
 
-	r5ch->chunk_xor_buffers = calloc(raid_bdev->num_base_bdevs, sizeof(*r5ch->chunk_xor_buffers));
-	if (!r5ch->chunk_xor_buffers) {
-		goto err;
-	}
+	spdk_json_write_named_string(w, "name", raid_bdev->bdev.name);
 
-	r5ch->chunk_xor_iovs = calloc(raid_bdev->num_base_bdevs, sizeof(*r5ch->chunk_xor_iovs));
-	if (!r5ch->chunk_xor_iovs) {
-		goto err;
+	if (r5f_info == NULL) {
+		spdk_json_write_named_string(w, "state", "offline");
+		return;
 	}
 
-	r5ch->chunk_xor_iovcnt = calloc(raid_bdev->num_base_bdevs, sizeof(*r5ch->chunk_xor_iovcnt));
-	if (!r5ch->chunk_xor_iovcnt) {
-		goto err;
+	/* The history is small, it is written out under the lock */
+	spdk_spin_lock(&r5f_info->mismatch_history.lock);
+	next_seq = r5f_info->mismatch_history.next_seq;
+	first = spdk_max(next_seq, RAID5F_MISMATCH_HISTORY_SIZE) - RAID5F_MISMATCH_HISTORY_SIZE;
+	if (cursor < first) {
+		lost = first - cursor;
+		cursor = first;
+	}
+	cursor = spdk_min(cursor, next_seq);
+	count = spdk_min(next_seq - cursor, max_events);
+
+	spdk_json_write_named_string(w, "state", "online");
+	spdk_json_write_named_uint64(w, "cursor", cursor + count);
+	spdk_json_write_named_uint64(w, "lost", lost);
+	spdk_json_write_named_uint64(w, "dropped", r5f_info->mismatch_history.dropped);
+
+	spdk_json_write_named_array_begin(w, "events");
+	for (i = 0; i < count; i++) {
+		event = &r5f_info->mismatch_history.events[(cursor + i) % RAID5F_MISMATCH_HISTORY_SIZE];
+
+		spdk_json_write_object_begin(w);
+		spdk_json_write_named_uint64(w, "seq", event->seq);
+		spdk_json_write_named_uint64(w, "stripe", event->stripe_index);
+		if (event->member != RAID5F_MISMATCH_NO_MEMBER) {
+			base_info = &raid_bdev->base_bdev_info[event->member];
+			spdk_json_write_named_uint32(w, "member", event->member);
+			if (base_info->name != NULL) {
+				spdk_json_write_named_string(w, "base_bdev", base_info->name);
+			}
+		}
+		spdk_json_write_named_uint64(w, "time_us", event->time);
+		spdk_json_write_named_string(w, "source", source_names[event->source]);
+		spdk_json_write_named_string(w, "action", action_names[event->action]);
+		spdk_json_write_object_end(w);
 	}
+	spdk_json_write_array_end(w);
+	spdk_spin_unlock(&r5f_info->mismatch_history.lock);
+}
 
-	return 0;
-err:
-	SPDK_ERRLOG("Failed to initialize io channel\n");
-	raid5f_ioch_destroy(r5f_info, r5ch);
-	return -ENOMEM;
+/*
+ * The raid bdev is created from the config with the base bdev being rebuilt as a regular
+ * member. Remove it again and continue its rebuild from the checkpoint.
+ */
+static void
+raid5f_write_rebuild_config_json(struct raid5f_info *r5f_info,
+				 struct raid_base_bdev_info *base_info, struct spdk_json_write_ctx *w)
+{
+	struct raid5f_rebuild_opts *opts = &r5f_info->rebuild_opts;
+
+	spdk_json_write_object_begin(w);
+	spdk_json_write_named_string(w, "method", "bdev_raid_remove_base_bdev");
+	spdk_json_write_named_object_begin(w, "params");
+	spdk_json_write_named_string(w, "name", base_info->name);
+	spdk_json_write_object_end(w);
+	spdk_json_write_object_end(w);
+
+	spdk_json_write_object_begin(w);
+	spdk_json_write_named_string(w, "method", "bdev_raid_start_rebuild");
+	spdk_json_write_named_object_begin(w, "params");
+	spdk_json_write_named_string(w, "name", r5f_info->raid_bdev->bdev.name);
+	spdk_json_write_named_string(w, "base_bdev", base_info->name);
+	spdk_json_write_named_uint32(w, "rate_mbps", opts->rate_mbps);
+	spdk_json_write_named_uint32(w, "max_fg_qd", opts->max_fg_qd);
+	spdk_json_write_named_uint32(w, "window_stripes", opts->window_stripes);
+	spdk_json_write_named_uint32(w, "queue_depth", opts->queue_depth);
+	spdk_json_write_named_uint64(w, "start_stripe",
+				     __atomic_load_n(&r5f_info->rebuild_checkpoint, __ATOMIC_RELAXED));
+	spdk_json_write_object_end(w);
+	spdk_json_write_object_end(w);
 }
 
-static int
-raid5f_start(struct raid_bdev *raid_bdev)
+/*
+ * Save a running scrub or an unfinished rebuild as RPCs restarting them from the current
+ * checkpoint, so that save_config followed by a restart resumes where they were. Arrays
+ * with a superblock are examined instead of created from the config, so nothing is saved.
+ */
+static void
+raid5f_write_config_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w)
 {
-	uint64_t min_blockcnt = UINT64_MAX;
-	uint64_t base_bdev_data_size;
+	struct raid5f_info *r5f_info = raid_bdev->module_private;
 	struct raid_base_bdev_info *base_info;
-	struct raid5f_info *r5f_info;
-	size_t alignment = 0;
+	struct raid5f_scrub *scrub;
 
-	r5f_info = calloc(1, sizeof(*r5f_info));
-	if (!r5f_info) {
-		SPDK_ERRLOG("Failed to allocate r5f_info\n");
-		return -ENOMEM;
+	if (raid_bdev->superblock_enabled || r5f_info == NULL) {
+		return;
 	}
-	r5f_info->raid_bdev = raid_bdev;
-
-	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
-		struct spdk_bdev *base_bdev = spdk_bdev_desc_get_bdev(base_info->desc);
 
-		min_blockcnt = spdk_min(min_blockcnt, base_info->data_size);
-		alignment = spdk_max(alignment, spdk_bdev_get_buf_align(base_bdev));
+	base_info = raid5f_rebuild_base_info(r5f_info);
+	if (base_info != NULL) {
+		raid5f_write_rebuild_config_json(r5f_info, base_info, w);
 	}
 
-	base_bdev_data_size = (min_blockcnt / raid_bdev->strip_size) * raid_bdev->strip_size;
-
-	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
-		base_info->data_size = base_bdev_data_size;
+	if (r5f_info->scrub == NULL || r5f_info->scrub->stopping) {
+		return;
 	}
+	scrub = r5f_info->scrub;
 
-	r5f_info->total_stripes = min_blockcnt / raid_bdev->strip_size;
-	r5f_info->stripe_blocks = raid_bdev->strip_size * raid5f_stripe_data_chunks_num(raid_bdev);
-	r5f_info->buf_alignment = alignment;
-
-	raid_bdev->bdev.blockcnt = r5f_info->stripe_blocks * r5f_info->total_stripes;
-	raid_bdev->bdev.optimal_io_boundary = raid_bdev->strip_size;
-	raid_bdev->bdev.split_on_optimal_io_boundary = true;
-	raid_bdev->bdev.write_unit_size = r5f_info->stripe_blocks;
-	raid_bdev->bdev.split_on_write_unit = true;
+	spdk_json_write_object_begin(w);
 
-	raid_bdev->module_private = r5f_info;
+	spdk_json_write_named_string(w, "method", "bdev_raid_start_scrub");
 
-	spdk_io_device_register(r5f_info, raid5f_ioch_create, raid5f_ioch_destroy,
-				sizeof(struct raid5f_io_channel), NULL);
+	spdk_json_write_named_object_begin(w, "params");
+	spdk_json_write_named_string(w, "name", raid_bdev->bdev.name);
+	spdk_json_write_named_uint32(w, "rate_mbps", scrub->opts.rate_mbps);
+	spdk_json_write_named_uint32(w, "rate_iops", scrub->opts.rate_iops);
+	spdk_json_write_named_uint32(w, "max_fg_qd", scrub->opts.max_fg_qd);
+	spdk_json_write_named_uint64(w, "start_stripe", raid5f_scrub_checkpoint(scrub));
+	spdk_json_write_named_bool(w, "repair", scrub->opts.repair);
+	spdk_json_write_object_end(w);
 
-	return 0;
+	spdk_json_write_object_end(w);
 }
 
 static void
@@ -1190,15 +11875,68 @@ raid5f_io_device_unregister_done(void *io_device)
 
 	raid_bdev_module_stop_done(r5f_info->raid_bdev);
 
+	if (r5f_info->cache) {
+		raid5f_cache_free(r5f_info->cache);
+	}
+	if (r5f_info->wib) {
+		raid5f_wib_free(r5f_info->wib);
+	}
+	if (r5f_info->csum) {
+		raid5f_csum_free(r5f_info->csum);
+	}
+	spdk_spin_destroy(&r5f_info->mismatch_history.lock);
+	free(r5f_info->owners);
+	raid5f_stripe_locks_free(r5f_info);
+	free(r5f_info->zero_stripes);
+	spdk_dma_free(r5f_info->zero_buf);
+	free(r5f_info->member_stats);
 	free(r5f_info);
 }
 
-static bool
-raid5f_stop(struct raid_bdev *raid_bdev)
+static void
+raid5f_stop_continue(void *ctx, int status)
 {
-	struct raid5f_info *r5f_info = raid_bdev->module_private;
+	struct raid5f_info *r5f_info = ctx;
+	struct raid_bdev *raid_bdev = r5f_info->raid_bdev;
+	struct raid5f_cache_entry *entry;
+	uint32_t num_dirty = 0;
+
+	if (r5f_info->cache != NULL) {
+		/*
+		 * The cache was flushed by the stop of the background operations, stripes are
+		 * left only if that failed while the raid bdev couldn't stay online
+		 */
+		spdk_spin_lock(&r5f_info->cache->lock);
+		r5f_info->cache->stopping = true;
+		TAILQ_FOREACH(entry, &r5f_info->cache->dirty_entries, link) {
+			num_dirty++;
+		}
+		spdk_spin_unlock(&r5f_info->cache->lock);
+
+		if (num_dirty > 0) {
+			SPDK_ERRLOG("Lost %" PRIu32 " stripes which failed to flush from stripe "
+				    "cache of raid bdev %s\n", num_dirty, raid_bdev->bdev.name);
+		}
+	}
+
+	/* The owner threads hold raid bdev io channels, release them first */
+	if (r5f_info->owners != NULL) {
+		raid5f_owners_release(r5f_info);
+		return;
+	}
 
 	spdk_io_device_unregister(r5f_info, raid5f_io_device_unregister_done);
+}
+
+static bool
+raid5f_stop(struct raid_bdev *raid_bdev)
+{
+	/*
+	 * The stripe cache is flushed and the scrubber and the rebuild are normally stopped
+	 * already, unless the stop is still in progress. The base bdevs may be closed, so the
+	 * cache isn't flushed again here.
+	 */
+	raid5f_stop_background_offline(raid_bdev, raid5f_stop_continue, raid_bdev->module_private);
 
 	return false;
 }
@@ -1218,8 +11956,20 @@ static struct raid_bdev_module g_raid5f_module = {
 	.start = raid5f_start,
 	.stop = raid5f_stop,
 	.submit_rw_request = raid5f_submit_rw_request,
+	.submit_null_payload_request = raid5f_submit_null_payload_request,
+	.io_type_supported = raid5f_io_type_supported,
 	.get_io_channel = raid5f_get_io_channel,
+	.stop_background = raid5f_stop_background,
+	.write_config_json = raid5f_write_config_json,
+	.memory_domains_supported = true,
 };
 RAID_MODULE_REGISTER(&g_raid5f_module)
 
+static void
+__attribute__((constructor))
+raid5f_notify_init(void)
+{
+	spdk_notify_type_register(RAID5F_MISMATCH_NOTIFY_TYPE);
+}
+
 SPDK_LOG_REGISTER_COMPONENT(bdev_raid5f)
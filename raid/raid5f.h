@@ -0,0 +1,106 @@
+/*   SPDX-License-Identifier: BSD-3-Clause
+ *   Copyright (C) 2022 Intel Corporation.
+ *   All rights reserved.
+ */
+
+#ifndef SPDK_RAID5F_H
+#define SPDK_RAID5F_H
+
+#include "bdev_raid.h"
+
+/* Parameters of the background scrubber */
+struct raid5f_scrub_opts {
+	/* Maximum read bandwidth of all base bdevs in MiB/s, 0 for no limit */
+	uint32_t rate_mbps;
+
+	/* Maximum read IOPS of all base bdevs, 0 for no limit */
+	uint32_t rate_iops;
+
+	/* Don't start verifying stripes while more foreground I/Os are outstanding, 0 for default */
+	uint32_t max_fg_qd;
+
+	/* Stripe to start from, e.g. the checkpoint of a previous scrub */
+	uint64_t start_stripe;
+
+	/*
+	 * Rewrite the parity of inconsistent stripes. The member at fault can't be
+	 * told from the parity alone, so the data chunks are taken as correct.
+	 */
+	bool repair;
+};
+
+/*
+ * Start verifying parity of all stripes of the raid bdev in the background. The
+ * scrubber keeps cycling over the array until stopped. Must be called on the app thread.
+ */
+int raid5f_scrub_start(struct raid_bdev *raid_bdev, const struct raid5f_scrub_opts *opts);
+
+/* Stop the scrubber. Must be called on the app thread. */
+int raid5f_scrub_stop(struct raid_bdev *raid_bdev);
+
+/* Write the scrubber state and the parity mismatch log of the raid bdev */
+void raid5f_write_scrub_status_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w);
+
+/* Parameters of the rebuild onto a replacement base bdev */
+struct raid5f_rebuild_opts {
+	/* Maximum bandwidth of all base bdev I/O in MiB/s, 0 for no limit */
+	uint32_t rate_mbps;
+
+	/* Don't start rebuilding stripes while more foreground I/Os are outstanding, 0 for default */
+	uint32_t max_fg_qd;
+
+	/* Number of stripes quiesced and rebuilt at a time, 0 for default */
+	uint32_t window_stripes;
+
+	/* Number of stripes rebuilt concurrently on each io channel, 0 for default */
+	uint32_t queue_depth;
+
+	/*
+	 * Stripe to start from, e.g. the checkpoint of a previous rebuild. The stripes
+	 * before it must already hold the rebuilt data on the base bdev.
+	 */
+	uint64_t start_stripe;
+};
+
+/*
+ * Rebuild the missing base bdev of a degraded raid bdev onto base_bdev_name. The bdev is
+ * attached to the empty slot and its data is reconstructed from the other base bdevs,
+ * while the rebuilt stripes serve I/O normally. If base_bdev_name is already attached
+ * by a stopped rebuild, the rebuild continues. Must be called on the app thread.
+ */
+int raid5f_rebuild_start(struct raid_bdev *raid_bdev, const char *base_bdev_name,
+			 const struct raid5f_rebuild_opts *opts);
+
+/* Stop the rebuild, keeping the progress. Must be called on the app thread. */
+int raid5f_rebuild_stop(struct raid_bdev *raid_bdev);
+
+/* Write the rebuild state of the raid bdev */
+void raid5f_write_rebuild_status_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w);
+
+/* Write the stripe request pool sizes and the resource shortage counters of the raid bdev */
+void raid5f_write_stripe_pool_stats_json(struct raid_bdev *raid_bdev,
+		struct spdk_json_write_ctx *w);
+
+/* Write the read latency of each base bdev and the hedged read counters of the raid bdev */
+void raid5f_write_read_hedge_stats_json(struct raid_bdev *raid_bdev,
+					struct spdk_json_write_ctx *w);
+
+/*
+ * Write the state of the write-intent bitmap of the raid bdev, which is kept on raid bdevs
+ * with a superblock
+ */
+void raid5f_write_wib_status_json(struct raid_bdev *raid_bdev, struct spdk_json_write_ctx *w);
+
+/* Write the state and the counters of the chunk checksum table of the raid bdev */
+void raid5f_write_chunk_checksum_stats_json(struct raid_bdev *raid_bdev,
+		struct spdk_json_write_ctx *w);
+
+/*
+ * Write at most max_events parity mismatch events of the raid bdev, starting from sequence
+ * number cursor, and the cursor to continue from. Events are recorded on the io channels
+ * and are moved to the history of the raid bdev periodically, within 100 ms.
+ */
+void raid5f_write_mismatch_events_json(struct raid_bdev *raid_bdev, uint64_t cursor,
+				       uint32_t max_events, struct spdk_json_write_ctx *w);
+
+#endif /* SPDK_RAID5F_H */
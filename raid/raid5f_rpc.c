@@ -0,0 +1,609 @@
+/*   SPDX-License-Identifier: BSD-3-Clause
+ *   Copyright (C) 2022 Intel Corporation.
+ *   All rights reserved.
+ */
+
+#include "spdk/rpc.h"
+#include "spdk/util.h"
+#include "spdk/string.h"
+#include "spdk/log.h"
+#include "raid5f.h"
+
+/*
+ * brief:
+ * rpc_raid5f_find_bdev looks up the raid5f bdev named in an RPC and sends the
+ * error response if there is none
+ * params:
+ * request - pointer to json rpc request
+ * name - raid bdev name
+ * returns:
+ * pointer to the raid bdev, NULL if not found
+ */
+static struct raid_bdev *
+rpc_raid5f_find_bdev(struct spdk_jsonrpc_request *request, const char *name)
+{
+	struct raid_bdev *raid_bdev;
+
+	raid_bdev = raid_bdev_find_by_name(name);
+	if (raid_bdev == NULL) {
+		spdk_jsonrpc_send_error_response_fmt(request, -ENODEV, "raid bdev %s not found", name);
+		return NULL;
+	}
+
+	if (raid_bdev->level != RAID5F) {
+		spdk_jsonrpc_send_error_response_fmt(request, -EINVAL,
+						     "raid bdev %s is not raid5f", name);
+		return NULL;
+	}
+
+	return raid_bdev;
+}
+
+/*
+ * Input structure for RPC starting the scrubber
+ */
+struct rpc_bdev_raid_start_scrub {
+	/* raid bdev name */
+	char *name;
+
+	/* Scrubber parameters */
+	struct raid5f_scrub_opts opts;
+};
+
+/*
+ * Decoder object for RPC bdev_raid_start_scrub
+ */
+static const struct spdk_json_object_decoder rpc_bdev_raid_start_scrub_decoders[] = {
+	{"name", offsetof(struct rpc_bdev_raid_start_scrub, name), spdk_json_decode_string},
+	{"rate_mbps", offsetof(struct rpc_bdev_raid_start_scrub, opts.rate_mbps), spdk_json_decode_uint32, true},
+	{"rate_iops", offsetof(struct rpc_bdev_raid_start_scrub, opts.rate_iops), spdk_json_decode_uint32, true},
+	{"max_fg_qd", offsetof(struct rpc_bdev_raid_start_scrub, opts.max_fg_qd), spdk_json_decode_uint32, true},
+	{"start_stripe", offsetof(struct rpc_bdev_raid_start_scrub, opts.start_stripe), spdk_json_decode_uint64, true},
+	{"repair", offsetof(struct rpc_bdev_raid_start_scrub, opts.repair), spdk_json_decode_bool, true},
+};
+
+/*
+ * brief:
+ * rpc_bdev_raid_start_scrub function is the RPC for starting the background
+ * parity verification of a raid5f bdev
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_start_scrub(struct spdk_jsonrpc_request *request,
+			  const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid_start_scrub req = {};
+	struct raid_bdev *raid_bdev;
+	int rc;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid_start_scrub_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid_start_scrub_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	rc = raid5f_scrub_start(raid_bdev, &req.opts);
+	if (rc != 0) {
+		spdk_jsonrpc_send_error_response_fmt(request, rc,
+						     "Failed to start scrub of raid bdev %s: %s",
+						     req.name, spdk_strerror(-rc));
+		goto cleanup;
+	}
+
+	spdk_jsonrpc_send_bool_response(request, true);
+cleanup:
+	free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_raid_start_scrub", rpc_bdev_raid_start_scrub, SPDK_RPC_RUNTIME)
+
+/*
+ * Input structure for RPCs taking only the raid bdev name
+ */
+struct rpc_bdev_raid5f_name {
+	/* raid bdev name */
+	char *name;
+};
+
+/*
+ * Decoder object for RPCs bdev_raid_stop_scrub, bdev_raid_get_scrub_status,
+ * bdev_raid_stop_rebuild, bdev_raid_get_rebuild_status, bdev_raid_get_stripe_pool_stats,
+ * bdev_raid_get_read_hedge_stats, bdev_raid_get_write_intent_bitmap and
+ * bdev_raid_get_chunk_checksum_stats
+ */
+static const struct spdk_json_object_decoder rpc_bdev_raid5f_name_decoders[] = {
+	{"name", offsetof(struct rpc_bdev_raid5f_name, name), spdk_json_decode_string},
+};
+
+/*
+ * brief:
+ * rpc_bdev_raid_stop_scrub function is the RPC for stopping the scrubber of a
+ * raid5f bdev. Stripes being verified are completed in the background.
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_stop_scrub(struct spdk_jsonrpc_request *request,
+			 const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid5f_name req = {};
+	struct raid_bdev *raid_bdev;
+	int rc;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid5f_name_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid5f_name_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	rc = raid5f_scrub_stop(raid_bdev);
+	if (rc != 0) {
+		spdk_jsonrpc_send_error_response_fmt(request, rc,
+						     "Failed to stop scrub of raid bdev %s: %s",
+						     req.name, spdk_strerror(-rc));
+		goto cleanup;
+	}
+
+	spdk_jsonrpc_send_bool_response(request, true);
+cleanup:
+	free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_raid_stop_scrub", rpc_bdev_raid_stop_scrub, SPDK_RPC_RUNTIME)
+
+/*
+ * brief:
+ * rpc_bdev_raid_get_scrub_status function is the RPC for getting the scrubber
+ * progress and the parity mismatches found on a raid5f bdev
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_get_scrub_status(struct spdk_jsonrpc_request *request,
+			       const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid5f_name req = {};
+	struct spdk_json_write_ctx *w;
+	struct raid_bdev *raid_bdev;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid5f_name_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid5f_name_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	w = spdk_jsonrpc_begin_result(request);
+	spdk_json_write_object_begin(w);
+	raid5f_write_scrub_status_json(raid_bdev, w);
+	spdk_json_write_object_end(w);
+	spdk_jsonrpc_end_result(request, w);
+cleanup:
+	free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_raid_get_scrub_status", rpc_bdev_raid_get_scrub_status, SPDK_RPC_RUNTIME)
+
+/*
+ * Input structure for RPC starting the rebuild
+ */
+struct rpc_bdev_raid_start_rebuild {
+	/* raid bdev name */
+	char *name;
+
+	/* Name of the replacement base bdev */
+	char *base_bdev;
+
+	/* Rebuild parameters */
+	struct raid5f_rebuild_opts opts;
+};
+
+/*
+ * Decoder object for RPC bdev_raid_start_rebuild
+ */
+static const struct spdk_json_object_decoder rpc_bdev_raid_start_rebuild_decoders[] = {
+	{"name", offsetof(struct rpc_bdev_raid_start_rebuild, name), spdk_json_decode_string},
+	{"base_bdev", offsetof(struct rpc_bdev_raid_start_rebuild, base_bdev), spdk_json_decode_string},
+	{"rate_mbps", offsetof(struct rpc_bdev_raid_start_rebuild, opts.rate_mbps), spdk_json_decode_uint32, true},
+	{"max_fg_qd", offsetof(struct rpc_bdev_raid_start_rebuild, opts.max_fg_qd), spdk_json_decode_uint32, true},
+	{"window_stripes", offsetof(struct rpc_bdev_raid_start_rebuild, opts.window_stripes), spdk_json_decode_uint32, true},
+	{"queue_depth", offsetof(struct rpc_bdev_raid_start_rebuild, opts.queue_depth), spdk_json_decode_uint32, true},
+	{"start_stripe", offsetof(struct rpc_bdev_raid_start_rebuild, opts.start_stripe), spdk_json_decode_uint64, true},
+};
+
+/*
+ * brief:
+ * rpc_bdev_raid_start_rebuild function is the RPC for rebuilding the missing base
+ * bdev of a degraded raid5f bdev onto a replacement bdev
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_start_rebuild(struct spdk_jsonrpc_request *request,
+			    const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid_start_rebuild req = {};
+	struct raid_bdev *raid_bdev;
+	int rc;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid_start_rebuild_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid_start_rebuild_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	rc = raid5f_rebuild_start(raid_bdev, req.base_bdev, &req.opts);
+	if (rc != 0) {
+		spdk_jsonrpc_send_error_response_fmt(request, rc,
+						     "Failed to start rebuild of raid bdev %s onto %s: %s",
+						     req.name, req.base_bdev, spdk_strerror(-rc));
+		goto cleanup;
+	}
+
+	spdk_jsonrpc_send_bool_response(request, true);
+cleanup:
+	free(req.name);
+	free(req.base_bdev);
+}
+SPDK_RPC_REGISTER("bdev_raid_start_rebuild", rpc_bdev_raid_start_rebuild, SPDK_RPC_RUNTIME)
+
+/*
+ * brief:
+ * rpc_bdev_raid_stop_rebuild function is the RPC for stopping the rebuild of a
+ * raid5f bdev. The replacement base bdev stays attached and the rebuild can be
+ * started again from where it stopped.
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_stop_rebuild(struct spdk_jsonrpc_request *request,
+			   const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid5f_name req = {};
+	struct raid_bdev *raid_bdev;
+	int rc;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid5f_name_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid5f_name_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	rc = raid5f_rebuild_stop(raid_bdev);
+	if (rc != 0) {
+		spdk_jsonrpc_send_error_response_fmt(request, rc,
+						     "Failed to stop rebuild of raid bdev %s: %s",
+						     req.name, spdk_strerror(-rc));
+		goto cleanup;
+	}
+
+	spdk_jsonrpc_send_bool_response(request, true);
+cleanup:
+	free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_raid_stop_rebuild", rpc_bdev_raid_stop_rebuild, SPDK_RPC_RUNTIME)
+
+/*
+ * brief:
+ * rpc_bdev_raid_get_rebuild_status function is the RPC for getting the rebuild
+ * progress of a raid5f bdev
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_get_rebuild_status(struct spdk_jsonrpc_request *request,
+				 const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid5f_name req = {};
+	struct spdk_json_write_ctx *w;
+	struct raid_bdev *raid_bdev;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid5f_name_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid5f_name_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	w = spdk_jsonrpc_begin_result(request);
+	spdk_json_write_object_begin(w);
+	raid5f_write_rebuild_status_json(raid_bdev, w);
+	spdk_json_write_object_end(w);
+	spdk_jsonrpc_end_result(request, w);
+cleanup:
+	free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_raid_get_rebuild_status", rpc_bdev_raid_get_rebuild_status,
+		  SPDK_RPC_RUNTIME)
+
+/*
+ * brief:
+ * rpc_bdev_raid_get_stripe_pool_stats function is the RPC for getting the stripe
+ * request pool sizes and the resource shortage counters of a raid5f bdev
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_get_stripe_pool_stats(struct spdk_jsonrpc_request *request,
+				    const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid5f_name req = {};
+	struct spdk_json_write_ctx *w;
+	struct raid_bdev *raid_bdev;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid5f_name_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid5f_name_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	w = spdk_jsonrpc_begin_result(request);
+	spdk_json_write_object_begin(w);
+	raid5f_write_stripe_pool_stats_json(raid_bdev, w);
+	spdk_json_write_object_end(w);
+	spdk_jsonrpc_end_result(request, w);
+cleanup:
+	free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_raid_get_stripe_pool_stats", rpc_bdev_raid_get_stripe_pool_stats,
+		  SPDK_RPC_RUNTIME)
+
+/*
+ * brief:
+ * rpc_bdev_raid_get_read_hedge_stats function is the RPC for getting the read
+ * latency of the base bdevs and the hedged read counters of a raid5f bdev
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_get_read_hedge_stats(struct spdk_jsonrpc_request *request,
+				   const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid5f_name req = {};
+	struct spdk_json_write_ctx *w;
+	struct raid_bdev *raid_bdev;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid5f_name_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid5f_name_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	w = spdk_jsonrpc_begin_result(request);
+	spdk_json_write_object_begin(w);
+	raid5f_write_read_hedge_stats_json(raid_bdev, w);
+	spdk_json_write_object_end(w);
+	spdk_jsonrpc_end_result(request, w);
+cleanup:
+	free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_raid_get_read_hedge_stats", rpc_bdev_raid_get_read_hedge_stats,
+		  SPDK_RPC_RUNTIME)
+
+/*
+ * brief:
+ * rpc_bdev_raid_get_write_intent_bitmap function is the RPC for getting the state
+ * of the write-intent bitmap of a raid5f bdev
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_get_write_intent_bitmap(struct spdk_jsonrpc_request *request,
+				      const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid5f_name req = {};
+	struct spdk_json_write_ctx *w;
+	struct raid_bdev *raid_bdev;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid5f_name_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid5f_name_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	w = spdk_jsonrpc_begin_result(request);
+	spdk_json_write_object_begin(w);
+	raid5f_write_wib_status_json(raid_bdev, w);
+	spdk_json_write_object_end(w);
+	spdk_jsonrpc_end_result(request, w);
+cleanup:
+	free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_raid_get_write_intent_bitmap", rpc_bdev_raid_get_write_intent_bitmap,
+		  SPDK_RPC_RUNTIME)
+
+/*
+ * brief:
+ * rpc_bdev_raid_get_chunk_checksum_stats function is the RPC for getting the state
+ * and the counters of the chunk checksum table of a raid5f bdev
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_get_chunk_checksum_stats(struct spdk_jsonrpc_request *request,
+				       const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid5f_name req = {};
+	struct spdk_json_write_ctx *w;
+	struct raid_bdev *raid_bdev;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid5f_name_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid5f_name_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	w = spdk_jsonrpc_begin_result(request);
+	spdk_json_write_object_begin(w);
+	raid5f_write_chunk_checksum_stats_json(raid_bdev, w);
+	spdk_json_write_object_end(w);
+	spdk_jsonrpc_end_result(request, w);
+cleanup:
+	free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_raid_get_chunk_checksum_stats", rpc_bdev_raid_get_chunk_checksum_stats,
+		  SPDK_RPC_RUNTIME)
+
+/*
+ * Input structure for RPC bdev_raid_get_mismatch_events
+ */
+struct rpc_bdev_raid_get_mismatch_events {
+	/* raid bdev name */
+	char *name;
+
+	/* Sequence number of the first event to return, the cursor of the previous call */
+	uint64_t cursor;
+
+	/* Maximum number of events to return */
+	uint32_t max_events;
+};
+
+/*
+ * Decoder object for RPC bdev_raid_get_mismatch_events
+ */
+static const struct spdk_json_object_decoder rpc_bdev_raid_get_mismatch_events_decoders[] = {
+	{"name", offsetof(struct rpc_bdev_raid_get_mismatch_events, name), spdk_json_decode_string},
+	{"cursor", offsetof(struct rpc_bdev_raid_get_mismatch_events, cursor), spdk_json_decode_uint64, true},
+	{"max_events", offsetof(struct rpc_bdev_raid_get_mismatch_events, max_events), spdk_json_decode_uint32, true},
+};
+
+/*
+ * brief:
+ * rpc_bdev_raid_get_mismatch_events function is the RPC for getting the parity
+ * mismatch events of a raid5f bdev. Passing the returned cursor to the next call
+ * returns only the events recorded since.
+ * params:
+ * request - pointer to json rpc request
+ * params - pointer to request parameters
+ * returns:
+ * none
+ */
+static void
+rpc_bdev_raid_get_mismatch_events(struct spdk_jsonrpc_request *request,
+				  const struct spdk_json_val *params)
+{
+	struct rpc_bdev_raid_get_mismatch_events req = {
+		.max_events = UINT32_MAX,
+	};
+	struct spdk_json_write_ctx *w;
+	struct raid_bdev *raid_bdev;
+
+	if (spdk_json_decode_object(params, rpc_bdev_raid_get_mismatch_events_decoders,
+				    SPDK_COUNTOF(rpc_bdev_raid_get_mismatch_events_decoders),
+				    &req)) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_PARSE_ERROR,
+						 "spdk_json_decode_object failed");
+		goto cleanup;
+	}
+
+	raid_bdev = rpc_raid5f_find_bdev(request, req.name);
+	if (raid_bdev == NULL) {
+		goto cleanup;
+	}
+
+	w = spdk_jsonrpc_begin_result(request);
+	spdk_json_write_object_begin(w);
+	raid5f_write_mismatch_events_json(raid_bdev, req.cursor, req.max_events, w);
+	spdk_json_write_object_end(w);
+	spdk_jsonrpc_end_result(request, w);
+cleanup:
+	free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_raid_get_mismatch_events", rpc_bdev_raid_get_mismatch_events,
+		  SPDK_RPC_RUNTIME)
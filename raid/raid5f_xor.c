@@ -0,0 +1,253 @@
+/*   SPDX-License-Identifier: BSD-3-Clause
+ *   Copyright (C) 2022 Intel Corporation.
+ *   All rights reserved.
+ */
+
+#include "raid5f_xor.h"
+
+#include "spdk/util.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+typedef void (*raid5f_xor_fn)(void *dest, void **srcs, uint32_t n_src, size_t len);
+
+struct raid5f_xor_impl {
+	const char *name;
+	raid5f_xor_fn fn;
+	bool (*supported)(void);
+};
+
+/* Xor the bytes from offset to len with plain 64-bit words */
+static void
+xor_gen_tail(void *dest, void **srcs, uint32_t n_src, size_t offset, size_t len)
+{
+	uint64_t v, s;
+	uint32_t i;
+
+	for (; offset + sizeof(v) <= len; offset += sizeof(v)) {
+		memcpy(&v, (uint8_t *)srcs[0] + offset, sizeof(v));
+		for (i = 1; i < n_src; i++) {
+			memcpy(&s, (uint8_t *)srcs[i] + offset, sizeof(s));
+			v ^= s;
+		}
+		memcpy((uint8_t *)dest + offset, &v, sizeof(v));
+	}
+
+	for (; offset < len; offset++) {
+		uint8_t b = ((uint8_t *)srcs[0])[offset];
+
+		for (i = 1; i < n_src; i++) {
+			b ^= ((uint8_t *)srcs[i])[offset];
+		}
+		((uint8_t *)dest)[offset] = b;
+	}
+}
+
+static void
+xor_gen_scalar(void *dest, void **srcs, uint32_t n_src, size_t len)
+{
+	xor_gen_tail(dest, srcs, n_src, 0, len);
+}
+
+static bool
+xor_supported_always(void)
+{
+	return true;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static void
+xor_gen_avx2(void *dest, void **srcs, uint32_t n_src, size_t len)
+{
+	__m256i v0, v1, v2, v3;
+	const uint8_t *s;
+	uint8_t *d;
+	size_t offset;
+	uint32_t i;
+
+	/* Four registers per source to keep several loads in flight */
+	for (offset = 0; offset + 4 * sizeof(__m256i) <= len; offset += 4 * sizeof(__m256i)) {
+		s = (const uint8_t *)srcs[0] + offset;
+		v0 = _mm256_loadu_si256((const __m256i *)s);
+		v1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+		v2 = _mm256_loadu_si256((const __m256i *)(s + 64));
+		v3 = _mm256_loadu_si256((const __m256i *)(s + 96));
+		for (i = 1; i < n_src; i++) {
+			s = (const uint8_t *)srcs[i] + offset;
+			v0 = _mm256_xor_si256(v0, _mm256_loadu_si256((const __m256i *)s));
+			v1 = _mm256_xor_si256(v1, _mm256_loadu_si256((const __m256i *)(s + 32)));
+			v2 = _mm256_xor_si256(v2, _mm256_loadu_si256((const __m256i *)(s + 64)));
+			v3 = _mm256_xor_si256(v3, _mm256_loadu_si256((const __m256i *)(s + 96)));
+		}
+		d = (uint8_t *)dest + offset;
+		_mm256_storeu_si256((__m256i *)d, v0);
+		_mm256_storeu_si256((__m256i *)(d + 32), v1);
+		_mm256_storeu_si256((__m256i *)(d + 64), v2);
+		_mm256_storeu_si256((__m256i *)(d + 96), v3);
+	}
+
+	for (; offset + sizeof(__m256i) <= len; offset += sizeof(__m256i)) {
+		v0 = _mm256_loadu_si256((const __m256i *)((const uint8_t *)srcs[0] + offset));
+		for (i = 1; i < n_src; i++) {
+			v0 = _mm256_xor_si256(v0, _mm256_loadu_si256((const __m256i *)((const uint8_t *)srcs[i] +
+					      offset)));
+		}
+		_mm256_storeu_si256((__m256i *)((uint8_t *)dest + offset), v0);
+	}
+
+	if (offset < len) {
+		xor_gen_tail(dest, srcs, n_src, offset, len);
+	}
+}
+
+static bool
+xor_supported_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx512f"))) static void
+xor_gen_avx512(void *dest, void **srcs, uint32_t n_src, size_t len)
+{
+	__m512i v0, v1, v2, v3;
+	const uint8_t *s;
+	uint8_t *d;
+	size_t offset;
+	uint32_t i;
+
+	for (offset = 0; offset + 4 * sizeof(__m512i) <= len; offset += 4 * sizeof(__m512i)) {
+		s = (const uint8_t *)srcs[0] + offset;
+		v0 = _mm512_loadu_si512(s);
+		v1 = _mm512_loadu_si512(s + 64);
+		v2 = _mm512_loadu_si512(s + 128);
+		v3 = _mm512_loadu_si512(s + 192);
+		for (i = 1; i < n_src; i++) {
+			s = (const uint8_t *)srcs[i] + offset;
+			v0 = _mm512_xor_si512(v0, _mm512_loadu_si512(s));
+			v1 = _mm512_xor_si512(v1, _mm512_loadu_si512(s + 64));
+			v2 = _mm512_xor_si512(v2, _mm512_loadu_si512(s + 128));
+			v3 = _mm512_xor_si512(v3, _mm512_loadu_si512(s + 192));
+		}
+		d = (uint8_t *)dest + offset;
+		_mm512_storeu_si512(d, v0);
+		_mm512_storeu_si512(d + 64, v1);
+		_mm512_storeu_si512(d + 128, v2);
+		_mm512_storeu_si512(d + 192, v3);
+	}
+
+	for (; offset + sizeof(__m512i) <= len; offset += sizeof(__m512i)) {
+		v0 = _mm512_loadu_si512((const uint8_t *)srcs[0] + offset);
+		for (i = 1; i < n_src; i++) {
+			v0 = _mm512_xor_si512(v0, _mm512_loadu_si512((const uint8_t *)srcs[i] + offset));
+		}
+		_mm512_storeu_si512((uint8_t *)dest + offset, v0);
+	}
+
+	if (offset < len) {
+		xor_gen_tail(dest, srcs, n_src, offset, len);
+	}
+}
+
+static bool
+xor_supported_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+#if defined(__aarch64__)
+static void
+xor_gen_neon(void *dest, void **srcs, uint32_t n_src, size_t len)
+{
+	uint8x16_t v0, v1, v2, v3;
+	const uint8_t *s;
+	uint8_t *d;
+	size_t offset;
+	uint32_t i;
+
+	for (offset = 0; offset + 4 * sizeof(uint8x16_t) <= len; offset += 4 * sizeof(uint8x16_t)) {
+		s = (const uint8_t *)srcs[0] + offset;
+		v0 = vld1q_u8(s);
+		v1 = vld1q_u8(s + 16);
+		v2 = vld1q_u8(s + 32);
+		v3 = vld1q_u8(s + 48);
+		for (i = 1; i < n_src; i++) {
+			s = (const uint8_t *)srcs[i] + offset;
+			v0 = veorq_u8(v0, vld1q_u8(s));
+			v1 = veorq_u8(v1, vld1q_u8(s + 16));
+			v2 = veorq_u8(v2, vld1q_u8(s + 32));
+			v3 = veorq_u8(v3, vld1q_u8(s + 48));
+		}
+		d = (uint8_t *)dest + offset;
+		vst1q_u8(d, v0);
+		vst1q_u8(d + 16, v1);
+		vst1q_u8(d + 32, v2);
+		vst1q_u8(d + 48, v3);
+	}
+
+	if (offset < len) {
+		xor_gen_tail(dest, srcs, n_src, offset, len);
+	}
+}
+#endif
+
+/* Ordered from the least to the most preferred */
+static const struct raid5f_xor_impl g_xor_impls[] = {
+	{ "scalar", xor_gen_scalar, xor_supported_always },
+#if defined(__x86_64__)
+	{ "avx2", xor_gen_avx2, xor_supported_avx2 },
+	{ "avx512", xor_gen_avx512, xor_supported_avx512 },
+#elif defined(__aarch64__)
+	{ "neon", xor_gen_neon, xor_supported_always },
+#endif
+};
+
+static const struct raid5f_xor_impl *g_xor_impl = &g_xor_impls[0];
+
+__attribute__((constructor)) static void
+raid5f_xor_select_impl(void)
+{
+	size_t i;
+
+	for (i = 0; i < SPDK_COUNTOF(g_xor_impls); i++) {
+		if (g_xor_impls[i].supported()) {
+			g_xor_impl = &g_xor_impls[i];
+		}
+	}
+}
+
+void
+raid5f_xor_gen(void *dest, void **srcs, uint32_t n_src, size_t len)
+{
+	assert(n_src > 0);
+
+	g_xor_impl->fn(dest, srcs, n_src, len);
+}
+
+const char *
+raid5f_xor_get_impl(void)
+{
+	return g_xor_impl->name;
+}
+
+int
+raid5f_xor_set_impl(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < SPDK_COUNTOF(g_xor_impls); i++) {
+		if (strcmp(g_xor_impls[i].name, name) == 0) {
+			if (!g_xor_impls[i].supported()) {
+				return -ENOTSUP;
+			}
+			g_xor_impl = &g_xor_impls[i];
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
@@ -0,0 +1,28 @@
+/*   SPDX-License-Identifier: BSD-3-Clause
+ *   Copyright (C) 2022 Intel Corporation.
+ *   All rights reserved.
+ */
+
+#ifndef SPDK_RAID5F_XOR_H
+#define SPDK_RAID5F_XOR_H
+
+#include "spdk/stdinc.h"
+
+/*
+ * Calculate the xor of n_src source buffers of len bytes into dest. The buffers
+ * don't need to be aligned. dest may be one of the sources, other overlaps are
+ * not allowed. n_src must be at least 1.
+ */
+void raid5f_xor_gen(void *dest, void **srcs, uint32_t n_src, size_t len);
+
+/* Get the name of the xor implementation currently in use */
+const char *raid5f_xor_get_impl(void);
+
+/*
+ * Select the xor implementation by name ("scalar", "avx2", "avx512", "neon").
+ * The best one supported by the CPU is selected by default.
+ * Returns -EINVAL if the name is unknown and -ENOTSUP if the CPU lacks support.
+ */
+int raid5f_xor_set_impl(const char *name);
+
+#endif /* SPDK_RAID5F_XOR_H */
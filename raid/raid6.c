@@ -0,0 +1,941 @@
+/*   SPDX-License-Identifier: BSD-3-Clause
+ *   Copyright (C) 2022 Intel Corporation.
+ *   All rights reserved.
+ */
+
+#include "bdev_raid.h"
+#include "raid5f_xor.h"
+#include "raid6_gf.h"
+
+#include "spdk/env.h"
+#include "spdk/likely.h"
+#include "spdk/log.h"
+#include "spdk/util.h"
+
+/* Maximum concurrent full stripe writes or stripe reads per io channel */
+#define RAID6_MAX_STRIPES 32
+
+struct raid6_chunk {
+	/* Corresponds to base_bdev index */
+	uint8_t index;
+
+	/* Set if the chunk couldn't be read */
+	bool failed;
+
+	/* Strip buffer holding the chunk for reads and the parity for writes */
+	void *buf;
+	struct iovec buf_iov;
+
+	/* Part of the raid_io payload mapped to this chunk */
+	struct iovec *iovs;
+	int iovcnt;
+	int iovcnt_max;
+
+	/* Part of buf holding the payload of a read */
+	size_t buf_offset;
+	size_t buf_len;
+
+	/* Stripe request this chunk belongs to */
+	struct raid6_stripe_request *stripe_req;
+};
+
+struct raid6_stripe_request {
+	/* The associated raid6_io_channel */
+	struct raid6_io_channel *r6ch;
+
+	/* The stripe's I/O */
+	struct raid_bdev_io *raid_io;
+
+	/* The stripe's index in the raid array */
+	uint64_t stripe_index;
+
+	/* Range of the chunks accessed, in blocks from the start of the strip */
+	uint64_t row_offset;
+	uint64_t row_blocks;
+
+	/* The stripe's parity chunks */
+	struct raid6_chunk *p_chunk;
+	struct raid6_chunk *q_chunk;
+
+	/* Data chunks in the order of their Q coefficients */
+	struct raid6_chunk **data_chunks;
+
+	/* Data chunks holding the payload of a read */
+	uint8_t first_data_idx;
+	uint8_t last_data_idx;
+
+	/* Index of the next chunk to submit */
+	uint8_t submitted;
+
+	/* Number of chunks which couldn't be read */
+	uint8_t failed;
+
+	/* Set when the stripe is read again after its syndromes didn't match */
+	bool reread;
+
+	/* Base bdev I/Os not completed yet, plus one while submitting */
+	uint32_t remaining;
+
+	enum spdk_bdev_io_status status;
+
+	/* Syndromes calculated from the data chunks of a read */
+	void *p_buf;
+	void *q_buf;
+
+	TAILQ_ENTRY(raid6_stripe_request) link;
+
+	/* Array of chunks corresponding to base_bdevs */
+	struct raid6_chunk chunks[0];
+};
+
+struct raid6_info {
+	/* The parent raid bdev */
+	struct raid_bdev *raid_bdev;
+
+	/* Number of data blocks in a stripe (without parity) */
+	uint64_t stripe_blocks;
+
+	/* Number of stripes on this array */
+	uint64_t total_stripes;
+
+	/* Size of a strip in bytes */
+	size_t strip_len;
+
+	/* Alignment for buffer allocation */
+	size_t buf_alignment;
+
+	/* Strip of zeroes in place of the failed data chunks when generating syndromes */
+	void *zero_buf;
+};
+
+struct raid6_io_channel {
+	/* All available stripe requests on this channel */
+	TAILQ_HEAD(, raid6_stripe_request) free_stripe_requests;
+
+	/* Iterator over the data and parity chunks of a full stripe write */
+	struct spdk_ioviter *chunk_iov_iters;
+	struct iovec **chunk_iovs;
+	size_t *chunk_iovcnt;
+
+	/* Current segment of each chunk */
+	void **chunk_buffers;
+};
+
+static inline uint8_t
+raid6_stripe_data_chunks_num(const struct raid_bdev *raid_bdev)
+{
+	return raid_bdev->num_base_bdevs - 2;
+}
+
+/* P rotates like the raid5f parity and Q follows it, wrapping around to the first base bdev */
+static inline uint8_t
+raid6_stripe_p_chunk_index(const struct raid_bdev *raid_bdev, uint64_t stripe_index)
+{
+	return raid_bdev->num_base_bdevs - 1 - stripe_index % raid_bdev->num_base_bdevs;
+}
+
+static inline uint8_t
+raid6_stripe_q_chunk_index(const struct raid_bdev *raid_bdev, uint64_t stripe_index)
+{
+	return (raid6_stripe_p_chunk_index(raid_bdev, stripe_index) + 1) % raid_bdev->num_base_bdevs;
+}
+
+static inline uint8_t
+raid6_stripe_data_chunk_index(const struct raid_bdev *raid_bdev, uint64_t stripe_index,
+			      uint8_t data_idx)
+{
+	uint8_t p_idx = raid6_stripe_p_chunk_index(raid_bdev, stripe_index);
+	uint8_t q_idx = raid6_stripe_q_chunk_index(raid_bdev, stripe_index);
+	uint8_t idx = data_idx;
+
+	if (idx >= spdk_min(p_idx, q_idx)) {
+		idx++;
+	}
+	if (idx >= spdk_max(p_idx, q_idx)) {
+		idx++;
+	}
+
+	return idx;
+}
+
+/* Map len bytes of the raid_io payload starting at byte offset to the chunk */
+static int
+raid6_chunk_map_payload(struct raid6_chunk *chunk, const struct iovec *iovs, int iovcnt,
+			size_t offset, size_t len)
+{
+	int i;
+
+	chunk->iovcnt = 0;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		size_t n;
+
+		if (offset >= iovs[i].iov_len) {
+			offset -= iovs[i].iov_len;
+			continue;
+		}
+
+		if (chunk->iovcnt == chunk->iovcnt_max) {
+			int new_max = chunk->iovcnt_max ? chunk->iovcnt_max * 2 : 4;
+			struct iovec *new_iovs;
+
+			new_iovs = realloc(chunk->iovs, new_max * sizeof(*new_iovs));
+			if (!new_iovs) {
+				return -ENOMEM;
+			}
+			chunk->iovs = new_iovs;
+			chunk->iovcnt_max = new_max;
+		}
+
+		n = spdk_min(len, iovs[i].iov_len - offset);
+		chunk->iovs[chunk->iovcnt].iov_base = iovs[i].iov_base + offset;
+		chunk->iovs[chunk->iovcnt].iov_len = n;
+		chunk->iovcnt++;
+		len -= n;
+		offset = 0;
+	}
+
+	return len == 0 ? 0 : -EINVAL;
+}
+
+static struct raid6_stripe_request *
+raid6_stripe_request_get(struct raid_bdev_io *raid_io, uint64_t stripe_index)
+{
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid6_io_channel *r6ch = spdk_io_channel_get_ctx(raid_io->raid_ch->module_channel);
+	struct raid6_stripe_request *stripe_req;
+	uint8_t i;
+
+	stripe_req = TAILQ_FIRST(&r6ch->free_stripe_requests);
+	if (!stripe_req) {
+		return NULL;
+	}
+	TAILQ_REMOVE(&r6ch->free_stripe_requests, stripe_req, link);
+
+	stripe_req->raid_io = raid_io;
+	stripe_req->stripe_index = stripe_index;
+	stripe_req->p_chunk = &stripe_req->chunks[raid6_stripe_p_chunk_index(raid_bdev, stripe_index)];
+	stripe_req->q_chunk = &stripe_req->chunks[raid6_stripe_q_chunk_index(raid_bdev, stripe_index)];
+	for (i = 0; i < raid6_stripe_data_chunks_num(raid_bdev); i++) {
+		stripe_req->data_chunks[i] = &stripe_req->chunks[raid6_stripe_data_chunk_index(raid_bdev,
+					     stripe_index, i)];
+	}
+	stripe_req->submitted = 0;
+	stripe_req->reread = false;
+	stripe_req->status = SPDK_BDEV_IO_STATUS_SUCCESS;
+
+	raid_io->module_private = stripe_req;
+
+	return stripe_req;
+}
+
+static void
+raid6_stripe_request_complete(struct raid6_stripe_request *stripe_req,
+			      enum spdk_bdev_io_status status)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+
+	TAILQ_INSERT_HEAD(&stripe_req->r6ch->free_stripe_requests, stripe_req, link);
+
+	raid_bdev_io_complete(raid_io, status);
+}
+
+/* Generate the syndromes of the data chunks read, taking the failed ones as zeroes */
+static void
+raid6_stripe_request_gen_pq(struct raid6_stripe_request *stripe_req)
+{
+	struct raid_bdev *raid_bdev = stripe_req->raid_io->raid_bdev;
+	struct raid6_info *r6info = raid_bdev->module_private;
+	void **buffers = stripe_req->r6ch->chunk_buffers;
+	uint8_t n_data = raid6_stripe_data_chunks_num(raid_bdev);
+	uint8_t i;
+
+	for (i = 0; i < n_data; i++) {
+		buffers[i] = stripe_req->data_chunks[i]->failed ? r6info->zero_buf :
+			     stripe_req->data_chunks[i]->buf;
+	}
+
+	raid6_gf_gen_pq(stripe_req->p_buf, stripe_req->q_buf, buffers, n_data,
+			stripe_req->row_blocks * raid_bdev->bdev.blocklen);
+}
+
+/* Generate the parity of a full stripe write from the payload into the parity chunks */
+static void
+raid6_stripe_request_gen_parity(struct raid6_stripe_request *stripe_req)
+{
+	struct raid_bdev *raid_bdev = stripe_req->raid_io->raid_bdev;
+	struct raid6_io_channel *r6ch = stripe_req->r6ch;
+	uint8_t n_data = raid6_stripe_data_chunks_num(raid_bdev);
+	size_t len;
+	uint8_t i;
+
+	for (i = 0; i < n_data; i++) {
+		r6ch->chunk_iovs[i] = stripe_req->data_chunks[i]->iovs;
+		r6ch->chunk_iovcnt[i] = stripe_req->data_chunks[i]->iovcnt;
+	}
+	r6ch->chunk_iovs[n_data] = &stripe_req->p_chunk->buf_iov;
+	r6ch->chunk_iovcnt[n_data] = 1;
+	r6ch->chunk_iovs[n_data + 1] = &stripe_req->q_chunk->buf_iov;
+	r6ch->chunk_iovcnt[n_data + 1] = 1;
+
+	len = spdk_ioviter_firstv(r6ch->chunk_iov_iters, n_data + 2, r6ch->chunk_iovs,
+				  r6ch->chunk_iovcnt, r6ch->chunk_buffers);
+	while (len > 0) {
+		raid6_gf_gen_pq(r6ch->chunk_buffers[n_data], r6ch->chunk_buffers[n_data + 1],
+				r6ch->chunk_buffers, n_data, len);
+		len = spdk_ioviter_nextv(r6ch->chunk_iov_iters, r6ch->chunk_buffers);
+	}
+}
+
+/*
+ * Find the chunk which explains the syndromes (the difference between the calculated and
+ * the read parity) of every byte. An error e in data chunk z gives the syndromes e and
+ * g^z * e, an error in a parity chunk gives only its own syndrome. Returns NULL if more
+ * than one chunk is corrupt.
+ */
+static struct raid6_chunk *
+raid6_stripe_locate_corruption(struct raid6_stripe_request *stripe_req, size_t len)
+{
+	const uint8_t *sp = stripe_req->p_buf;
+	const uint8_t *sq = stripe_req->q_buf;
+	uint8_t n_data = raid6_stripe_data_chunks_num(stripe_req->raid_io->raid_bdev);
+	struct raid6_chunk *bad = NULL;
+	struct raid6_chunk *chunk;
+	uint32_t z;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (sp[i] == 0 && sq[i] == 0) {
+			continue;
+		}
+
+		if (sq[i] == 0) {
+			chunk = stripe_req->p_chunk;
+		} else if (sp[i] == 0) {
+			chunk = stripe_req->q_chunk;
+		} else {
+			z = (raid6_gf_log(sq[i]) + 255 - raid6_gf_log(sp[i])) % 255;
+			if (z >= n_data) {
+				return NULL;
+			}
+			chunk = stripe_req->data_chunks[z];
+		}
+
+		if (bad != NULL && bad != chunk) {
+			return NULL;
+		}
+		bad = chunk;
+	}
+
+	return bad;
+}
+
+/*
+ * Check the data chunks of a read against both parity chunks. A mismatch is first read
+ * again, as it can come from a full stripe write racing with the read. If it persists,
+ * the corrupt chunk is located from the syndromes and corrected in the returned data.
+ */
+static int
+raid6_stripe_verify(struct raid6_stripe_request *stripe_req)
+{
+	struct raid_bdev *raid_bdev = stripe_req->raid_io->raid_bdev;
+	size_t len = stripe_req->row_blocks * raid_bdev->bdev.blocklen;
+	struct raid6_chunk *bad;
+	void *srcs[2];
+
+	raid6_stripe_request_gen_pq(stripe_req);
+
+	if (memcmp(stripe_req->p_buf, stripe_req->p_chunk->buf, len) == 0 &&
+	    memcmp(stripe_req->q_buf, stripe_req->q_chunk->buf, len) == 0) {
+		return 0;
+	}
+
+	if (!stripe_req->reread) {
+		stripe_req->reread = true;
+		return -EAGAIN;
+	}
+
+	srcs[0] = stripe_req->p_buf;
+	srcs[1] = stripe_req->p_chunk->buf;
+	raid5f_xor_gen(stripe_req->p_buf, srcs, 2, len);
+	srcs[0] = stripe_req->q_buf;
+	srcs[1] = stripe_req->q_chunk->buf;
+	raid5f_xor_gen(stripe_req->q_buf, srcs, 2, len);
+
+	bad = raid6_stripe_locate_corruption(stripe_req, len);
+	if (bad == NULL) {
+		SPDK_ERRLOG("raid bdev %s: stripe %" PRIu64 " has more than one corrupt chunk\n",
+			    raid_bdev->bdev.name, stripe_req->stripe_index);
+		return -EIO;
+	}
+
+	/* The P syndrome is the error pattern of a corrupt data chunk */
+	if (bad != stripe_req->p_chunk && bad != stripe_req->q_chunk) {
+		srcs[0] = bad->buf;
+		srcs[1] = stripe_req->p_buf;
+		raid5f_xor_gen(bad->buf, srcs, 2, len);
+	}
+
+	SPDK_ERRLOG("raid bdev %s: corrected corrupt chunk of base bdev %s in stripe %" PRIu64 "\n",
+		    raid_bdev->bdev.name, raid_bdev->base_bdev_info[bad->index].name,
+		    stripe_req->stripe_index);
+
+	return 0;
+}
+
+/* Reconstruct the failed data chunks of a read from the parity */
+static void
+raid6_stripe_reconstruct(struct raid6_stripe_request *stripe_req)
+{
+	struct raid_bdev *raid_bdev = stripe_req->raid_io->raid_bdev;
+	size_t len = stripe_req->row_blocks * raid_bdev->bdev.blocklen;
+	struct raid6_chunk *x = NULL, *y = NULL;
+	uint8_t x_idx = 0, y_idx = 0;
+	uint8_t den;
+	void *srcs[2];
+	uint8_t i;
+
+	for (i = 0; i < raid6_stripe_data_chunks_num(raid_bdev); i++) {
+		if (!stripe_req->data_chunks[i]->failed) {
+			continue;
+		}
+		if (x == NULL) {
+			x = stripe_req->data_chunks[i];
+			x_idx = i;
+		} else {
+			y = stripe_req->data_chunks[i];
+			y_idx = i;
+		}
+	}
+
+	/* Only parity is missing */
+	if (x == NULL) {
+		return;
+	}
+
+	raid6_stripe_request_gen_pq(stripe_req);
+
+	if (y == NULL && !stripe_req->p_chunk->failed) {
+		/* D_x = P + P' */
+		srcs[0] = stripe_req->p_buf;
+		srcs[1] = stripe_req->p_chunk->buf;
+		raid5f_xor_gen(x->buf, srcs, 2, len);
+	} else if (y == NULL) {
+		/* D_x = (Q + Q') / g^x */
+		srcs[0] = stripe_req->q_buf;
+		srcs[1] = stripe_req->q_chunk->buf;
+		raid5f_xor_gen(stripe_req->q_buf, srcs, 2, len);
+		raid6_gf_mul(x->buf, stripe_req->q_buf, raid6_gf_inv(raid6_gf_exp(x_idx)), len, false);
+	} else {
+		/*
+		 * With Pxy = P + P' = D_x + D_y and Qxy = Q + Q' = g^x * D_x + g^y * D_y:
+		 * D_x = (g^y * Pxy + Qxy) / (g^x + g^y) and D_y = Pxy + D_x
+		 */
+		srcs[0] = stripe_req->p_buf;
+		srcs[1] = stripe_req->p_chunk->buf;
+		raid5f_xor_gen(stripe_req->p_buf, srcs, 2, len);
+		srcs[0] = stripe_req->q_buf;
+		srcs[1] = stripe_req->q_chunk->buf;
+		raid5f_xor_gen(stripe_req->q_buf, srcs, 2, len);
+
+		den = raid6_gf_inv(raid6_gf_exp(x_idx) ^ raid6_gf_exp(y_idx));
+		raid6_gf_mul(x->buf, stripe_req->p_buf, raid6_gf_mul_byte(raid6_gf_exp(y_idx), den), len,
+			     false);
+		raid6_gf_mul(x->buf, stripe_req->q_buf, den, len, true);
+
+		srcs[0] = stripe_req->p_buf;
+		srcs[1] = x->buf;
+		raid5f_xor_gen(y->buf, srcs, 2, len);
+	}
+}
+
+static void raid6_stripe_request_submit_chunks(struct raid6_stripe_request *stripe_req);
+
+static void
+raid6_stripe_read_done(struct raid6_stripe_request *stripe_req)
+{
+	struct raid6_chunk *chunk;
+	uint8_t i;
+	int ret = 0;
+
+	if (stripe_req->failed > 2) {
+		raid6_stripe_request_complete(stripe_req, SPDK_BDEV_IO_STATUS_FAILED);
+		return;
+	}
+
+	/* Parity can be checked only with all chunks, otherwise it's needed to reconstruct */
+	if (stripe_req->failed == 0) {
+		ret = raid6_stripe_verify(stripe_req);
+		if (ret == -EAGAIN) {
+			stripe_req->submitted = 0;
+			raid6_stripe_request_submit_chunks(stripe_req);
+			return;
+		}
+	} else {
+		raid6_stripe_reconstruct(stripe_req);
+	}
+
+	if (ret == 0) {
+		for (i = stripe_req->first_data_idx; i <= stripe_req->last_data_idx; i++) {
+			chunk = stripe_req->data_chunks[i];
+			spdk_copy_buf_to_iovs(chunk->iovs, chunk->iovcnt, chunk->buf + chunk->buf_offset,
+					      chunk->buf_len);
+		}
+	}
+
+	raid6_stripe_request_complete(stripe_req, ret == 0 ? SPDK_BDEV_IO_STATUS_SUCCESS :
+				      SPDK_BDEV_IO_STATUS_FAILED);
+}
+
+static void
+raid6_stripe_request_put(struct raid6_stripe_request *stripe_req)
+{
+	assert(stripe_req->remaining > 0);
+	if (--stripe_req->remaining > 0) {
+		return;
+	}
+
+	if (stripe_req->raid_io->type == SPDK_BDEV_IO_TYPE_READ) {
+		raid6_stripe_read_done(stripe_req);
+	} else {
+		raid6_stripe_request_complete(stripe_req, stripe_req->status);
+	}
+}
+
+static void
+raid6_chunk_done(struct raid6_chunk *chunk, bool success)
+{
+	struct raid6_stripe_request *stripe_req = chunk->stripe_req;
+
+	if (!success) {
+		if (stripe_req->raid_io->type == SPDK_BDEV_IO_TYPE_READ) {
+			/* Reconstructed from the other chunks if possible */
+			chunk->failed = true;
+			stripe_req->failed++;
+		} else {
+			stripe_req->status = SPDK_BDEV_IO_STATUS_FAILED;
+		}
+	}
+
+	raid6_stripe_request_put(stripe_req);
+}
+
+static void
+raid6_chunk_complete_bdev_io(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg)
+{
+	struct raid6_chunk *chunk = cb_arg;
+
+	spdk_bdev_free_io(bdev_io);
+
+	raid6_chunk_done(chunk, success);
+}
+
+static void
+_raid6_stripe_request_submit_chunks(void *_raid_io)
+{
+	struct raid_bdev_io *raid_io = _raid_io;
+
+	raid6_stripe_request_submit_chunks(raid_io->module_private);
+}
+
+static void
+raid6_stripe_request_submit_chunks(struct raid6_stripe_request *stripe_req)
+{
+	struct raid_bdev_io *raid_io = stripe_req->raid_io;
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	uint64_t base_offset_blocks = (stripe_req->stripe_index << raid_bdev->strip_size_shift) +
+				      stripe_req->row_offset;
+
+	if (stripe_req->submitted == 0) {
+		stripe_req->remaining = raid_bdev->num_base_bdevs + 1;
+		stripe_req->failed = 0;
+	}
+
+	while (stripe_req->submitted < raid_bdev->num_base_bdevs) {
+		struct raid6_chunk *chunk = &stripe_req->chunks[stripe_req->submitted];
+		struct raid_base_bdev_info *base_info = &raid_bdev->base_bdev_info[chunk->index];
+		struct spdk_io_channel *base_ch = raid_io->raid_ch->base_channel[chunk->index];
+		int ret;
+
+		chunk->failed = false;
+
+		if (base_ch == NULL) {
+			ret = -ENODEV;
+		} else if (raid_io->type == SPDK_BDEV_IO_TYPE_READ) {
+			ret = raid_bdev_readv_blocks_ext(base_info, base_ch, &chunk->buf_iov, 1,
+							 base_offset_blocks, stripe_req->row_blocks,
+							 raid6_chunk_complete_bdev_io, chunk, NULL);
+		} else if (chunk == stripe_req->p_chunk || chunk == stripe_req->q_chunk) {
+			ret = raid_bdev_writev_blocks_ext(base_info, base_ch, &chunk->buf_iov, 1,
+							  base_offset_blocks, stripe_req->row_blocks,
+							  raid6_chunk_complete_bdev_io, chunk, NULL);
+		} else {
+			ret = raid_bdev_writev_blocks_ext(base_info, base_ch, chunk->iovs, chunk->iovcnt,
+							  base_offset_blocks, stripe_req->row_blocks,
+							  raid6_chunk_complete_bdev_io, chunk, NULL);
+		}
+
+		if (spdk_unlikely(ret == -ENOMEM)) {
+			raid_bdev_queue_io_wait(raid_io, spdk_bdev_desc_get_bdev(base_info->desc),
+						base_ch, _raid6_stripe_request_submit_chunks);
+			return;
+		}
+
+		stripe_req->submitted++;
+
+		/* A missing base bdev's chunk is skipped by writes and reconstructed by reads */
+		if (spdk_unlikely(ret != 0)) {
+			raid6_chunk_done(chunk, base_ch == NULL &&
+					 raid_io->type == SPDK_BDEV_IO_TYPE_WRITE);
+		}
+	}
+
+	raid6_stripe_request_put(stripe_req);
+}
+
+static int
+raid6_submit_write_request(struct raid_bdev_io *raid_io, uint64_t stripe_index)
+{
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	struct raid6_info *r6info = raid_bdev->module_private;
+	struct raid6_stripe_request *stripe_req;
+	uint8_t i;
+	int ret;
+
+	stripe_req = raid6_stripe_request_get(raid_io, stripe_index);
+	if (!stripe_req) {
+		return -ENOMEM;
+	}
+
+	stripe_req->row_offset = 0;
+	stripe_req->row_blocks = raid_bdev->strip_size;
+
+	for (i = 0; i < raid6_stripe_data_chunks_num(raid_bdev); i++) {
+		ret = raid6_chunk_map_payload(stripe_req->data_chunks[i], raid_io->iovs, raid_io->iovcnt,
+					      i * r6info->strip_len, r6info->strip_len);
+		if (ret) {
+			TAILQ_INSERT_HEAD(&stripe_req->r6ch->free_stripe_requests, stripe_req, link);
+			return ret;
+		}
+	}
+
+	stripe_req->p_chunk->buf_iov.iov_len = r6info->strip_len;
+	stripe_req->q_chunk->buf_iov.iov_len = r6info->strip_len;
+
+	raid6_stripe_request_gen_parity(stripe_req);
+
+	raid6_stripe_request_submit_chunks(stripe_req);
+
+	return 0;
+}
+
+/*
+ * Every read gets the same range of all chunks of the stripe, to verify the data against
+ * both parity chunks or to reconstruct the chunks of missing base bdevs. A read spanning
+ * more than one data chunk covers the whole strip.
+ */
+static int
+raid6_submit_read_request(struct raid_bdev_io *raid_io, uint64_t stripe_index,
+			  uint64_t stripe_offset)
+{
+	struct raid_bdev *raid_bdev = raid_io->raid_bdev;
+	uint32_t blocklen = raid_bdev->bdev.blocklen;
+	uint64_t end_offset = stripe_offset + raid_io->num_blocks;
+	struct raid6_stripe_request *stripe_req;
+	struct raid6_chunk *chunk;
+	uint64_t chunk_start, chunk_end;
+	uint8_t i;
+	int ret;
+
+	stripe_req = raid6_stripe_request_get(raid_io, stripe_index);
+	if (!stripe_req) {
+		return -ENOMEM;
+	}
+
+	stripe_req->first_data_idx = stripe_offset >> raid_bdev->strip_size_shift;
+	stripe_req->last_data_idx = (end_offset - 1) >> raid_bdev->strip_size_shift;
+
+	if (stripe_req->first_data_idx == stripe_req->last_data_idx) {
+		stripe_req->row_offset = stripe_offset & (raid_bdev->strip_size - 1);
+		stripe_req->row_blocks = raid_io->num_blocks;
+	} else {
+		stripe_req->row_offset = 0;
+		stripe_req->row_blocks = raid_bdev->strip_size;
+	}
+
+	for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+		stripe_req->chunks[i].buf_iov.iov_len = stripe_req->row_blocks * blocklen;
+	}
+
+	for (i = stripe_req->first_data_idx; i <= stripe_req->last_data_idx; i++) {
+		chunk = stripe_req->data_chunks[i];
+		chunk_start = spdk_max(stripe_offset, (uint64_t)i << raid_bdev->strip_size_shift);
+		chunk_end = spdk_min(end_offset, (uint64_t)(i + 1) << raid_bdev->strip_size_shift);
+
+		chunk->buf_offset = (chunk_start - ((uint64_t)i << raid_bdev->strip_size_shift) -
+				     stripe_req->row_offset) * blocklen;
+		chunk->buf_len = (chunk_end - chunk_start) * blocklen;
+
+		ret = raid6_chunk_map_payload(chunk, raid_io->iovs, raid_io->iovcnt,
+					      (chunk_start - stripe_offset) * blocklen, chunk->buf_len);
+		if (ret) {
+			TAILQ_INSERT_HEAD(&stripe_req->r6ch->free_stripe_requests, stripe_req, link);
+			return ret;
+		}
+	}
+
+	raid6_stripe_request_submit_chunks(stripe_req);
+
+	return 0;
+}
+
+static void
+raid6_submit_rw_request(struct raid_bdev_io *raid_io)
+{
+	struct raid6_info *r6info = raid_io->raid_bdev->module_private;
+	uint64_t stripe_index = raid_io->offset_blocks / r6info->stripe_blocks;
+	uint64_t stripe_offset = raid_io->offset_blocks % r6info->stripe_blocks;
+	int ret;
+
+	switch (raid_io->type) {
+	case SPDK_BDEV_IO_TYPE_READ:
+		assert(stripe_offset + raid_io->num_blocks <= r6info->stripe_blocks);
+		ret = raid6_submit_read_request(raid_io, stripe_index, stripe_offset);
+		break;
+	case SPDK_BDEV_IO_TYPE_WRITE:
+		assert(stripe_offset == 0);
+		assert(raid_io->num_blocks == r6info->stripe_blocks);
+		ret = raid6_submit_write_request(raid_io, stripe_index);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	if (spdk_unlikely(ret)) {
+		raid_bdev_io_complete(raid_io, ret == -ENOMEM ? SPDK_BDEV_IO_STATUS_NOMEM :
+				      SPDK_BDEV_IO_STATUS_FAILED);
+	}
+}
+
+static void
+raid6_stripe_request_free(struct raid6_stripe_request *stripe_req, uint8_t num_chunks)
+{
+	uint8_t i;
+
+	for (i = 0; i < num_chunks; i++) {
+		spdk_dma_free(stripe_req->chunks[i].buf);
+		free(stripe_req->chunks[i].iovs);
+	}
+
+	spdk_dma_free(stripe_req->p_buf);
+	spdk_dma_free(stripe_req->q_buf);
+	free(stripe_req->data_chunks);
+	free(stripe_req);
+}
+
+static struct raid6_stripe_request *
+raid6_stripe_request_alloc(struct raid6_io_channel *r6ch, struct raid6_info *r6info)
+{
+	struct raid_bdev *raid_bdev = r6info->raid_bdev;
+	struct raid6_stripe_request *stripe_req;
+	struct raid6_chunk *chunk;
+	uint8_t i;
+
+	stripe_req = calloc(1, sizeof(*stripe_req) +
+			    sizeof(struct raid6_chunk) * raid_bdev->num_base_bdevs);
+	if (!stripe_req) {
+		return NULL;
+	}
+
+	stripe_req->r6ch = r6ch;
+
+	stripe_req->data_chunks = calloc(raid6_stripe_data_chunks_num(raid_bdev),
+					 sizeof(*stripe_req->data_chunks));
+	if (!stripe_req->data_chunks) {
+		goto err;
+	}
+
+	for (i = 0; i < raid_bdev->num_base_bdevs; i++) {
+		chunk = &stripe_req->chunks[i];
+		chunk->index = i;
+		chunk->stripe_req = stripe_req;
+		chunk->buf = spdk_dma_malloc(r6info->strip_len, r6info->buf_alignment, NULL);
+		if (!chunk->buf) {
+			goto err;
+		}
+		chunk->buf_iov.iov_base = chunk->buf;
+	}
+
+	stripe_req->p_buf = spdk_dma_malloc(r6info->strip_len, r6info->buf_alignment, NULL);
+	stripe_req->q_buf = spdk_dma_malloc(r6info->strip_len, r6info->buf_alignment, NULL);
+	if (!stripe_req->p_buf || !stripe_req->q_buf) {
+		goto err;
+	}
+
+	return stripe_req;
+err:
+	raid6_stripe_request_free(stripe_req, raid_bdev->num_base_bdevs);
+	return NULL;
+}
+
+static void
+raid6_ioch_destroy(void *io_device, void *ctx_buf)
+{
+	struct raid6_io_channel *r6ch = ctx_buf;
+	struct raid6_info *r6info = io_device;
+	struct raid6_stripe_request *stripe_req;
+
+	while ((stripe_req = TAILQ_FIRST(&r6ch->free_stripe_requests))) {
+		TAILQ_REMOVE(&r6ch->free_stripe_requests, stripe_req, link);
+		raid6_stripe_request_free(stripe_req, r6info->raid_bdev->num_base_bdevs);
+	}
+
+	free(r6ch->chunk_iov_iters);
+	free(r6ch->chunk_iovs);
+	free(r6ch->chunk_iovcnt);
+	free(r6ch->chunk_buffers);
+}
+
+static int
+raid6_ioch_create(void *io_device, void *ctx_buf)
+{
+	struct raid6_io_channel *r6ch = ctx_buf;
+	struct raid6_info *r6info = io_device;
+	uint8_t num_chunks = r6info->raid_bdev->num_base_bdevs;
+	struct raid6_stripe_request *stripe_req;
+	int i;
+
+	TAILQ_INIT(&r6ch->free_stripe_requests);
+
+	for (i = 0; i < RAID6_MAX_STRIPES; i++) {
+		stripe_req = raid6_stripe_request_alloc(r6ch, r6info);
+		if (!stripe_req) {
+			goto err;
+		}
+
+		TAILQ_INSERT_HEAD(&r6ch->free_stripe_requests, stripe_req, link);
+	}
+
+	r6ch->chunk_iov_iters = malloc(SPDK_IOVITER_SIZE(num_chunks));
+	r6ch->chunk_iovs = calloc(num_chunks, sizeof(*r6ch->chunk_iovs));
+	r6ch->chunk_iovcnt = calloc(num_chunks, sizeof(*r6ch->chunk_iovcnt));
+	r6ch->chunk_buffers = calloc(num_chunks, sizeof(*r6ch->chunk_buffers));
+	if (!r6ch->chunk_iov_iters || !r6ch->chunk_iovs || !r6ch->chunk_iovcnt ||
+	    !r6ch->chunk_buffers) {
+		goto err;
+	}
+
+	return 0;
+err:
+	SPDK_ERRLOG("Failed to initialize io channel\n");
+	raid6_ioch_destroy(r6info, r6ch);
+	return -ENOMEM;
+}
+
+static int
+raid6_start(struct raid_bdev *raid_bdev)
+{
+	uint64_t min_blockcnt = UINT64_MAX;
+	uint64_t base_bdev_data_size;
+	struct raid_base_bdev_info *base_info;
+	struct raid6_info *r6info;
+	size_t alignment = 0;
+
+	/* The parity covers whole blocks, so only interleaved metadata is protected */
+	if (raid_bdev->bdev.md_len != 0 && !raid_bdev->bdev.md_interleave) {
+		SPDK_ERRLOG("Separate metadata is not supported by raid6\n");
+		return -EINVAL;
+	}
+
+	r6info = calloc(1, sizeof(*r6info));
+	if (!r6info) {
+		SPDK_ERRLOG("Failed to allocate r6info\n");
+		return -ENOMEM;
+	}
+	r6info->raid_bdev = raid_bdev;
+
+	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
+		struct spdk_bdev *base_bdev = spdk_bdev_desc_get_bdev(base_info->desc);
+
+		min_blockcnt = spdk_min(min_blockcnt, base_info->data_size);
+		alignment = spdk_max(alignment, spdk_bdev_get_buf_align(base_bdev));
+	}
+
+	base_bdev_data_size = (min_blockcnt / raid_bdev->strip_size) * raid_bdev->strip_size;
+
+	RAID_FOR_EACH_BASE_BDEV(raid_bdev, base_info) {
+		base_info->data_size = base_bdev_data_size;
+	}
+
+	r6info->total_stripes = min_blockcnt / raid_bdev->strip_size;
+	r6info->stripe_blocks = raid_bdev->strip_size * raid6_stripe_data_chunks_num(raid_bdev);
+	r6info->strip_len = raid_bdev->strip_size * raid_bdev->bdev.blocklen;
+	r6info->buf_alignment = alignment;
+
+	r6info->zero_buf = spdk_dma_zmalloc(r6info->strip_len, alignment, NULL);
+	if (!r6info->zero_buf) {
+		SPDK_ERRLOG("Failed to allocate zero buffer\n");
+		free(r6info);
+		return -ENOMEM;
+	}
+
+	/*
+	 * Only full stripes are written, so the parity is always generated from the payload.
+	 * Reads are split on stripe boundaries.
+	 */
+	raid_bdev->bdev.blockcnt = r6info->stripe_blocks * r6info->total_stripes;
+	raid_bdev->bdev.optimal_io_boundary = r6info->stripe_blocks;
+	raid_bdev->bdev.split_on_optimal_io_boundary = true;
+	raid_bdev->bdev.write_unit_size = r6info->stripe_blocks;
+	raid_bdev->bdev.split_on_write_unit = true;
+
+	raid_bdev->module_private = r6info;
+
+	spdk_io_device_register(r6info, raid6_ioch_create, raid6_ioch_destroy,
+				sizeof(struct raid6_io_channel), NULL);
+
+	return 0;
+}
+
+static void
+raid6_io_device_unregister_done(void *io_device)
+{
+	struct raid6_info *r6info = io_device;
+
+	raid_bdev_module_stop_done(r6info->raid_bdev);
+
+	spdk_dma_free(r6info->zero_buf);
+	free(r6info);
+}
+
+static bool
+raid6_stop(struct raid_bdev *raid_bdev)
+{
+	struct raid6_info *r6info = raid_bdev->module_private;
+
+	spdk_io_device_unregister(r6info, raid6_io_device_unregister_done);
+
+	return false;
+}
+
+static struct spdk_io_channel *
+raid6_get_io_channel(struct raid_bdev *raid_bdev)
+{
+	struct raid6_info *r6info = raid_bdev->module_private;
+
+	return spdk_get_io_channel(r6info);
+}
+
+static struct raid_bdev_module g_raid6_module = {
+	.level = RAID6,
+	.base_bdevs_min = 4,
+	.base_bdevs_constraint = {CONSTRAINT_MAX_BASE_BDEVS_REMOVED, 2},
+	.start = raid6_start,
+	.stop = raid6_stop,
+	.submit_rw_request = raid6_submit_rw_request,
+	.get_io_channel = raid6_get_io_channel,
+};
+RAID_MODULE_REGISTER(&g_raid6_module)
+
+SPDK_LOG_REGISTER_COMPONENT(bdev_raid6)
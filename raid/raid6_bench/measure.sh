@@ -0,0 +1,7 @@
+#!/bin/bash
+# Measure the raid6 GF kernels per strip size and data chunk count.
+
+make clean
+make
+
+./raid6_bench -m 0x1 "$@"
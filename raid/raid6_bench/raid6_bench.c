@@ -0,0 +1,173 @@
+/*   SPDX-License-Identifier: BSD-3-Clause
+ *   Copyright (C) 2022 Intel Corporation.
+ *   All rights reserved.
+ */
+
+/*
+ * Measure the raid6 GF(2^8) kernels for the strip sizes and data chunk counts raid6 uses.
+ * gen_pq calculates P and Q of one strip of every data chunk, like a full stripe write.
+ * mul multiplies one strip by a constant into an accumulator, which is the step of the
+ * reconstruction of a data chunk from Q.
+ */
+
+#include "spdk/stdinc.h"
+#include "spdk/env.h"
+#include "spdk/event.h"
+#include "spdk/log.h"
+#include "spdk/string.h"
+#include "spdk/util.h"
+
+#include "raid6_gf.h"
+
+#define RAID6_BENCH_MAX_DATA 16
+
+static const size_t g_strip_sizes[] = { 4096, 8192, 16384, 32768, 65536, 131072, 262144 };
+static const uint32_t g_data_counts[] = { 2, 4, 6, 10, 14 };
+static const char *g_impls[] = { "scalar", "avx2", "avx512", "neon" };
+
+static uint64_t g_bytes_per_test = 1024ULL * 1024 * 1024;
+
+struct raid6_bench_ctx {
+	void *data[RAID6_BENCH_MAX_DATA];
+	void *p;
+	void *q;
+	int status;
+};
+
+static struct raid6_bench_ctx g_ctx;
+
+static void
+raid6_bench_usage(void)
+{
+	printf(" -B <bytes>                source bytes processed per test (default 1 GiB)\n");
+}
+
+static int
+raid6_bench_parse_arg(int ch, char *arg)
+{
+	long long val = spdk_strtoll(arg, 10);
+
+	if (val <= 0) {
+		fprintf(stderr, "Invalid value %s\n", arg);
+		return -EINVAL;
+	}
+
+	switch (ch) {
+	case 'B':
+		g_bytes_per_test = val;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void
+raid6_bench_print(size_t strip, uint32_t n_data, const char *op, const char *impl,
+		  uint64_t iters, uint64_t bytes_per_iter, uint64_t ticks)
+{
+	double sec = (double)ticks / spdk_get_ticks_hz();
+
+	printf("%8zu %6u %-7s %-8s %10.2f %10.2f\n", strip, n_data, op, impl,
+	       sec * 1000000 / iters,
+	       (double)iters * bytes_per_iter / sec / (1024 * 1024 * 1024));
+}
+
+static void
+raid6_bench_run(size_t strip, uint32_t n_data)
+{
+	uint64_t iters = spdk_max(g_bytes_per_test / (strip * n_data), 1000);
+	uint64_t start, i;
+	size_t j;
+
+	for (j = 0; j < SPDK_COUNTOF(g_impls); j++) {
+		if (raid6_gf_set_impl(g_impls[j]) != 0) {
+			continue;
+		}
+
+		start = spdk_get_ticks();
+		for (i = 0; i < iters; i++) {
+			raid6_gf_gen_pq(g_ctx.p, g_ctx.q, g_ctx.data, n_data, strip);
+		}
+		raid6_bench_print(strip, n_data, "gen_pq", g_impls[j], iters, strip * n_data,
+				  spdk_get_ticks() - start);
+
+		/* The same amount of source bytes, multiplied strip by strip */
+		start = spdk_get_ticks();
+		for (i = 0; i < iters * n_data; i++) {
+			raid6_gf_mul(g_ctx.q, g_ctx.data[i % n_data], raid6_gf_exp(i % n_data), strip,
+				     true);
+		}
+		raid6_bench_print(strip, n_data, "mul", g_impls[j], iters, strip * n_data,
+				  spdk_get_ticks() - start);
+	}
+}
+
+static void
+raid6_bench_start(void *arg)
+{
+	size_t max_strip = g_strip_sizes[SPDK_COUNTOF(g_strip_sizes) - 1];
+	const char *default_impl = raid6_gf_get_impl();
+	size_t s, d;
+	int i;
+
+	for (i = 0; i < RAID6_BENCH_MAX_DATA; i++) {
+		g_ctx.data[i] = spdk_dma_malloc(max_strip, 4096, NULL);
+		if (!g_ctx.data[i]) {
+			goto nomem;
+		}
+		memset(g_ctx.data[i], i + 1, max_strip);
+	}
+
+	g_ctx.p = spdk_dma_zmalloc(max_strip, 4096, NULL);
+	g_ctx.q = spdk_dma_zmalloc(max_strip, 4096, NULL);
+	if (!g_ctx.p || !g_ctx.q) {
+		goto nomem;
+	}
+
+	printf("Default GF kernel: %s\n", default_impl);
+	printf("%8s %6s %-7s %-8s %10s %10s\n", "strip", "n_data", "op", "impl", "lat_us", "GiB/s");
+
+	for (s = 0; s < SPDK_COUNTOF(g_strip_sizes); s++) {
+		for (d = 0; d < SPDK_COUNTOF(g_data_counts); d++) {
+			raid6_bench_run(g_strip_sizes[s], g_data_counts[d]);
+		}
+	}
+	goto out;
+nomem:
+	SPDK_ERRLOG("Failed to allocate buffers\n");
+	g_ctx.status = -ENOMEM;
+out:
+	for (i = 0; i < RAID6_BENCH_MAX_DATA; i++) {
+		spdk_dma_free(g_ctx.data[i]);
+	}
+	spdk_dma_free(g_ctx.p);
+	spdk_dma_free(g_ctx.q);
+
+	spdk_app_stop(g_ctx.status);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct spdk_app_opts opts = {};
+	int rc;
+
+	spdk_app_opts_init(&opts, sizeof(opts));
+	opts.name = "raid6_bench";
+
+	if ((rc = spdk_app_parse_args(argc, argv, &opts, "B:", NULL, raid6_bench_parse_arg,
+				      raid6_bench_usage)) != SPDK_APP_PARSE_ARGS_SUCCESS) {
+		exit(rc);
+	}
+
+	rc = spdk_app_start(&opts, raid6_bench_start, NULL);
+	if (rc) {
+		SPDK_ERRLOG("ERROR running raid6_bench\n");
+	}
+
+	spdk_app_fini();
+
+	return rc;
+}
@@ -0,0 +1,455 @@
+/*   SPDX-License-Identifier: BSD-3-Clause
+ *   Copyright (C) 2022 Intel Corporation.
+ *   All rights reserved.
+ */
+
+#include "raid6_gf.h"
+
+#include "spdk/util.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define GF_POLY 0x1d
+
+typedef void (*raid6_gf_gen_pq_fn)(void *p, void *q, void **data, uint32_t n_data, size_t len);
+typedef void (*raid6_gf_mul_fn)(void *dest, const void *src, uint8_t coef, size_t len,
+				 bool accumulate);
+
+struct raid6_gf_impl {
+	const char *name;
+	raid6_gf_gen_pq_fn gen_pq;
+	raid6_gf_mul_fn mul;
+	bool (*supported)(void);
+};
+
+/* Powers of the generator, doubled so that the sum of two logarithms can index it */
+static uint8_t g_gf_exp[2 * 255];
+static uint8_t g_gf_log[256];
+
+/*
+ * Products of each coefficient with the low (first 16 bytes) and the high (last 16 bytes)
+ * nibble of a byte. Xor of both is the product with the whole byte. These are the
+ * tables for the byte shuffle instructions of the vector kernels.
+ */
+static uint8_t g_gf_mul_nib[256][32];
+
+static inline uint8_t
+gf_mul2(uint8_t v)
+{
+	return (v << 1) ^ ((v & 0x80) ? GF_POLY : 0);
+}
+
+/* Multiply each byte of a 64-bit word by 2 */
+static inline uint64_t
+gf_mul2_u64(uint64_t v)
+{
+	uint64_t mask = v & 0x8080808080808080ULL;
+
+	/* 0xff in the bytes with the top bit set */
+	mask = (mask << 1) - (mask >> 7);
+
+	return ((v << 1) & 0xfefefefefefefefeULL) ^ (mask & 0x1d1d1d1d1d1d1d1dULL);
+}
+
+/* Generate the syndromes of the bytes from offset to len with plain 64-bit words */
+static void
+gf_gen_pq_tail(void *p, void *q, void **data, uint32_t n_data, size_t offset, size_t len)
+{
+	uint64_t vp, vq, d;
+	int i;
+
+	/* Horner's scheme: q = ((d[n-1] * g + d[n-2]) * g + ...) * g + d[0] */
+	for (; offset + sizeof(vp) <= len; offset += sizeof(vp)) {
+		memcpy(&vp, (uint8_t *)data[n_data - 1] + offset, sizeof(vp));
+		vq = vp;
+		for (i = (int)n_data - 2; i >= 0; i--) {
+			memcpy(&d, (uint8_t *)data[i] + offset, sizeof(d));
+			vp ^= d;
+			vq = gf_mul2_u64(vq) ^ d;
+		}
+		memcpy((uint8_t *)p + offset, &vp, sizeof(vp));
+		memcpy((uint8_t *)q + offset, &vq, sizeof(vq));
+	}
+
+	for (; offset < len; offset++) {
+		uint8_t bp, bq;
+
+		bp = bq = ((uint8_t *)data[n_data - 1])[offset];
+		for (i = (int)n_data - 2; i >= 0; i--) {
+			uint8_t b = ((uint8_t *)data[i])[offset];
+
+			bp ^= b;
+			bq = gf_mul2(bq) ^ b;
+		}
+		((uint8_t *)p)[offset] = bp;
+		((uint8_t *)q)[offset] = bq;
+	}
+}
+
+static void
+gf_mul_tail(void *dest, const void *src, uint8_t coef, size_t offset, size_t len,
+	    bool accumulate)
+{
+	const uint8_t *tbl = g_gf_mul_nib[coef];
+
+	for (; offset < len; offset++) {
+		uint8_t s = ((const uint8_t *)src)[offset];
+		uint8_t v = tbl[s & 0xf] ^ tbl[16 + (s >> 4)];
+
+		((uint8_t *)dest)[offset] = accumulate ? ((uint8_t *)dest)[offset] ^ v : v;
+	}
+}
+
+static void
+gf_gen_pq_scalar(void *p, void *q, void **data, uint32_t n_data, size_t len)
+{
+	gf_gen_pq_tail(p, q, data, n_data, 0, len);
+}
+
+static void
+gf_mul_scalar(void *dest, const void *src, uint8_t coef, size_t len, bool accumulate)
+{
+	gf_mul_tail(dest, src, coef, 0, len, accumulate);
+}
+
+static bool
+gf_supported_always(void)
+{
+	return true;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static inline __m256i
+gf_mul2_avx2(__m256i v, __m256i poly)
+{
+	/* Bytes with the top bit set compare lower than zero */
+	__m256i mask = _mm256_cmpgt_epi8(_mm256_setzero_si256(), v);
+
+	return _mm256_xor_si256(_mm256_add_epi8(v, v), _mm256_and_si256(mask, poly));
+}
+
+__attribute__((target("avx2"))) static void
+gf_gen_pq_avx2(void *p, void *q, void **data, uint32_t n_data, size_t len)
+{
+	const __m256i poly = _mm256_set1_epi8(GF_POLY);
+	__m256i p0, p1, q0, q1, d0, d1;
+	const uint8_t *s;
+	size_t offset;
+	int i;
+
+	for (offset = 0; offset + 2 * sizeof(__m256i) <= len; offset += 2 * sizeof(__m256i)) {
+		s = (const uint8_t *)data[n_data - 1] + offset;
+		p0 = q0 = _mm256_loadu_si256((const __m256i *)s);
+		p1 = q1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+		for (i = (int)n_data - 2; i >= 0; i--) {
+			s = (const uint8_t *)data[i] + offset;
+			d0 = _mm256_loadu_si256((const __m256i *)s);
+			d1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+			p0 = _mm256_xor_si256(p0, d0);
+			p1 = _mm256_xor_si256(p1, d1);
+			q0 = _mm256_xor_si256(gf_mul2_avx2(q0, poly), d0);
+			q1 = _mm256_xor_si256(gf_mul2_avx2(q1, poly), d1);
+		}
+		_mm256_storeu_si256((__m256i *)((uint8_t *)p + offset), p0);
+		_mm256_storeu_si256((__m256i *)((uint8_t *)p + offset + 32), p1);
+		_mm256_storeu_si256((__m256i *)((uint8_t *)q + offset), q0);
+		_mm256_storeu_si256((__m256i *)((uint8_t *)q + offset + 32), q1);
+	}
+
+	if (offset < len) {
+		gf_gen_pq_tail(p, q, data, n_data, offset, len);
+	}
+}
+
+__attribute__((target("avx2"))) static void
+gf_mul_avx2(void *dest, const void *src, uint8_t coef, size_t len, bool accumulate)
+{
+	const __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)
+			    g_gf_mul_nib[coef]));
+	const __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)
+			    (g_gf_mul_nib[coef] + 16)));
+	const __m256i nib = _mm256_set1_epi8(0x0f);
+	__m256i s, v;
+	uint8_t *d;
+	size_t offset;
+
+	/* Look up the products of both nibbles of each byte with PSHUFB */
+	for (offset = 0; offset + sizeof(__m256i) <= len; offset += sizeof(__m256i)) {
+		s = _mm256_loadu_si256((const __m256i *)((const uint8_t *)src + offset));
+		d = (uint8_t *)dest + offset;
+		v = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(s, nib)),
+				     _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4),
+						     nib)));
+		if (accumulate) {
+			v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i *)d));
+		}
+		_mm256_storeu_si256((__m256i *)d, v);
+	}
+
+	if (offset < len) {
+		gf_mul_tail(dest, src, coef, offset, len, accumulate);
+	}
+}
+
+static bool
+gf_supported_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i
+gf_mul2_avx512(__m512i v, __m512i poly)
+{
+	__mmask64 mask = _mm512_movepi8_mask(v);
+
+	return _mm512_xor_si512(_mm512_add_epi8(v, v), _mm512_maskz_mov_epi8(mask, poly));
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+gf_gen_pq_avx512(void *p, void *q, void **data, uint32_t n_data, size_t len)
+{
+	const __m512i poly = _mm512_set1_epi8(GF_POLY);
+	__m512i p0, p1, q0, q1, d0, d1;
+	const uint8_t *s;
+	size_t offset;
+	int i;
+
+	for (offset = 0; offset + 2 * sizeof(__m512i) <= len; offset += 2 * sizeof(__m512i)) {
+		s = (const uint8_t *)data[n_data - 1] + offset;
+		p0 = q0 = _mm512_loadu_si512(s);
+		p1 = q1 = _mm512_loadu_si512(s + 64);
+		for (i = (int)n_data - 2; i >= 0; i--) {
+			s = (const uint8_t *)data[i] + offset;
+			d0 = _mm512_loadu_si512(s);
+			d1 = _mm512_loadu_si512(s + 64);
+			p0 = _mm512_xor_si512(p0, d0);
+			p1 = _mm512_xor_si512(p1, d1);
+			q0 = _mm512_xor_si512(gf_mul2_avx512(q0, poly), d0);
+			q1 = _mm512_xor_si512(gf_mul2_avx512(q1, poly), d1);
+		}
+		_mm512_storeu_si512((uint8_t *)p + offset, p0);
+		_mm512_storeu_si512((uint8_t *)p + offset + 64, p1);
+		_mm512_storeu_si512((uint8_t *)q + offset, q0);
+		_mm512_storeu_si512((uint8_t *)q + offset + 64, q1);
+	}
+
+	if (offset < len) {
+		gf_gen_pq_tail(p, q, data, n_data, offset, len);
+	}
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+gf_mul_avx512(void *dest, const void *src, uint8_t coef, size_t len, bool accumulate)
+{
+	const __m512i tlo = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)
+			    g_gf_mul_nib[coef]));
+	const __m512i thi = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)
+			    (g_gf_mul_nib[coef] + 16)));
+	const __m512i nib = _mm512_set1_epi8(0x0f);
+	__m512i s, v;
+	size_t offset;
+
+	for (offset = 0; offset + sizeof(__m512i) <= len; offset += sizeof(__m512i)) {
+		s = _mm512_loadu_si512((const uint8_t *)src + offset);
+		v = _mm512_xor_si512(_mm512_shuffle_epi8(tlo, _mm512_and_si512(s, nib)),
+				     _mm512_shuffle_epi8(thi, _mm512_and_si512(_mm512_srli_epi64(s, 4),
+						     nib)));
+		if (accumulate) {
+			v = _mm512_xor_si512(v, _mm512_loadu_si512((uint8_t *)dest + offset));
+		}
+		_mm512_storeu_si512((uint8_t *)dest + offset, v);
+	}
+
+	if (offset < len) {
+		gf_mul_tail(dest, src, coef, offset, len, accumulate);
+	}
+}
+
+static bool
+gf_supported_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+#if defined(__aarch64__)
+static inline uint8x16_t
+gf_mul2_neon(uint8x16_t v, uint8x16_t poly)
+{
+	/* Arithmetic shift spreads the top bit over the byte */
+	uint8x16_t mask = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(v), 7));
+
+	return veorq_u8(vshlq_n_u8(v, 1), vandq_u8(mask, poly));
+}
+
+static void
+gf_gen_pq_neon(void *p, void *q, void **data, uint32_t n_data, size_t len)
+{
+	const uint8x16_t poly = vdupq_n_u8(GF_POLY);
+	uint8x16_t p0, p1, q0, q1, d0, d1;
+	const uint8_t *s;
+	size_t offset;
+	int i;
+
+	for (offset = 0; offset + 2 * sizeof(uint8x16_t) <= len; offset += 2 * sizeof(uint8x16_t)) {
+		s = (const uint8_t *)data[n_data - 1] + offset;
+		p0 = q0 = vld1q_u8(s);
+		p1 = q1 = vld1q_u8(s + 16);
+		for (i = (int)n_data - 2; i >= 0; i--) {
+			s = (const uint8_t *)data[i] + offset;
+			d0 = vld1q_u8(s);
+			d1 = vld1q_u8(s + 16);
+			p0 = veorq_u8(p0, d0);
+			p1 = veorq_u8(p1, d1);
+			q0 = veorq_u8(gf_mul2_neon(q0, poly), d0);
+			q1 = veorq_u8(gf_mul2_neon(q1, poly), d1);
+		}
+		vst1q_u8((uint8_t *)p + offset, p0);
+		vst1q_u8((uint8_t *)p + offset + 16, p1);
+		vst1q_u8((uint8_t *)q + offset, q0);
+		vst1q_u8((uint8_t *)q + offset + 16, q1);
+	}
+
+	if (offset < len) {
+		gf_gen_pq_tail(p, q, data, n_data, offset, len);
+	}
+}
+
+static void
+gf_mul_neon(void *dest, const void *src, uint8_t coef, size_t len, bool accumulate)
+{
+	const uint8x16_t tlo = vld1q_u8(g_gf_mul_nib[coef]);
+	const uint8x16_t thi = vld1q_u8(g_gf_mul_nib[coef] + 16);
+	const uint8x16_t nib = vdupq_n_u8(0x0f);
+	uint8x16_t s, v;
+	size_t offset;
+
+	/* Look up the products of both nibbles of each byte with TBL */
+	for (offset = 0; offset + sizeof(uint8x16_t) <= len; offset += sizeof(uint8x16_t)) {
+		s = vld1q_u8((const uint8_t *)src + offset);
+		v = veorq_u8(vqtbl1q_u8(tlo, vandq_u8(s, nib)), vqtbl1q_u8(thi, vshrq_n_u8(s, 4)));
+		if (accumulate) {
+			v = veorq_u8(v, vld1q_u8((uint8_t *)dest + offset));
+		}
+		vst1q_u8((uint8_t *)dest + offset, v);
+	}
+
+	if (offset < len) {
+		gf_mul_tail(dest, src, coef, offset, len, accumulate);
+	}
+}
+#endif
+
+/* Ordered from the least to the most preferred */
+static const struct raid6_gf_impl g_gf_impls[] = {
+	{ "scalar", gf_gen_pq_scalar, gf_mul_scalar, gf_supported_always },
+#if defined(__x86_64__)
+	{ "avx2", gf_gen_pq_avx2, gf_mul_avx2, gf_supported_avx2 },
+	{ "avx512", gf_gen_pq_avx512, gf_mul_avx512, gf_supported_avx512 },
+#elif defined(__aarch64__)
+	{ "neon", gf_gen_pq_neon, gf_mul_neon, gf_supported_always },
+#endif
+};
+
+static const struct raid6_gf_impl *g_gf_impl = &g_gf_impls[0];
+
+__attribute__((constructor)) static void
+raid6_gf_init(void)
+{
+	uint8_t x = 1;
+	uint32_t i, c;
+
+	for (i = 0; i < 255; i++) {
+		g_gf_exp[i] = x;
+		g_gf_exp[i + 255] = x;
+		g_gf_log[x] = i;
+		x = gf_mul2(x);
+	}
+
+	for (c = 0; c < 256; c++) {
+		for (i = 0; i < 16; i++) {
+			g_gf_mul_nib[c][i] = raid6_gf_mul_byte(c, i);
+			g_gf_mul_nib[c][16 + i] = raid6_gf_mul_byte(c, i << 4);
+		}
+	}
+
+	for (i = 0; i < SPDK_COUNTOF(g_gf_impls); i++) {
+		if (g_gf_impls[i].supported()) {
+			g_gf_impl = &g_gf_impls[i];
+		}
+	}
+}
+
+void
+raid6_gf_gen_pq(void *p, void *q, void **data, uint32_t n_data, size_t len)
+{
+	assert(n_data > 0);
+
+	g_gf_impl->gen_pq(p, q, data, n_data, len);
+}
+
+void
+raid6_gf_mul(void *dest, const void *src, uint8_t coef, size_t len, bool accumulate)
+{
+	g_gf_impl->mul(dest, src, coef, len, accumulate);
+}
+
+uint8_t
+raid6_gf_mul_byte(uint8_t a, uint8_t b)
+{
+	if (a == 0 || b == 0) {
+		return 0;
+	}
+
+	return g_gf_exp[g_gf_log[a] + g_gf_log[b]];
+}
+
+uint8_t
+raid6_gf_exp(uint32_t n)
+{
+	return g_gf_exp[n % 255];
+}
+
+uint8_t
+raid6_gf_log(uint8_t a)
+{
+	assert(a != 0);
+
+	return g_gf_log[a];
+}
+
+uint8_t
+raid6_gf_inv(uint8_t a)
+{
+	assert(a != 0);
+
+	return g_gf_exp[255 - g_gf_log[a]];
+}
+
+const char *
+raid6_gf_get_impl(void)
+{
+	return g_gf_impl->name;
+}
+
+int
+raid6_gf_set_impl(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < SPDK_COUNTOF(g_gf_impls); i++) {
+		if (strcmp(g_gf_impls[i].name, name) == 0) {
+			if (!g_gf_impls[i].supported()) {
+				return -ENOTSUP;
+			}
+			g_gf_impl = &g_gf_impls[i];
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
@@ -0,0 +1,51 @@
+/*   SPDX-License-Identifier: BSD-3-Clause
+ *   Copyright (C) 2022 Intel Corporation.
+ *   All rights reserved.
+ */
+
+#ifndef SPDK_RAID6_GF_H
+#define SPDK_RAID6_GF_H
+
+#include "spdk/stdinc.h"
+
+/*
+ * Arithmetic over GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11d) and
+ * the generator 2, as used for the Q syndrome of RAID6.
+ */
+
+/*
+ * Calculate the P (xor) and Q (sum of g^i * data[i]) syndromes of n_data buffers of
+ * len bytes. The buffers don't need to be aligned and must not overlap. n_data must
+ * be at least 1.
+ */
+void raid6_gf_gen_pq(void *p, void *q, void **data, uint32_t n_data, size_t len);
+
+/*
+ * Multiply len bytes of src by coef into dest. With accumulate, the product is
+ * xor-ed into dest instead of replacing it. dest may be src.
+ */
+void raid6_gf_mul(void *dest, const void *src, uint8_t coef, size_t len, bool accumulate);
+
+/* Multiply two field elements */
+uint8_t raid6_gf_mul_byte(uint8_t a, uint8_t b);
+
+/* Get the generator raised to the power of n */
+uint8_t raid6_gf_exp(uint32_t n);
+
+/* Get the discrete logarithm of a, which must not be 0 */
+uint8_t raid6_gf_log(uint8_t a);
+
+/* Get the multiplicative inverse of a, which must not be 0 */
+uint8_t raid6_gf_inv(uint8_t a);
+
+/* Get the name of the GF implementation currently in use */
+const char *raid6_gf_get_impl(void);
+
+/*
+ * Select the GF implementation by name ("scalar", "avx2", "avx512", "neon").
+ * The best one supported by the CPU is selected by default.
+ * Returns -EINVAL if the name is unknown and -ENOTSUP if the CPU lacks support.
+ */
+int raid6_gf_set_impl(const char *name);
+
+#endif /* SPDK_RAID6_GF_H */
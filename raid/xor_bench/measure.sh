@@ -0,0 +1,9 @@
+#!/bin/bash
+# Compare the raid5f xor kernels with the accel framework per strip size and
+# source count. Pass an accel config with -c to measure a hardware accel module.
+
+make clean
+make
+
+./xor_bench -m 0x1 -Q 1 "$@"
+./xor_bench -m 0x1 -Q 8 "$@"
@@ -0,0 +1,268 @@
+/*   SPDX-License-Identifier: BSD-3-Clause
+ *   Copyright (C) 2022 Intel Corporation.
+ *   All rights reserved.
+ */
+
+/*
+ * Compare the raid5f in-module xor kernels with spdk_accel_submit_xor for the
+ * strip sizes and source counts raid5f uses. Each xor is one strip of every data
+ * chunk of a stripe, like a full stripe write.
+ */
+
+#include "spdk/stdinc.h"
+#include "spdk/accel.h"
+#include "spdk/env.h"
+#include "spdk/event.h"
+#include "spdk/log.h"
+#include "spdk/string.h"
+#include "spdk/thread.h"
+#include "spdk/util.h"
+
+#include "raid5f_xor.h"
+
+#define XOR_BENCH_MAX_SRC 16
+
+static const size_t g_strip_sizes[] = { 4096, 8192, 16384, 32768, 65536, 131072, 262144 };
+static const uint32_t g_src_counts[] = { 2, 3, 4, 7, 11 };
+static const char *g_impls[] = { "scalar", "avx2", "avx512", "neon" };
+
+static uint64_t g_bytes_per_test = 1024ULL * 1024 * 1024;
+static int g_queue_depth = 1;
+
+struct xor_bench_ctx {
+	struct spdk_io_channel *accel_ch;
+	void *srcs[XOR_BENCH_MAX_SRC];
+	void *dest;
+
+	/* Current test */
+	size_t strip_idx;
+	size_t src_idx;
+	uint64_t iters;
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t start_tsc;
+	int status;
+};
+
+static struct xor_bench_ctx g_ctx;
+
+static void
+xor_bench_usage(void)
+{
+	printf(" -B <bytes>                source bytes xor-ed per test (default 1 GiB)\n");
+	printf(" -Q <depth>                accel queue depth (default 1)\n");
+}
+
+static int
+xor_bench_parse_arg(int ch, char *arg)
+{
+	long long val = spdk_strtoll(arg, 10);
+
+	if (val <= 0) {
+		fprintf(stderr, "Invalid value %s\n", arg);
+		return -EINVAL;
+	}
+
+	switch (ch) {
+	case 'B':
+		g_bytes_per_test = val;
+		break;
+	case 'Q':
+		g_queue_depth = val;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void
+xor_bench_print(const char *impl, uint64_t ticks)
+{
+	size_t strip = g_strip_sizes[g_ctx.strip_idx];
+	uint32_t n_src = g_src_counts[g_ctx.src_idx];
+	double sec = (double)ticks / spdk_get_ticks_hz();
+
+	printf("%8zu %6u %-8s %10.2f %10.2f\n", strip, n_src, impl,
+	       sec * 1000000 / g_ctx.iters,
+	       (double)g_ctx.iters * strip * n_src / sec / (1024 * 1024 * 1024));
+}
+
+static void
+xor_bench_run_inline(void)
+{
+	size_t strip = g_strip_sizes[g_ctx.strip_idx];
+	uint32_t n_src = g_src_counts[g_ctx.src_idx];
+	uint64_t start, i;
+	size_t j;
+
+	for (j = 0; j < SPDK_COUNTOF(g_impls); j++) {
+		if (raid5f_xor_set_impl(g_impls[j]) != 0) {
+			continue;
+		}
+
+		start = spdk_get_ticks();
+		for (i = 0; i < g_ctx.iters; i++) {
+			raid5f_xor_gen(g_ctx.dest, g_ctx.srcs, n_src, strip);
+		}
+		xor_bench_print(g_impls[j], spdk_get_ticks() - start);
+	}
+}
+
+static void xor_bench_next(void *arg);
+static void xor_bench_accel_submit(void);
+
+static void
+xor_bench_accel_cb(void *arg, int status)
+{
+	if (status != 0) {
+		g_ctx.status = status;
+	}
+
+	g_ctx.completed++;
+	if (g_ctx.completed == g_ctx.iters) {
+		xor_bench_print("accel", spdk_get_ticks() - g_ctx.start_tsc);
+		spdk_thread_send_msg(spdk_get_thread(), xor_bench_next, NULL);
+		return;
+	}
+
+	xor_bench_accel_submit();
+}
+
+static void
+xor_bench_accel_submit(void)
+{
+	size_t strip = g_strip_sizes[g_ctx.strip_idx];
+	uint32_t n_src = g_src_counts[g_ctx.src_idx];
+	int rc;
+
+	if (g_ctx.submitted == g_ctx.iters) {
+		return;
+	}
+
+	rc = spdk_accel_submit_xor(g_ctx.accel_ch, g_ctx.dest, g_ctx.srcs, n_src, strip,
+				   xor_bench_accel_cb, NULL);
+	if (rc != 0) {
+		/* Completions will resubmit */
+		if (rc != -ENOMEM || g_ctx.submitted == g_ctx.completed) {
+			SPDK_ERRLOG("Failed to submit xor: %s\n", spdk_strerror(-rc));
+			g_ctx.status = rc;
+			spdk_app_stop(rc);
+		}
+		return;
+	}
+
+	g_ctx.submitted++;
+}
+
+static void
+xor_bench_run_accel(void)
+{
+	int i;
+
+	g_ctx.submitted = 0;
+	g_ctx.completed = 0;
+	g_ctx.start_tsc = spdk_get_ticks();
+
+	for (i = 0; i < g_queue_depth; i++) {
+		xor_bench_accel_submit();
+	}
+}
+
+static void
+xor_bench_finish(void)
+{
+	int i;
+
+	spdk_put_io_channel(g_ctx.accel_ch);
+	for (i = 0; i < XOR_BENCH_MAX_SRC; i++) {
+		spdk_dma_free(g_ctx.srcs[i]);
+	}
+	spdk_dma_free(g_ctx.dest);
+
+	spdk_app_stop(g_ctx.status);
+}
+
+/* Run the inline kernels and then accel for each strip size and source count */
+static void
+xor_bench_next(void *arg)
+{
+	bool first = arg != NULL;
+
+	if (!first && ++g_ctx.src_idx == SPDK_COUNTOF(g_src_counts)) {
+		g_ctx.src_idx = 0;
+		if (++g_ctx.strip_idx == SPDK_COUNTOF(g_strip_sizes)) {
+			xor_bench_finish();
+			return;
+		}
+	}
+
+	g_ctx.iters = spdk_max(g_bytes_per_test /
+			       (g_strip_sizes[g_ctx.strip_idx] * g_src_counts[g_ctx.src_idx]), 1000);
+
+	xor_bench_run_inline();
+	xor_bench_run_accel();
+}
+
+static void
+xor_bench_start(void *arg)
+{
+	size_t max_strip = g_strip_sizes[SPDK_COUNTOF(g_strip_sizes) - 1];
+	const char *default_impl = raid5f_xor_get_impl();
+	int i;
+
+	g_ctx.accel_ch = spdk_accel_get_io_channel();
+	if (!g_ctx.accel_ch) {
+		SPDK_ERRLOG("Failed to get accel channel\n");
+		spdk_app_stop(-1);
+		return;
+	}
+
+	for (i = 0; i < XOR_BENCH_MAX_SRC; i++) {
+		g_ctx.srcs[i] = spdk_dma_malloc(max_strip, 4096, NULL);
+		if (!g_ctx.srcs[i]) {
+			goto nomem;
+		}
+		memset(g_ctx.srcs[i], i + 1, max_strip);
+	}
+
+	g_ctx.dest = spdk_dma_zmalloc(max_strip, 4096, NULL);
+	if (!g_ctx.dest) {
+		goto nomem;
+	}
+
+	printf("Default xor kernel: %s, accel queue depth: %d\n", default_impl, g_queue_depth);
+	printf("%8s %6s %-8s %10s %10s\n", "strip", "n_src", "impl", "lat_us", "GiB/s");
+
+	xor_bench_next(&g_ctx);
+	return;
+nomem:
+	SPDK_ERRLOG("Failed to allocate buffers\n");
+	g_ctx.status = -ENOMEM;
+	xor_bench_finish();
+}
+
+int
+main(int argc, char **argv)
+{
+	struct spdk_app_opts opts = {};
+	int rc;
+
+	spdk_app_opts_init(&opts, sizeof(opts));
+	opts.name = "xor_bench";
+
+	if ((rc = spdk_app_parse_args(argc, argv, &opts, "B:Q:", NULL, xor_bench_parse_arg,
+				      xor_bench_usage)) != SPDK_APP_PARSE_ARGS_SUCCESS) {
+		exit(rc);
+	}
+
+	rc = spdk_app_start(&opts, xor_bench_start, NULL);
+	if (rc) {
+		SPDK_ERRLOG("ERROR running xor_bench\n");
+	}
+
+	spdk_app_fini();
+
+	return rc;
+}